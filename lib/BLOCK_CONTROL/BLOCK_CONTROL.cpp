@@ -0,0 +1,723 @@
+#include "BLOCK_CONTROL.h"
+#include <esp_now.h>
+#include <stddef.h>
+#include <atomic>
+#include "CRASH_TRACE.h"
+
+RTC_NOINIT_ATTR static BlockCheckpointData rtcBlocks;
+
+static uint8_t checkOf(const BlockCheckpointData &data) {
+    const uint8_t *bytes = (const uint8_t *)&data;
+    uint8_t sum = 0;
+    for (size_t i = offsetof(BlockCheckpointData, phase); i < offsetof(BlockCheckpointData, check); i++) sum ^= bytes[i];
+    return ~sum;
+}
+
+void BlockControl::begin(uint8_t trains, const uint8_t macs[][6], Semaphore &signals, Settings &settings, Profiles &operating,
+                         esp_reset_reason_t reason) {
+    semaphores = &signals;
+    config = &settings;
+    profiles = &operating;
+    trainCount = trains < BLOCK_MAX_TRAINS ? trains : BLOCK_MAX_TRAINS;
+    memset(&saved, 0, sizeof(saved));
+    memset(legMillis, 0, sizeof(legMillis));
+    fastestLeg = 0;
+
+    // ESP-NOW is already up (setupEspNowReceiver), the trains are peers for the commands
+    for (uint8_t t = 0; t < trainCount; t++) {
+        memset(&link[t], 0, sizeof(link[t]));
+        memcpy(link[t].mac, macs[t], 6);
+        link[t].acked = true;
+        if (esp_now_is_peer_exist(macs[t])) continue;
+        esp_now_peer_info_t peer = {};
+        memcpy(peer.peer_addr, macs[t], 6);
+        peer.channel = 0;
+        peer.encrypt = false;
+        esp_now_add_peer(&peer);
+    }
+
+    // The neighbouring controllers of a loop cut into sections, for the section link
+    bool sectioned = layout.sections() > 0;
+    if (sectioned) {
+        sectionLink.begin(layout.section(), layout.sections(), true, esp_random() | 1, sendLink, this);
+        for (uint8_t side = SECTION_DOWN; side <= SECTION_UP; side++) {
+            const uint8_t *mac = layout.controllerMac(sectionLink.neighbour(side));
+            if (esp_now_is_peer_exist(mac)) continue;
+            esp_now_peer_info_t peer = {};
+            memcpy(peer.peer_addr, mac, 6);
+            peer.channel = 0;
+            peer.encrypt = false;
+            esp_now_add_peer(&peer);
+        }
+    }
+
+    if (restore(reason)) {
+        Serial.println("Blocks: " + String(trainCount) + " trains, resumed from the RTC checkpoint");
+    } else {
+        for (int i = 0; i < BLOCK_SECTIONS; i++) owner[i] = -1;
+        for (uint8_t t = 0; t < trainCount; t++) {
+            int8_t station = sectioned ? t / layout.sections() : t;
+            bool ours = (!sectioned || t % layout.sections() == layout.section()) && station <= layout.lastStation();
+            train[t] = {station, station, 0, false, millis() + profiles->active().dwellMillis, millis(), false, false,
+                        (uint8_t)(ours ? BLOCK_OWN : BLOCK_AWAY), 0};
+            if (ours) owner[2 * station] = t;
+        }
+        phase = BLOCK_OUTBOUND;
+        running = config->loopEnabled();
+        if (sectioned) {
+            Serial.println("Blocks: " + String(trainCount) + " trains on a loop of " + String(layout.sections()) + " sections, this one's parked at its stations 0..");
+        } else {
+            Serial.println("Blocks: " + String(trainCount) + " trains, parked at stations 0.." + String(trainCount - 1));
+        }
+    }
+
+    for (uint8_t t = 0; t < trainCount; t++) {
+        int8_t direction = train[t].direction;
+        command(t, direction > 0 ? TRAIN_CMD_FORWARD : direction < 0 ? TRAIN_CMD_BACKWARD : TRAIN_CMD_STOP);
+    }
+
+    // Packed 1 + BLOCK_OVERLAP apart after a return, see the class comment
+    int run = layout.lastStation() - (trainCount - 1) * (1 + BLOCK_OVERLAP);
+    if (!sectioned && run < 1 + BLOCK_OVERLAP) {
+        Serial.println("Blocks: " + String(trainCount) + " trains leave each " + String(max(run, 0)) + " station(s) to run per round on " +
+                       String(layout.stationCount()) + " stations, fewer trains serve more stops");
+    }
+    // On the loop a train moves only with 1 + BLOCK_OVERLAP stations free
+    // ahead, so one train per that many stations stands everyone still
+    int loopStations = layout.lineStationCount();
+    if (sectioned && trainCount * (1 + BLOCK_OVERLAP) >= loopStations) {
+        Serial.println("Blocks: " + String(trainCount) + " trains can lock each other up on a loop of " + String(loopStations) +
+                       " stations, at most " + String(max((loopStations - 1) / (1 + BLOCK_OVERLAP), 1)) + " keep moving");
+    }
+}
+
+void BlockControl::update(STATION_STATE station, int input, bool loopEnabled) {
+    if (trainCount == 0) return;
+
+    // Trains handed over from the section below before their START sensor fires
+    if (layout.sections() > 0) serviceSectionLink();
+    if (station != STATION_NONE) sensor(station);
+
+    bool moving = false;
+    for (uint8_t t = 0; t < trainCount; t++) {
+        if (train[t].direction != 0) moving = true;
+    }
+
+    if (input == BUTTON_PLAY_PAUSE && moving && !halted) {
+        halted = true;
+        for (uint8_t t = 0; t < trainCount; t++) {
+            if (train[t].direction == 0) continue;
+            command(t, TRAIN_CMD_STOP);
+            train[t].starting = false;
+        }
+        Serial.println("Blocks: all trains halted, PLAY/PAUSE to go on");
+    } else if ((input == BUTTON_PLAY_PAUSE || input == BUTTON_BACKWARDS) && halted) {
+        halted = false;
+        for (uint8_t t = 0; t < trainCount; t++) {
+            if (train[t].direction == 0) continue;
+            command(t, train[t].direction > 0 ? TRAIN_CMD_FORWARD : TRAIN_CMD_BACKWARD);
+            train[t].sensorMillis = millis();
+        }
+        Serial.println("Blocks: trains moving again");
+    } else if (input == BUTTON_PLAY_PAUSE && !running) {
+        running = true;
+        for (uint8_t t = 0; t < trainCount; t++) train[t].readyMillis = millis();
+        Serial.println("Blocks: outbound");
+    }
+    if (input == BUTTON_BACKWARDS && phase == BLOCK_OUTBOUND && layout.sections() == 0) {
+        returnRequested = true;
+        Serial.println("Blocks: returning to START once the trains stand");
+    }
+
+    if (!halted) checkOverdue();
+    dispatch(loopEnabled);
+    serviceSignals();
+    serviceLinks();
+    save();
+}
+
+void BlockControl::sensor(int8_t station) {
+    for (uint8_t t = 0; t < trainCount; t++) {
+        BlockTrain &moving = train[t];
+        if (moving.hand == BLOCK_AWAY) continue;
+        if (moving.direction == 0) {
+            if (moving.station == station) return;   // Standing on its sensor, as at power on
+            continue;
+        }
+        if (moving.station + moving.direction == station) {
+            arrive(t, station);
+            return;
+        }
+        // Leaving a sensor it had stopped beyond
+        if (moving.station == station) return;
+    }
+
+    // Further on in its own route: the triggers of the stations in between were lost
+    for (uint8_t t = 0; t < trainCount; t++) {
+        BlockTrain &moving = train[t];
+        int8_t ahead = (station - moving.station) * moving.direction;
+        if (moving.direction == 0 || ahead < 2 || owner[2 * station] != t) continue;
+        missed += ahead - 1;
+        moving.starting = false;             // Not a leg to time
+        Serial.println("Blocks: train " + String(t) + " passed " + String(ahead - 1) + " station(s) unseen before station " + String(station));
+        arrive(t, station);
+        return;
+    }
+
+    ignored++;
+    Serial.println("Blocks: station " + String(station) + " triggered, no train due there. Ignored");
+    // On a loop that is most likely one of the section below's, past its lost LAST trigger
+    if (station == 0 && layout.sections() > 0 && sectionLink.incoming(SECTION_DOWN) == SECTION_NO_TRAIN) {
+        sectionLink.reportOverrun(SECTION_DOWN, millis());
+    }
+}
+
+void BlockControl::checkOverdue() {
+    unsigned long now = millis();
+    for (uint8_t t = 0; t < trainCount; t++) {
+        BlockTrain &moving = train[t];
+        if (moving.direction == 0) continue;
+        // Until this train has run this way from a stop, twice the slowest leg any train has run
+        unsigned long leg = legMillis[t][moving.direction > 0];
+        unsigned long slowest = 0;
+        for (uint8_t other = 0; other < trainCount; other++) slowest = max(slowest, max(legMillis[other][0], legMillis[other][1]));
+        unsigned long limit = leg != 0 ? leg + leg / 2 : slowest != 0 ? 2 * slowest : BLOCK_SENSOR_TIMEOUT;
+        // Past the LAST of a section lies the next one's START, not a bumper: stopping
+        // short there costs nothing, the handoff drives the train on over the sensor
+        int8_t next = constrain(moving.station + moving.direction, 0, layout.lastStation());
+        if (layout.sections() > 0 && next == layout.lastStation() && fastestLeg != 0) limit = min(limit, fastestLeg + fastestLeg / 2);
+        if (now - moving.sensorMillis <= limit) continue;
+
+        Serial.println("Blocks: train " + String(t) + " overdue at station " + String(next) + ", stopped");
+        stopUnseen(t, next, now);
+    }
+}
+
+// Stopped where the sensor of station next should have been; the overlap beyond is still its own
+void BlockControl::stopUnseen(uint8_t t, int8_t next, unsigned long now) {
+    BlockTrain &moving = train[t];
+    missed++;
+    moving.starting = false;
+    moving.stop = next;
+    int8_t direction = moving.direction;
+    arrive(t, next);
+    moving.readyMillis = now + profiles->active().dwellMillis;   // Stands for real before it goes on, the next sensor then places it
+    moving.guessed = true;
+
+    // It may have run on past the sensor, the overlap stays its own until it moves again
+    int8_t far = constrain(next + direction * BLOCK_OVERLAP, 0, layout.lastStation());
+    for (int section = 2 * min(next, far); section <= 2 * max(next, far); section++) {
+        if (owner[section] < 0) owner[section] = t;
+    }
+}
+
+void BlockControl::arrive(uint8_t t, int8_t station) {
+    BlockTrain &arriving = train[t];
+    int8_t direction = arriving.direction;
+    unsigned long now = millis();
+    if (arriving.starting && now - arriving.sensorMillis > legMillis[t][direction > 0]) {
+        legMillis[t][direction > 0] = now - arriving.sensorMillis;
+    }
+    if (arriving.starting && (fastestLeg == 0 || now - arriving.sensorMillis < fastestLeg)) fastestLeg = now - arriving.sensorMillis;
+    arriving.starting = false;
+    arriving.guessed = false;
+    arriving.sensorMillis = now;
+    if (direction > 0) setSignal(arriving.station, RED);
+    // In from the boundary below: the block behind it is clear
+    if (arriving.station < 0) sectionLink.arrived(SECTION_DOWN, t);
+    arriving.station = station;
+
+    // Short of the authority the train runs on, the sections behind it are free again
+    if ((station - arriving.stop) * direction < 0) {
+        for (int section = 0; section < sectionCount(); section++) {
+            if (owner[section] == t && (section - 2 * station) * direction < 0) owner[section] = -1;
+        }
+        Serial.println("Train " + String(t) + " passed station " + String(station));
+        return;
+    }
+
+    command(t, TRAIN_CMD_STOP);
+    arriving.direction = 0;
+    arriving.stop = station;
+    arriving.cleared = false;
+    release(t, 2 * station);
+    if (phase == BLOCK_OUTBOUND) {
+        arriving.readyMillis = millis() + profiles->active().dwellMillis;
+        if (station > 0 || layout.sections() > 0) stopsServed++;
+    } else {
+        arriving.readyMillis = millis();
+    }
+    Serial.println("Train " + String(t) + " stopped at station " + String(station));
+}
+
+void BlockControl::dispatch(bool loopEnabled) {
+    if (halted) return;
+    unsigned long now = millis();
+    bool routed = false;
+
+    for (uint8_t t = 0; t < trainCount; t++) {
+        BlockTrain &waiting = train[t];
+        if (!waiting.cleared) continue;
+        if (returnRequested) {
+            waiting.cleared = false;
+            waiting.stop = waiting.station;
+            release(t, 2 * waiting.station);
+            setSignal(waiting.station, RED);
+        } else if (signalGreen(waiting.station)) {
+            depart(t);
+        }
+    }
+
+    for (uint8_t t = 0; t < trainCount; t++) {
+        BlockTrain &candidate = train[t];
+        if (candidate.hand == BLOCK_OFFERED && (long)(now - candidate.readyMillis) >= 0) handOver(t, now);
+        if (candidate.hand != BLOCK_OWN) continue;
+        bool ready = candidate.direction == 0 && !candidate.cleared && (long)(now - candidate.readyMillis) >= 0;
+        bool outbound = phase == BLOCK_OUTBOUND && running && !returnRequested && ready;
+
+        if (outbound && candidate.station == layout.lastStation() && layout.sections() > 0) {
+            handOver(t, now);
+        } else if (outbound && candidate.station < layout.lastStation()) {
+            int8_t end = routeEnd(t, candidate.station, 1, candidate.station + 1);
+            if (end == candidate.station) continue;
+            claim(t, candidate.station, end, 1);
+            candidate.stop = end;
+            candidate.cleared = true;
+            routed = true;
+            setSignal(candidate.station, GREEN);
+            if (signalGreen(candidate.station)) depart(t);
+        } else if (phase == BLOCK_RETURN && ready && candidate.station > 0) {
+            int8_t end = routeEnd(t, candidate.station, -1, 0);
+            if (end == candidate.station) continue;
+            claim(t, candidate.station, end, -1);
+            candidate.stop = end;
+            routed = true;
+            depart(t);
+        } else if (phase == BLOCK_RETURN && candidate.direction < 0) {
+            // Further back as the train ahead clears the way
+            int8_t end = routeEnd(t, candidate.station, -1, 0);
+            if (end < candidate.stop) {
+                claim(t, candidate.station, end, -1);
+                candidate.stop = end;
+            }
+        }
+    }
+
+    // The convoy turns round once every train stands and none can go on; a
+    // loop cut into sections has no return
+    if (routed || layout.sections() > 0 || !allStanding()) return;
+    bool allReady = true;
+    for (uint8_t t = 0; t < trainCount; t++) {
+        if ((long)(now - train[t].readyMillis) < 0) allReady = false;
+    }
+
+    if (phase == BLOCK_OUTBOUND && (returnRequested || (running && allReady))) {
+        returnRequested = false;
+        startPhase(BLOCK_RETURN, profiles->active().backwardDelayMillis);
+        Serial.println("Blocks: convoy returning to START");
+    } else if (phase == BLOCK_RETURN && allReady) {
+        rounds++;
+        running = loopEnabled;
+        startPhase(BLOCK_OUTBOUND, profiles->active().dwellMillis);
+        Serial.println(running ? "Blocks: new round" : "Blocks: back at START, PLAY/PAUSE to go on");
+        printReport();
+    }
+}
+
+// A train that served LAST, offered to the next controller until it takes it
+void BlockControl::handOver(uint8_t t, unsigned long now) {
+    BlockTrain &leaving = train[t];
+    uint8_t next = sectionLink.neighbour(SECTION_UP);
+    SectionHandoff result = sectionLink.handOff(SECTION_UP, t, leaving.trip + 1, now);
+    if (result == SECTION_WAIT) {
+        if (leaving.hand == BLOCK_OWN) Serial.println("Train " + String(t) + " offered to section " + String(next));
+        leaving.hand = BLOCK_OFFERED;
+    } else if (result == SECTION_REFUSED) {
+        leaving.hand = BLOCK_OFFERED;  // Still, offered again after the backoff
+        leaving.readyMillis = now + BLOCK_REFUSED_BACKOFF;
+    } else {
+        leaving.hand = BLOCK_LEAVING;
+        leaving.trip++;
+        handedOver++;
+        Serial.println("Train " + String(t) + (result == SECTION_GO ? " handed over to section " : " taken over while silent by section ") +
+                       String(next));
+    }
+}
+
+// Handed over from the section below: driven from the boundary to START
+void BlockControl::takeOver(const SectionArrival &arrival) {
+    uint8_t t = arrival.train;
+    if (t >= trainCount || arrival.side != SECTION_DOWN) return;
+    unsigned long now = millis();
+    release(t, -1);
+    train[t] = {-1, 0, 1, false, now, now, false, true, BLOCK_OWN, arrival.trip};
+    int high = min(2 * BLOCK_OVERLAP, sectionCount() - 1);
+    for (int section = 0; section <= high; section++) {
+        if (owner[section] < 0) owner[section] = t;
+    }
+    takenOver++;
+    command(t, TRAIN_CMD_FORWARD);
+    Serial.println("Train " + String(t) + (arrival.adopted ? " adopted from the silent section " : " taken over from section ") +
+                   String(sectionLink.neighbour(SECTION_DOWN)) + ", running to START");
+}
+
+// START and the overlap beyond, all a train coming in may run into
+bool BlockControl::berthFree() {
+    int high = min(2 * BLOCK_OVERLAP, sectionCount() - 1);
+    for (int section = 0; section <= high; section++) {
+        if (owner[section] >= 0) return false;
+    }
+    return true;
+}
+
+void BlockControl::serviceSectionLink() {
+    unsigned long now = millis();
+    for (;;) {
+        SectionMessage message;
+        portENTER_CRITICAL(&lock);
+        bool queued = linkQueued > 0;
+        if (queued) {
+            message = linkQueue[linkHead];
+            linkHead = (linkHead + 1) % BLOCK_LINK_QUEUE;
+            linkQueued--;
+        }
+        portEXIT_CRITICAL(&lock);
+        if (!queued) break;
+        sectionLink.receive(message, now);
+    }
+    sectionLink.update(now);
+
+    SectionArrival arrival;
+    while (sectionLink.takeArrival(arrival)) takeOver(arrival);
+
+    // A restart on either side can lose the word that a train left the block below; say it again
+    uint8_t below = sectionLink.occupant(SECTION_DOWN);
+    if (below < trainCount && train[below].hand == BLOCK_OWN && train[below].station >= 0) sectionLink.arrived(SECTION_DOWN, below);
+
+    // The next controller saw a train of ours at its START: the front one running, however
+    // many triggers it lost on the way
+    if (sectionLink.takeOverrun(SECTION_UP)) {
+        int overrun = -1;
+        for (uint8_t t = 0; t < trainCount; t++) {
+            const BlockTrain &moving = train[t];
+            if (moving.hand != BLOCK_OWN || moving.direction <= 0) continue;
+            if (overrun < 0 || moving.station > train[overrun].station) overrun = t;
+        }
+        if (overrun >= 0) {
+            Serial.println("Blocks: train " + String(overrun) + " ran past LAST into section " + String(sectionLink.neighbour(SECTION_UP)) + ", stopped");
+            stopUnseen(overrun, layout.lastStation(), now);
+        }
+    }
+
+    // LAST's berth stays taken until the next controller has the train at its START
+    for (uint8_t t = 0; t < trainCount; t++) {
+        if (train[t].hand != BLOCK_LEAVING || sectionLink.epoch(SECTION_UP) == 0 || sectionLink.occupant(SECTION_UP) == t) continue;
+        train[t].hand = BLOCK_AWAY;
+        release(t, -1);
+        Serial.println("Train " + String(t) + " left the section");
+    }
+    sectionLink.setAccepting(SECTION_DOWN, berthFree());
+}
+
+void BlockControl::sendLink(void *, uint8_t section, const SectionMessage &message) {
+    esp_now_send(layout.controllerMac(section), (const uint8_t *)&message, sizeof(message));
+}
+
+void BlockControl::recordLink(const uint8_t *mac, const SectionMessage &message) {
+    if (layout.sections() == 0 || layout.findController(mac) != message.from) return;
+
+    portENTER_CRITICAL(&lock);
+    if (linkQueued == BLOCK_LINK_QUEUE) {
+        linkDropped++;
+    } else {
+        linkQueue[(linkHead + linkQueued) % BLOCK_LINK_QUEUE] = message;
+        linkQueued++;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+void BlockControl::depart(uint8_t t) {
+    BlockTrain &leaving = train[t];
+    leaving.cleared = false;
+    leaving.direction = leaving.stop > leaving.station ? 1 : -1;
+    leaving.sensorMillis = millis();
+    leaving.starting = !leaving.guessed;
+    command(t, leaving.direction > 0 ? TRAIN_CMD_FORWARD : TRAIN_CMD_BACKWARD);
+    Serial.println("Train " + String(t) + " leaves station " + String(leaving.station) + " for station " + String(leaving.stop));
+}
+
+void BlockControl::startPhase(BlockPhase next, unsigned long waitMillis) {
+    phase = next;
+    wantedGreen = 0;
+    for (uint8_t t = 0; t < trainCount; t++) train[t].readyMillis = millis() + waitMillis;
+}
+
+bool BlockControl::allStanding() {
+    for (uint8_t t = 0; t < trainCount; t++) {
+        if (train[t].direction != 0 || train[t].cleared) return false;
+    }
+    return true;
+}
+
+int8_t BlockControl::routeEnd(uint8_t t, int8_t from, int8_t direction, int8_t limit) {
+    int8_t end = from;
+    for (int8_t next = from + direction; (next - limit) * direction <= 0; next += direction) {
+        if (!freeFor(t, 2 * next - direction) || !freeFor(t, 2 * next)) break;
+        bool overlapFree = true;
+        for (int8_t k = 1; k <= BLOCK_OVERLAP; k++) {
+            int8_t beyond = next + k * direction;
+            if (beyond < 0 || beyond > layout.lastStation()) break;
+            if (!freeFor(t, 2 * beyond - direction) || !freeFor(t, 2 * beyond)) overlapFree = false;
+        }
+        if (overlapFree) end = next;
+    }
+    return end;
+}
+
+void BlockControl::claim(uint8_t t, int8_t from, int8_t to, int8_t direction) {
+    int8_t far = constrain(to + direction * BLOCK_OVERLAP, 0, layout.lastStation());
+    int low = 2 * min(from, far);
+    int high = 2 * max(from, far);
+    release(t, -1);
+    for (int section = low; section <= high; section++) owner[section] = t;
+}
+
+void BlockControl::release(uint8_t t, int keepSection) {
+    for (int section = 0; section < sectionCount(); section++) {
+        if (owner[section] == t && section != keepSection) owner[section] = -1;
+    }
+}
+
+void BlockControl::setSignal(int8_t station, SemaphoreState state) {
+    if (station < 1 || station > semaphores->count()) return;
+    uint64_t bit = (uint64_t)1 << (station - 1);
+    wantedGreen = state == GREEN ? (wantedGreen | bit) : (wantedGreen & ~bit);
+}
+
+bool BlockControl::signalGreen(int8_t station) {
+    if (station < 1 || station > semaphores->count()) return true;  // START and LAST have none
+    uint64_t bit = (uint64_t)1 << (station - 1);
+    return (shownKnown & shownGreen & bit) != 0;
+}
+
+void BlockControl::serviceSignals() {
+    if (pulsingId != 0) {
+        if (!semaphores->setSemaphore(pulsingId, pulsingState)) return;
+        uint64_t bit = (uint64_t)1 << (pulsingId - 1);
+        shownGreen = pulsingState == GREEN ? (shownGreen | bit) : (shownGreen & ~bit);
+        shownKnown |= bit;
+        pulsingId = 0;
+    }
+
+    // Only semaphores that differ from what they show, lowest id first
+    uint64_t all = semaphores->count() >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << semaphores->count()) - 1;
+    uint64_t stale = ((wantedGreen ^ shownGreen) | ~shownKnown) & all;
+    while (stale != 0) {
+        uint8_t id = lowestStation(stale) + 1;
+        uint64_t bit = (uint64_t)1 << (id - 1);
+        stale &= stale - 1;
+        bool green = (wantedGreen & bit) != 0;
+        pulsingId = id;
+        pulsingState = green ? GREEN : RED;
+        // Network semaphores are done at once, a MUX pulse takes a while
+        if (!semaphores->setSemaphore(id, pulsingState)) return;
+        shownGreen = green ? (shownGreen | bit) : (shownGreen & ~bit);
+        shownKnown |= bit;
+        pulsingId = 0;
+    }
+}
+
+void BlockControl::command(uint8_t t, uint8_t wanted) {
+    if (train[t].hand != BLOCK_OWN) return;   // Offered or another controller's: left alone
+    const OperatingProfile &profile = profiles->active();
+    uint8_t speed = wanted == TRAIN_CMD_FORWARD ? profile.forwardSpeed : wanted == TRAIN_CMD_BACKWARD ? profile.backwardSpeed : 0;
+    BlockTrainLink &node = link[t];
+
+    portENTER_CRITICAL(&lock);
+    bool repeat = node.seq != 0 && node.command == wanted && node.speed == speed;
+    if (!repeat) {
+        node.command = wanted;
+        node.speed = speed;
+        node.seq++;
+        node.acked = false;
+        node.firstSentMicros = micros();
+    }
+    portEXIT_CRITICAL(&lock);
+    if (repeat) return;
+
+    commands++;
+    crashTrace.record(TRACE_MOTOR, wanted, t);   // TRAIN_CMD_* are in CrashTraceMotor order
+    sendCommand(t);
+}
+
+void BlockControl::sendCommand(uint8_t t) {
+    BlockTrainLink &node = link[t];
+    TrainCommand packet;
+    packet.type = STATION_MSG_TRAIN_CMD;
+    packet.train = t;
+    portENTER_CRITICAL(&lock);
+    packet.command = node.command;
+    packet.speed = node.speed;
+    packet.seq = node.seq;
+    portEXIT_CRITICAL(&lock);
+    esp_now_send(node.mac, (const uint8_t *)&packet, sizeof(packet));
+    node.lastSentMillis = millis();
+}
+
+void BlockControl::serviceLinks() {
+    unsigned long now = millis();
+    for (uint8_t t = 0; t < trainCount; t++) {
+        if (train[t].hand != BLOCK_OWN) continue;
+        BlockTrainLink &node = link[t];
+        portENTER_CRITICAL(&lock);
+        bool acked = node.acked;
+        portEXIT_CRITICAL(&lock);
+        unsigned long since = now - node.lastSentMillis;
+
+        // Unacknowledged commands go out again quickly, the rest keep the nodes from timing out
+        if (!acked && since >= TRAIN_CMD_RETRY) {
+            retries++;
+            sendCommand(t);
+        } else if (since >= TRAIN_CMD_KEEPALIVE) {
+            sendCommand(t);
+        }
+    }
+}
+
+void BlockControl::recordAck(const uint8_t *mac, const TrainAck &ack, uint32_t receivedMicros) {
+    if (ack.train >= trainCount || memcmp(mac, link[ack.train].mac, 6) != 0) return;
+
+    portENTER_CRITICAL(&lock);
+    BlockTrainLink &node = link[ack.train];
+    if (ack.seq == node.seq && !node.acked) {
+        node.acked = true;
+        uint32_t latency = receivedMicros - node.firstSentMicros;
+        acks++;
+        ackSumMicros += latency;
+        if (latency > ackMaxMicros) ackMaxMicros = latency;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+void BlockControl::save() {
+    BlockCheckpointData current;
+    memset(&current, 0, sizeof(current));
+    current.phase = phase;
+    current.running = running;
+    current.trains = trainCount;
+    for (uint8_t t = 0; t < trainCount; t++) {
+        current.station[t] = train[t].station;
+        current.stop[t] = train[t].direction != 0 ? train[t].stop : train[t].station;
+        current.direction[t] = train[t].direction;
+        current.legMillis[t][0] = min(legMillis[t][0], 65535UL);
+        current.legMillis[t][1] = min(legMillis[t][1], 65535UL);
+        current.hand[t] = train[t].hand;
+        current.trip[t] = train[t].trip;
+    }
+    current.fastestLeg = min(fastestLeg, 65535UL);
+    current.check = checkOf(current);
+    current.magic = BLOCK_CHECKPOINT_MAGIC;
+    if (memcmp(&current, &saved, sizeof(current)) == 0) return;
+    saved = current;
+
+    // Magic cleared while the fields change, as in lib/CHECKPOINT
+    rtcBlocks.magic = 0;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    uint32_t magic = current.magic;
+    current.magic = 0;
+    rtcBlocks = current;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    rtcBlocks.magic = magic;
+}
+
+bool BlockControl::restore(esp_reset_reason_t reason) {
+    BlockCheckpointData data = rtcBlocks;
+    rtcBlocks.magic = 0;
+    for (int i = 0; i < BLOCK_SECTIONS; i++) owner[i] = -1;
+    if (reason == ESP_RST_POWERON || data.magic != BLOCK_CHECKPOINT_MAGIC || data.check != checkOf(data) || data.trains != trainCount) {
+        return false;
+    }
+
+    bool sectioned = layout.sections() > 0;
+    for (uint8_t t = 0; t < trainCount; t++) {
+        int8_t station = data.station[t];
+        int8_t stop = data.stop[t];
+        int8_t direction = data.direction[t];
+        uint8_t hand = data.hand[t];
+        if (hand == BLOCK_AWAY && sectioned) {
+            train[t] = {station, station, 0, false, millis(), millis(), false, false, BLOCK_AWAY, data.trip[t]};
+            continue;
+        }
+        // Between the boundary below and START, as a train taken over runs
+        int8_t lowest = sectioned && direction > 0 ? -1 : 0;
+        bool valid = station >= lowest && station <= layout.lastStation() && stop >= 0 && stop <= layout.lastStation() &&
+                     direction >= -1 && direction <= 1 && (direction == 0) == (stop == station) && hand <= BLOCK_LEAVING &&
+                     (hand == BLOCK_OWN || (sectioned && station == layout.lastStation() && direction == 0));
+        int8_t far = direction == 0 ? station : constrain(stop + direction * BLOCK_OVERLAP, 0, layout.lastStation());
+        int low = 2 * max((int)min(station, far), 0);
+        for (int section = low; valid && section <= 2 * max(station, far); section++) {
+            if (owner[section] >= 0) valid = false;
+        }
+        if (!valid) {
+            for (int i = 0; i < BLOCK_SECTIONS; i++) owner[i] = -1;
+            return false;
+        }
+        train[t] = {station, stop, direction, false, millis(), millis(), false, true, hand, data.trip[t]};
+        for (int section = low; section <= 2 * max(station, far); section++) owner[section] = t;
+
+        // It left under GREEN and holds the route, the semaphore shows that again
+        if (direction > 0) setSignal(station, GREEN);
+    }
+    for (uint8_t t = 0; t < trainCount; t++) {
+        legMillis[t][0] = data.legMillis[t][0];
+        legMillis[t][1] = data.legMillis[t][1];
+    }
+    fastestLeg = data.fastestLeg;
+    phase = data.phase == BLOCK_RETURN ? BLOCK_RETURN : BLOCK_OUTBOUND;
+    running = data.running;
+    return true;
+}
+
+void BlockControl::printReport() {
+    portENTER_CRITICAL(&lock);
+    uint32_t ackCount = acks;
+    uint32_t sum = ackSumMicros;
+    uint32_t longest = ackMaxMicros;
+    portEXIT_CRITICAL(&lock);
+
+    Serial.print("Blocks: round ");
+    Serial.print(rounds);
+    Serial.print(", ");
+    Serial.print(trainCount);
+    Serial.print(" trains, ");
+    Serial.print(stopsServed);
+    Serial.print(" stops served | commands ");
+    Serial.print(commands);
+    Serial.print(", ");
+    Serial.print(retries);
+    Serial.print(" resent, acked avg ");
+    Serial.print(ackCount ? sum / ackCount : 0);
+    Serial.print(" max ");
+    Serial.print(longest);
+    Serial.print(" us | triggers ");
+    Serial.print(missed);
+    Serial.print(" missed, ");
+    Serial.print(ignored);
+    Serial.print(" ignored");
+    if (layout.sections() > 0) {
+        Serial.print(" | section ");
+        Serial.print(layout.section());
+        Serial.print(": ");
+        Serial.print(handedOver);
+        Serial.print(" handed over, ");
+        Serial.print(takenOver);
+        Serial.print(" taken over, ");
+        Serial.print(sectionLink.adoptions);
+        Serial.print(" adopted, ");
+        Serial.print(sectionLink.refusals);
+        Serial.print(" refused, ");
+        Serial.print(linkDropped);
+        Serial.print(" link messages dropped");
+    }
+    Serial.println();
+}
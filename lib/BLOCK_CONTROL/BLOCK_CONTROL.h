@@ -0,0 +1,198 @@
+#ifndef BLOCK_CONTROL_H
+#define BLOCK_CONTROL_H
+
+#include <Arduino.h>
+#include <esp_system.h>
+#include "UI.h"
+#include "SEMAPHORE_T.h"
+#include "SETTINGS.h"
+#include "PROFILES.h"
+#include "STATION_PROTOCOL.h"
+#include "SECTION_LINK.h"
+
+#define BLOCK_MAX_TRAINS 4
+#define BLOCK_SECTIONS (2 * LAYOUT_MAX_STATIONS - 1)  // Station berths at even indexes, the blocks between them at odd ones
+#define BLOCK_OVERLAP 1                         // Stations beyond a stop kept clear, so a lost trigger still stops in time
+#define BLOCK_SENSOR_TIMEOUT 15000              // ms without a sensor before a train is overdue, until a leg is timed
+#define BLOCK_CHECKPOINT_MAGIC 0x324B4C42       // "BLK2"
+#define BLOCK_REFUSED_BACKOFF 200               // ms before a train the next controller refused is offered again
+#define BLOCK_LINK_QUEUE 8                      // Section link messages from the receive callback waiting for loop()
+
+enum BlockPhase : uint8_t {
+    BLOCK_OUTBOUND,                      // START -> LAST, stopping at every station
+    BLOCK_RETURN,                        // Back to START without stops, as one train does
+};
+
+// Whose a train is on a loop run by several controllers (lib/SECTION_LINK)
+enum BlockHand : uint8_t {
+    BLOCK_OWN,                           // This controller drives it
+    BLOCK_OFFERED,                       // Stands at LAST, offered to the next controller: left alone
+    BLOCK_LEAVING,                       // Handed over, keeps LAST's berth until the boundary block is clear
+    BLOCK_AWAY,                          // In another controller's section
+};
+
+struct BlockTrain {
+    int8_t station;                      // Last station sensor reached, where it stands when not moving
+    int8_t stop;                         // Movement authority: station it may run to, == station when standing
+    int8_t direction;                    // 1 forward, -1 backward, 0 standing
+    bool cleared;                        // Route set, departs once its semaphore shows GREEN
+    unsigned long readyMillis;           // May depart from then on
+    unsigned long sensorMillis;          // Departure or last sensor, for the overdue check
+    bool starting;                       // Departed from a sensor, none reached yet: the leg is timed
+    bool guessed;                        // Stands where the overdue check put it, not at a sensor
+    uint8_t hand;                        // BlockHand
+    uint8_t trip;                        // Boundaries crossed, for the section link
+};
+
+// Link state of one train node, shared with the receive callback
+struct BlockTrainLink {
+    uint8_t mac[6];
+    uint8_t command;                     // TRAIN_CMD_*
+    uint8_t speed;
+    uint32_t seq;
+    bool acked;
+    uint32_t firstSentMicros;            // First send of seq, the ack latency runs from here
+    unsigned long lastSentMillis;
+};
+
+// Train positions in RTC_NOINIT memory, like lib/CHECKPOINT for one train
+struct BlockCheckpointData {
+    uint32_t magic;
+    uint8_t phase;
+    uint8_t running;
+    uint8_t trains;
+    int8_t station[BLOCK_MAX_TRAINS];
+    int8_t stop[BLOCK_MAX_TRAINS];
+    int8_t direction[BLOCK_MAX_TRAINS];
+    uint16_t legMillis[BLOCK_MAX_TRAINS][2];
+    uint16_t fastestLeg;
+    uint8_t hand[BLOCK_MAX_TRAINS];
+    uint8_t trip[BLOCK_MAX_TRAINS];
+    uint8_t check;                       // ~XOR of the bytes between magic and check
+};
+
+// Several trains on the line, each with an ESP-NOW train node
+// (lib/TRAIN_NODE). Every station berth and every block between two stations
+// is a section with at most one owner. A train only moves along sections it
+// owns: a route from its station to its stop plus BLOCK_OVERLAP stations
+// beyond, reserved whole before it departs and released behind it at each
+// station sensor. A sensor edge belongs to the train whose next station it
+// is, or whose route it lies in: no other train can be there, so the
+// stations in between were missed. Spurious triggers move nothing. A train that reaches no sensor in
+// half as long again as its slowest leg is stopped and taken to be at the
+// next station, so two lost triggers in a row do not run it out of its route.
+//
+// The trains run as a convoy. Outbound, each stops at every station and
+// leaves when its dwell is over, the route is free and the semaphore at the
+// station's exit shows GREEN; the semaphore drops to RED when the train
+// reaches the next station. Once the lead train is at LAST and the others are
+// queued behind it, the convoy returns: the rear train first, each running as
+// far towards START as the route is free. Trains park at stations 0..N-1 for
+// power on; a reset that keeps RTC memory resumes from where they were.
+//
+// The return leaves the convoy 1 + BLOCK_OVERLAP stations apart, so from the
+// second round on each train runs LAST - (N - 1) * (1 + BLOCK_OVERLAP)
+// stations outbound. More trains make the rounds shorter but leave each less
+// to run: on the 8 stations of the default layout 3 trains serve the most
+// stops per hour, a fourth runs one station each and serves fewer. begin()
+// says so when the trains leave less than one spacing to run.
+//
+// On a loop cut into sections (lib/LAYOUT), each controller runs the trains
+// in its own section and there is no return: a train that has served LAST is
+// offered to the next controller through the section link and left alone,
+// and once handed over that controller drives it across the boundary to its
+// START. Until the link says the boundary block is clear again, the train
+// keeps LAST's berth here. A train coming in the other way reserves START and
+// the overlap beyond. At power on train t stands at station t / sections of
+// section t % sections.
+//
+// Past LAST there is no bumper but the next section, so the leg into LAST is
+// timed from the quickest leg seen, and a START trigger with no train due is
+// reported to the controller below, which stops the train it has running.
+// With 1 + BLOCK_OVERLAP stations per train the trains can stand each other
+// still, begin() says so.
+class BlockControl {
+public:
+    void begin(uint8_t trains, const uint8_t macs[][6], Semaphore &signals, Settings &settings, Profiles &operating,
+               esp_reset_reason_t reason);
+    void update(STATION_STATE station, int input, bool loopEnabled);   // Call from loop()
+    void recordAck(const uint8_t *mac, const TrainAck &ack, uint32_t receivedMicros);  // From the ESP-NOW receive callback (WiFi task)
+    void recordLink(const uint8_t *mac, const SectionMessage &message);               // Likewise, from a neighbouring controller
+    uint8_t trains() { return trainCount; }
+    uint32_t missedTriggers() { return missed; }
+    uint32_t ignoredTriggers() { return ignored; }
+    void printReport();
+
+private:
+    static void sendLink(void *context, uint8_t section, const SectionMessage &message);
+    void serviceSectionLink();
+    void handOver(uint8_t train, unsigned long now);
+    void takeOver(const SectionArrival &arrival);
+    bool berthFree();
+    void sensor(int8_t station);
+    void checkOverdue();
+    void stopUnseen(uint8_t train, int8_t next, unsigned long now);
+    void arrive(uint8_t train, int8_t station);
+    void dispatch(bool loopEnabled);
+    void depart(uint8_t train);
+    void command(uint8_t train, uint8_t command);
+    void sendCommand(uint8_t train);
+    void serviceLinks();
+    void serviceSignals();
+    void setSignal(int8_t station, SemaphoreState state);
+    bool signalGreen(int8_t station);
+    bool freeFor(uint8_t train, int section) { return owner[section] < 0 || owner[section] == train; }
+    int sectionCount() { return 2 * layout.stationCount() - 1; }
+    int8_t routeEnd(uint8_t train, int8_t from, int8_t direction, int8_t limit);
+    void claim(uint8_t train, int8_t from, int8_t to, int8_t direction);
+    void release(uint8_t train, int keepSection);
+    bool allStanding();
+    void startPhase(BlockPhase next, unsigned long waitMillis);
+    bool restore(esp_reset_reason_t reason);
+    void save();
+
+    Semaphore *semaphores = nullptr;
+    Settings *config = nullptr;
+    Profiles *profiles = nullptr;        // Dwell, delays and speeds of the active profile
+    uint8_t trainCount = 0;
+    BlockTrain train[BLOCK_MAX_TRAINS];
+    int8_t owner[BLOCK_SECTIONS];        // Train owning each section, -1 for free; sectionCount() of them in use
+    BlockPhase phase = BLOCK_OUTBOUND;
+    bool running = false;                // Outbound runs start; off after a return without loop mode until PLAY/PAUSE
+    bool halted = false;                 // PLAY/PAUSE stopped every train where it was
+    bool returnRequested = false;        // BACKWARDS: no new outbound runs, return once all stand
+    BlockCheckpointData saved;
+    unsigned long legMillis[BLOCK_MAX_TRAINS][2];  // Slowest run from a stop to the next sensor, [train][forward]
+    unsigned long fastestLeg = 0;        // Quickest such run of any train, times the leg into a section's LAST
+
+    // Semaphores are set one at a time, the MUX pulses them in turn
+    uint64_t wantedGreen = 0;            // Bit (id - 1)
+    uint64_t shownGreen = 0;
+    uint64_t shownKnown = 0;
+    uint8_t pulsingId = 0;
+    SemaphoreState pulsingState = RED;
+
+    // Shared with the receive callback
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    BlockTrainLink link[BLOCK_MAX_TRAINS];
+    uint32_t acks = 0;
+    uint32_t ackSumMicros = 0;
+    uint32_t ackMaxMicros = 0;
+    SectionMessage linkQueue[BLOCK_LINK_QUEUE];
+    uint8_t linkHead = 0;
+    uint8_t linkQueued = 0;
+    uint32_t linkDropped = 0;            // Queue full
+
+    SectionLink sectionLink;             // Only with sections
+
+    uint32_t rounds = 0;
+    uint32_t stopsServed = 0;            // Outbound stops at stations 1..LAST
+    uint32_t commands = 0;
+    uint32_t retries = 0;
+    uint32_t missed = 0;                 // Triggers lost: a station further on in the route reported, or none in time
+    uint32_t ignored = 0;                // Sensor edges no train was heading for
+    uint32_t handedOver = 0;             // Trains the next controller took, at a handoff or while this one was silent
+    uint32_t takenOver = 0;              // Trains taken from the controller before
+};
+
+#endif // BLOCK_CONTROL_H
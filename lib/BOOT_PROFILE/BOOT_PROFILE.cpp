@@ -0,0 +1,69 @@
+#include "BOOT_PROFILE.h"
+
+BootProfile bootProfile;
+
+static void printMillis(uint32_t micros) {
+    Serial.print(micros / 1000);
+    Serial.print(".");
+    Serial.print(micros / 100 % 10);
+    Serial.print(" ms");
+}
+
+void BootProfile::begin() {
+    startMicros = micros();
+    phaseCount = 0;
+}
+
+void BootProfile::phase(const char *name) {
+    if (phaseCount == BOOT_PROFILE_MAX_PHASES) return;
+    phases[phaseCount].name = name;
+    phases[phaseCount].micros = micros();
+    phaseCount++;
+}
+
+void BootProfile::ready() {
+    uint32_t now = micros();
+    Serial.print("Boot: ready at ");
+    printMillis(now);
+    Serial.print(" (before setup ");
+    printMillis(startMicros);
+    uint32_t last = startMicros;
+    for (uint8_t i = 0; i < phaseCount; i++) {
+        Serial.print(", ");
+        Serial.print(phases[i].name);
+        Serial.print(" ");
+        printMillis(phases[i].micros - last);
+        last = phases[i].micros;
+    }
+    Serial.print(", rest ");
+    printMillis(now - last);
+    Serial.println(")");
+}
+
+void BootProfile::backgroundDone(const char *name) {
+    if (backgroundCount == BOOT_PROFILE_MAX_BACKGROUND) return;
+    background[backgroundCount].name = name;
+    background[backgroundCount].micros = micros();
+    backgroundCount++;
+}
+
+void IRAM_ATTR BootProfile::stationEvent() {
+    if (firstStationMicros == 0) firstStationMicros = micros() | 1;
+}
+
+void BootProfile::update() {
+    while (backgroundPrinted < backgroundCount) {
+        const Mark &mark = background[backgroundPrinted++];
+        Serial.print("Boot: ");
+        Serial.print(mark.name);
+        Serial.print(" done at ");
+        printMillis(mark.micros);
+        Serial.println();
+    }
+    if (!stationPrinted && firstStationMicros != 0) {
+        stationPrinted = true;
+        Serial.print("Boot: first station message accepted at ");
+        printMillis(firstStationMicros);
+        Serial.println();
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef BOOT_PROFILE_H
+#define BOOT_PROFILE_H
+
+#include <Arduino.h>
+
+#define BOOT_PROFILE_MAX_PHASES 8
+#define BOOT_PROFILE_MAX_BACKGROUND 4
+
+// Where the boot time goes. setup() marks the end of each of its phases and
+// calls ready() once the control path works (motor off, sensors and radio
+// up); the work that overlaps the first loop() passes (LED self-test,
+// DFPlayer start) reports when it finishes. Times are micros() since the app
+// started, so the ROM and bootloader before it are not included.
+class BootProfile {
+public:
+    void begin();                              // First thing in setup()
+    void phase(const char *name);              // End of a setup() phase
+    void ready();                              // End of setup(), prints the breakdown
+    void backgroundDone(const char *name);     // Overlapped work finished
+    void IRAM_ATTR stationEvent();             // A station message was accepted (receive callback)
+    void update();                             // Prints what finished since, call from loop()
+
+private:
+    struct Mark {
+        const char *name;
+        uint32_t micros;
+    };
+    uint32_t startMicros = 0;
+    Mark phases[BOOT_PROFILE_MAX_PHASES];
+    uint8_t phaseCount = 0;
+    Mark background[BOOT_PROFILE_MAX_BACKGROUND];
+    uint8_t backgroundCount = 0;
+    uint8_t backgroundPrinted = 0;
+    volatile uint32_t firstStationMicros = 0;  // 0 until the first accepted station message
+    bool stationPrinted = false;
+};
+
+extern BootProfile bootProfile;
+
+#endif // BOOT_PROFILE_H
@@ -0,0 +1,31 @@
+#include "CHECKPOINT.h"
+#include <atomic>
+
+RTC_NOINIT_ATTR static CheckpointData rtcCheckpoint;
+
+void Checkpoint::save(uint8_t state, uint8_t station, uint8_t trainState) {
+    rtcCheckpoint.magic = 0;
+    std::atomic_signal_fence(std::memory_order_seq_cst);  // Keep the stores in this order
+    rtcCheckpoint.state = state;
+    rtcCheckpoint.station = station;
+    rtcCheckpoint.trainState = trainState;
+    rtcCheckpoint.check = ~(state ^ station ^ trainState);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    rtcCheckpoint.magic = CHECKPOINT_MAGIC;
+}
+
+ResumeSource Checkpoint::restore(esp_reset_reason_t reason, OpsJournal &journal) {
+    saved = rtcCheckpoint;
+    rtcCheckpoint.magic = 0;  // Used once; the state machine saves again right away
+
+    bool intact = reason != ESP_RST_POWERON && saved.magic == CHECKPOINT_MAGIC &&
+                  saved.check == (uint8_t)~(saved.state ^ saved.station ^ saved.trainState);
+    if (intact) {
+        resumeSource = RESUME_CHECKPOINT;
+    } else if (journal.lastPosition(journalPosition) && journalPosition.a != 0xFF) {
+        resumeSource = RESUME_JOURNAL;
+    } else {
+        resumeSource = RESUME_NONE;
+    }
+    return resumeSource;
+}
@@ -0,0 +1,45 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <Arduino.h>
+#include <esp_system.h>
+#include "OPS_JOURNAL.h"
+
+#define CHECKPOINT_MAGIC 0x314B4843      // "CHK1"
+
+// State machine position in RTC_NOINIT memory. Survives every reset except a
+// power cycle; magic is cleared while the fields change, so a reset in the
+// middle of save() leaves no checkpoint instead of a torn one.
+struct CheckpointData {
+    uint32_t magic;
+    uint8_t state;
+    uint8_t station;
+    uint8_t trainState;
+    uint8_t check;                       // ~(state ^ station ^ trainState)
+};
+
+enum ResumeSource {
+    RESUME_NONE,                         // Nothing known, home to START
+    RESUME_CHECKPOINT,                   // Exact state from RTC memory (crash, watchdog, brownout)
+    RESUME_JOURNAL,                      // Last position on flash (power cycle)
+};
+
+// Where to pick up after a reset. save() is a few RAM stores and is called on
+// every state change; restore() runs once in setup().
+class Checkpoint {
+public:
+    void save(uint8_t state, uint8_t station, uint8_t trainState);
+    ResumeSource restore(esp_reset_reason_t reason, OpsJournal &journal);
+    ResumeSource source() { return resumeSource; }
+    uint8_t state() { return saved.state; }
+    uint8_t station() { return saved.station; }
+    uint8_t trainState() { return saved.trainState; }
+    const JournalRecord &position() { return journalPosition; }
+
+private:
+    ResumeSource resumeSource = RESUME_NONE;
+    CheckpointData saved;
+    JournalRecord journalPosition;
+};
+
+#endif // CHECKPOINT_H
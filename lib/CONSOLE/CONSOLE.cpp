@@ -0,0 +1,105 @@
+#include "CONSOLE.h"
+
+void Console::begin(const ConsoleCommand *commands, uint8_t count) {
+    table = commands;
+    tableCount = count;
+    xTaskCreatePinnedToCore(task, "console", CONSOLE_TASK_STACK, this, CONSOLE_TASK_PRIORITY, nullptr, CONSOLE_TASK_CORE);
+    Serial.println("Console: ready, \"help\" lists the commands");
+}
+
+void Console::task(void *arg) {
+    Console *console = (Console *)arg;
+    for (;;) {
+        console->poll();
+        vTaskDelay(pdMS_TO_TICKS(CONSOLE_POLL_MS));
+    }
+}
+
+void Console::poll() {
+    uint32_t start = micros();
+    for (int i = 0; i < CONSOLE_MAX_BYTES && Serial.available() > 0; i++) {
+        int c = Serial.read();
+        if (c < 0) break;
+        if (c == '\r') continue;
+        if (c == '\b' || c == 0x7F) {
+            if (length > 0) length--;
+            continue;
+        }
+        if (c != '\n') {
+            if (length < CONSOLE_LINE_SIZE - 1) {
+                line[length++] = c;
+            } else {
+                overflow = true;
+            }
+            continue;
+        }
+
+        line[length] = 0;
+        if (overflow) {
+            overflows++;
+            Serial.print("Console: line too long, ");
+            Serial.print(CONSOLE_LINE_SIZE - 1);
+            Serial.println(" characters at most");
+        } else {
+            run();
+        }
+        length = 0;
+        overflow = false;
+        break;  // One command per pass, the rest waits for the next
+    }
+    uint32_t passMicros = micros() - start;
+    if (passMicros > maxPassMicros) maxPassMicros = passMicros;
+}
+
+void Console::run() {
+    char *argv[CONSOLE_MAX_ARGS];
+    int argc = 0;
+    char *p = line;
+    while (*p) {
+        while (*p == ' ' || *p == '\t') *p++ = 0;
+        if (*p == 0) break;
+        if (argc == CONSOLE_MAX_ARGS) {
+            Serial.print("Console: ");
+            Serial.print(CONSOLE_MAX_ARGS - 1);
+            Serial.println(" arguments at most");
+            return;
+        }
+        argv[argc++] = p;
+        while (*p && *p != ' ' && *p != '\t') p++;
+    }
+    if (argc == 0) return;
+
+    if (!strcmp(argv[0], "help")) {
+        lines++;
+        printHelp();
+        return;
+    }
+    for (uint8_t i = 0; i < tableCount; i++) {
+        if (strcmp(argv[0], table[i].name)) continue;
+        lines++;
+        table[i].run(argc, argv);
+        return;
+    }
+    unknown++;
+    Serial.print("Console: no command ");
+    Serial.print(argv[0]);
+    Serial.println(", \"help\" lists them");
+}
+
+bool Console::number(const char *text, long low, long high, long &value) {
+    char *end;
+    value = strtol(text, &end, 10);
+    return end != text && *end == 0 && value >= low && value <= high;
+}
+
+void Console::printHelp() {
+    for (uint8_t i = 0; i < tableCount; i++) {
+        Serial.print("  ");
+        Serial.print(table[i].name);
+        Serial.print(" ");
+        Serial.print(table[i].args);
+        for (size_t column = 3 + strlen(table[i].name) + strlen(table[i].args); column < CONSOLE_HELP_COLUMN; column++) Serial.print(' ');
+        Serial.print(" ");
+        Serial.println(table[i].help);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define CONSOLE_LINE_SIZE 64             // Longest command line, longer ones are refused whole
+#define CONSOLE_MAX_ARGS 4               // Words of a line, the command included
+#define CONSOLE_MAX_BYTES 32             // Read per pass, so one pass costs about the same however fast they are typed
+#define CONSOLE_POLL_MS 20               // Between passes
+#define CONSOLE_TASK_STACK 3072
+#define CONSOLE_TASK_PRIORITY 1          // Below the WiFi and timer tasks
+#define CONSOLE_TASK_CORE 0              // loop() runs on core 1
+#define CONSOLE_HELP_COLUMN 24           // Where help puts what a command does
+
+typedef void (*ConsoleHandler)(int argc, char **argv);
+
+struct ConsoleCommand {
+    const char *name;
+    const char *args;                    // For help
+    const char *help;
+    ConsoleHandler run;
+};
+
+// Line console on Serial, in its own low priority task on the other core
+// than loop(). Each pass takes at most CONSOLE_MAX_BYTES from the receive
+// buffer into a fixed line buffer and runs at most one complete line, split
+// into words in place; there is no String and no allocation. Handlers run in
+// the console task: whatever they touch in loop()'s state has to go through
+// something made for another task (an atomic, a critical section, a queue).
+class Console {
+public:
+    void begin(const ConsoleCommand *commands, uint8_t count);  // Starts the task
+    void poll();                         // One pass, the task calls it
+
+    static bool number(const char *text, long low, long high, long &value);  // false if not a number in range
+    void printHelp();
+
+    uint32_t lines = 0;                  // Commands run
+    uint32_t unknown = 0;                // Lines that were no command
+    uint32_t overflows = 0;              // Lines too long
+    uint32_t maxPassMicros = 0;          // Longest pass, command included
+
+private:
+    static void task(void *arg);
+    void run();
+
+    const ConsoleCommand *table = nullptr;
+    uint8_t tableCount = 0;
+    char line[CONSOLE_LINE_SIZE];
+    uint8_t length = 0;
+    bool overflow = false;               // Dropping the rest of a line too long
+};
+
+#endif // CONSOLE_H
@@ -0,0 +1,155 @@
+#include "CRASH_TRACE.h"
+
+CrashTrace crashTrace;
+
+RTC_NOINIT_ATTR static CrashTraceRing ring;
+
+void CrashTrace::begin() {
+    reason = esp_reset_reason();
+
+    // After a power cycle RTC memory holds noise, whatever the magic says
+    bool intact = reason != ESP_RST_POWERON && ring.magic == CRASH_TRACE_MAGIC &&
+                  ring.head < CRASH_TRACE_SIZE && ring.count <= CRASH_TRACE_SIZE;
+
+    if (intact) {
+        Serial.print("Reset reason: ");
+        Serial.println(resetReasonName(reason));
+        printTrace();
+    } else {
+        ring.boots = 0;
+        ring.head = 0;
+        ring.count = 0;
+        ring.magic = CRASH_TRACE_MAGIC;
+        Serial.print("Reset reason: ");
+        Serial.print(resetReasonName(reason));
+        Serial.println(", no trace from before");
+    }
+
+    ring.boots++;
+    started = true;
+    record(TRACE_BOOT, reason, ring.boots);
+}
+
+void IRAM_ATTR CrashTrace::record(CrashTraceKind kind, uint8_t a, uint16_t b) {
+    if (!started) return;
+    portENTER_CRITICAL(&lock);
+    CrashTraceEntry &entry = ring.entries[ring.head];
+    entry.millis = millis();
+    entry.kind = kind;
+    entry.a = a;
+    entry.b = b;
+    ring.head = (ring.head + 1) % CRASH_TRACE_SIZE;
+    if (ring.count < CRASH_TRACE_SIZE) ring.count++;
+    portEXIT_CRITICAL(&lock);
+}
+
+void CrashTrace::setStateNames(const char *const *names, uint8_t count) {
+    stateNames = names;
+    stateNameCount = count;
+}
+
+void CrashTrace::setButtonNames(const char *const *names, uint8_t count) {
+    buttonNames = names;
+    buttonNameCount = count;
+}
+
+const char *CrashTrace::resetReasonName(esp_reset_reason_t reason) {
+    switch (reason) {
+        case ESP_RST_POWERON: return "POWERON (power on)";
+        case ESP_RST_EXT: return "EXT (reset pin)";
+        case ESP_RST_SW: return "SW (esp_restart)";
+        case ESP_RST_PANIC: return "PANIC (exception or abort)";
+        case ESP_RST_INT_WDT: return "INT_WDT (interrupt watchdog)";
+        case ESP_RST_TASK_WDT: return "TASK_WDT (task watchdog)";
+        case ESP_RST_WDT: return "WDT (other watchdog)";
+        case ESP_RST_DEEPSLEEP: return "DEEPSLEEP (wake from deep sleep)";
+        case ESP_RST_BROWNOUT: return "BROWNOUT (supply voltage dropped)";
+        case ESP_RST_SDIO: return "SDIO";
+        default: return "UNKNOWN";
+    }
+}
+
+void CrashTrace::printTrace() {
+    portENTER_CRITICAL(&lock);
+    CrashTraceRing copy = ring;
+    portEXIT_CRITICAL(&lock);
+
+    Serial.println("---- Crash Trace (oldest first, ms since that boot) ----");
+    uint16_t first = (copy.head + CRASH_TRACE_SIZE - copy.count) % CRASH_TRACE_SIZE;
+    uint32_t lastMillis = copy.count ? copy.entries[first].millis : 0;
+    for (uint16_t i = 0; i < copy.count; i++) {
+        const CrashTraceEntry &entry = copy.entries[(first + i) % CRASH_TRACE_SIZE];
+        printEntry(entry, lastMillis);
+        lastMillis = entry.millis;
+    }
+    Serial.println("---- End of Crash Trace ----");
+}
+
+void CrashTrace::printEntry(const CrashTraceEntry &entry, uint32_t lastMillis) {
+    Serial.print(entry.millis);
+    if (entry.kind != TRACE_BOOT && entry.millis >= lastMillis) {
+        Serial.print(" (+");
+        Serial.print(entry.millis - lastMillis);
+        Serial.print(")");
+    }
+    Serial.print(" ");
+
+    switch (entry.kind) {
+        case TRACE_BOOT:
+            Serial.print("BOOT #");
+            Serial.print(entry.b);
+            Serial.print(", reset reason ");
+            Serial.println(resetReasonName((esp_reset_reason_t)entry.a));
+            break;
+        case TRACE_STATE:
+            Serial.print("STATE ");
+            if (entry.a < stateNameCount) {
+                Serial.print(stateNames[entry.a]);
+            } else {
+                Serial.print(entry.a);
+            }
+            Serial.print(", station ");
+            Serial.println(entry.b);
+            break;
+        case TRACE_STATION:
+            Serial.print("STATION ");
+            Serial.print(entry.a);
+            if (entry.b == 0) {
+                Serial.println(" active");
+            } else {
+                Serial.print(" trigger received, ");
+                Serial.print(entry.b);
+                Serial.println(entry.b == 1 ? " hop" : " hops");
+            }
+            break;
+        case TRACE_MOTOR:
+            Serial.print("MOTOR ");
+            Serial.println(entry.a == TRACE_MOTOR_FORWARD ? "FORWARD" : entry.a == TRACE_MOTOR_BACKWARD ? "BACKWARD" : "STOP");
+            break;
+        case TRACE_BUTTON:
+            Serial.print("BUTTON ");
+            if (entry.a < buttonNameCount) {
+                Serial.println(buttonNames[entry.a]);
+            } else {
+                Serial.println(entry.a);
+            }
+            break;
+        case TRACE_SEMAPHORE:
+            Serial.print("SEMAPHORE ");
+            if (entry.a == 0) {
+                Serial.print("all");
+            } else {
+                Serial.print(entry.a);
+            }
+            Serial.println(entry.b ? " GREEN" : " RED");
+            break;
+        default:
+            Serial.print("kind ");
+            Serial.print(entry.kind);
+            Serial.print(" a ");
+            Serial.print(entry.a);
+            Serial.print(" b ");
+            Serial.println(entry.b);
+            break;
+    }
+}
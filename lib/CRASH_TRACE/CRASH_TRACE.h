@@ -0,0 +1,64 @@
+#ifndef CRASH_TRACE_H
+#define CRASH_TRACE_H
+
+#include <Arduino.h>
+#include <esp_system.h>
+
+#define CRASH_TRACE_SIZE 64              // Entries kept, 8 bytes each in RTC slow memory
+#define CRASH_TRACE_MAGIC 0x54524331     // "TRC1": the ring in RTC memory is ours and intact
+
+enum CrashTraceKind : uint8_t {
+    TRACE_BOOT = 1,      // a = reset reason, b = boot count
+    TRACE_STATE,         // a = new train state, b = station
+    TRACE_STATION,       // a = station, b = radio hops (0 = wired or consumed by the FSM)
+    TRACE_MOTOR,         // a = CrashTraceMotor
+    TRACE_BUTTON,        // a = button
+    TRACE_SEMAPHORE,     // a = semaphore (0 = all), b = 0 RED / 1 GREEN
+};
+
+enum CrashTraceMotor : uint8_t { TRACE_MOTOR_STOP, TRACE_MOTOR_FORWARD, TRACE_MOTOR_BACKWARD };
+
+struct CrashTraceEntry {
+    uint32_t millis;
+    uint8_t kind;
+    uint8_t a;
+    uint16_t b;
+};
+
+// Lives in RTC_NOINIT memory: not cleared by a panic, watchdog or software
+// reset, only by a power cycle (then the magic does not match).
+struct CrashTraceRing {
+    uint32_t magic;
+    uint32_t boots;
+    uint16_t head;                       // Next slot to write
+    uint16_t count;                      // Valid entries
+    CrashTraceEntry entries[CRASH_TRACE_SIZE];
+};
+
+// Flight recorder for post-mortems. record() is a handful of RAM stores (no
+// Serial, no flash) and is safe from the WiFi task. begin() prints what the
+// previous run did last, together with why it reset.
+class CrashTrace {
+public:
+    void begin();                        // Dump the surviving trace and log this boot, call early in setup()
+    void IRAM_ATTR record(CrashTraceKind kind, uint8_t a, uint16_t b = 0);
+    void setStateNames(const char *const *names, uint8_t count); // Print train states by name
+    void setButtonNames(const char *const *names, uint8_t count); // And buttons, else their codes
+    void printTrace();
+    esp_reset_reason_t resetReason() { return reason; }
+    static const char *resetReasonName(esp_reset_reason_t reason);
+
+private:
+    void printEntry(const CrashTraceEntry &entry, uint32_t lastMillis);
+    esp_reset_reason_t reason = ESP_RST_UNKNOWN;
+    const char *const *stateNames = nullptr;
+    uint8_t stateNameCount = 0;
+    const char *const *buttonNames = nullptr;
+    uint8_t buttonNameCount = 0;
+    bool started = false;                // RTC memory may hold noise until begin() checked it
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+extern CrashTrace crashTrace;
+
+#endif // CRASH_TRACE_H
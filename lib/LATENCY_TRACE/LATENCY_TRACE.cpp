@@ -0,0 +1,179 @@
+#include "LATENCY_TRACE.h"
+
+static const char *const hopNames[LATENCY_HOPS] = {"radio", "queue", "decide", "output"};
+
+void IRAM_ATTR LatencyTrace::received(uint8_t station, uint32_t edgeMicros, uint32_t receivedMicros, bool edgeKnown) {
+    if (station >= LAYOUT_MAX_STATIONS) return;
+    portENTER_CRITICAL_ISR(&openLock);
+    if (++nextId == 0) nextId = 1;
+    open[station] = {nextId, edgeKnown, edgeMicros, receivedMicros};
+    portEXIT_CRITICAL_ISR(&openLock);
+}
+
+void LatencyTrace::taken(uint8_t station, uint32_t micros) {
+    if (station >= LAYOUT_MAX_STATIONS) return;
+    if (current.id != 0 && !current.stopping) {
+        portENTER_CRITICAL(&statsLock);
+        dropped++;
+        portEXIT_CRITICAL(&statsLock);
+    }
+
+    portENTER_CRITICAL(&openLock);
+    Open trigger = open[station];
+    open[station].id = 0;
+    if (trigger.id == 0) {
+        // Wired to this board: the edge is when loop() saw it
+        if (++nextId == 0) nextId = 1;
+        trigger = {nextId, false, micros, micros};
+    }
+    portEXIT_CRITICAL(&openLock);
+
+    // A stop still waiting for the outputs keeps its trace
+    if (current.stopping) return;
+    current = {trigger.id, station, trigger.edgeKnown, trigger.edgeMicros, trigger.receivedMicros, micros, 0, false};
+}
+
+void LatencyTrace::decided(uint8_t station, uint32_t micros) {
+    if (current.id == 0 || current.stopping || current.station != station) return;
+    current.decidedMicros = micros;
+    current.stopping = true;
+}
+
+void LatencyTrace::applied(uint32_t micros) {
+    if (!current.stopping) return;
+    uint32_t total = micros - current.edgeMicros;
+
+    portENTER_CRITICAL(&statsLock);
+    add(stations[current.station], total);
+    if (current.edgeKnown) add(hops[LATENCY_RADIO], current.receivedMicros - current.edgeMicros);
+    add(hops[LATENCY_QUEUE], current.takenMicros - current.receivedMicros);
+    add(hops[LATENCY_DECIDE], current.decidedMicros - current.takenMicros);
+    add(hops[LATENCY_OUTPUT], micros - current.decidedMicros);
+    if (!current.edgeKnown) unsynced++;
+    portEXIT_CRITICAL(&statsLock);
+
+    lastId = current.id;
+    lastStation = current.station;
+    lastMicros = total;
+    lastEdgeKnown = current.edgeKnown;
+    current = {};
+}
+
+// Bin 0 below 2^FIRST_OCTAVE, then LATENCY_TRACE_SUB_BINS per octave, the
+// last one open ended
+uint8_t LatencyTrace::binOf(uint32_t micros) {
+    if (micros < (1u << LATENCY_TRACE_FIRST_OCTAVE)) return 0;
+    int octave = 31 - __builtin_clz(micros);
+    if (octave >= LATENCY_TRACE_FIRST_OCTAVE + LATENCY_TRACE_OCTAVES) return LATENCY_TRACE_BINS - 1;
+    uint32_t sub = (micros >> (octave - 2)) & (LATENCY_TRACE_SUB_BINS - 1);
+    return 1 + (octave - LATENCY_TRACE_FIRST_OCTAVE) * LATENCY_TRACE_SUB_BINS + sub;
+}
+
+uint32_t LatencyTrace::binEnd(uint8_t bin) {
+    if (bin == 0) return 1u << LATENCY_TRACE_FIRST_OCTAVE;
+    if (bin >= LATENCY_TRACE_BINS - 1) return UINT32_MAX;
+    int octave = LATENCY_TRACE_FIRST_OCTAVE + (bin - 1) / LATENCY_TRACE_SUB_BINS;
+    uint32_t sub = (bin - 1) % LATENCY_TRACE_SUB_BINS;
+    return (LATENCY_TRACE_SUB_BINS + sub + 1) << (octave - 2);
+}
+
+void LatencyTrace::add(LatencyStats &stats, uint32_t micros) {
+    stats.count++;
+    stats.sumMicros += micros;
+    if (micros > stats.maxMicros) stats.maxMicros = micros;
+    stats.bins[binOf(micros)]++;
+}
+
+uint32_t LatencyTrace::percentile(const LatencyStats &stats, uint32_t perMille) {
+    uint64_t wanted = ((uint64_t)stats.count * perMille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint8_t bin = 0; bin < LATENCY_TRACE_BINS; bin++) {
+        seen += stats.bins[bin];
+        if (seen >= wanted) return binEnd(bin) < stats.maxMicros ? binEnd(bin) : stats.maxMicros;
+    }
+    return stats.maxMicros;
+}
+
+static void printMillis(uint32_t micros) {
+    Serial.print(micros / 1000.0, 2);
+}
+
+void LatencyTrace::printStats(const LatencyStats &stats) {
+    Serial.print(stats.count);
+    if (stats.count == 0) {
+        Serial.println();
+        return;
+    }
+    Serial.print(", avg ");
+    printMillis(stats.sumMicros / stats.count);
+    Serial.print(" p50 < ");
+    printMillis(percentile(stats, 500));
+    Serial.print(" p99 < ");
+    printMillis(percentile(stats, 990));
+    Serial.print(" max ");
+    printMillis(stats.maxMicros);
+    Serial.println(" ms");
+}
+
+void LatencyTrace::printReport() {
+    Serial.println("Latency: sensor edge to motor outputs, p50/p99 are bin upper bounds");
+    LatencyStats stats;
+    bool any = false;
+    for (uint8_t station = 0; station < LAYOUT_MAX_STATIONS; station++) {
+        portENTER_CRITICAL(&statsLock);
+        stats = stations[station];
+        portEXIT_CRITICAL(&statsLock);
+        if (stats.count == 0) continue;
+        any = true;
+        Serial.print("  station ");
+        Serial.print(station);
+        Serial.print(": ");
+        printStats(stats);
+    }
+    if (!any) Serial.println("  no stops traced yet");
+    for (uint8_t hop = 0; hop < LATENCY_HOPS; hop++) {
+        portENTER_CRITICAL(&statsLock);
+        stats = hops[hop];
+        portEXIT_CRITICAL(&statsLock);
+        Serial.print("  ");
+        Serial.print(hopNames[hop]);
+        Serial.print(": ");
+        printStats(stats);
+    }
+    Serial.print("  ");
+    Serial.print(unsynced);
+    Serial.print(" without the edge time (station not synced or wired), ");
+    Serial.print(dropped);
+    Serial.println(" triggers stopped nothing");
+}
+
+void LatencyTrace::printHistogram(uint8_t station) {
+    if (station >= LAYOUT_MAX_STATIONS) return;
+    LatencyStats stats;
+    portENTER_CRITICAL(&statsLock);
+    stats = stations[station];
+    portEXIT_CRITICAL(&statsLock);
+    Serial.print("Latency: station ");
+    Serial.print(station);
+    Serial.println(", ms up to - stops");
+    for (uint8_t bin = 0; bin < LATENCY_TRACE_BINS; bin++) {
+        if (stats.bins[bin] == 0) continue;
+        Serial.print("  ");
+        if (bin == LATENCY_TRACE_BINS - 1) {
+            Serial.print("more");
+        } else {
+            printMillis(binEnd(bin));
+        }
+        Serial.print(" - ");
+        Serial.println(stats.bins[bin]);
+    }
+}
+
+void LatencyTrace::reset() {
+    portENTER_CRITICAL(&statsLock);
+    memset(stations, 0, sizeof(stations));
+    memset(hops, 0, sizeof(hops));
+    unsynced = 0;
+    dropped = 0;
+    portEXIT_CRITICAL(&statsLock);
+}
@@ -0,0 +1,89 @@
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <Arduino.h>
+#include "LAYOUT.h"
+
+#define LATENCY_TRACE_SUB_BINS 4         // Per octave, so a bin is at most 25 % of its start wide
+#define LATENCY_TRACE_FIRST_OCTAVE 7     // Bin 0 holds everything below 128 us
+#define LATENCY_TRACE_OCTAVES 13         // Up to 2^20 us, the last bin holds everything from there (1.05 s)
+#define LATENCY_TRACE_BINS (LATENCY_TRACE_OCTAVES * LATENCY_TRACE_SUB_BINS + 2)
+
+// The parts of the way from sensor edge to motor outputs
+enum LatencyHop : uint8_t {
+    LATENCY_RADIO,                       // Sensor edge at the station -> ESP-NOW receive callback
+    LATENCY_QUEUE,                       // Callback -> loop() takes the trigger (StationTriggers)
+    LATENCY_DECIDE,                      // Taken -> the state machine calls train.stop()
+    LATENCY_OUTPUT,                      // train.stop() -> the ramp timer writes the motor outputs
+    LATENCY_HOPS
+};
+
+struct LatencyStats {
+    uint32_t count;
+    uint32_t maxMicros;
+    uint64_t sumMicros;
+    uint32_t bins[LATENCY_TRACE_BINS];   // As wide as count, so the percentiles stay right however long it runs
+};
+
+// Traces a station trigger to the motor outputs. The receive callback opens
+// a trace with its own id for each fresh trigger and stamps the sensor edge
+// (the packet's send time when the station is synced to this board's clock,
+// else the receive time) and the receive time; loop() stamps when it takes
+// the trigger, when the state machine stops the train for it and when the
+// ramp timer acted on that stop. Triggers that stop nothing (passed
+// stations) are dropped. Each finished trace adds edge to outputs to the
+// histogram of its station and every hop to the hop statistics.
+class LatencyTrace {
+public:
+    void IRAM_ATTR received(uint8_t station, uint32_t edgeMicros, uint32_t receivedMicros, bool edgeKnown);  // Receive callback
+    void taken(uint8_t station, uint32_t micros);    // loop(); a local station opens its trace here
+    void decided(uint8_t station, uint32_t micros);  // loop(), the train is stopped for the station
+    bool awaitingOutput() { return current.stopping; }
+    void applied(uint32_t micros);                    // loop(), the outputs acted on that stop
+
+    void printReport();                               // Any task: p50/p99/max per station and per hop
+    void printHistogram(uint8_t station);             // Any task
+    void reset();                                     // Any task
+
+    // The last finished trace, for the telemetry frame
+    uint16_t lastId = 0;
+    uint8_t lastStation = 0;
+    uint32_t lastMicros = 0;                          // Edge (or receive when not synced) to outputs
+    bool lastEdgeKnown = false;
+
+private:
+    struct Open {
+        uint16_t id;                                  // 0 = none
+        bool edgeKnown;
+        uint32_t edgeMicros;
+        uint32_t receivedMicros;
+    };
+    struct Trace {
+        uint16_t id;
+        uint8_t station;
+        bool edgeKnown;
+        uint32_t edgeMicros;
+        uint32_t receivedMicros;
+        uint32_t takenMicros;
+        uint32_t decidedMicros;
+        bool stopping;                                // Decided, outputs not acted yet
+    };
+
+    static uint8_t binOf(uint32_t micros);
+    static uint32_t binEnd(uint8_t bin);              // Smallest latency of the next bin, UINT32_MAX for the last
+    static void add(LatencyStats &stats, uint32_t micros);
+    static uint32_t percentile(const LatencyStats &stats, uint32_t perMille);  // Upper end of its bin, at most the max
+    static void printStats(const LatencyStats &stats);
+
+    Open open[LAYOUT_MAX_STATIONS] = {};              // Written by the receive callback
+    uint16_t nextId = 0;
+    Trace current = {};                               // loop() only
+    LatencyStats stations[LAYOUT_MAX_STATIONS] = {};  // Edge to outputs
+    LatencyStats hops[LATENCY_HOPS] = {};
+    uint32_t unsynced = 0;                            // Finished traces without the edge time
+    uint32_t dropped = 0;                             // Taken, but no stop came of it
+    portMUX_TYPE openLock = portMUX_INITIALIZER_UNLOCKED;
+    portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // LATENCY_TRACE_H
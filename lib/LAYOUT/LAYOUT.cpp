@@ -0,0 +1,148 @@
+#include "LAYOUT.h"
+
+StationLayout layout;
+
+uint8_t StationLayout::slotOf(const uint8_t *mac) {
+    // FNV-1a; the vendor prefix is shared, the low bytes tell boards apart
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 6; i++) {
+        hash ^= mac[i];
+        hash *= 16777619u;
+    }
+    return (hash ^ (hash >> 16)) & (LAYOUT_MAC_SLOTS - 1);
+}
+
+void StationLayout::begin(uint8_t stations, const uint8_t stationMacs[][6], const LayoutSection *sectionTable, uint8_t sectionRows,
+                          const uint8_t *ownMac) {
+    count = constrain(stations, LAYOUT_MIN_STATIONS, LAYOUT_MAX_STATIONS);
+    lineCount = count;
+    memset(macs, 0, sizeof(macs));
+    memset(slots, -1, sizeof(slots));
+    memset(controllers, 0, sizeof(controllers));
+    longestProbe = 0;
+    sectionCount = 0;
+    own = 0;
+    first = 0;
+
+    if (sectionRows > 0) {
+        int row = -1;
+        for (uint8_t s = 0; s < sectionRows && s < LAYOUT_MAX_SECTIONS; s++) {
+            if (memcmp(sectionTable[s].mac, ownMac, 6) == 0) row = s;
+        }
+        if (row < 0) {
+            Serial.println("Layout: this controller is not in the section table, running the whole line");
+        } else if (sectionsValid(sectionTable, sectionRows, count)) {
+            sectionCount = sectionRows;
+            own = row;
+            first = sectionTable[row].firstStation;
+            uint8_t end = row + 1 < sectionRows ? sectionTable[row + 1].firstStation : count;
+            count = end - first;
+            for (uint8_t s = 0; s < sectionCount; s++) memcpy(controllers[s], sectionTable[s].mac, 6);
+        }
+    }
+
+    for (uint8_t station = 0; station < count; station++) {
+        memcpy(macs[station], stationMacs[first + station], 6);
+        if (!hasMac(station)) continue;
+        if (find(macs[station]) >= 0) {
+            Serial.println("Layout: station " + String(station) + " has the MAC of station " + String(find(macs[station])) + ", ignored");
+            continue;
+        }
+
+        uint8_t probe = 0;
+        uint8_t slot = slotOf(macs[station]);
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & (LAYOUT_MAC_SLOTS - 1);
+            probe++;
+        }
+        slots[slot] = station;
+        if (probe > longestProbe) longestProbe = probe;
+    }
+    printReport();
+}
+
+// Section 0 starts the loop and every section has a START and a LAST of its own
+bool StationLayout::sectionsValid(const LayoutSection *sectionTable, uint8_t sectionRows, uint8_t stations) {
+    bool valid = sectionRows >= 2 && sectionRows <= LAYOUT_MAX_SECTIONS && sectionTable[0].firstStation == 0;
+    for (uint8_t s = 0; valid && s < sectionRows; s++) {
+        int end = s + 1 < sectionRows ? sectionTable[s + 1].firstStation : stations;
+        if (end - sectionTable[s].firstStation < LAYOUT_MIN_STATIONS) valid = false;
+    }
+    if (!valid) Serial.println("Layout: the section table does not cut " + String(stations) + " stations into runs of two or more, running the whole line");
+    return valid;
+}
+
+int StationLayout::findController(const uint8_t *mac) {
+    for (uint8_t s = 0; s < sectionCount; s++) {
+        if (memcmp(controllers[s], mac, 6) == 0) return s;
+    }
+    return -1;
+}
+
+bool StationLayout::hasMac(uint8_t station) {
+    for (int i = 0; i < 6; i++) {
+        if (macs[station][i] != 0) return true;
+    }
+    return false;
+}
+
+int StationLayout::find(const uint8_t *mac) {
+    uint8_t slot = slotOf(mac);
+    for (uint8_t probe = 0; probe <= longestProbe; probe++) {
+        int8_t station = slots[slot];
+        if (station < 0) return -1;
+        if (memcmp(macs[station], mac, 6) == 0) return station;
+        slot = (slot + 1) & (LAYOUT_MAC_SLOTS - 1);
+    }
+    return -1;
+}
+
+void StationLayout::printReport() {
+    uint8_t senders = 0;
+    for (uint8_t station = 0; station < count; station++) {
+        if (hasMac(station)) senders++;
+    }
+    Serial.print("Layout: ");
+    if (sectionCount > 0) {
+        Serial.print("section ");
+        Serial.print(own);
+        Serial.print(" of ");
+        Serial.print(sectionCount);
+        Serial.print(" on the loop, line stations ");
+        Serial.print(first);
+        Serial.print("..");
+        Serial.print(first + count - 1);
+        Serial.print(", ");
+    }
+    Serial.print(count);
+    Serial.print(" stations, ");
+    Serial.print(semaphoreCount());
+    Serial.print(" semaphores, ");
+    Serial.print(senders);
+    Serial.print(" senders, longest MAC probe ");
+    Serial.println(longestProbe + 1);
+}
+
+bool IRAM_ATTR StationTriggers::post(uint8_t station, uint32_t edgeMicros) {
+    if (station >= LAYOUT_MAX_STATIONS) return false;
+    StationSet bit = (StationSet)1 << station;
+    portENTER_CRITICAL(&lock);
+    bool fresh = !(pending & bit);
+    edges[station] = edgeMicros;
+    pending |= bit;
+    portEXIT_CRITICAL(&lock);
+    return fresh;
+}
+
+int StationTriggers::take() {
+    if (pending == 0) return -1;
+    portENTER_CRITICAL(&lock);
+    StationSet set = pending;
+    int station = -1;
+    if (set != 0) {
+        station = lowestStation(set);
+        pending = set & (set - 1);
+    }
+    portEXIT_CRITICAL(&lock);
+    return station;
+}
@@ -0,0 +1,89 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <Arduino.h>
+
+#define LAYOUT_MAX_STATIONS 64               // Capacity of every per-station table, one bit each in a StationSet
+#define LAYOUT_DEFAULT_STATIONS 8            // START, six stations with a semaphore, LAST
+#define LAYOUT_MIN_STATIONS 2                // START and LAST
+#define LAYOUT_MAX_SEMAPHORES (LAYOUT_MAX_STATIONS - 2)
+#define LAYOUT_MAC_SLOTS 128                 // Open addressing MAC index, a power of two at least twice the capacity
+#define LAYOUT_MAX_SECTIONS 8                // Controllers sharing one loop (lib/SECTION_LINK)
+
+// Bit n = station n
+typedef uint64_t StationSet;
+
+// Lowest station in a non-empty set
+inline uint8_t lowestStation(StationSet set) { return __builtin_ctzll(set); }
+
+// One controller of a loop run by several, and the first line station of its section
+struct LayoutSection {
+    uint8_t mac[6];
+    uint8_t firstStation;
+};
+
+// The stations of the line: how many there are and which sender MAC belongs
+// to which. Station 0 is START, stationCount() - 1 is LAST and every station
+// in between has a semaphore with the same id. The count comes from the
+// settings and is read at boot; tables are sized for LAYOUT_MAX_STATIONS so
+// nothing depends on it at compile time. find() hashes the MAC into a table
+// twice the capacity, so a lookup costs the same for 8 stations as for 64.
+//
+// On a loop run by several controllers the line is cut into sections, one
+// per row of the section table in line order. Each controller finds its row
+// by its own MAC and owns the line stations from its firstStation up to the
+// next row's; those are its stations 0..LAST, numbered as on a line of their
+// own, with START the first past the boundary below and LAST the last before
+// the one above. lineStation() gives the number on the whole loop.
+class StationLayout {
+public:
+    // Rows 0..stations-1 of macs, all zero = no sender. With a section table
+    // stations counts the whole loop and the row of ownMac picks the section.
+    void begin(uint8_t stations, const uint8_t macs[][6], const LayoutSection *sectionTable = nullptr, uint8_t sectionRows = 0,
+               const uint8_t *ownMac = nullptr);
+    uint8_t stationCount() { return count; }
+    uint8_t lastStation() { return count - 1; }
+    uint8_t semaphoreCount() { return count - 2; }           // Stations 1..LAST-1
+    const uint8_t *mac(uint8_t station) { return macs[station]; }
+    bool hasMac(uint8_t station);
+    int find(const uint8_t *mac);                            // Station of a sender MAC, -1 if unknown
+    uint8_t sections() { return sectionCount; }              // Controllers on the loop, 0 when this one runs the whole line
+    uint8_t section() { return own; }
+    uint8_t lineStation(uint8_t station) { return first + station; }
+    uint8_t lineStationCount() { return lineCount; }         // Of the whole loop, stationCount() without sections
+    const uint8_t *controllerMac(uint8_t section) { return controllers[section]; }
+    int findController(const uint8_t *mac);                  // Section of a controller MAC, -1 if none
+    void printReport();
+
+private:
+    static uint8_t slotOf(const uint8_t *mac);
+    bool sectionsValid(const LayoutSection *sectionTable, uint8_t sectionRows, uint8_t stations);
+    uint8_t count = LAYOUT_DEFAULT_STATIONS;
+    uint8_t sectionCount = 0;
+    uint8_t own = 0;
+    uint8_t first = 0;                       // Line station of station 0
+    uint8_t lineCount = LAYOUT_DEFAULT_STATIONS;
+    uint8_t controllers[LAYOUT_MAX_SECTIONS][6];
+    uint8_t macs[LAYOUT_MAX_STATIONS][6];
+    int8_t slots[LAYOUT_MAC_SLOTS];          // Station in each slot, -1 for empty
+    uint8_t longestProbe = 0;
+};
+
+extern StationLayout layout;
+
+// Station triggers waiting for loop(). The ESP-NOW receive callback posts
+// them, loop() takes the lowest station first. One bit per station, so
+// neither side scans the stations.
+class StationTriggers {
+public:
+    bool IRAM_ATTR post(uint8_t station, uint32_t edgeMicros);  // false if that station was pending already
+    int take();                                                 // Lowest pending station, -1 if none
+    uint32_t edgeMicros(uint8_t station) { return edges[station]; }
+
+private:
+    volatile StationSet pending = 0;
+    uint32_t edges[LAYOUT_MAX_STATIONS];     // Sensor edge time of the last trigger, in this board's micros()
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // LAYOUT_H
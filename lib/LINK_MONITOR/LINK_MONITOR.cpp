@@ -0,0 +1,207 @@
+#include "LINK_MONITOR.h"
+
+LinkMonitor::LinkMonitor() {
+    for (int i = 0; i < LAYOUT_MAX_STATIONS; i++) {
+        links[i] = StationLink();
+    }
+    for (int i = 0; i <= LINK_MAX_HOPS; i++) {
+        hopStats[i] = HopStats();
+    }
+}
+
+void LinkMonitor::init(unsigned long window) {
+    missingWindow = window;
+    initMillis = millis();
+    lastReportMillis = initMillis;
+}
+
+void LinkMonitor::setMissingWindow(unsigned long window) {
+    missingWindow = window;
+}
+
+void LinkMonitor::setMonitored(int station, bool monitored) {
+    if (station < 0 || station >= LAYOUT_MAX_STATIONS) return;
+    links[station].monitored = monitored;
+}
+
+void LinkMonitor::recordPacket(int station, const StationPacket &packet, int8_t rssi, uint32_t receivedMicros, uint8_t hops) {
+    if (station < 0 || station >= LAYOUT_MAX_STATIONS) return;
+    if (hops < 1) hops = 1;
+    if (hops > LINK_MAX_HOPS) hops = LINK_MAX_HOPS;
+
+    uint32_t seq = packet.seq;
+
+    portENTER_CRITICAL(&lock);
+    StationLink &link = links[station];
+
+    // A synced station stamps in our clock, so the difference is the real latency.
+    // Otherwise it is measured against the fastest delivery seen so far (that
+    // packet is taken as zero queueing delay).
+    int32_t delta = (int32_t)(receivedMicros - packet.sentMicros);
+    int32_t latency = delta;
+    if (!(packet.flags & STATION_FLAG_SYNCED)) {
+        if (!link.seen || delta < link.minDelta) {
+            link.minDelta = delta;
+        }
+        latency = delta - link.minDelta;
+    }
+    if (latency < 0) latency = 0; // Sync error can put the stamp slightly in the future
+
+    bool late = false;
+    if (link.seen && seq != 0) {
+        if (seq > link.lastSeq) {
+            uint32_t shift = seq - link.lastSeq;
+            link.lost += shift - 1;
+            link.window = shift >= 32 ? 1 : (link.window << shift) | 1;
+        } else if (link.lastSeq - seq < LINK_REORDER_WINDOW &&
+                   ((packet.flags & STATION_FLAG_SYNCED) || packet.sentMicros >= LINK_BOOT_MICROS)) {
+            uint32_t bit = 1UL << (link.lastSeq - seq);
+            if (link.window & bit) {
+                portEXIT_CRITICAL(&lock);
+                return; // Duplicate
+            }
+            // Counted lost when a newer one skipped it
+            link.window |= bit;
+            if (link.lost > 0) link.lost--;
+            link.reordered++;
+            late = true;
+        } else {
+            link.window = 1; // The station rebooted and restarted its counter
+        }
+    } else {
+        link.window = 1;
+    }
+
+    link.seen = true;
+    if (!late) link.lastSeq = seq;
+    link.received++;
+    link.lastSeenMillis = millis();
+    link.syncError = packet.syncError;
+    link.hops = hops;
+
+    HopStats &route = hopStats[hops];
+    route.packets++;
+    if (packet.flags & STATION_FLAG_SYNCED) {
+        route.timed++;
+        route.latencySum += (uint32_t)latency;
+        if ((uint32_t)latency > route.latencyMax) route.latencyMax = (uint32_t)latency;
+    }
+
+    link.history[link.head].rssi = rssi;
+    link.history[link.head].latencyMicros = (uint32_t)latency;
+    link.head = (link.head + 1) % LINK_HISTORY_SIZE;
+    if (link.count < LINK_HISTORY_SIZE) link.count++;
+    portEXIT_CRITICAL(&lock);
+}
+
+void LinkMonitor::update() {
+    unsigned long now = millis();
+
+    // One station per pass keeps loop() the same length however many there
+    // are; each is still checked many times within the missing window
+    int i = nextCheck;
+    nextCheck = nextCheck + 1 < layout.stationCount() ? nextCheck + 1 : 0;
+    StationLink &link = links[i];
+    if (link.monitored) {
+        // A station never heard from counts from boot
+        unsigned long lastSeen = link.seen ? link.lastSeenMillis : initMillis;
+        bool missing = now - lastSeen > missingWindow;
+
+        if (missing && !link.missing) {
+            Serial.println("Link: station " + String(i) + " is MISSING (silent for " + String(now - lastSeen) + " ms)");
+        } else if (!missing && link.missing) {
+            Serial.println("Link: station " + String(i) + " is back");
+        }
+        link.missing = missing;
+    }
+
+    if (now - lastReportMillis > LINK_REPORT_INTERVAL) {
+        printReport();
+        lastReportMillis = now;
+    }
+}
+
+bool LinkMonitor::isMissing(int station) {
+    if (station < 0 || station >= LAYOUT_MAX_STATIONS) return false;
+    return links[station].missing;
+}
+
+void LinkMonitor::printReport() {
+    Serial.println("---- Station Links ----");
+
+    for (int i = 0; i < layout.stationCount(); i++) {
+        if (!links[i].monitored) continue;
+
+        portENTER_CRITICAL(&lock);
+        StationLink link = links[i];
+        portEXIT_CRITICAL(&lock);
+
+        Serial.print("Station ");
+        Serial.print(i);
+        if (!link.seen) {
+            Serial.println(": never seen");
+            continue;
+        }
+
+        long rssiSum = 0;
+        int8_t rssiMin = 0;
+        uint32_t latencySum = 0;
+        uint32_t latencyMax = 0;
+        for (int s = 0; s < link.count; s++) {
+            rssiSum += link.history[s].rssi;
+            if (link.history[s].rssi < rssiMin) rssiMin = link.history[s].rssi;
+            latencySum += link.history[s].latencyMicros;
+            if (link.history[s].latencyMicros > latencyMax) latencyMax = link.history[s].latencyMicros;
+        }
+
+        uint32_t expected = link.received + link.lost;
+        float lossPercent = expected ? 100.0f * link.lost / expected : 0.0f;
+
+        Serial.print(link.missing ? ": MISSING" : ": ok");
+        if (link.hops > 1) {
+            Serial.print(" via ");
+            Serial.print(link.hops - 1);
+            Serial.print(" relay(s)");
+        }
+        Serial.print(", last seen ");
+        Serial.print(millis() - link.lastSeenMillis);
+        Serial.print(" ms ago, RSSI avg ");
+        Serial.print(link.count ? rssiSum / link.count : 0);
+        Serial.print(" min ");
+        Serial.print(rssiMin);
+        Serial.print(" dBm, loss ");
+        Serial.print(lossPercent, 1);
+        Serial.print("%, ");
+        Serial.print(link.reordered);
+        Serial.print(" late, latency avg ");
+        Serial.print(link.count ? latencySum / link.count : 0);
+        Serial.print(" max ");
+        Serial.print(latencyMax);
+        Serial.print(" us, clock sync ");
+        if (link.syncError == STATION_SYNC_ERROR_UNKNOWN) {
+            Serial.println("none");
+        } else {
+            Serial.print("+/-");
+            Serial.print(link.syncError);
+            Serial.println(" us");
+        }
+    }
+
+    for (int hops = 1; hops <= LINK_MAX_HOPS; hops++) {
+        portENTER_CRITICAL(&lock);
+        HopStats route = hopStats[hops];
+        portEXIT_CRITICAL(&lock);
+        if (route.packets == 0) continue;
+
+        Serial.print(hops);
+        Serial.print(hops == 1 ? " hop: " : " hops: ");
+        Serial.print(route.packets);
+        Serial.print(" packets, latency avg ");
+        Serial.print(route.timed ? route.latencySum / route.timed : 0);
+        Serial.print(" max ");
+        Serial.print(route.latencyMax);
+        Serial.print(" us (");
+        Serial.print(route.timed);
+        Serial.println(" timed)");
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef LINK_MONITOR_H
+#define LINK_MONITOR_H
+
+#include <Arduino.h>
+#include "LAYOUT.h"
+#include "STATION_PROTOCOL.h"
+
+#define LINK_HISTORY_SIZE 16                 // Samples kept per station (ring buffer)
+#define LINK_DEFAULT_MISSING_WINDOW 4500     // Station is missing after this many ms of silence (two lost heartbeats are normal)
+#define LINK_REPORT_INTERVAL 30000           // Print the link report this often (ms)
+#define LINK_REORDER_WINDOW 32               // A seq this far behind the newest arrived late; further back the station rebooted
+#define LINK_BOOT_MICROS 5000000             // An unsynced stamp this early means the station just rebooted
+
+struct LinkSample {
+    int8_t rssi;               // dBm, 0 when unknown
+    uint32_t latencyMicros;    // Delivery latency of this packet
+};
+
+struct StationLink {
+    bool monitored;            // Only remote stations are monitored
+    bool seen;                 // At least one packet received since boot
+    bool missing;              // Silent for longer than the missing window
+    unsigned long lastSeenMillis;
+    uint32_t lastSeq;
+    uint32_t window;           // Bit n set = lastSeq - n received
+    uint32_t received;
+    uint32_t lost;             // Sequence gaps not filled by a late packet
+    uint32_t reordered;        // Arrived after a newer one
+    int32_t minDelta;          // Smallest (receive - sent) seen, the latency reference for unsynced stations
+    uint16_t syncError;        // Clock sync error reported by the station (us)
+    uint8_t hops;              // Radio hops of the last packet, 1 = direct
+    LinkSample history[LINK_HISTORY_SIZE];
+    uint8_t head;              // Next slot to write
+    uint8_t count;             // Valid samples in history
+};
+
+// End-to-end latency by route length, from packets stamped in controller time
+struct HopStats {
+    uint32_t packets;
+    uint32_t timed;            // Packets from synced stations
+    uint32_t latencySum;
+    uint32_t latencyMax;
+};
+
+#define LINK_MAX_HOPS (STATION_RELAY_MAX_HOPS + 1)
+
+class LinkMonitor {
+public:
+    LinkMonitor();
+    void init(unsigned long missingWindow = LINK_DEFAULT_MISSING_WINDOW);
+    void setMissingWindow(unsigned long window);
+    void setMonitored(int station, bool monitored);
+    // Called from the ESP-NOW receive callback (WiFi task)
+    void recordPacket(int station, const StationPacket &packet, int8_t rssi, uint32_t receivedMicros, uint8_t hops = 1);
+    void update();             // Check the next station for silence and print the periodic report, call from loop()
+    bool isMissing(int station);
+    void printReport();
+
+private:
+    StationLink links[LAYOUT_MAX_STATIONS];
+    uint8_t nextCheck = 0;     // update() looks at one station per call
+    HopStats hopStats[LINK_MAX_HOPS + 1]; // Indexed by hops, 0 unused
+    unsigned long missingWindow = LINK_DEFAULT_MISSING_WINDOW;
+    unsigned long initMillis = 0;
+    unsigned long lastReportMillis = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // LINK_MONITOR_H
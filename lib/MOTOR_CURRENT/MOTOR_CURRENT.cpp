@@ -0,0 +1,213 @@
+#include "MOTOR_CURRENT.h"
+
+const char *currentFaultName(CurrentFault fault) {
+    switch (fault) {
+        case CURRENT_OVERCURRENT: return "OVERCURRENT";
+        case CURRENT_STALL: return "STALL";
+        case CURRENT_NO_LOAD: return "NO LOAD";
+        default: return "OK";
+    }
+}
+
+void CurrentDetector::reset() {
+    lastDrive = 0;
+    riseFrom = 0;
+    rising = false;
+    riseMicros = 0;
+    inrushMicros = 0;
+    coastMicros = 0;
+    stallMicros = 0;
+    noLoadMicros = 0;
+    overcurrent = false;
+}
+
+CurrentFault CurrentDetector::feed(float milliamps, uint32_t blockMicros, float drive) {
+    filteredMilliamps += (milliamps - filteredMilliamps) * CURRENT_FILTER_GAIN;
+
+    // A short is judged on the raw block means, the filter would only delay it.
+    // With the bridge off there is nothing left to cut.
+    bool above = milliamps > CURRENT_OVERCURRENT_MA && drive > 0;
+    if (above && overcurrent) {
+        reset();
+        return CURRENT_OVERCURRENT;
+    }
+    overcurrent = above;
+
+    // Speeding up draws inrush current, slowing down lets the back-EMF hold
+    // it near zero. Each only hides the fault on its own side, for a
+    // settling time that grows with how far the drive moved.
+    if (drive > lastDrive) {
+        if (!rising) {
+            riseFrom = lastDrive;
+            riseMicros = 0;
+        }
+        rising = true;
+        riseMicros += blockMicros;
+        inrushMicros = CURRENT_SETTLE_MICROS * (drive - riseFrom) + blockMicros;
+    } else {
+        rising = false;
+    }
+    if (drive < lastDrive) coastMicros = CURRENT_SETTLE_MICROS;
+    lastDrive = drive;
+    inrushMicros = inrushMicros > blockMicros ? inrushMicros - blockMicros : 0;
+    coastMicros = coastMicros > blockMicros ? coastMicros - blockMicros : 0;
+
+    // A stalled rotor has no back-EMF, so it draws the running current plus
+    // what the whole drive pushes through the winding; a turning one only
+    // the running current once it is up to speed. The line between the two
+    // keeps its margin down to creep drives. While the drive rises and
+    // settles a turning rotor lags it, so the line moves up towards the
+    // locked rotor current; only the first moments of a start are blanked.
+    bool settling = rising || inrushMicros > 0;
+    bool blanked = rising ? riseMicros < CURRENT_INRUSH_MICROS : false;
+    float stallMilliamps = CURRENT_RUNNING_MA + ((settling ? CURRENT_LOCKED_MA : CURRENT_STALL_MA) - CURRENT_RUNNING_MA) * drive;
+    if (!blanked && drive >= CURRENT_STALL_MIN_DRIVE && filteredMilliamps > stallMilliamps) {
+        stallMicros += blockMicros;
+        if (stallMicros >= CURRENT_STALL_MICROS) {
+            reset();
+            return CURRENT_STALL;
+        }
+    } else {
+        stallMicros = 0;
+    }
+
+    if (coastMicros == 0 && drive >= CURRENT_NO_LOAD_MIN_DRIVE && filteredMilliamps < CURRENT_NO_LOAD_MA) {
+        noLoadMicros += blockMicros;
+        if (noLoadMicros >= CURRENT_NO_LOAD_MICROS) {
+            reset();
+            return CURRENT_NO_LOAD;
+        }
+    } else {
+        noLoadMicros = 0;
+    }
+    return CURRENT_OK;
+}
+
+bool MotorCurrent::begin(Train &motor) {
+    train = &motor;
+
+    adc_digi_init_config_t init = {};
+    init.max_store_buf_size = CURRENT_BUFFER_BYTES;
+    init.conv_num_each_intr = CURRENT_FRAME_BYTES;
+    init.adc1_chan_mask = 1 << CURRENT_ADC_CHANNEL;
+    init.adc2_chan_mask = 0;
+    if (adc_digi_initialize(&init) != ESP_OK) {
+        Serial.println("Motor current: ADC DMA init failed, no current sensing");
+        return false;
+    }
+
+    adc_digi_pattern_config_t pattern = {};
+    pattern.atten = ADC_ATTEN_DB_11;
+    pattern.channel = CURRENT_ADC_CHANNEL;
+    pattern.unit = 0;                     // ADC1
+    pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+
+    adc_digi_configuration_t config = {};
+    config.conv_limit_en = true;          // Required on the ESP32
+    config.conv_limit_num = 250;
+    config.pattern_num = 1;
+    config.adc_pattern = &pattern;
+    config.sample_freq_hz = CURRENT_SAMPLE_RATE;
+    config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+    config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+    if (adc_digi_controller_configure(&config) != ESP_OK || adc_digi_start() != ESP_OK) {
+        Serial.println("Motor current: ADC DMA start failed, no current sensing");
+        adc_digi_deinitialize();
+        return false;
+    }
+
+    if (pollTimer == nullptr) {
+        esp_timer_create_args_t args = {};
+        args.callback = onPollTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "motor_current";
+        esp_timer_create(&args, &pollTimer);
+        esp_timer_start_periodic(pollTimer, CURRENT_POLL_PERIOD);
+    }
+    Serial.println("Motor current: sampling at " + String(CURRENT_SAMPLE_RATE) + " Hz");
+    return true;
+}
+
+void MotorCurrent::onPollTimer(void *arg) {
+    ((MotorCurrent *)arg)->poll();
+}
+
+void MotorCurrent::poll() {
+    uint32_t start = micros();
+
+    // Everything the DMA wrote since the last poll, as one block
+    uint8_t buffer[CURRENT_FRAME_BYTES];
+    uint32_t sum = 0;
+    uint32_t count = 0;
+    bool overrun = false;
+    while (true) {
+        uint32_t length = 0;
+        esp_err_t result = adc_digi_read_bytes(buffer, sizeof(buffer), &length, 0);
+        if (result == ESP_ERR_INVALID_STATE) {
+            overrun = true;               // Samples were dropped, the ones returned are good
+        } else if (result != ESP_OK) {
+            break;
+        }
+        for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES) {
+            const adc_digi_output_data_t *sample = (const adc_digi_output_data_t *)&buffer[i];
+            if (sample->type1.channel != CURRENT_ADC_CHANNEL) continue;
+            sum += sample->type1.data;
+            count++;
+        }
+        if (length < sizeof(buffer)) break;
+    }
+    if (count == 0) return;
+
+    float milliamps = (float)sum / count * CURRENT_MICROAMPS_PER_COUNT / 1000;
+    CurrentFault fault = detector.feed(milliamps, count * 1000000ULL / CURRENT_SAMPLE_RATE, train->driveFraction());
+    if (fault != CURRENT_OK) train->emergencyStop();
+
+    uint32_t elapsed = micros() - start;
+    portENTER_CRITICAL(&lock);
+    samples += count;
+    if (overrun) overruns++;
+    if (milliamps > peakMilliamps) peakMilliamps = milliamps;
+    if (elapsed > maxPollMicros) maxPollMicros = elapsed;
+    if (fault != CURRENT_OK) {
+        pendingFault = fault;
+        lastFaultMilliamps = fault == CURRENT_OVERCURRENT ? milliamps : detector.filtered();
+        faults[fault]++;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+CurrentFault MotorCurrent::takeFault() {
+    portENTER_CRITICAL(&lock);
+    CurrentFault fault = pendingFault;
+    pendingFault = CURRENT_OK;
+    portEXIT_CRITICAL(&lock);
+    return fault;
+}
+
+void MotorCurrent::printReport() {
+    portENTER_CRITICAL(&lock);
+    uint32_t sampled = samples;
+    uint32_t overrunCount = overruns;
+    float peak = peakMilliamps;
+    uint32_t longest = maxPollMicros;
+    uint32_t counts[4];
+    memcpy(counts, faults, sizeof(counts));
+    portEXIT_CRITICAL(&lock);
+
+    Serial.print("Motor current: ");
+    Serial.print(sampled);
+    Serial.print(" samples, ");
+    Serial.print(overrunCount);
+    Serial.print(" overruns, peak ");
+    Serial.print(peak, 0);
+    Serial.print(" mA, longest poll ");
+    Serial.print(longest);
+    Serial.print(" us | faults: ");
+    Serial.print(counts[CURRENT_OVERCURRENT]);
+    Serial.print(" overcurrent, ");
+    Serial.print(counts[CURRENT_STALL]);
+    Serial.print(" stall, ");
+    Serial.print(counts[CURRENT_NO_LOAD]);
+    Serial.println(" no load");
+}
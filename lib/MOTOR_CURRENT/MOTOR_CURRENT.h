@@ -0,0 +1,92 @@
+#ifndef MOTOR_CURRENT_H
+#define MOTOR_CURRENT_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <driver/adc.h>
+#include "TRAIN.h"
+
+// Shunt amplifier output on GPIO 35 (ADC1 channel 7, input only). Every
+// ADC1 pin of the module is taken; 35 was a wired station input that nothing
+// reads since the stations moved to ESP-NOW. UI.cpp checks its pins against it.
+#define CURRENT_ADC_PIN 35
+#define CURRENT_ADC_CHANNEL ADC1_CHANNEL_7
+#define CURRENT_SAMPLE_RATE 24000         // Hz, ADC DMA; not a multiple or divisor of the 20 kHz motor PWM
+#define CURRENT_FRAME_BYTES 128           // One DMA interrupt, 64 samples (2.7 ms)
+#define CURRENT_BUFFER_BYTES 1024         // Driver ring buffer, 21 ms of samples
+#define CURRENT_POLL_PERIOD 2000          // us between ring buffer reads
+#define CURRENT_MICROAMPS_PER_COUNT 760   // 0.1 ohm shunt, gain 10, 11 dB attenuation
+
+#define CURRENT_FILTER_GAIN 0.5f          // EWMA weight of a new block, each block is one poll
+#define CURRENT_OVERCURRENT_MA 1500       // Short circuit: two blocks in a row above this cut the motor
+#define CURRENT_RUNNING_MA 250            // Friction load, what a running train draws at any steady drive
+#define CURRENT_STALL_MA 900              // Stall at full drive; towards CURRENT_RUNNING_MA with the drive
+#define CURRENT_STALL_MIN_DRIVE 0.15f     // Below this the stall and running currents are too close
+#define CURRENT_STALL_MICROS 100000       // Held this long is a stall
+#define CURRENT_LOCKED_MA 1150            // Stall while the drive rises: near the locked rotor current at full drive
+#define CURRENT_INRUSH_MICROS 150000      // No stall judged this early in a rise, the rotor has not moved yet either
+#define CURRENT_NO_LOAD_MA 60             // Less than this while driving: no contact, derailed
+#define CURRENT_NO_LOAD_MIN_DRIVE 0.15f
+#define CURRENT_NO_LOAD_MICROS 200000
+#define CURRENT_SETTLE_MICROS 150000      // Inrush after a full drive increase, back-EMF after a decrease; scaled by the step
+
+enum CurrentFault : uint8_t { CURRENT_OK, CURRENT_OVERCURRENT, CURRENT_STALL, CURRENT_NO_LOAD };
+
+const char *currentFaultName(CurrentFault fault);
+
+// Threshold detection on the block means of the motor current. Time only
+// advances by the blocks fed in, so the host can test it on synthetic traces.
+class CurrentDetector {
+public:
+    void reset();
+    // Mean current over a block of samples taken in blockMicros, with the drive
+    // (0..1 of full, either direction) applied while they were taken
+    CurrentFault feed(float milliamps, uint32_t blockMicros, float drive);
+    float filtered() { return filteredMilliamps; }
+
+private:
+    float filteredMilliamps = 0;
+    float lastDrive = 0;
+    float riseFrom = 0;                   // Drive before the current increase (a ramp is one step)
+    bool rising = false;
+    uint32_t riseMicros = 0;              // Since the increase began
+    uint32_t inrushMicros = 0;            // Stall not judged until this ran out
+    uint32_t coastMicros = 0;             // No load not judged until this ran out
+    uint32_t stallMicros = 0;
+    uint32_t noLoadMicros = 0;
+    bool overcurrent = false;             // The previous block was above the limit
+};
+
+// Samples the motor current continuously with ADC DMA. A periodic esp_timer
+// drains the driver's ring buffer and runs the detector in the esp_timer task,
+// the same task that steps the train's ramps, so a fault cuts the motor within
+// a poll and a DMA frame of the current rising (about 5 ms), whatever loop()
+// is doing. loop() picks the fault up with takeFault() for the state machine.
+// The DMA runs on I2S0 on the ESP32, which nothing else here uses.
+class MotorCurrent {
+public:
+    bool begin(Train &motor);             // Call after train.initTrain()
+    CurrentFault takeFault();             // Last fault since the previous call, the motor is already off
+    uint16_t faultMilliamps() { return lastFaultMilliamps; }
+    void printReport();
+
+private:
+    static void onPollTimer(void *arg);
+    void poll();
+
+    Train *train = nullptr;
+    esp_timer_handle_t pollTimer = nullptr;
+    CurrentDetector detector;
+
+    // Shared with the timer task
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    CurrentFault pendingFault = CURRENT_OK;
+    uint16_t lastFaultMilliamps = 0;
+    uint32_t faults[4] = {0, 0, 0, 0};
+    uint32_t samples = 0;
+    uint32_t overruns = 0;                // Ring buffer overflowed between polls
+    float peakMilliamps = 0;
+    uint32_t maxPollMicros = 0;
+};
+
+#endif // MOTOR_CURRENT_H
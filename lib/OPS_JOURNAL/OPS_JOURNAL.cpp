@@ -0,0 +1,272 @@
+#include "OPS_JOURNAL.h"
+
+bool OpsJournal::begin() {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, JOURNAL_PARTITION_LABEL);
+    if (partition == nullptr) {
+        Serial.println("Journal: no '" JOURNAL_PARTITION_LABEL "' partition, journal disabled");
+        return false;
+    }
+    sectorCount = partition->size / JOURNAL_SECTOR_SIZE;
+
+    // The newest sector is the one with the highest seq
+    bool found = false;
+    for (uint32_t i = 0; i < sectorCount; i++) {
+        JournalSectorHeader header;
+        if (esp_partition_read(partition, sectorOffset(i), &header, sizeof(header)) != ESP_OK) continue;
+        if (header.magic != JOURNAL_MAGIC || header.recordSize != JOURNAL_RECORD_SIZE) continue;
+        if (!found || (int32_t)(header.seq - seq) > 0) {
+            sector = i;
+            seq = header.seq;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        // Empty or foreign partition: start over at sector 0
+        sector = sectorCount - 1;
+        seq = 0;
+        slot = JOURNAL_SLOTS_PER_SECTOR;
+        if (!startNextSector()) return false;
+        Serial.println("Journal: new journal, " + String(sectorCount) + " sectors");
+        xTaskCreatePinnedToCore(task, "journal", JOURNAL_TASK_STACK, this, JOURNAL_TASK_PRIORITY, nullptr, JOURNAL_TASK_CORE);
+        return true;
+    }
+
+    // Continue after the last record of the newest sector
+    JournalRecord records[JOURNAL_BATCH];
+    slot = JOURNAL_SLOTS_PER_SECTOR;
+    for (uint16_t first = 0; first < JOURNAL_SLOTS_PER_SECTOR && slot == JOURNAL_SLOTS_PER_SECTOR; first += JOURNAL_BATCH) {
+        esp_partition_read(partition, sectorOffset(sector) + first * JOURNAL_RECORD_SIZE, records, sizeof(records));
+        for (uint16_t i = 0; i < JOURNAL_BATCH; i++) {
+            if (first + i < JOURNAL_HEADER_SLOTS) continue;
+            if (records[i].type == 0xFF && records[i].millis == 0xFFFFFFFF) {
+                slot = first + i;
+                break;
+            }
+        }
+    }
+
+    // The position can sit one sector back when this one only holds boots
+    scanPositions(sector, slot);
+    if (!hasPosition) scanPositions((sector + sectorCount - 1) % sectorCount, JOURNAL_SLOTS_PER_SECTOR);
+
+    // A power cut during an erase can leave the next sector half erased, so it is always erased again
+    nextErased = false;
+    if (slot == JOURNAL_SLOTS_PER_SECTOR && !startNextSector()) return false;
+
+    Serial.println("Journal: sector " + String(sector) + " of " + String(sectorCount) + ", slot " + String(slot) +
+                   ", " + String((seq + sectorCount - 1) / sectorCount) + " erases per sector so far");
+    xTaskCreatePinnedToCore(task, "journal", JOURNAL_TASK_STACK, this, JOURNAL_TASK_PRIORITY, nullptr, JOURNAL_TASK_CORE);
+    return true;
+}
+
+void OpsJournal::scanPositions(uint32_t scanned, uint16_t endSlot) {
+    JournalSectorHeader header;
+    esp_partition_read(partition, sectorOffset(scanned), &header, sizeof(header));
+    if (header.magic != JOURNAL_MAGIC || header.recordSize != JOURNAL_RECORD_SIZE) return;
+
+    JournalRecord records[JOURNAL_BATCH];
+    for (uint16_t first = 0; first < endSlot; first += JOURNAL_BATCH) {
+        esp_partition_read(partition, sectorOffset(scanned) + first * JOURNAL_RECORD_SIZE, records, sizeof(records));
+        for (uint16_t i = 0; i < JOURNAL_BATCH && first + i < endSlot; i++) {
+            if (first + i < JOURNAL_HEADER_SLOTS) continue;
+            const JournalRecord &r = records[i];
+            if (r.type == JOURNAL_ARRIVE || r.type == JOURNAL_DEPART || r.type == JOURNAL_PASS) {
+                position = r;
+                hasPosition = true;
+            } else if (r.type == JOURNAL_MISSED && hasPosition && position.type != JOURNAL_HALT && position.type != JOURNAL_ARRIVE) {
+                // The segment model gave up waiting for it: most likely passed
+                position = r;
+                position.type = JOURNAL_PASS;
+            } else if (r.type == JOURNAL_HALT || r.type == JOURNAL_MOTOR_FAULT) {
+                if (!hasPosition) {
+                    position.a = 0xFF;
+                    position.b = JOURNAL_FORWARD;
+                }
+                position.type = JOURNAL_HALT;
+                position.millis = r.millis;
+                hasPosition = true;
+            }
+        }
+    }
+}
+
+bool OpsJournal::lastPosition(JournalRecord &record) {
+    if (!hasPosition) return false;
+    record = position;
+    return true;
+}
+
+void OpsJournal::record(JournalType type, uint8_t a, uint16_t b) {
+    if (partition == nullptr) return;
+
+    portENTER_CRITICAL(&lock);
+    if (type == JOURNAL_DEPART) {
+        moving = true;
+        positionPending = true;
+    } else if (type == JOURNAL_PASS || type == JOURNAL_MISSED) {
+        positionPending = true;
+    } else if (type == JOURNAL_ARRIVE || type == JOURNAL_HALT || type == JOURNAL_MOTOR_FAULT) {
+        moving = false;
+        stoppedMillis = millis();
+    }
+
+    if (count == JOURNAL_BUFFER_SIZE) {
+        dropped++;
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    JournalRecord &entry = buffer[(head + count) % JOURNAL_BUFFER_SIZE];
+    entry.millis = millis();
+    entry.type = type;
+    entry.a = a;
+    entry.b = b;
+    count++;
+    recorded++;
+    portEXIT_CRITICAL(&lock);
+}
+
+void OpsJournal::task(void *arg) {
+    OpsJournal *journal = (OpsJournal *)arg;
+    for (;;) {
+        journal->service();
+        vTaskDelay(pdMS_TO_TICKS(JOURNAL_POLL_MS));
+    }
+}
+
+void OpsJournal::service() {
+    if (partition == nullptr) {
+        flushRequested = false;
+        return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    uint16_t pending = count;
+    bool standing = !moving;
+    bool urgent = positionPending || flushRequested;
+    unsigned long stopped = stoppedMillis;
+    portEXIT_CRITICAL(&lock);
+
+    // One flash operation per pass so the stalls stay spread out. A batch
+    // write is under a millisecond, so it goes out as soon as the motor is off
+    // or the train has left or passed a station; a power cut then never loses
+    // which segment the train was on.
+    if (pending >= JOURNAL_FORCE_FLUSH || (pending > 0 && (standing || urgent))) {
+        writePending(JOURNAL_BATCH);
+    } else if (!nextErased && standing && millis() - stopped > JOURNAL_IDLE_ERASE) {
+        eraseNext();
+    }
+
+    if (flushRequested && (count == 0 || partition == nullptr)) flushRequested = false;
+}
+
+void OpsJournal::flush() {
+    if (partition == nullptr) return;
+    flushRequested = true;
+    unsigned long start = millis();
+    while (flushRequested && millis() - start < JOURNAL_FLUSH_TIMEOUT) {
+        delay(JOURNAL_POLL_MS);
+    }
+}
+
+bool OpsJournal::writePending(uint16_t maxRecords) {
+    if (slot == JOURNAL_SLOTS_PER_SECTOR && !startNextSector()) return false;
+
+    JournalRecord batch[JOURNAL_BATCH];
+    portENTER_CRITICAL(&lock);
+    uint16_t n = count;
+    if (n > maxRecords) n = maxRecords;
+    if (n > JOURNAL_BATCH) n = JOURNAL_BATCH;
+    if (n > JOURNAL_SLOTS_PER_SECTOR - slot) n = JOURNAL_SLOTS_PER_SECTOR - slot;
+    for (uint16_t i = 0; i < n; i++) {
+        batch[i] = buffer[(head + i) % JOURNAL_BUFFER_SIZE];
+    }
+    portEXIT_CRITICAL(&lock);
+    if (n == 0) return false;
+
+    uint32_t start = micros();
+    esp_err_t result = esp_partition_write(partition, sectorOffset(sector) + slot * JOURNAL_RECORD_SIZE, batch, n * JOURNAL_RECORD_SIZE);
+    noteStall(start);
+    writes++;
+
+    // Records that failed to write are dropped rather than retried forever
+    if (result != ESP_OK) dropped += n;
+    slot += n;
+    portENTER_CRITICAL(&lock);
+    head = (head + n) % JOURNAL_BUFFER_SIZE;
+    count -= n;
+    if (count == 0) positionPending = false;
+    portEXIT_CRITICAL(&lock);
+    return result == ESP_OK;
+}
+
+bool OpsJournal::eraseNext() {
+    uint32_t next = (sector + 1) % sectorCount;
+    uint32_t start = micros();
+    esp_err_t result = esp_partition_erase_range(partition, sectorOffset(next), JOURNAL_SECTOR_SIZE);
+    noteStall(start);
+    erases++;
+    nextErased = result == ESP_OK;
+    return nextErased;
+}
+
+bool OpsJournal::startNextSector() {
+    if (!nextErased && !eraseNext()) {
+        Serial.println("Journal: erase failed, journal disabled");
+        partition = nullptr;
+        return false;
+    }
+
+    sector = (sector + 1) % sectorCount;
+    seq++;
+    slot = JOURNAL_HEADER_SLOTS;
+    nextErased = false;
+
+    JournalSectorHeader header;
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.seq = seq;
+    header.version = JOURNAL_VERSION;
+    header.recordSize = JOURNAL_RECORD_SIZE;
+    header.sectorCount = sectorCount;
+    uint32_t start = micros();
+    esp_partition_write(partition, sectorOffset(sector), &header, sizeof(header));
+    noteStall(start);
+    writes++;
+    return true;
+}
+
+void OpsJournal::noteStall(uint32_t startMicros) {
+    uint32_t elapsed = micros() - startMicros;
+    flashMicros += elapsed;
+    if (elapsed > maxStallMicros) maxStallMicros = elapsed;
+}
+
+void OpsJournal::printReport() {
+    if (partition == nullptr) {
+        Serial.println("Journal: disabled");
+        return;
+    }
+    Serial.print("Journal: ");
+    Serial.print(recorded);
+    Serial.print(" records, ");
+    Serial.print(count);
+    Serial.print(" pending, ");
+    Serial.print(dropped);
+    Serial.print(" dropped | flash: ");
+    Serial.print(writes);
+    Serial.print(" writes, ");
+    Serial.print(erases);
+    Serial.print(" erases, ");
+    Serial.print(flashMicros / 1000);
+    Serial.print(" ms total, longest stall ");
+    Serial.print(maxStallMicros);
+    Serial.print(" us | sector ");
+    Serial.print(sector);
+    Serial.print("/");
+    Serial.print(sectorCount);
+    Serial.print(" slot ");
+    Serial.print(slot);
+    Serial.print(", erases per sector so far ");
+    Serial.println((seq + sectorCount - 1) / sectorCount);
+}
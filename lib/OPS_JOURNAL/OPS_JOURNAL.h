@@ -0,0 +1,116 @@
+#ifndef OPS_JOURNAL_H
+#define OPS_JOURNAL_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define JOURNAL_PARTITION_LABEL "journal"    // data partition, subtype 0x40 (partitions.csv)
+#define JOURNAL_SECTOR_SIZE 4096             // Flash erase unit
+#define JOURNAL_MAGIC 0x314A504F             // "OPJ1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_RECORD_SIZE 8
+#define JOURNAL_HEADER_SLOTS 2               // The sector header takes the first two record slots
+#define JOURNAL_SLOTS_PER_SECTOR (JOURNAL_SECTOR_SIZE / JOURNAL_RECORD_SIZE)
+#define JOURNAL_BUFFER_SIZE 128              // Records waiting in RAM for the next flash write
+#define JOURNAL_BATCH 32                     // Records per flash write (256 bytes, one flash page)
+#define JOURNAL_IDLE_ERASE 200               // ms the train must stand still before the next sector is erased
+#define JOURNAL_FORCE_FLUSH (JOURNAL_BUFFER_SIZE * 3 / 4) // Write even while moving beyond this many pending
+#define JOURNAL_TASK_STACK 3072
+#define JOURNAL_TASK_PRIORITY 1              // Below the WiFi and timer tasks, like the console
+#define JOURNAL_TASK_CORE 0                  // loop() runs on core 1
+#define JOURNAL_POLL_MS 10                   // The task looks for work this often
+#define JOURNAL_FLUSH_TIMEOUT 1000           // ms flush() waits for the task at most
+
+enum JournalType : uint8_t {
+    JOURNAL_BOOT = 1,        // a = reset reason
+    JOURNAL_CYCLE_START,     // A new show cycle leaves START
+    JOURNAL_DEPART,          // a = station, b = direction
+    JOURNAL_ARRIVE,          // a = station, b = direction; the train stopped there
+    JOURNAL_PASS,            // a = station, b = direction; passed without stopping
+    JOURNAL_HALT,            // Stopped by a button between stations
+    JOURNAL_SEMAPHORE,       // a = semaphore (0 = all), b = 0 RED / 1 GREEN
+    JOURNAL_BUTTON,          // a = button
+    JOURNAL_MISSED,          // a = station, b = direction; its trigger is overdue (lib/SEGMENT_MODEL)
+    JOURNAL_MOTOR_FAULT,     // a = CurrentFault, b = mA; the motor was cut, a halt (lib/MOTOR_CURRENT)
+};
+
+enum JournalDirection : uint8_t { JOURNAL_FORWARD, JOURNAL_BACKWARD };
+
+// Erased flash reads 0xFF, so a slot with type 0xFF is free
+struct __attribute__((packed)) JournalRecord {
+    uint32_t millis;         // Since the boot of the preceding JOURNAL_BOOT
+    uint8_t type;
+    uint8_t a;
+    uint16_t b;
+};
+
+struct __attribute__((packed)) JournalSectorHeader {
+    uint32_t magic;
+    uint32_t seq;            // Increases by one per sector written, orders the sectors after a wrap
+    uint8_t version;
+    uint8_t recordSize;
+    uint16_t sectorCount;    // Sectors in the partition when this one was started
+    uint32_t reserved;
+};
+
+// Append-only record of what the layout did, in its own flash partition.
+// The sectors are used round robin, so every one is erased once per lap of
+// the partition (1.4 MB, months of shows). record() only queues in RAM; all
+// flash work is done by a low priority task, so loop() never waits for a
+// write or an erase. The task writes the queue as soon as the train stops,
+// departs or passes a station, and erases the next sector ahead of time once
+// the train has stood briefly, so the erase (which stalls the flash cache of
+// both cores) lands after the stop was timed. The last position on flash is
+// therefore at most JOURNAL_POLL_MS behind. sim/journal_analyzer.cpp reads a
+// partition dump.
+class OpsJournal {
+public:
+    bool begin();                            // Find the write position and start the task, call once in setup()
+    void record(JournalType type, uint8_t a = 0, uint16_t b = 0);
+    void flush();                            // Wait until the task has written everything pending
+    // Newest ARRIVE, DEPART, PASS or HALT on flash at boot (a HALT carries the
+    // station and direction of the move it stopped, a = 0xFF if unknown; a
+    // MOTOR_FAULT is returned as a HALT, a MISSED as a PASS)
+    bool lastPosition(JournalRecord &record);
+    void printReport();
+
+private:
+    static void task(void *arg);
+    void service();
+    void scanPositions(uint32_t sector, uint16_t endSlot);
+    bool writePending(uint16_t maxRecords);
+    bool startNextSector();
+    bool eraseNext();
+    uint32_t sectorOffset(uint32_t sector) { return sector * JOURNAL_SECTOR_SIZE; }
+    void noteStall(uint32_t startMicros);
+
+    const esp_partition_t *partition = nullptr;
+    uint32_t sectorCount = 0;
+    uint32_t sector = 0;                     // Sector being filled
+    uint32_t seq = 0;                        // Its header seq
+    uint16_t slot = 0;                       // Next free record slot in it
+    bool nextErased = false;                 // The sector after it is ready
+    // Set by record(), read by the task; under lock
+    bool moving = false;                     // Between DEPART and ARRIVE/HALT
+    bool positionPending = false;            // A DEPART, PASS or MISSED is not on flash yet
+    unsigned long stoppedMillis = 0;
+    volatile bool flushRequested = false;    // flush() waits for the task to clear it
+    JournalRecord position;
+    bool hasPosition = false;
+
+    JournalRecord buffer[JOURNAL_BUFFER_SIZE];
+    uint16_t head = 0;                       // Next record to write to flash
+    uint16_t count = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    uint32_t recorded = 0;
+    uint32_t dropped = 0;                    // Buffer full, flash not keeping up
+    uint32_t writes = 0;
+    uint32_t erases = 0;
+    uint32_t flashMicros = 0;                // Total time spent in flash calls
+    uint32_t maxStallMicros = 0;             // Longest single flash call
+};
+
+#endif // OPS_JOURNAL_H
@@ -0,0 +1,122 @@
+#include "PROFILES.h"
+
+// Same order as the fields of OperatingProfile
+static const char *const fieldNames[PROFILES_FIELDS] = {
+    "dwell", "reverse", "pulse", "forward", "backward", "accel", "decel", "creep", "sound",
+};
+
+void Profiles::begin(const OperatingProfile *profileTable, uint8_t profileCount, Settings &settings) {
+    normal = {"normal", settings.dwellMillis(), settings.backwardDelayMillis(), settings.pulseMillis(),
+              settings.forwardSpeed(), settings.backwardSpeed(), settings.accelMillis(), settings.decelMillis(),
+              settings.creepSpeed(), PROFILES_DEFAULT_SOUND};
+    table = profileTable;
+    tableCount = profileCount;
+
+    uint8_t stored = settings.profile();
+    const OperatingProfile *block = profile(stored);
+    if (block == nullptr) {
+        Serial.println("Profiles: no profile " + String(stored) + ", running normal");
+        block = &normal;
+    }
+    current.store(block, std::memory_order_release);
+    printReport();
+}
+
+const OperatingProfile *Profiles::profile(uint8_t index) {
+    if (index == PROFILES_NORMAL) return &normal;
+    if (index > tableCount) return nullptr;
+    return &table[index - 1];
+}
+
+uint8_t Profiles::indexOf(const OperatingProfile *block) {
+    if (block == &normal) return PROFILES_NORMAL;
+    if (block >= custom && block < custom + PROFILES_CUSTOM_BLOCKS) return PROFILES_CUSTOM;
+    return block - table + 1;
+}
+
+bool Profiles::request(uint8_t index) {
+    const OperatingProfile *block = profile(index);
+    if (block == nullptr) return false;
+    requested.store(block, std::memory_order_release);
+    return true;
+}
+
+bool Profiles::apply() {
+    const OperatingProfile *block = requested.load(std::memory_order_acquire);
+    if (block == nullptr) return false;
+    // Active first, then the request cleared unless a newer one came in meanwhile
+    bool changed = block != current.load(std::memory_order_relaxed);
+    current.store(block, std::memory_order_seq_cst);
+    requested.compare_exchange_strong(block, nullptr, std::memory_order_seq_cst);
+    if (changed) switches++;
+    return changed;
+}
+
+int Profiles::field(const char *name) {
+    for (int i = 0; i < PROFILES_FIELDS; i++) {
+        if (!strcmp(name, fieldNames[i])) return i;
+    }
+    return -1;
+}
+
+const char *Profiles::fieldName(uint8_t field) {
+    return field < PROFILES_FIELDS ? fieldNames[field] : "?";
+}
+
+const char *Profiles::fieldUnit(uint8_t field) {
+    return field == 3 || field == 4 || field == 7 ? "%" : "ms";
+}
+
+uint32_t Profiles::value(const OperatingProfile &p, uint8_t field) {
+    switch (field) {
+        case 0: return p.dwellMillis;
+        case 1: return p.backwardDelayMillis;
+        case 2: return p.pulseMillis;
+        case 3: return p.forwardSpeed;
+        case 4: return p.backwardSpeed;
+        case 5: return p.accelMillis;
+        case 6: return p.decelMillis;
+        case 7: return p.creepSpeed;
+        case 8: return p.soundMillis;
+    }
+    return 0;
+}
+
+bool Profiles::tune(uint8_t field, uint32_t value) {
+    if (field >= PROFILES_FIELDS) return false;
+    uint32_t limit = !strcmp(fieldUnit(field), "%") ? 100 : field == 8 ? 0xFFFFFFFF : 0xFFFF;
+    if (value > limit) return false;
+
+    // No request open means no apply() between its two stores either
+    if (requested.load(std::memory_order_seq_cst) != nullptr) return false;
+    const OperatingProfile *running = current.load(std::memory_order_seq_cst);
+    OperatingProfile *block = running == &custom[0] ? &custom[1] : &custom[0];
+
+    *block = *running;
+    block->name = "custom";
+    switch (field) {
+        case 0: block->dwellMillis = value; break;
+        case 1: block->backwardDelayMillis = value; break;
+        case 2: block->pulseMillis = value; break;
+        case 3: block->forwardSpeed = value; break;
+        case 4: block->backwardSpeed = value; break;
+        case 5: block->accelMillis = value; break;
+        case 6: block->decelMillis = value; break;
+        case 7: block->creepSpeed = value; break;
+        case 8: block->soundMillis = value; break;
+    }
+    requested.store(block, std::memory_order_seq_cst);
+    return true;
+}
+
+void Profiles::printReport() {
+    const OperatingProfile &p = active();
+    String index = activeIndex() == PROFILES_CUSTOM ? String("tuned") : String(activeIndex()) + " of 0-" + String(count() - 1);
+    Serial.println("Profiles: " + String(p.name) + " (" + index + "), dwell " +
+                   String(p.dwellMillis) + " ms, backward delay " + String(p.backwardDelayMillis) + " ms, pulse " +
+                   String(p.pulseMillis) + " ms, speed " + String(p.forwardSpeed) + "/" + String(p.backwardSpeed) +
+                   "%, ramps " + String(p.accelMillis) + "/" + String(p.decelMillis) + " ms, creep " +
+                   String(p.creepSpeed) + "%, " +
+                   (p.soundMillis ? "sound every " + String(p.soundMillis / 1000) + " s, " : String("sound at boot only, ")) +
+                   String(switches) + " switches");
+}
@@ -0,0 +1,74 @@
+#ifndef PROFILES_H
+#define PROFILES_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "SETTINGS.h"
+
+#define PROFILES_NORMAL 0                // Built from the settings at boot
+#define PROFILES_DEFAULT_SOUND 324000    // ms between plays of the sound (PLAYING_TIME)
+#define PROFILES_CUSTOM 0xFF             // Index of a profile tuned value by value (tune())
+#define PROFILES_CUSTOM_BLOCKS 2         // One active, one being written
+#define PROFILES_FIELDS 9
+
+// The timing and drive values the train runs with, one set per way of running
+// the layout. Speeds and creep are % motor drive as in the settings.
+struct OperatingProfile {
+    const char *name;
+    uint16_t dwellMillis;                // At a station; a stop's own dwell in the timetable still wins
+    uint16_t backwardDelayMillis;
+    uint16_t pulseMillis;                // Semaphore relay pulse
+    uint8_t forwardSpeed;
+    uint8_t backwardSpeed;
+    uint16_t accelMillis;
+    uint16_t decelMillis;
+    uint8_t creepSpeed;
+    uint32_t soundMillis;                // Between plays of the sound, 0 = only at boot
+};
+
+// Named operating profiles ("rush hour", "quiet", ...) as immutable blocks.
+// Profile 0 is normal operation, made from the settings at boot; the others
+// come from a const table. The active block is switched by swapping a
+// pointer: request() may come from any task and only stores the block
+// wanted, apply() picks it up in loop() at a point where nothing is half
+// done, so no reader ever sees a mix of two profiles and nobody waits on a
+// lock. Blocks are never freed, so an old one stays valid for as long as
+// anyone still holds it.
+//
+// tune() makes a custom profile: a copy of the active block with one value
+// changed, written into the custom block that is not active and requested
+// like any other. It waits until no request is open: apply() publishes the
+// new active block before it clears the request, so with none open the
+// active block is the only one in use (loop() holds none across apply()).
+class Profiles {
+public:
+    void begin(const OperatingProfile *table, uint8_t count, Settings &settings);  // Starts in the stored profile
+    bool request(uint8_t index);         // Any task; false if there is no such profile
+    bool apply();                        // loop() only, at a safe point; true if the active profile changed
+    const OperatingProfile &active() { return *current.load(std::memory_order_acquire); }  // Any task
+    uint8_t activeIndex() { return indexOf(current.load(std::memory_order_acquire)); }
+    bool pending() { return requested.load(std::memory_order_acquire) != nullptr; }
+    uint8_t count() { return tableCount + 1; }
+    const OperatingProfile *profile(uint8_t index);  // nullptr if there is no such profile
+    void printReport();
+
+    // Values by name, as the console shows and sets them
+    static int field(const char *name);                  // -1 if there is no such value
+    static const char *fieldName(uint8_t field);
+    static const char *fieldUnit(uint8_t field);         // "ms" or "%"
+    static uint32_t value(const OperatingProfile &profile, uint8_t field);
+    bool tune(uint8_t field, uint32_t value);            // One task only; false if out of range or a request is open
+
+    uint32_t switches = 0;               // Applied this boot
+
+private:
+    uint8_t indexOf(const OperatingProfile *block);
+    OperatingProfile normal;
+    const OperatingProfile *table = nullptr;
+    uint8_t tableCount = 0;
+    OperatingProfile custom[PROFILES_CUSTOM_BLOCKS];
+    std::atomic<const OperatingProfile *> current{&normal};       // Stored by apply() only
+    std::atomic<const OperatingProfile *> requested{nullptr};     // Taken by the next apply()
+};
+
+#endif // PROFILES_H
@@ -0,0 +1,330 @@
+#include "SECTION_LINK.h"
+#include <string.h>
+
+void SectionLink::begin(uint8_t section, uint8_t sections, bool ring, uint32_t boot, SectionSend send, void *context) {
+    self = section;
+    incarnation = boot;
+    sendMessage = send;
+    sendContext = context;
+    arrivalHead = 0;
+    arrivalCount = 0;
+
+    for (uint8_t side = SECTION_DOWN; side <= SECTION_UP; side++) {
+        Boundary &b = boundaries[side];
+        memset(&b, 0, sizeof(b));
+        b.occupant = SECTION_NO_TRAIN;
+        b.cleared = SECTION_NO_TRAIN;
+        b.incomingTrain = SECTION_NO_TRAIN;
+        b.peer = SECTION_NONE;
+        b.id = SECTION_NONE;
+        if (sections < 2) continue;
+        if (side == SECTION_UP && (ring || section + 1 < sections)) {
+            b.peer = (section + 1) % sections;
+            b.id = section;
+        }
+        if (side == SECTION_DOWN && (ring || section > 0)) {
+            b.peer = (section + sections - 1) % sections;
+            b.id = b.peer;
+        }
+    }
+}
+
+void SectionLink::send(uint8_t side, uint8_t kind, uint8_t train, uint8_t trip, uint8_t seq, unsigned long now) {
+    Boundary &b = boundaries[side];
+    SectionMessage message;
+    message.type = STATION_MSG_SECTION;
+    message.kind = kind;
+    message.from = self;
+    message.boundary = b.id;
+    message.incarnation = incarnation;
+    message.seen = b.peerIncarnation;
+    message.epoch = b.epoch;
+    message.version = b.version;
+    message.holder = b.epoch == 0 ? SECTION_NONE : b.holder ? self : b.peer;
+    message.occupant = b.occupant;
+    message.train = train;
+    message.trip = trip;
+    message.seq = seq;
+    unsigned long ago = now - b.heardMillis;
+    message.heardAgo = !b.heard ? 0xFFFF : ago < 0xFFFF ? ago : 0xFFFE;
+    b.sentMillis = now;
+    sent++;
+    sendMessage(sendContext, b.peer, message);
+}
+
+bool SectionLink::mayDecide(uint8_t side, unsigned long now) {
+    Boundary &b = boundaries[side];
+    return b.holder && heardWithin(b, SECTION_LEASE, now) && b.heardUs && now - b.heardUsMillis < SECTION_LEASE;
+}
+
+void SectionLink::takeOver(Boundary &b) {
+    b.holder = true;
+    b.epoch++;
+    b.version = 0;
+    takeovers++;
+}
+
+// The newer token state wins. One naming this controller the holder only
+// counts if the sender knew this boot: the holder it means may be the one
+// before a restart, and the sender takes the token over once it hears of it.
+void SectionLink::merge(Boundary &b, const SectionMessage &message) {
+    if (message.epoch == 0) {
+        if (b.epoch == 0) {
+            // Both just started: boundary b is held by section b
+            b.epoch = 1;
+            b.version = 0;
+            b.holder = b.id == self;
+            b.occupant = SECTION_NO_TRAIN;
+        }
+        return;
+    }
+    bool newer = message.epoch > b.epoch || (message.epoch == b.epoch && message.version > b.version);
+    if (!newer) return;
+    if (message.holder == self && message.seen != incarnation) return;
+    b.epoch = message.epoch;
+    b.version = message.version;
+    b.holder = message.holder == self;
+    b.occupant = message.occupant;
+}
+
+void SectionLink::peerLost(Boundary &b, unsigned long now) {
+    restarts++;
+    b.heardUs = false;
+    b.refusedValid = false;
+    b.overrunValid = false;
+    if (!b.holder && b.epoch > 0) takeOver(b);
+    // Its reservation of our train's berth is gone, ask again
+    if (b.offer == OFFER_ACCEPTED) b.offer = OFFER_SENT;
+    // It offers again what it still runs; the rest is adopted after SECTION_FAILOVER
+    if (b.incoming == INCOMING_ACCEPTED) {
+        b.orphaned = true;
+        b.incomingMillis = now;
+    }
+}
+
+void SectionLink::receive(const SectionMessage &message, unsigned long now) {
+    if (message.type != STATION_MSG_SECTION) return;
+    uint8_t side = message.boundary == self ? SECTION_UP : SECTION_DOWN;
+    Boundary &b = boundaries[side];
+    if (b.peer == SECTION_NONE || message.from != b.peer || message.boundary != b.id) return;
+
+    if (b.peerIncarnation != 0 && message.incarnation != b.peerIncarnation) peerLost(b, now);
+    b.peerIncarnation = message.incarnation;
+    b.heard = true;
+    b.heardMillis = now;
+    if (message.heardAgo != 0xFFFF && message.seen == incarnation) {
+        unsigned long heardUs = now - message.heardAgo;
+        if (!b.heardUs || (long)(heardUs - b.heardUsMillis) > 0) b.heardUsMillis = heardUs;
+        b.heardUs = true;
+    }
+    merge(b, message);
+
+    switch (message.kind) {
+    case SECTION_MSG_HEARTBEAT:
+        if (message.train != SECTION_NO_TRAIN && b.holder && b.occupant == message.train) {
+            b.occupant = SECTION_NO_TRAIN;
+            b.version++;
+        }
+        break;
+    case SECTION_MSG_OFFER:
+        onOffer(side, message, now);
+        break;
+    case SECTION_MSG_COMMIT:
+        onCommit(side, message, now);
+        break;
+    case SECTION_MSG_OVERRUN:
+        if (b.overrunValid && message.seq == b.overrunHeard) break;  // A copy
+        b.overrunValid = true;
+        b.overrunHeard = message.seq;
+        b.overrun = true;
+        overruns++;
+        break;
+    default:
+        onAnswer(b, message);
+        break;
+    }
+}
+
+void SectionLink::onOffer(uint8_t side, const SectionMessage &message, unsigned long now) {
+    Boundary &b = boundaries[side];
+    bool same = b.incomingTrain == message.train && b.incomingTrip == message.trip;
+    if (same && b.incoming == INCOMING_TAKEN) {
+        send(side, SECTION_MSG_DONE, message.train, message.trip, message.seq, now);
+        return;
+    }
+    if (same && b.incoming == INCOMING_ACCEPTED) {
+        b.incomingMillis = now;
+        b.orphaned = false;
+        send(side, SECTION_MSG_ACCEPT, message.train, message.trip, message.seq, now);
+        return;
+    }
+    // A refusal stands for repeats of that offer and late copies of older ones
+    bool ok = !(b.refusedValid && (int8_t)(message.seq - b.refusedSeq) <= 0) && b.incoming != INCOMING_ACCEPTED && b.accepting;
+    if (ok && b.holder) ok = mayDecide(side, now) && b.occupant == SECTION_NO_TRAIN;
+    if (!ok) {
+        b.refusedValid = true;
+        b.refusedSeq = message.seq;
+        send(side, SECTION_MSG_REFUSE, message.train, message.trip, message.seq, now);
+        return;
+    }
+    b.incoming = INCOMING_ACCEPTED;
+    b.incomingTrain = message.train;
+    b.incomingTrip = message.trip;
+    b.incomingMillis = now;
+    b.orphaned = false;
+    if (b.holder) {
+        b.occupant = message.train;
+        b.version++;
+    }
+    send(side, SECTION_MSG_ACCEPT, message.train, message.trip, message.seq, now);
+}
+
+// A commit is always taken: only an accepted train is committed, and a
+// restart here may have lost the acceptance
+void SectionLink::onCommit(uint8_t side, const SectionMessage &message, unsigned long now) {
+    Boundary &b = boundaries[side];
+    bool same = b.incomingTrain == message.train && b.incomingTrip == message.trip;
+    if (!(same && b.incoming == INCOMING_TAKEN)) {
+        b.incoming = INCOMING_TAKEN;
+        b.incomingTrain = message.train;
+        b.incomingTrip = message.trip;
+        taken++;
+        pushArrival(side, message.train, message.trip, false);
+    }
+    send(side, SECTION_MSG_DONE, message.train, message.trip, message.seq, now);
+}
+
+void SectionLink::onAnswer(Boundary &b, const SectionMessage &message) {
+    if (b.offer == OFFER_NONE || message.seq != b.offerSeq || message.train != b.offerTrain) return;
+    switch (message.kind) {
+    case SECTION_MSG_ACCEPT:
+        if (b.offer == OFFER_SENT) b.offer = OFFER_ACCEPTED;
+        break;
+    case SECTION_MSG_REFUSE:
+        if (b.offer == OFFER_SENT) b.offer = OFFER_REFUSED;
+        break;
+    case SECTION_MSG_DONE:
+        if (b.offer == OFFER_COMMITTING) b.offer = OFFER_NONE;
+        else if (b.offer == OFFER_SENT || b.offer == OFFER_ACCEPTED) b.offer = OFFER_GONE;
+        break;
+    }
+}
+
+SectionHandoff SectionLink::handOff(uint8_t side, uint8_t train, uint8_t trip, unsigned long now) {
+    Boundary &b = boundaries[side];
+    if (b.peer == SECTION_NONE) return SECTION_REFUSED;
+    if (b.offer != OFFER_NONE && (b.offerTrain != train || b.offerTrip != trip)) return SECTION_WAIT;  // One at a time
+
+    switch (b.offer) {
+    case OFFER_NONE:
+        b.offer = OFFER_SENT;
+        b.offerTrain = train;
+        b.offerTrip = trip;
+        b.offerSeq = b.nextSeq++;
+        b.offerMillis = now;
+        send(side, SECTION_MSG_OFFER, train, trip, b.offerSeq, now);
+        return SECTION_WAIT;
+    case OFFER_ACCEPTED:
+        if (b.holder) {
+            if (!mayDecide(side, now) || (b.occupant != SECTION_NO_TRAIN && b.occupant != train)) return SECTION_WAIT;
+            // The commit hands the token over with the train in the block
+            b.occupant = train;
+            b.holder = false;
+            b.epoch++;
+            b.version = 0;
+        }
+        b.offer = OFFER_COMMITTING;
+        b.offerMillis = now;
+        handoffs++;
+        send(side, SECTION_MSG_COMMIT, train, trip, b.offerSeq, now);
+        return SECTION_GO;
+    case OFFER_REFUSED:
+        b.offer = OFFER_NONE;
+        refusals++;
+        return SECTION_REFUSED;
+    case OFFER_GONE:
+        b.offer = OFFER_NONE;
+        return SECTION_GONE;
+    case OFFER_COMMITTING:
+        return SECTION_GO;
+    default:
+        return SECTION_WAIT;
+    }
+}
+
+void SectionLink::update(unsigned long now) {
+    for (uint8_t side = SECTION_DOWN; side <= SECTION_UP; side++) {
+        Boundary &b = boundaries[side];
+        if (b.peer == SECTION_NONE) continue;
+        bool silent = b.heard && now - b.heardMillis >= SECTION_FAILOVER;
+
+        if (silent && !b.holder && b.epoch > 0) takeOver(b);
+        if (b.incoming == INCOMING_ACCEPTED && now - b.incomingMillis >= SECTION_FAILOVER && (silent || b.orphaned)) {
+            if (!b.holder) takeOver(b);
+            if (b.occupant == SECTION_NO_TRAIN) {
+                b.occupant = b.incomingTrain;
+                b.version++;
+            }
+            b.incoming = INCOMING_TAKEN;
+            adoptions++;
+            pushArrival(side, b.incomingTrain, b.incomingTrip, true);
+        }
+        if (b.cleared != SECTION_NO_TRAIN && b.occupant != b.cleared) b.cleared = SECTION_NO_TRAIN;
+
+        if ((b.offer == OFFER_SENT || b.offer == OFFER_COMMITTING) && now - b.offerMillis >= SECTION_RETRY) {
+            b.offerMillis = now;
+            repeats++;
+            send(side, b.offer == OFFER_SENT ? SECTION_MSG_OFFER : SECTION_MSG_COMMIT, b.offerTrain, b.offerTrip, b.offerSeq, now);
+        } else if (b.overrunRepeats > 0 && now - b.sentMillis >= SECTION_RETRY) {
+            b.overrunRepeats--;
+            send(side, SECTION_MSG_OVERRUN, SECTION_NO_TRAIN, 0, b.overrunSeq, now);
+        } else if (now - b.sentMillis >= SECTION_HEARTBEAT_INTERVAL) {
+            send(side, SECTION_MSG_HEARTBEAT, b.cleared, 0, 0, now);
+        }
+    }
+}
+
+uint8_t SectionLink::incoming(uint8_t side) {
+    Boundary &b = boundaries[side];
+    return b.incoming == INCOMING_ACCEPTED ? b.incomingTrain : SECTION_NO_TRAIN;
+}
+
+void SectionLink::arrived(uint8_t side, uint8_t train) {
+    Boundary &b = boundaries[side];
+    if (b.occupant != train) return;
+    if (b.holder) {
+        b.occupant = SECTION_NO_TRAIN;
+        b.version++;
+    } else {
+        b.cleared = train;
+    }
+}
+
+void SectionLink::reportOverrun(uint8_t side, unsigned long now) {
+    Boundary &b = boundaries[side];
+    if (b.peer == SECTION_NONE) return;
+    b.overrunSeq++;
+    b.overrunRepeats = SECTION_OVERRUN_REPEATS - 1;
+    send(side, SECTION_MSG_OVERRUN, SECTION_NO_TRAIN, 0, b.overrunSeq, now);
+}
+
+bool SectionLink::takeOverrun(uint8_t side) {
+    Boundary &b = boundaries[side];
+    bool heard = b.overrun;
+    b.overrun = false;
+    return heard;
+}
+
+void SectionLink::pushArrival(uint8_t side, uint8_t train, uint8_t trip, bool adopted) {
+    if (arrivalCount == SECTION_ARRIVALS) return;  // Two trains per boundary at most are ever waiting
+    arrivals[(arrivalHead + arrivalCount) % SECTION_ARRIVALS] = {side, train, trip, adopted};
+    arrivalCount++;
+}
+
+bool SectionLink::takeArrival(SectionArrival &arrival) {
+    if (arrivalCount == 0) return false;
+    arrival = arrivals[arrivalHead];
+    arrivalHead = (arrivalHead + 1) % SECTION_ARRIVALS;
+    arrivalCount--;
+    return true;
+}
@@ -0,0 +1,170 @@
+#ifndef SECTION_LINK_H
+#define SECTION_LINK_H
+
+#include <stdint.h>
+#include "STATION_PROTOCOL.h"
+
+#define SECTION_NONE 0xFF
+#define SECTION_NO_TRAIN 0xFF
+#define SECTION_DOWN 0                   // Side towards the section below
+#define SECTION_UP 1
+#define SECTION_HEARTBEAT_INTERVAL 100   // ms between messages to a neighbour when nothing else is sent
+#define SECTION_RETRY 30                 // ms between repeats of an unanswered offer or commit
+#define SECTION_LEASE 400                // ms: the token holder decides only while both sides heard each other this recently
+#define SECTION_FAILOVER 1000            // ms of silence before a neighbour's token and train are taken over; the
+                                         // margin over SECTION_LEASE covers the radio delay
+#define SECTION_OVERRUN_REPEATS 3        // Copies of an overrun report, SECTION_RETRY apart
+#define SECTION_ARRIVALS 8
+
+enum SectionHandoff : uint8_t {
+    SECTION_WAIT,                        // Asked the neighbour, keep the train standing and leave it alone
+    SECTION_GO,                          // Handed over: the train is the neighbour's, no more commands to it
+    SECTION_REFUSED,                     // Not now (berth taken, block busy), the train is still this controller's
+    SECTION_GONE,                        // The neighbour took the train over while this controller was silent
+};
+
+// A train that became this controller's, on the boundary on that side
+struct SectionArrival {
+    uint8_t side;
+    uint8_t train;
+    uint8_t trip;                        // Crossing count, the next handOff() of the train passes trip + 1
+    bool adopted;                        // Taken over from a neighbour gone silent, not handed over
+};
+
+typedef void (*SectionSend)(void *context, uint8_t section, const SectionMessage &message);
+
+// One controller's part in a line run by several: each owns a contiguous
+// section with its stations, semaphores and trains, and trains cross from one
+// section to the next on the boundaries between them.
+//
+// The block on a boundary has one token, held by one of its two controllers,
+// and only the holder lets a train into the block. A train standing at the
+// last station before a boundary is handed over in three steps: its
+// controller OFFERs it and stops commanding it, the next one ACCEPTs once its
+// berth is free and reserves it, the first one COMMITs and from then on the
+// train is the next one's, which drives it out. A commit from the holder
+// hands the token over too; the new holder frees the block when the train
+// reaches its station. A train never has two controllers.
+//
+// Every message doubles as a heartbeat and says how long ago the sender heard
+// the receiver. The holder only decides while both directions were heard
+// within SECTION_LEASE, and the other controller takes the token over after
+// SECTION_FAILOVER without a word. By then the holder's lease has run out, so
+// the two never decide at once; every change of hands bumps the token's epoch
+// and the higher epoch wins when they hear each other again. A train accepted
+// but not committed when its controller went silent is adopted by the next
+// one; the silent one hears DONE to its offer when it is back. A neighbour
+// that restarted (new incarnation) lost its token at once and gets
+// SECTION_FAILOVER to offer again what it still runs.
+//
+// A train whose last trigger before the boundary was lost runs on into the
+// next section. That controller sees its START trigger with no train due and
+// reports an overrun; the one below stops the train it was running there.
+//
+// Pure logic on the times it is given, like lib/TIME_SYNC, so several
+// controllers run on host threads (sim/federation_sim.cpp). All calls come
+// from one task; on the board lib/BLOCK_CONTROL runs it from loop() and the
+// ESP-NOW callback queues the messages.
+class SectionLink {
+public:
+    // ring: the last section's up neighbour is section 0, as on a loop layout
+    void begin(uint8_t section, uint8_t sections, bool ring, uint32_t incarnation, SectionSend send, void *context);
+    void receive(const SectionMessage &message, unsigned long now);
+    void update(unsigned long now);      // Heartbeats, repeats and failover, call from loop()
+
+    // Leaving: poll while the train stands at the last station before the boundary
+    SectionHandoff handOff(uint8_t side, uint8_t train, uint8_t trip, unsigned long now);
+
+    // Entering
+    void setAccepting(uint8_t side, bool free) { boundaries[side].accepting = free; }  // The berth past the boundary is free
+    uint8_t incoming(uint8_t side);      // Train accepted and not committed yet, its berth is taken; SECTION_NO_TRAIN if none
+    bool takeArrival(SectionArrival &arrival);  // A train became this controller's
+    void arrived(uint8_t side, uint8_t train);  // The train from that boundary reached its station, the block is free
+    void reportOverrun(uint8_t side, unsigned long now);  // A train ran in across that boundary unannounced
+
+    // Leaving, too: the neighbour on that side reported an overrun, true once per report
+    bool takeOverrun(uint8_t side);
+
+    uint8_t neighbour(uint8_t side) { return boundaries[side].peer; }
+    bool neighbourUp(uint8_t side, unsigned long now) { return heardWithin(boundaries[side], SECTION_FAILOVER, now); }
+    bool holder(uint8_t side) { return boundaries[side].holder; }
+    bool mayDecide(uint8_t side, unsigned long now);  // Holder with a valid lease
+    uint16_t epoch(uint8_t side) { return boundaries[side].epoch; }
+    uint8_t occupant(uint8_t side) { return boundaries[side].occupant; }  // As last known here, SECTION_NO_TRAIN if none
+
+    uint32_t handoffs = 0;               // Trains handed over
+    uint32_t taken = 0;                  // Trains handed over to this controller
+    uint32_t adoptions = 0;              // Trains taken over from a neighbour gone silent
+    uint32_t refusals = 0;               // Offers of this controller refused
+    uint32_t takeovers = 0;              // Tokens taken over
+    uint32_t restarts = 0;               // Neighbour restarts seen
+    uint32_t overruns = 0;               // Overruns neighbours reported
+    uint32_t sent = 0;
+    uint32_t repeats = 0;                // Offers and commits sent again
+
+private:
+    enum OfferState : uint8_t { OFFER_NONE, OFFER_SENT, OFFER_ACCEPTED, OFFER_REFUSED, OFFER_GONE, OFFER_COMMITTING };
+    enum IncomingState : uint8_t { INCOMING_NONE, INCOMING_ACCEPTED, INCOMING_TAKEN };
+
+    struct Boundary {
+        uint8_t peer;                    // SECTION_NONE at the end of a line
+        uint8_t id;                      // Boundary number, the section below it
+        uint16_t epoch;                  // 0 until the token state is known
+        uint16_t version;
+        bool holder;
+        uint8_t occupant;
+        uint8_t cleared;                 // Left the block while the neighbour held the token, to tell it
+        bool accepting;
+        bool heard;                      // Anything from the neighbour yet
+        unsigned long heardMillis;
+        bool heardUs;
+        unsigned long heardUsMillis;     // When the neighbour last heard this controller, as it reported
+        uint32_t peerIncarnation;
+        unsigned long sentMillis;
+
+        // This controller's train leaving across the boundary
+        OfferState offer;
+        uint8_t offerTrain;
+        uint8_t offerTrip;
+        uint8_t offerSeq;
+        uint8_t nextSeq;
+        unsigned long offerMillis;
+
+        // The neighbour's train coming in
+        IncomingState incoming;
+        uint8_t incomingTrain;
+        uint8_t incomingTrip;
+        unsigned long incomingMillis;    // Last word about it
+        bool orphaned;                   // Its controller restarted since
+        bool refusedValid;
+        uint8_t refusedSeq;              // Last offer refused
+
+        // Overrun reports, to the neighbour and from it
+        uint8_t overrunSeq;
+        uint8_t overrunRepeats;          // Copies still to send
+        bool overrunValid;
+        uint8_t overrunHeard;            // Seq of the last report heard
+        bool overrun;                    // Heard and not taken yet
+    };
+
+    bool heardWithin(const Boundary &b, unsigned long window, unsigned long now) { return b.heard && now - b.heardMillis < window; }
+    void send(uint8_t side, uint8_t kind, uint8_t train, uint8_t trip, uint8_t seq, unsigned long now);
+    void merge(Boundary &b, const SectionMessage &message);
+    void takeOver(Boundary &b);
+    void peerLost(Boundary &b, unsigned long now);
+    void onOffer(uint8_t side, const SectionMessage &message, unsigned long now);
+    void onCommit(uint8_t side, const SectionMessage &message, unsigned long now);
+    void onAnswer(Boundary &b, const SectionMessage &message);
+    void pushArrival(uint8_t side, uint8_t train, uint8_t trip, bool adopted);
+
+    uint8_t self = 0;
+    uint32_t incarnation = 0;
+    SectionSend sendMessage = nullptr;
+    void *sendContext = nullptr;
+    Boundary boundaries[2];
+    SectionArrival arrivals[SECTION_ARRIVALS];
+    uint8_t arrivalHead = 0;
+    uint8_t arrivalCount = 0;
+};
+
+#endif // SECTION_LINK_H
@@ -0,0 +1,265 @@
+#include "SEGMENT_MODEL.h"
+
+static Preferences preferences;
+
+static const char *directionName(JournalDirection direction) {
+    return direction == JOURNAL_FORWARD ? "fwd" : "back";
+}
+
+void SegmentModel::begin(uint8_t route, StationSet stops) {
+    uint8_t stations = layout.stationCount();
+    memset(&data, 0, sizeof(data));
+    forwardStops = stops;
+    if (route > 0) snprintf(key, sizeof(key), "%s%u", SEGMENT_KEY, route);
+
+    // Read over the whole model, header and rows as saved; the rows of
+    // stations past the stored ones stay zero
+    preferences.begin(SEGMENT_NAMESPACE, true);
+    size_t length = preferences.getBytesLength(key);
+    uint8_t *raw = (uint8_t *)&data;
+    bool read = length > 0 && length <= sizeof(data) && preferences.getBytes(key, raw, length) == length;
+    preferences.end();
+
+    if (read && data.version == SEGMENT_VERSION && data.stations == stations && length == storedSize(stations)) {
+        Serial.println("Segment model: loaded");
+    } else if (read && raw[0] == 2 && stations == SEGMENT_LEGACY_STATIONS &&
+               length == 1 + 2 * SEGMENT_LEGACY_STATIONS * sizeof(SegmentStats)) {
+        SegmentStats legacy[2][SEGMENT_LEGACY_STATIONS];
+        memcpy(legacy, raw + 1, sizeof(legacy));
+        memset(data.segments, 0, sizeof(data.segments));
+        for (int from = 0; from < SEGMENT_LEGACY_STATIONS; from++) {
+            data.segments[from][JOURNAL_FORWARD] = legacy[JOURNAL_FORWARD][from];
+            data.segments[from][JOURNAL_BACKWARD] = legacy[JOURNAL_BACKWARD][from];
+        }
+        dirty = true;
+        Serial.println("Segment model: loaded, upgraded from version 2");
+    } else {
+        memset(data.segments, 0, sizeof(data.segments));
+        Serial.println(read ? "Segment model: stored for another layout, learning from scratch"
+                            : "Segment model: none stored, learning from scratch");
+    }
+    data.version = SEGMENT_VERSION;
+    data.stations = stations;
+}
+
+int8_t SegmentModel::nextStation(uint8_t from, JournalDirection direction) {
+    int next = direction == JOURNAL_FORWARD ? from + 1 : from - 1;
+    return next >= 0 && next < data.stations ? next : -1;
+}
+
+void SegmentModel::depart(uint8_t station, JournalDirection direction) {
+    if (station >= data.stations) return;
+    timing = true;
+    fromStation = station;
+    runDirection = direction;
+    startMillis = millis();
+    watchedStation = nextStation(station, direction);
+    watchStartMillis = startMillis;
+    overdueFlagged = false;
+    creepActive = false;
+}
+
+void SegmentModel::pass(uint8_t station, JournalDirection direction) {
+    if (station >= data.stations) return;
+    unsigned long now = millis();
+
+    // Only a run straight to the neighbour is learned, a late one included;
+    // after a lost trigger the train arrives from two stations back
+    if (timing && direction == runDirection && station == nextStation(fromStation, direction)) {
+        SegmentStats &stats = data.segments[fromStation][direction];
+        float elapsed = now - startMillis;
+        if (stats.creepAt > 0 && towardsStop()) {
+            // Reaching the sensor before the creep point counts as a negative creep time
+            stats.creepAt += (elapsed - stats.creepAt - SEGMENT_CREEP_MILLIS) * SEGMENT_CREEP_GAIN;
+            if (stats.creepAt < 1) stats.creepAt = 1;
+        }
+        learn(stats, elapsed, fromStation, direction);
+    }
+    depart(station, direction);
+}
+
+void SegmentModel::arrive(uint8_t station, JournalDirection direction) {
+    pass(station, direction);
+    timing = false;
+}
+
+void SegmentModel::cancel() {
+    timing = false;
+}
+
+const SegmentStats *SegmentModel::seenSegment(JournalDirection direction, bool slowest) {
+    const SegmentStats *found = nullptr;
+    for (int from = 0; from < data.stations; from++) {
+        const SegmentStats &stats = data.segments[from][direction];
+        if (stats.count > 0 && (found == nullptr || (stats.mean > found->mean) == slowest)) found = &stats;
+    }
+    return found;
+}
+
+bool SegmentModel::reachable(uint8_t station, JournalDirection direction) {
+    int ahead = direction == JOURNAL_FORWARD ? station - fromStation : fromStation - station;
+    if (!timing || direction != runDirection || station >= data.stations || ahead <= 0) return true;
+    const SegmentStats *forward = seenSegment(JOURNAL_FORWARD, false);
+    const SegmentStats *backward = seenSegment(JOURNAL_BACKWARD, false);
+    float fastest = forward == nullptr ? (backward == nullptr ? 0 : backward->mean)
+                  : backward == nullptr ? forward->mean : min(forward->mean, backward->mean);
+    return millis() - startMillis >= ahead * fastest * SEGMENT_REACH_SHARE;
+}
+
+float SegmentModel::expectedMillis(uint8_t from, JournalDirection direction) {
+    if (from >= data.stations) return 0;
+    const SegmentStats &stats = data.segments[from][direction];
+    return stats.count >= SEGMENT_MIN_SAMPLES ? stats.mean : 0;
+}
+
+void SegmentModel::learn(SegmentStats &stats, float sample, uint8_t from, JournalDirection direction) {
+    if (stats.count < 0xFFFF) stats.count++;
+
+    // Plain average over the first runs, then exponentially weighted
+    float alpha = 1.0f / stats.count;
+    if (alpha < SEGMENT_ALPHA) alpha = SEGMENT_ALPHA;
+    float delta = sample - stats.mean;
+    stats.mean += alpha * delta;
+    stats.variance = (1 - alpha) * (stats.variance + alpha * delta * delta);
+    runs++;
+    dirty = true;
+
+    // First guess: creeping at about a quarter of the speed covers the last
+    // quarter of the creep time's distance at full speed
+    if (stats.count == SEGMENT_MIN_SAMPLES && stats.creepAt == 0) {
+        stats.creepAt = stats.mean - SEGMENT_CREEP_MILLIS / 4;
+        if (stats.creepAt < stats.mean / 2) stats.creepAt = stats.mean / 2;
+    }
+
+    int8_t to = nextStation(from, direction);
+    if (stats.count == SEGMENT_BASELINE_SAMPLES) {
+        stats.baseline = stats.mean;
+        Serial.println("Segment model: " + String(directionName(direction)) + " " + String(from) + "->" + String(to) +
+                       " baseline " + String(stats.baseline / 1000, 3) + " s");
+        return;
+    }
+    if (stats.baseline <= 0) return;
+
+    // Slower runs point at dirty track or worn wheels, faster ones at a changed speed setting
+    float drift = (stats.mean - stats.baseline) / stats.baseline;
+    if (!stats.drifting && fabsf(drift) > SEGMENT_DRIFT_LIMIT) {
+        stats.drifting = 1;
+        warnings++;
+        Serial.println("Maintenance: segment " + String(directionName(direction)) + " " + String(from) + "->" + String(to) +
+                       " now takes " + String(stats.mean / 1000, 3) + " s, " + String(drift * 100, 1) + "% off its " +
+                       String(stats.baseline / 1000, 3) + " s baseline. Check the track and the wheels");
+    } else if (stats.drifting && fabsf(drift) < SEGMENT_DRIFT_LIMIT / 2) {
+        stats.drifting = 0;
+        Serial.println("Maintenance: segment " + String(directionName(direction)) + " " + String(from) + "->" + String(to) +
+                       " back near its baseline");
+    }
+}
+
+void SegmentModel::update(OpsJournal &journal) {
+    unsigned long now = millis();
+
+    if (timing && !creepActive && watchedStation == nextStation(fromStation, runDirection) && towardsStop()) {
+        const SegmentStats &stats = data.segments[fromStation][runDirection];
+        if (stats.creepAt > 0 && now - startMillis >= stats.creepAt) {
+            creepActive = true;
+            creepStartMillis = now;
+        }
+    }
+
+    if (timing && !overdueFlagged && watchedStation >= 0) {
+        uint8_t from = runDirection == JOURNAL_FORWARD ? watchedStation - 1 : watchedStation + 1;
+        const SegmentStats *watched = &data.segments[from][runDirection];
+        bool end = nextStation(watchedStation, runDirection) < 0;
+        if (watched->count < SEGMENT_MIN_SAMPLES) {
+            const SegmentStats *slowest = seenSegment(runDirection, true);
+            if (slowest != nullptr && slowest->mean > watched->mean) watched = slowest;
+        }
+        const SegmentStats &stats = *watched;
+        if (stats.count > 0) {
+            float margin = SEGMENT_SIGMAS * sqrtf(stats.variance);
+            if (margin < stats.mean * SEGMENT_MIN_MARGIN) margin = stats.mean * SEGMENT_MIN_MARGIN;
+            float limit = stats.mean + margin;
+            if (creepActive) {
+                float creepLimit = (creepStartMillis - watchStartMillis) + SEGMENT_CREEP_MILLIS * SEGMENT_CREEP_OVERDUE;
+                if (creepLimit > limit) limit = creepLimit;
+            }
+            if (now - watchStartMillis > limit) {
+                if (!end) creepActive = false;  // Full speed on to the next station
+                misses[runDirection]++;
+                journal.record(JOURNAL_MISSED, watchedStation, runDirection);
+                Serial.println("Segment model: station " + String(watchedStation) + " overdue (" + String(now - watchStartMillis) +
+                               " ms, expected " + String(stats.mean, 0) + " ms), trigger missed?");
+
+                // Go on watching for the station after it, from when the train likely passed this one
+                if (!end) {
+                    watchStartMillis += (unsigned long)stats.mean;
+                    watchedStation = nextStation(watchedStation, runDirection);
+                } else {
+                    overdueFlagged = true;
+                }
+            }
+        }
+    }
+
+    // The first runs of a boot are saved at the next stop, so frequent resets do not lose everything
+    if (dirty && !timing && (saves == 0 || now - lastSaveMillis >= SEGMENT_SAVE_INTERVAL)) {
+        save();
+        lastSaveMillis = now;
+    }
+}
+
+void SegmentModel::save() {
+    dirty = false;
+    preferences.begin(SEGMENT_NAMESPACE, false);
+    size_t written = preferences.putBytes(key, &data, storedSize(data.stations));
+    preferences.end();
+    if (written != storedSize(data.stations)) {
+        Serial.println("Segment model: write FAILED");
+        return;
+    }
+    saves++;
+    printReport();
+}
+
+void SegmentModel::printReport() {
+    Serial.print("Segment model: ");
+    Serial.print(runs);
+    Serial.print(" runs learned, ");
+    Serial.print(misses[JOURNAL_FORWARD]);
+    Serial.print("/");
+    Serial.print(misses[JOURNAL_BACKWARD]);
+    Serial.print(" overdue stations fwd/back, ");
+    Serial.print(warnings);
+    Serial.println(" drift warnings this boot");
+
+    for (int direction = JOURNAL_FORWARD; direction <= JOURNAL_BACKWARD; direction++) {
+        for (int from = 0; from < data.stations; from++) {
+            const SegmentStats &stats = data.segments[from][direction];
+            if (stats.count == 0) continue;
+            Serial.print("  ");
+            Serial.print(directionName((JournalDirection)direction));
+            Serial.print(" ");
+            Serial.print(from);
+            Serial.print("->");
+            Serial.print(nextStation(from, (JournalDirection)direction));
+            Serial.print(": n ");
+            Serial.print(stats.count);
+            Serial.print(", mean ");
+            Serial.print(stats.mean / 1000, 3);
+            Serial.print(" s, sd ");
+            Serial.print(sqrtf(stats.variance) / 1000, 3);
+            Serial.print(" s");
+            if (stats.creepAt > 0) {
+                Serial.print(", creep at ");
+                Serial.print(stats.creepAt / 1000, 3);
+                Serial.print(" s");
+            }
+            if (stats.baseline > 0) {
+                Serial.print(", baseline ");
+                Serial.print(stats.baseline / 1000, 3);
+                Serial.print(" s");
+            }
+            Serial.println(stats.drifting ? " DRIFTING" : "");
+        }
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef SEGMENT_MODEL_H
+#define SEGMENT_MODEL_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "LAYOUT.h"
+#include "OPS_JOURNAL.h"
+
+#define SEGMENT_NAMESPACE "valley"
+#define SEGMENT_KEY "segments"
+#define SEGMENT_VERSION 3
+#define SEGMENT_LEGACY_STATIONS 8         // Version 2 blobs: [direction][from] for eight stations
+#define SEGMENT_ALPHA (1.0f / 16)        // EWMA weight of a new run, about the last 16 runs count
+#define SEGMENT_MIN_SAMPLES 5            // Runs before a segment is checked against its own times
+#define SEGMENT_SIGMAS 4.0f              // Overrun beyond mean + k sigma flags a missed trigger
+#define SEGMENT_MIN_MARGIN (1.0f / 16)   // ...but never closer than this share of the mean
+#define SEGMENT_BASELINE_SAMPLES 32      // Runs before the mean becomes the baseline the drift is measured against
+#define SEGMENT_DRIFT_LIMIT 0.10f        // Maintenance warning beyond this share off the baseline
+#define SEGMENT_CREEP_MILLIS 600.0f      // Aim: this long from slowing down to reaching a stop's sensor
+#define SEGMENT_CREEP_GAIN 0.125f        // Share of the creep time error corrected per run
+#define SEGMENT_CREEP_OVERDUE 3          // A creeping train is overdue this many creep times after slowing down
+#define SEGMENT_REACH_SHARE 0.5f         // A station is reachable after this share of the fastest segment per station
+#define SEGMENT_SAVE_INTERVAL 120000     // ms between NVS writes of the model, 10 entries each: about 20 years of NVS page erases when always moving
+
+// One segment is the run from a station to its neighbour in one direction
+struct __attribute__((packed)) SegmentStats {
+    float mean;                          // ms, EWMA
+    float variance;                      // ms^2, EWMA
+    float baseline;                      // ms, mean once SEGMENT_BASELINE_SAMPLES runs were in, 0 before
+    float creepAt;                       // ms after departure to slow down for a stop, 0 until learned
+    uint16_t count;                      // Runs seen, saturates
+    uint8_t drifting;                    // Maintenance warning raised and not cleared yet
+};
+
+// Only the rows of the stations on the line are stored: the blob is as long
+// as the header plus stations * 2 segments
+struct __attribute__((packed)) SegmentModelData {
+    uint8_t version;
+    uint8_t stations;                        // Layout the model was learned on
+    SegmentStats segments[LAYOUT_MAX_STATIONS][2];  // [from station][direction]
+};
+
+// Learns how long the train takes between neighbouring stations, from the
+// departure, pass and arrival times, and flags a station whose trigger is
+// overdue: a lost trigger is otherwise only noticed when the train stops one
+// station too far. Each run is an O(1) update of an exponentially weighted
+// mean and variance; with eight stations the model is a 306 byte NVS blob, written at the first
+// stop of a boot, then at most every SEGMENT_SAVE_INTERVAL, and only while the
+// train stands.
+//
+// Runs towards a stop (the route's stops going forward, START going back)
+// also learn when to slow down to creep speed: the train should reach the
+// sensor SEGMENT_CREEP_MILLIS after it, slow enough to stop right on it. Each
+// run moves that point by a share of how far off the creep time was.
+//
+// The end of the line has a bumper behind it instead of a station that would
+// catch its lost trigger, so loop() stops the train once endOverdue(). Until
+// a segment is learned, the slowest one run that way stands in for it, so the
+// watch reaches the end from the first run on. The same times tell a spurious
+// trigger from a station the train cannot have reached yet.
+//
+// A segment run at speed past a station takes another time than one from or
+// to a stop, so every timetable route learns its own model under its own key;
+// route 0 keeps SEGMENT_KEY.
+class SegmentModel {
+public:
+    void begin(uint8_t route = 0, StationSet stops = ~(StationSet)0);  // Load from NVS, call once in setup()
+    void depart(uint8_t station, JournalDirection direction);
+    void pass(uint8_t station, JournalDirection direction);    // Passed without stopping, keeps timing
+    void arrive(uint8_t station, JournalDirection direction);  // Stopped there
+    void cancel();                                     // Halted or position unknown, the run is not timed
+    void update(OpsJournal &journal);                  // Overrun check and deferred save, call from loop()
+    // Learned travel time from a station to the next in that direction, 0 while too few runs
+    float expectedMillis(uint8_t from, JournalDirection direction);
+    bool creeping() { return creepActive; }            // Slow down now, the stop is close
+    // The train may be at this station by now, going by the fastest segment
+    // run either way; true before any was. A spurious trigger only ever makes
+    // a segment look slower, so it cannot shut out the real ones.
+    bool reachable(uint8_t station, JournalDirection direction);
+    int8_t awaitedStation() { return timing ? watchedStation : -1; }   // Moves on past an overdue one
+    // The end of the line was not reached in time going this way: stop before the bumper
+    bool endOverdue(JournalDirection direction) { return timing && overdueFlagged && runDirection == direction; }
+    uint32_t missesFlagged(JournalDirection direction) { return misses[direction]; }
+    uint32_t driftWarnings() { return warnings; }
+    void printReport();
+
+private:
+    int8_t nextStation(uint8_t from, JournalDirection direction);
+    const SegmentStats *seenSegment(JournalDirection direction, bool slowest);  // Of those run at least once
+    bool towardsStop() { return runDirection == JOURNAL_FORWARD ? watchedStation >= 0 && ((forwardStops >> watchedStation) & 1) : watchedStation == 0; }
+    void learn(SegmentStats &stats, float sample, uint8_t from, JournalDirection direction);
+    void save();
+    size_t storedSize(uint8_t stations) { return offsetof(SegmentModelData, segments) + stations * sizeof(data.segments[0]); }
+
+    SegmentModelData data;
+    char key[16] = SEGMENT_KEY;          // NVS key of the route's model
+    StationSet forwardStops = ~(StationSet)0;
+    bool dirty = false;
+    unsigned long lastSaveMillis = 0;
+    uint32_t saves = 0;                  // This boot
+
+    // The run being timed
+    bool timing = false;
+    uint8_t fromStation = 0;
+    JournalDirection runDirection = JOURNAL_FORWARD;
+    unsigned long startMillis = 0;
+    // Station whose trigger is awaited. After an overdue one it moves on to the
+    // next, with the start guessed from the learned time of the one missed.
+    int8_t watchedStation = -1;
+    unsigned long watchStartMillis = 0;
+    bool overdueFlagged = false;         // The station at the end was overdue
+    bool creepActive = false;
+    unsigned long creepStartMillis = 0;
+
+    uint32_t runs = 0;                   // Learned this boot
+    uint32_t misses[2] = {0, 0};         // Overdue stations flagged, per direction
+    uint32_t warnings = 0;
+};
+
+#endif // SEGMENT_MODEL_H
@@ -0,0 +1,108 @@
+#include "SEMAPHORE_NODE.h"
+#include <WiFi.h>
+#include <esp_now.h>
+
+// esp_now callbacks are plain functions, so route them to the (single) node
+static SemaphoreNode *activeNode = nullptr;
+
+SemaphoreNode::SemaphoreNode(uint8_t semaphoreId, uint8_t red, uint8_t green) {
+    id = semaphoreId;
+    redPin = red;
+    greenPin = green;
+    memset(controllerMac, 0, sizeof(controllerMac));
+}
+
+bool SemaphoreNode::begin(const uint8_t *mac) {
+    WiFi.mode(WIFI_STA);
+    WiFi.disconnect();
+
+    if (esp_now_init() != ESP_OK) {
+        Serial.println("Error initializing ESP-NOW");
+        return false;
+    }
+
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, mac, 6);
+    peer.channel = 0;
+    peer.encrypt = false;
+    if (esp_now_add_peer(&peer) != ESP_OK) {
+        Serial.println("Error adding controller peer");
+        return false;
+    }
+
+    setController(mac);
+    activeNode = this;
+    esp_now_register_recv_cb(onReceive);
+    return true;
+}
+
+void SemaphoreNode::setController(const uint8_t *mac) {
+    memcpy(controllerMac, mac, 6);
+
+    pinMode(redPin, OUTPUT);
+    pinMode(greenPin, OUTPUT);
+    digitalWrite(redPin, HIGH);
+    digitalWrite(greenPin, HIGH);
+}
+
+void SemaphoreNode::onReceive(const uint8_t *mac, const uint8_t *data, int len) {
+    uint32_t receivedMicros = micros();
+
+    if (activeNode != nullptr) {
+        activeNode->handleReceive(mac, data, len, receivedMicros);
+    }
+}
+
+void SemaphoreNode::handleReceive(const uint8_t *mac, const uint8_t *data, int len, uint32_t receivedMicros) {
+    if (len < (int)sizeof(SemaphoreAspects) || data[0] != STATION_MSG_ASPECTS) return;
+    if (memcmp(mac, controllerMac, 6) != 0) return;
+
+    SemaphoreAspects packet;
+    memcpy(&packet, data, sizeof(packet));
+
+    // Repeats of an applied update; a smaller seq means the controller rebooted
+    if (packet.seq == appliedSeq) return;
+    if (id < 1 || id > packet.count) return;
+    appliedSeq = packet.seq;
+
+    // The latching relay only needs a pulse when the aspect really changes
+    int8_t wanted = ((packet.green >> (id - 1)) & 0x01) ? GREEN : RED;
+    if (wanted != aspect) {
+        digitalWrite(wanted == GREEN ? redPin : greenPin, HIGH);
+        digitalWrite(wanted == GREEN ? greenPin : redPin, LOW);
+        aspect = wanted;
+        pulsing = true;
+        pulseStartMillis = millis();
+    }
+
+    uint32_t appliedMicros = micros();
+    portENTER_CRITICAL(&lock);
+    ackSeq = packet.seq;
+    ackReceivedMicros = receivedMicros;
+    ackAppliedMicros = appliedMicros;
+    ackPending = true;
+    portEXIT_CRITICAL(&lock);
+}
+
+void SemaphoreNode::loop() {
+    if (pulsing && millis() - pulseStartMillis >= SEMAPHORE_NODE_PULSE) {
+        digitalWrite(redPin, HIGH);
+        digitalWrite(greenPin, HIGH);
+        pulsing = false;
+    }
+
+    // Sent from here, not from the receive callback, like the controller's sync replies
+    if (!ackPending) return;
+
+    SemaphoreAck ack;
+    ack.type = STATION_MSG_ASPECT_ACK;
+    ack.id = id;
+    portENTER_CRITICAL(&lock);
+    ack.seq = ackSeq;
+    ack.receiveToApply = ackAppliedMicros - ackReceivedMicros;
+    uint32_t receivedMicros = ackReceivedMicros;
+    ackPending = false;
+    portEXIT_CRITICAL(&lock);
+    ack.receiveToSend = micros() - receivedMicros;
+    esp_now_send(controllerMac, (const uint8_t *)&ack, sizeof(ack));
+}
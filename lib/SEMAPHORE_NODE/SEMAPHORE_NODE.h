@@ -0,0 +1,38 @@
+#ifndef SEMAPHORE_NODE_H
+#define SEMAPHORE_NODE_H
+
+#include <Arduino.h>
+#include "STATION_PROTOCOL.h"
+#include "SEMAPHORE_T.h"
+
+#define SEMAPHORE_NODE_PULSE 200   // ms the relay coil is driven, same as the controller MUX pulse
+
+// Semaphore side of the networked semaphores. A dedicated board calls begin(),
+// a station board that also drives a semaphore hands it to StationNode instead.
+// Red and green relay pins are active LOW like the MUX output on the controller.
+class SemaphoreNode {
+public:
+    SemaphoreNode(uint8_t id, uint8_t redPin, uint8_t greenPin);
+    bool begin(const uint8_t *controllerMac);  // Dedicated board: starts ESP-NOW and listens for broadcasts
+    void setController(const uint8_t *controllerMac); // Shared board: the station already started ESP-NOW
+    void loop();                               // Ends the relay pulse and sends the pending ack
+    void handleReceive(const uint8_t *mac, const uint8_t *data, int len, uint32_t receivedMicros);
+
+private:
+    static void onReceive(const uint8_t *mac, const uint8_t *data, int len);
+    uint8_t id;
+    uint8_t redPin;
+    uint8_t greenPin;
+    uint8_t controllerMac[6];
+    uint32_t appliedSeq = 0;
+    int8_t aspect = -1;                        // SemaphoreState, -1 until the first broadcast arrives
+    bool pulsing = false;
+    unsigned long pulseStartMillis = 0;
+    volatile bool ackPending = false;
+    uint32_t ackSeq = 0;
+    uint32_t ackReceivedMicros = 0;
+    uint32_t ackAppliedMicros = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // SEMAPHORE_NODE_H
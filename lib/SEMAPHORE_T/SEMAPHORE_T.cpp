@@ -1,10 +1,36 @@
 #include "SEMAPHORE_T.h"
+#include <esp_now.h>
 
-// Define the pulse duration in milliseconds
-#define PULSE_DURATION 200
+static const uint8_t broadcastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
-void Semaphore::init() {
-    // Set MUX select pins and output pin as output
+void Semaphore::init(SemaphoreMode semaphoreMode) {
+    mode = semaphoreMode;
+    semaphoreCount = layout.semaphoreCount();
+
+    if (mode == SEMAPHORE_NETWORK) {
+        // ESP-NOW is already up (setupEspNowReceiver), only the broadcast peer is missing
+        if (!esp_now_is_peer_exist(broadcastMac)) {
+            esp_now_peer_info_t peer = {};
+            memcpy(peer.peer_addr, broadcastMac, 6);
+            peer.channel = 0;
+            peer.encrypt = false;
+            esp_now_add_peer(&peer);
+        }
+        lastReportMillis = millis();
+        Serial.println("Semaphores: network mode");
+        return;
+    }
+
+    if (mode == SEMAPHORE_MUX && semaphoreCount > SEMAPHORE_MUX_MAX) {
+        Serial.println("Semaphores: the MUX drives " + String(SEMAPHORE_MUX_MAX) + " of " + String(semaphoreCount) +
+                       ", use SEMAPHORE_SHIFT or SEMAPHORE_NETWORK for the rest");
+        semaphoreCount = SEMAPHORE_MUX_MAX;
+    }
+    if (mode == SEMAPHORE_SHIFT) {
+        Serial.println("Semaphores: shift register mode, " + String((2 * semaphoreCount + 7) / 8) + " registers");
+    }
+
+    // Set MUX select pins and output pin as output (the shift chain uses the same pins)
     pinMode(MUX_OUTPUT_PIN, OUTPUT);
     pinMode(SEL0, OUTPUT);
     pinMode(SEL1, OUTPUT);
@@ -37,8 +63,23 @@ void Semaphore::init() {
 //     return false; // Return false until all semaphores are set
 // }
 
+void Semaphore::setPulseDuration(unsigned long duration) {
+    pulseDuration = duration;
+}
+
 bool Semaphore::initToRed() {
-    for (uint8_t currentSemaphore = 1; currentSemaphore <= 6; currentSemaphore++) {
+    if (mode == SEMAPHORE_NETWORK) {
+        // The first call also tells the nodes the state they boot into
+        if (aspects != 0 || seq == 0) {
+            aspects = 0;
+            broadcastAspects();
+            crashTrace.record(TRACE_SEMAPHORE, 0, RED);
+            Serial.println("All semaphores set to RED");
+        }
+        return true;
+    }
+
+    for (uint8_t currentSemaphore = 1; currentSemaphore <= semaphoreCount; currentSemaphore++) {
         while (!setSemaphore(currentSemaphore, RED)) {
             // Wait until the semaphore is set before moving to the next one
             delay(1);  // Small delay to prevent watchdog timer resets
@@ -56,25 +97,42 @@ bool Semaphore::setSemaphore(uint8_t id, SemaphoreState state) {
     static uint8_t currentSemaphoreId = 0;
     static SemaphoreState currentState = RED;
 
-    if (id < 1 || id > 6) return false; // Ensure ID is within range 1-6 for semaphores
+    if (id < 1 || id > semaphoreCount) return false; // Ensure ID is within range for semaphores
+
+    if (mode == SEMAPHORE_NETWORK) {
+        uint64_t bit = (uint64_t)1 << (id - 1);
+        uint64_t updated = (state == GREEN) ? (aspects | bit) : (aspects & ~bit);
+        if (updated != aspects || seq == 0) {
+            aspects = updated;
+            broadcastAspects();
+            crashTrace.record(TRACE_SEMAPHORE, id, state);
+            Serial.print("Semaphore ");
+            Serial.print(id);
+            Serial.println(state == RED ? " set to RED" : " set to GREEN");
+        }
+        return true; // Nodes switch on their own, nothing to wait for here
+    }
 
     // Adjust `id` to match zero-based channel indexing
     uint8_t zeroBasedId = id - 1;
 
     // Calculate channels for RED and GREEN states of this semaphore
-    uint8_t redChannel = zeroBasedId;           // Channels 0-5 are for RED
-    uint8_t greenChannel = zeroBasedId + 6;     // Channels 6-11 are for GREEN
+    uint8_t redChannel = zeroBasedId;                    // Channels 0..count-1 are for RED
+    uint8_t greenChannel = zeroBasedId + semaphoreCount; // The next count channels are for GREEN
 
     // Start the pulse if it hasn't started
     if (!isPulsing) {
         // Select the appropriate channel based on the desired color
-        if (state == RED) {
+        if (mode == SEMAPHORE_SHIFT) {
+            selectShiftOutput(2 * zeroBasedId + (state == RED ? 0 : 1));
+        } else if (state == RED) {
             selectMuxChannel(redChannel);    // Select RED channel for this semaphore
         } else {
             selectMuxChannel(greenChannel);  // Select GREEN channel for this semaphore
         }
 
         digitalWrite(MUX_OUTPUT_PIN, LOW);  // Set the color to LOW to start the pulse
+        crashTrace.record(TRACE_SEMAPHORE, id, state);
         pulseStartTime = millis();           // Record the pulse start time
         isPulsing = true;                    // Set pulsing state
         currentSemaphoreId = id;             // Store the semaphore ID for later printing
@@ -83,9 +141,11 @@ bool Semaphore::setSemaphore(uint8_t id, SemaphoreState state) {
     }
 
     // Check if the pulse duration has passed
-    if (isPulsing && (millis() - pulseStartTime >= PULSE_DURATION)) {
+    if (isPulsing && (millis() - pulseStartTime >= pulseDuration)) {
         digitalWrite(MUX_OUTPUT_PIN, HIGH);   // Turn off the selected color
         isPulsing = false;                   // Reset pulsing state
+        uint64_t bit = (uint64_t)1 << (currentSemaphoreId - 1);
+        aspects = (currentState == GREEN) ? (aspects | bit) : (aspects & ~bit);
 
         // Print the semaphore ID and final color after the pulse is complete
         Serial.print("Semaphore ");
@@ -108,3 +168,132 @@ void Semaphore::selectMuxChannel(uint8_t channel) {
     digitalWrite(SEL2, (channel >> 2) & 0x01);
     digitalWrite(SEL3, (channel >> 3) & 0x01);
 }
+
+void Semaphore::selectShiftOutput(uint8_t output) {
+    // Last register's last output first, every register is 8 outputs
+    int outputs = (2 * semaphoreCount + 7) / 8 * 8;
+    digitalWrite(SHIFT_LATCH, LOW);
+    for (int i = outputs - 1; i >= 0; i--) {
+        digitalWrite(SHIFT_DATA, i == output ? HIGH : LOW);
+        digitalWrite(SHIFT_CLOCK, HIGH);
+        digitalWrite(SHIFT_CLOCK, LOW);
+    }
+    digitalWrite(SHIFT_LATCH, HIGH);
+}
+
+void Semaphore::update() {
+    if (mode != SEMAPHORE_NETWORK || seq == 0) return;
+
+    unsigned long now = millis();
+
+    // Same seq again: nodes that already applied it ignore the repeat, a node
+    // that missed the first broadcast catches up
+    if (now - lastBroadcastMillis >= SEMAPHORE_REBROADCAST_INTERVAL) {
+        SemaphoreAspects packet;
+        packet.type = STATION_MSG_ASPECTS;
+        packet.count = semaphoreCount;
+        packet.seq = seq;
+        packet.green = aspects;
+        esp_now_send(broadcastMac, (const uint8_t *)&packet, sizeof(packet));
+        lastBroadcastMillis = now;
+    }
+
+    if (now - lastReportMillis > SEMAPHORE_REPORT_INTERVAL) {
+        printReport();
+        lastReportMillis = now;
+    }
+}
+
+void Semaphore::broadcastAspects() {
+    SemaphoreAspects packet;
+    packet.type = STATION_MSG_ASPECTS;
+    packet.count = semaphoreCount;
+    packet.green = aspects;
+
+    portENTER_CRITICAL(&lock);
+    packet.seq = ++seq;
+    sentMicros[seq % SEMAPHORE_SENT_HISTORY] = micros();
+    portEXIT_CRITICAL(&lock);
+
+    esp_now_send(broadcastMac, (const uint8_t *)&packet, sizeof(packet));
+    lastBroadcastMillis = millis();
+}
+
+void Semaphore::recordAck(const SemaphoreAck &ack, uint32_t receivedMicros) {
+    portENTER_CRITICAL(&lock);
+
+    // Too old to still have its broadcast time
+    if (ack.seq == 0 || ack.seq > seq || seq - ack.seq >= SEMAPHORE_SENT_HISTORY) {
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+
+    // Half of the round trip (node turnaround excluded) is the radio delay,
+    // the node adds how long it took to switch the output
+    uint32_t roundTrip = receivedMicros - sentMicros[ack.seq % SEMAPHORE_SENT_HISTORY];
+    if (ack.receiveToSend > roundTrip) {
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    uint32_t latency = (roundTrip - ack.receiveToSend) / 2 + ack.receiveToApply;
+
+    uint8_t bin = 0;
+    while (bin < SEMAPHORE_LATENCY_BINS - 1 && (latency >> bin) > 1) bin++;
+    latencyBins[bin]++;
+
+    if (ackCount == 0 || latency < latencyMin) latencyMin = latency;
+    if (latency > latencyMax) latencyMax = latency;
+    latencySum += latency;
+    ackCount++;
+    portEXIT_CRITICAL(&lock);
+}
+
+void Semaphore::printReport() {
+    if (mode != SEMAPHORE_NETWORK) {
+        // Pulsed relays have nothing to count but the aspects they hold
+        Serial.print("Semaphores: ");
+        Serial.print(semaphoreCount);
+        Serial.print(mode == SEMAPHORE_SHIFT ? " on shift registers" : " on the MUX");
+        Serial.print(", green 0x");
+        Serial.println(aspects, HEX);
+        return;
+    }
+
+    portENTER_CRITICAL(&lock);
+    uint32_t count = ackCount;
+    uint32_t sum = latencySum;
+    uint32_t minLatency = latencyMin;
+    uint32_t maxLatency = latencyMax;
+    uint32_t bins[SEMAPHORE_LATENCY_BINS];
+    memcpy(bins, latencyBins, sizeof(bins));
+    portEXIT_CRITICAL(&lock);
+
+    Serial.print("Semaphores: ");
+    Serial.print(seq);
+    Serial.print(" updates, ");
+    Serial.print(count);
+    Serial.print(" acks");
+    if (count == 0) {
+        Serial.println();
+        return;
+    }
+
+    // p99 from the histogram: upper edge of the bin holding it
+    uint32_t target = count - count / 100;
+    uint32_t seen = 0;
+    uint8_t bin = 0;
+    for (; bin < SEMAPHORE_LATENCY_BINS - 1; bin++) {
+        seen += bins[bin];
+        if (seen >= target) break;
+    }
+
+    Serial.print(", broadcast to applied avg ");
+    Serial.print(sum / count);
+    Serial.print(" min ");
+    Serial.print(minLatency);
+    Serial.print(" max ");
+    Serial.print(maxLatency);
+    Serial.print(" p99 < ");
+    Serial.print(2UL << bin);
+    Serial.println(" us");
+}
@@ -2,6 +2,9 @@
 #define SEMAPHORE_T_H
 
 #include <Arduino.h>
+#include "STATION_PROTOCOL.h"
+#include "CRASH_TRACE.h"
+#include "LAYOUT.h"
 
 // Define pins for multiplexer control
 const uint8_t MUX_OUTPUT_PIN = 19;
@@ -10,17 +13,60 @@ const uint8_t SEL1 = 4;
 const uint8_t SEL2 = 5;
 const uint8_t SEL3 = 18;
 
+// A 74HC595 chain on the same connector: data, shift clock and latch on the
+// first three select lines, its active LOW output enable on the MUX output
+const uint8_t SHIFT_DATA = SEL0;
+const uint8_t SHIFT_CLOCK = SEL1;
+const uint8_t SHIFT_LATCH = SEL2;
+const uint8_t SHIFT_ENABLE = MUX_OUTPUT_PIN;
+
+#define SEMAPHORE_MUX_MAX 8                  // 16 MUX channels, a red and a green coil each
+#define PULSE_DURATION 200                   // Default relay pulse in milliseconds
+#define SEMAPHORE_REBROADCAST_INTERVAL 250   // ms between repeats of the aspect broadcast
+#define SEMAPHORE_SENT_HISTORY 8             // Broadcast times kept to match late acks
+#define SEMAPHORE_LATENCY_BINS 24            // Power of two latency histogram (us)
+#define SEMAPHORE_REPORT_INTERVAL 30000      // Print the latency report this often (ms)
+
 // Semaphore states
 enum SemaphoreState { RED, GREEN };
 
+// MUX: relays pulsed one at a time through the multiplexer (200 ms each).
+// NETWORK: every aspect goes out in one ESP-NOW broadcast to the semaphore nodes.
+// SHIFT: like MUX, through a chain of shift registers with two outputs per
+// semaphore (red 2 * (id - 1), green the next), for more than SEMAPHORE_MUX_MAX.
+enum SemaphoreMode { SEMAPHORE_MUX, SEMAPHORE_NETWORK, SEMAPHORE_SHIFT };
+
 class Semaphore {
 public:
-    void init();                               // Initialize semaphore pins
+    void init(SemaphoreMode mode = SEMAPHORE_MUX); // Initialize semaphore pins or the broadcast peer, for layout.semaphoreCount()
+    uint8_t count() { return semaphoreCount; }      // Ids 1..count() can be set
+    uint64_t greenAspects() { return aspects; }     // Bit (id - 1) set = GREEN, as last set
     bool initToRed();                          // Initialize all semaphores to RED state, returns true when complete
     bool setSemaphore(uint8_t id, SemaphoreState state); // Set semaphore color, returns true when pulse is complete
+    void setPulseDuration(unsigned long duration);       // ms the relay coil is driven (MUX mode)
+    void update();                             // Repeat the broadcast and print the latency report, call from loop()
+    // Called from the ESP-NOW receive callback (WiFi task)
+    void recordAck(const SemaphoreAck &ack, uint32_t receivedMicros);
+    void printReport();
 
 private:
     void selectMuxChannel(uint8_t channel);    // Select MUX channel for semaphore and color
+    void selectShiftOutput(uint8_t output);    // Load the chain with only this output on
+    void broadcastAspects();
+    SemaphoreMode mode = SEMAPHORE_MUX;
+    uint8_t semaphoreCount = 0;
+    unsigned long pulseDuration = PULSE_DURATION;
+    uint64_t aspects = 0;                      // Bit (id - 1) set = GREEN; MUX modes once the pulse is done
+    uint32_t seq = 0;
+    unsigned long lastBroadcastMillis = 0;
+    unsigned long lastReportMillis = 0;
+    uint32_t sentMicros[SEMAPHORE_SENT_HISTORY]; // First broadcast of each seq, indexed by seq
+    uint32_t ackCount = 0;
+    uint32_t latencySum = 0;
+    uint32_t latencyMin = 0;
+    uint32_t latencyMax = 0;
+    uint32_t latencyBins[SEMAPHORE_LATENCY_BINS] = {0};
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
 };
 
 #endif // SEMAPHORE_T_H
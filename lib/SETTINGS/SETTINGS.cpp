@@ -0,0 +1,253 @@
+#include "SETTINGS.h"
+#include <EEPROM.h>
+
+static Preferences preferences;
+
+void Settings::loadFromFlash() {
+    loaded = true;
+
+    data.version = SETTINGS_VERSION;
+    data.loopEnabled = false;
+    data.volume = SETTINGS_DEFAULT_VOLUME;
+    data.dwellMillis = SETTINGS_DEFAULT_DWELL;
+    data.backwardDelayMillis = SETTINGS_DEFAULT_BACKWARD_DELAY;
+    data.pulseMillis = SETTINGS_DEFAULT_PULSE;
+    data.commits = 0;
+    data.forwardSpeed = SETTINGS_DEFAULT_SPEED;
+    data.backwardSpeed = SETTINGS_DEFAULT_SPEED;
+    data.accelMillis = SETTINGS_DEFAULT_ACCEL;
+    data.decelMillis = SETTINGS_DEFAULT_DECEL;
+    data.creepSpeed = SETTINGS_DEFAULT_CREEP;
+    data.stationCount = SETTINGS_DEFAULT_STATIONS;
+    data.route = SETTINGS_DEFAULT_ROUTE;
+    data.profile = SETTINGS_DEFAULT_PROFILE;
+    data.telemetryMillis = SETTINGS_DEFAULT_TELEMETRY;
+
+    preferences.begin(SETTINGS_NAMESPACE, true);
+    size_t length = preferences.getBytesLength(SETTINGS_KEY);
+    SettingsData saved;
+    bool found = length > 0 && length <= sizeof(saved) && preferences.getBytes(SETTINGS_KEY, &saved, length) == length;
+    preferences.end();
+
+    if (found) {
+        // Fields are only ever appended, so a shorter (older) blob fills the front
+        memcpy(&data, &saved, length);
+        if (data.version != SETTINGS_VERSION) {
+            Serial.println("Settings: upgraded from version " + String(data.version));
+            data.version = SETTINGS_VERSION;
+        }
+        stored = data;
+        if (length != sizeof(data)) stored.version = 0;  // Rewrite in the new layout on the next change
+        return;
+    }
+
+    // First boot with the settings store: take loopEnabled over from the EEPROM byte
+    EEPROM.begin(SETTINGS_LEGACY_EEPROM_ADDR + 1);
+    data.loopEnabled = EEPROM.read(SETTINGS_LEGACY_EEPROM_ADDR) == 1;
+    Serial.println("Settings: none stored, using defaults (loop mode from EEPROM)");
+    stored = data;
+    stored.version = 0;
+    dirty = true;
+    firstChangeMillis = lastChangeMillis = millis();
+}
+
+void Settings::changed() {
+    unsigned long now = millis();
+    if (!dirty) firstChangeMillis = now;
+    lastChangeMillis = now;
+    dirty = true;
+    sets++;
+}
+
+void Settings::setLoopEnabled(bool enabled) {
+    load();
+    if (data.loopEnabled == enabled) return;
+    data.loopEnabled = enabled;
+    changed();
+}
+
+void Settings::setVolume(uint8_t volume) {
+    load();
+    if (data.volume == volume) return;
+    data.volume = volume;
+    changed();
+}
+
+void Settings::setDwellMillis(uint16_t value) {
+    load();
+    if (data.dwellMillis == value) return;
+    data.dwellMillis = value;
+    changed();
+}
+
+void Settings::setBackwardDelayMillis(uint16_t value) {
+    load();
+    if (data.backwardDelayMillis == value) return;
+    data.backwardDelayMillis = value;
+    changed();
+}
+
+void Settings::setPulseMillis(uint16_t value) {
+    load();
+    if (data.pulseMillis == value) return;
+    data.pulseMillis = value;
+    changed();
+}
+
+void Settings::setSpeeds(uint8_t forward, uint8_t backward) {
+    load();
+    if (data.forwardSpeed == forward && data.backwardSpeed == backward) return;
+    data.forwardSpeed = forward;
+    data.backwardSpeed = backward;
+    changed();
+}
+
+void Settings::setRamps(uint16_t accel, uint16_t decel) {
+    load();
+    if (data.accelMillis == accel && data.decelMillis == decel) return;
+    data.accelMillis = accel;
+    data.decelMillis = decel;
+    changed();
+}
+
+void Settings::setCreepSpeed(uint8_t value) {
+    load();
+    if (data.creepSpeed == value) return;
+    data.creepSpeed = value;
+    changed();
+}
+
+void Settings::setStationCount(uint8_t value) {
+    load();
+    if (data.stationCount == value) return;
+    data.stationCount = value;
+    changed();
+}
+
+void Settings::setRoute(uint8_t value) {
+    load();
+    if (data.route == value) return;
+    data.route = value;
+    changed();
+}
+
+void Settings::setProfile(uint8_t value) {
+    load();
+    if (data.profile == value) return;
+    data.profile = value;
+    changed();
+}
+
+void Settings::setTelemetryMillis(uint16_t value) {
+    load();
+    if (data.telemetryMillis == value) return;
+    data.telemetryMillis = value;
+    changed();
+}
+
+bool Settings::authEpoch(uint8_t station, AuthEpochRecord &record) {
+    char key[16];
+    snprintf(key, sizeof(key), SETTINGS_EPOCH_KEY, station);
+    preferences.begin(SETTINGS_NAMESPACE, true);
+    bool found = preferences.isKey(key) && preferences.getBytesLength(key) == sizeof(record) &&
+                 preferences.getBytes(key, &record, sizeof(record)) == sizeof(record);
+    preferences.end();
+    return found;
+}
+
+void Settings::saveAuthEpoch(uint8_t station, const AuthEpochRecord &record) {
+    char key[16];
+    snprintf(key, sizeof(key), SETTINGS_EPOCH_KEY, station);
+    preferences.begin(SETTINGS_NAMESPACE, false);
+    size_t written = preferences.putBytes(key, &record, sizeof(record));
+    preferences.end();
+    if (written != sizeof(record)) Serial.println("Settings: epoch write FAILED");
+}
+
+void Settings::update() {
+    if (!dirty) return;
+
+    unsigned long now = millis();
+    if (now - lastChangeMillis >= SETTINGS_COMMIT_DELAY || now - firstChangeMillis >= SETTINGS_MAX_DEFER) {
+        commit();
+    }
+}
+
+void Settings::flush() {
+    if (dirty) commit();
+}
+
+void Settings::commit() {
+    dirty = false;
+
+    // Toggled back and forth while waiting: nothing to write
+    data.commits = stored.commits;
+    if (memcmp(&data, &stored, sizeof(data)) == 0) {
+        skippedCommits++;
+        return;
+    }
+
+    data.commits = stored.commits + 1;
+    preferences.begin(SETTINGS_NAMESPACE, false);
+    size_t written = preferences.putBytes(SETTINGS_KEY, &data, sizeof(data));
+    preferences.end();
+
+    if (written != sizeof(data)) {
+        Serial.println("Settings: write FAILED");
+        data.commits = stored.commits;
+        return;
+    }
+    stored = data;
+    sessionCommits++;
+    Serial.println("Settings: saved (" + String(sessionCommits) + " writes this boot, " + String(stored.commits) + " lifetime)");
+}
+
+void Settings::printReport() {
+    load();
+
+    // A blob takes one 32 byte entry per 32 bytes of data plus its header and index
+    // entries; a 4 KB page holds 126 entries and every page is erased once per fill
+    const uint32_t entriesPerCommit = 2 + (sizeof(SettingsData) + 31) / 32;
+
+    Serial.print("Settings: loop ");
+    Serial.print(data.loopEnabled ? "on" : "off");
+    Serial.print(", volume ");
+    Serial.print(data.volume);
+    Serial.print(", dwell ");
+    Serial.print(data.dwellMillis);
+    Serial.print(" ms, backward delay ");
+    Serial.print(data.backwardDelayMillis);
+    Serial.print(" ms, pulse ");
+    Serial.print(data.pulseMillis);
+    Serial.print(" ms, speed ");
+    Serial.print(data.forwardSpeed);
+    Serial.print("/");
+    Serial.print(data.backwardSpeed);
+    Serial.print("%, ramps ");
+    Serial.print(data.accelMillis);
+    Serial.print("/");
+    Serial.print(data.decelMillis);
+    Serial.print(" ms, creep ");
+    Serial.print(data.creepSpeed);
+    Serial.print("%, ");
+    Serial.print(data.stationCount);
+    Serial.print(" stations, route ");
+    Serial.print(data.route);
+    Serial.print(", profile ");
+    Serial.print(data.profile);
+    Serial.print(", telemetry ");
+    Serial.print(data.telemetryMillis);
+    Serial.println(" ms");
+
+    Serial.print("Settings: ");
+    Serial.print(sets);
+    Serial.print(" changes -> ");
+    Serial.print(sessionCommits);
+    Serial.print(" flash writes this boot (");
+    Serial.print(skippedCommits);
+    Serial.print(" skipped), ");
+    Serial.print(stored.commits);
+    Serial.print(" lifetime, about ");
+    Serial.print(stored.commits * entriesPerCommit / 126);
+    Serial.println(" page erases");
+}
@@ -0,0 +1,120 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#define SETTINGS_NAMESPACE "valley"
+#define SETTINGS_KEY "settings"
+#define SETTINGS_VERSION 7
+#define SETTINGS_COMMIT_DELAY 5000       // ms without changes before dirty settings are written
+#define SETTINGS_MAX_DEFER 30000         // Write at the latest this long after the first change
+#define SETTINGS_LEGACY_EEPROM_ADDR 0    // loopEnabled byte of the old EEPROM layout
+#define SETTINGS_EPOCH_KEY "epoch%u"     // Per station, outside the blob (AuthEpochRecord)
+
+#define SETTINGS_DEFAULT_VOLUME 20
+#define SETTINGS_DEFAULT_DWELL 2000          // ms waiting at a station (WAITING_AT_SEMAPHORE_TIME)
+#define SETTINGS_DEFAULT_BACKWARD_DELAY 2000 // ms before reversing at the last station (GOING_BACKWARD_DELAY)
+#define SETTINGS_DEFAULT_PULSE 200           // ms semaphore relay pulse (PULSE_DURATION)
+#define SETTINGS_DEFAULT_SPEED 100           // % motor drive, each direction
+#define SETTINGS_DEFAULT_ACCEL 400           // ms from standstill to full drive
+#define SETTINGS_DEFAULT_DECEL 150           // ms from full drive to standstill
+#define SETTINGS_DEFAULT_CREEP 25            // % motor drive when closing in on a stop
+#define SETTINGS_DEFAULT_STATIONS 8          // START, LAST and the semaphore stations between them
+#define SETTINGS_DEFAULT_ROUTE 0             // First route of the timetable, all stations
+#define SETTINGS_DEFAULT_PROFILE 0           // Normal operation, the values above
+#define SETTINGS_DEFAULT_TELEMETRY 0         // ms between binary telemetry frames, 0 = off
+
+// Stored as one NVS blob, so a commit replaces all values at once: NVS writes
+// the new entry before erasing the old one and a power cut leaves either.
+// Add fields at the end and bump SETTINGS_VERSION; older blobs are read for
+// the fields they have and the rest keep their defaults.
+struct __attribute__((packed)) SettingsData {
+    uint8_t version;
+    uint8_t loopEnabled;
+    uint8_t volume;                      // 0-30, DFPlayer scale
+    uint16_t dwellMillis;
+    uint16_t backwardDelayMillis;
+    uint16_t pulseMillis;
+    uint32_t commits;                    // Lifetime writes of this blob, for the wear estimate
+    // Version 2
+    uint8_t forwardSpeed;                // % motor drive
+    uint8_t backwardSpeed;
+    uint16_t accelMillis;                // Motor ramps, standstill <-> full drive
+    uint16_t decelMillis;
+    // Version 3
+    uint8_t creepSpeed;                  // % motor drive, 100 turns precision stopping off
+    // Version 4
+    uint8_t stationCount;                // Stations on the line, read at boot (lib/LAYOUT)
+    // Version 5
+    uint8_t route;                       // Timetable route the train runs, read at boot (lib/TIMETABLE)
+    // Version 6
+    uint8_t profile;                     // Operating profile last switched to, read at boot (lib/PROFILES)
+    // Version 7
+    uint16_t telemetryMillis;            // Binary status frame period (lib/TELEMETRY), 0 = off
+};
+
+// Newest epoch accepted from a station (lib/STATION_AUTH) and the key it was
+// accepted under. Every station has its own NVS entry, written when its epoch
+// advances, so station boots do not rewrite the settings blob.
+struct __attribute__((packed)) AuthEpochRecord {
+    uint16_t epoch;
+    uint32_t keyId;                      // stationKeyId() of the key, a new key starts the epochs over
+};
+
+// Typed settings cached in RAM. Getters never touch flash; setters only mark
+// the cache dirty and update() writes it once the changes have settled, so a
+// burst of button presses costs one flash write.
+class Settings {
+public:
+    bool loopEnabled() { load(); return data.loopEnabled; }
+    uint8_t volume() { load(); return data.volume; }
+    uint16_t dwellMillis() { load(); return data.dwellMillis; }
+    uint16_t backwardDelayMillis() { load(); return data.backwardDelayMillis; }
+    uint16_t pulseMillis() { load(); return data.pulseMillis; }
+    uint8_t forwardSpeed() { load(); return data.forwardSpeed; }
+    uint8_t backwardSpeed() { load(); return data.backwardSpeed; }
+    uint16_t accelMillis() { load(); return data.accelMillis; }
+    uint16_t decelMillis() { load(); return data.decelMillis; }
+    uint8_t creepSpeed() { load(); return data.creepSpeed; }
+    uint8_t stationCount() { load(); return data.stationCount; }
+    uint8_t route() { load(); return data.route; }
+    uint8_t profile() { load(); return data.profile; }
+    uint16_t telemetryMillis() { load(); return data.telemetryMillis; }
+
+    void setLoopEnabled(bool enabled);
+    void setVolume(uint8_t volume);
+    void setDwellMillis(uint16_t value);
+    void setBackwardDelayMillis(uint16_t value);
+    void setPulseMillis(uint16_t value);
+    void setSpeeds(uint8_t forward, uint8_t backward);
+    void setRamps(uint16_t accel, uint16_t decel);
+    void setCreepSpeed(uint8_t value);
+    void setStationCount(uint8_t value);   // Takes effect at the next boot
+    void setRoute(uint8_t value);          // Takes effect at the next boot
+    void setProfile(uint8_t value);        // Remembers a switch for the next boot, Profiles makes it
+    void setTelemetryMillis(uint16_t value);
+    bool authEpoch(uint8_t station, AuthEpochRecord &record); // false: none stored
+    void saveAuthEpoch(uint8_t station, const AuthEpochRecord &record); // Written at once
+
+    void update();                       // Commit settled changes, call from loop()
+    void flush();                        // Commit now (e.g. before a planned restart)
+    void printReport();
+
+private:
+    void load() { if (!loaded) loadFromFlash(); }
+    void loadFromFlash();
+    void changed();
+    void commit();
+    SettingsData data;
+    SettingsData stored;                 // What flash holds, to skip writes that change nothing
+    bool loaded = false;
+    bool dirty = false;
+    unsigned long firstChangeMillis = 0;
+    unsigned long lastChangeMillis = 0;
+    uint32_t sets = 0;                   // Setter calls that changed a value
+    uint32_t sessionCommits = 0;
+    uint32_t skippedCommits = 0;         // Dirty, but equal to flash again when it was time to write
+};
+
+#endif // SETTINGS_H
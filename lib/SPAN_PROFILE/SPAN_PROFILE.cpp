@@ -0,0 +1,107 @@
+#include "SPAN_PROFILE.h"
+
+#if SPAN_PROFILE
+
+static SpanZone *zones = nullptr;
+std::atomic<uint32_t> SpanZone::resetGeneration{0};
+
+SpanZone::SpanZone(const char *name) : name(name), next(zones) {
+    zones = this;
+}
+
+void SpanZone::clear() {
+    generation = resetGeneration.load(std::memory_order_relaxed);
+    count = 0;
+    minCycles = UINT32_MAX;
+    maxCycles = 0;
+    sumCycles = 0;
+    memset(bins, 0, sizeof(bins));
+}
+
+// Upper end of the bin that holds the given share of the spans
+static uint64_t percentileCycles(const SpanZone &zone, uint32_t perMille) {
+    uint64_t wanted = ((uint64_t)zone.count * perMille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int bin = 0; bin < SPAN_PROFILE_BINS; bin++) {
+        seen += zone.bins[bin];
+        if (seen >= wanted) return (uint64_t)2 << bin;
+    }
+    return (uint64_t)1 << SPAN_PROFILE_BINS;
+}
+
+static void printMicros(uint64_t cycles, uint32_t mhz) {
+    Serial.print((double)cycles / mhz, 1);
+}
+
+void SpanProfile::printReport() {
+    uint32_t mhz = getCpuFrequencyMhz();
+    Serial.print("Spans: us at ");
+    Serial.print(mhz);
+    Serial.println(" MHz, p50/p99 are bin upper bounds");
+    for (SpanZone *zone = zones; zone != nullptr; zone = zone->next) {
+        bool current = zone->generation == SpanZone::resetGeneration.load(std::memory_order_relaxed);
+        uint32_t count = current ? zone->count : 0;
+        Serial.print("  ");
+        Serial.print(zone->name);
+        Serial.print(": ");
+        Serial.print(count);
+        if (count == 0) {
+            Serial.println(" spans");
+            continue;
+        }
+        Serial.print(" spans, min ");
+        printMicros(zone->minCycles, mhz);
+        Serial.print(" avg ");
+        printMicros(zone->sumCycles / count, mhz);
+        Serial.print(" max ");
+        printMicros(zone->maxCycles, mhz);
+        Serial.print(", p50 < ");
+        printMicros(percentileCycles(*zone, 500), mhz);
+        Serial.print(" p99 < ");
+        printMicros(percentileCycles(*zone, 990), mhz);
+        Serial.println(" us");
+    }
+}
+
+void SpanProfile::printHistogram(const char *zoneName) {
+    SpanZone *zone = zones;
+    while (zone != nullptr && strcmp(zone->name, zoneName)) zone = zone->next;
+    if (zone == nullptr) {
+        Serial.print("Spans: no zone ");
+        Serial.println(zoneName);
+        return;
+    }
+    uint32_t mhz = getCpuFrequencyMhz();
+    Serial.print("Spans: ");
+    Serial.print(zone->name);
+    Serial.println(", cycles from - spans");
+    if (zone->generation != SpanZone::resetGeneration.load(std::memory_order_relaxed)) return;
+    for (int bin = 0; bin < SPAN_PROFILE_BINS; bin++) {
+        if (zone->bins[bin] == 0) continue;
+        Serial.print("  ");
+        Serial.print((unsigned long)1 << bin);
+        Serial.print(" (");
+        printMicros((uint64_t)1 << bin, mhz);
+        Serial.print(" us) - ");
+        Serial.println(zone->bins[bin]);
+    }
+}
+
+void SpanProfile::reset() {
+    SpanZone::resetGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+#else
+
+void SpanProfile::printReport() {
+    Serial.println("Spans: compiled out (SPAN_PROFILE 0)");
+}
+
+void SpanProfile::printHistogram(const char *zoneName) {
+    (void)zoneName;
+    printReport();
+}
+
+void SpanProfile::reset() {}
+
+#endif // SPAN_PROFILE
@@ -0,0 +1,76 @@
+#ifndef SPAN_PROFILE_H
+#define SPAN_PROFILE_H
+
+#include <Arduino.h>
+#include <atomic>
+
+// 0 takes every zone and span out of the build (build_flags = -DSPAN_PROFILE=0)
+#ifndef SPAN_PROFILE
+#define SPAN_PROFILE 1
+#endif
+
+#define SPAN_PROFILE_BINS 32             // Bin b counts spans of 2^b up to 2^(b+1) cycles
+
+// Where loop() spends its time, zone by zone. A zone is a named static
+// (SPAN_ZONE at file scope); SPAN(zone) at the top of a block times the rest
+// of the block with the CPU cycle counter (CCOUNT) and adds it to the zone's
+// count, min, max, sum and log2 histogram: two counter reads and a few adds,
+// no lock. CCOUNT is per core and wraps after 17 s at 240 MHz, so zones are
+// for code on loop()'s core and spans shorter than that.
+class SpanZone {
+public:
+    explicit SpanZone(const char *name);
+    void record(uint32_t cycles) {
+        if (generation != resetGeneration.load(std::memory_order_relaxed)) clear();
+        count++;
+        sumCycles += cycles;
+        if (cycles < minCycles) minCycles = cycles;
+        if (cycles > maxCycles) maxCycles = cycles;
+        bins[31 - __builtin_clz(cycles | 1)]++;
+    }
+
+    const char *const name;
+    uint32_t count = 0;
+    uint32_t minCycles = UINT32_MAX;
+    uint32_t maxCycles = 0;
+    uint64_t sumCycles = 0;
+    uint32_t bins[SPAN_PROFILE_BINS] = {0};
+
+private:
+    friend class SpanProfile;
+    void clear();
+    uint32_t generation = 0;
+    SpanZone *next;                      // All zones, in the order they were constructed
+    static std::atomic<uint32_t> resetGeneration;
+};
+
+class SpanScope {
+public:
+    explicit SpanScope(SpanZone &zone) : zone(zone), startCycles(ESP.getCycleCount()) {}
+    ~SpanScope() { zone.record(ESP.getCycleCount() - startCycles); }
+
+private:
+    SpanZone &zone;
+    uint32_t startCycles;
+};
+
+// Reading the zones, from any task. A report taken while loop() runs may
+// catch a zone between two of its counters.
+class SpanProfile {
+public:
+    static void printReport();           // Count, min/avg/max, p50/p99 from the histogram, per zone
+    static void printHistogram(const char *zoneName);  // The bins of one zone
+    static void reset();                 // Each zone starts over with its next span
+};
+
+#if SPAN_PROFILE
+#define SPAN_CONCAT_(a, b) a##b
+#define SPAN_CONCAT(a, b) SPAN_CONCAT_(a, b)
+#define SPAN_ZONE(zone, name) SpanZone zone(name)
+#define SPAN(zone) SpanScope SPAN_CONCAT(spanScope, __LINE__)(zone)
+#else
+#define SPAN_ZONE(zone, name) static_assert(true, "")
+#define SPAN(zone) do {} while (0)
+#endif
+
+#endif // SPAN_PROFILE_H
@@ -0,0 +1,243 @@
+#include "STATION_AUTH.h"
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND            \
+    do {                    \
+        v0 += v1;           \
+        v1 = ROTL(v1, 13);  \
+        v1 ^= v0;           \
+        v0 = ROTL(v0, 32);  \
+        v2 += v3;           \
+        v3 = ROTL(v3, 16);  \
+        v3 ^= v2;           \
+        v0 += v3;           \
+        v3 = ROTL(v3, 21);  \
+        v3 ^= v0;           \
+        v2 += v1;           \
+        v1 = ROTL(v1, 17);  \
+        v1 ^= v2;           \
+        v2 = ROTL(v2, 32);  \
+    } while (0)
+
+static uint64_t readLittleEndian64(const uint8_t *p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+uint64_t stationSipHash(const uint8_t *key, const uint8_t *data, size_t len) {
+    uint64_t k0 = readLittleEndian64(key);
+    uint64_t k1 = readLittleEndian64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const uint8_t *end = data + len - (len % 8);
+    for (const uint8_t *p = data; p != end; p += 8) {
+        uint64_t m = readLittleEndian64(p);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Last block: remaining bytes and the length in the top byte
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < len % 8; i++) {
+        b |= (uint64_t)end[i] << (8 * i);
+    }
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t tagWithEpoch(const uint8_t *key, const void *body, size_t len, uint16_t epoch) {
+    uint8_t message[AUTH_MAX_MESSAGE + sizeof(epoch)];
+    memcpy(message, body, len);
+    memcpy(message + len, &epoch, sizeof(epoch));
+    return (uint32_t)stationSipHash(key, message, len + sizeof(epoch));
+}
+
+uint32_t stationAuthTag(const uint8_t *key, const StationPacket &packet, uint16_t epoch) {
+    return tagWithEpoch(key, &packet, sizeof(packet), epoch);
+}
+
+uint32_t stationAuthTag(const uint8_t *key, const StationSyncReply &reply, uint16_t epoch) {
+    return tagWithEpoch(key, &reply, sizeof(reply), epoch);
+}
+
+static_assert(sizeof(StationPacket) <= AUTH_MAX_MESSAGE && sizeof(StationSyncReply) <= AUTH_MAX_MESSAGE, "tagged message too long");
+
+uint32_t stationKeyId(const uint8_t *key) {
+    static const uint8_t label[] = "key id";
+    return (uint32_t)stationSipHash(key, label, sizeof(label) - 1);
+}
+
+bool stationKeyProvisioned(const uint8_t *key) {
+    uint8_t bits = 0;
+    for (int i = 0; i < STATION_KEY_SIZE; i++) bits |= key[i];
+    return bits != 0;
+}
+
+StationAuthVerifier::StationAuthVerifier() {
+    for (int i = 0; i < AUTH_MAX_STATIONS; i++) {
+        states[i] = AuthState();
+    }
+}
+
+AuthResult StationAuthVerifier::verify(int station, const uint8_t *key, const StationPacket &packet, const StationAuthTrailer &trailer) {
+    if (station < 0 || station >= AUTH_MAX_STATIONS) return AUTH_BAD_TAG;
+    if (!stationKeyProvisioned(key)) {
+        reject(AUTH_NO_KEY);
+        return AUTH_NO_KEY;
+    }
+
+    uint32_t start = ESP.getCycleCount();
+    uint32_t expected = stationAuthTag(key, packet, trailer.epoch);
+    // Compare without an early exit so timing does not leak matching bytes
+    uint32_t difference = expected ^ trailer.tag;
+    uint32_t cycles = ESP.getCycleCount() - start;
+
+    portENTER_CRITICAL(&lock);
+    if (verifications == 0 || cycles < cyclesMin) cyclesMin = cycles;
+    if (cycles > cyclesMax) cyclesMax = cycles;
+    cyclesSum += cycles;
+    verifications++;
+
+    if (difference != 0) {
+        badTags++;
+        portEXIT_CRITICAL(&lock);
+        return AUTH_BAD_TAG;
+    }
+
+    // Sliding window per station: (epoch, seq) must be new. A new epoch means the
+    // station rebooted; an older epoch is always a replay, so is a wrapped one.
+    AuthState &state = states[station];
+    bool fresh = false;
+    if (!state.seen || trailer.epoch > state.epoch) {
+        state.epoch = trailer.epoch;
+        state.seq = packet.seq;
+        state.window = 1;
+        fresh = true;
+    } else if (trailer.epoch == state.epoch) {
+        if (packet.seq > state.seq) {
+            uint32_t shift = packet.seq - state.seq;
+            state.window = shift >= 32 ? 1 : (state.window << shift) | 1;
+            state.seq = packet.seq;
+            fresh = true;
+        } else {
+            uint32_t age = state.seq - packet.seq;
+            if (age < AUTH_REPLAY_WINDOW && !(state.window & (1UL << age))) {
+                state.window |= 1UL << age;
+                fresh = true;
+            }
+        }
+    }
+
+    if (!fresh) {
+        replays++;
+        portEXIT_CRITICAL(&lock);
+        return AUTH_REPLAY;
+    }
+
+    state.seen = true;
+    accepted++;
+    portEXIT_CRITICAL(&lock);
+    return AUTH_OK;
+}
+
+bool StationAuthVerifier::requiresAuth(int station) {
+    if (station < 0 || station >= AUTH_MAX_STATIONS) return false;
+    return states[station].seen;
+}
+
+// Without this a reset forgets every window and the first packet of any old
+// epoch is taken; now only a station that has booted again (or opened a new
+// epoch, see StationNode) gets through, and it still cannot downgrade
+void StationAuthVerifier::restoreEpoch(int station, uint16_t epoch) {
+    if (station < 0 || station >= AUTH_MAX_STATIONS) return;
+    portENTER_CRITICAL(&lock);
+    AuthState &state = states[station];
+    state.seen = true;
+    state.epoch = epoch;
+    state.seq = UINT32_MAX;              // Nothing of this epoch is new any more
+    state.window = UINT32_MAX;
+    portEXIT_CRITICAL(&lock);
+}
+
+bool StationAuthVerifier::acceptedEpoch(int station, uint16_t &epoch) {
+    if (station < 0 || station >= AUTH_MAX_STATIONS) return false;
+    portENTER_CRITICAL(&lock);
+    bool seen = states[station].seen;
+    epoch = states[station].epoch;
+    portEXIT_CRITICAL(&lock);
+    return seen;
+}
+
+void StationAuthVerifier::reject(AuthResult result) {
+    portENTER_CRITICAL(&lock);
+    if (result == AUTH_MISSING) missing++;
+    else if (result == AUTH_REPLAY) replays++;
+    else if (result == AUTH_BAD_TAG) badTags++;
+    else if (result == AUTH_NO_KEY) noKey++;
+    portEXIT_CRITICAL(&lock);
+}
+
+void StationAuthVerifier::update() {
+    unsigned long now = millis();
+    if (now - lastReportMillis > AUTH_REPORT_INTERVAL) {
+        printReport();
+        lastReportMillis = now;
+    }
+}
+
+void StationAuthVerifier::printReport() {
+    portENTER_CRITICAL(&lock);
+    uint32_t count = verifications;
+    uint32_t ok = accepted;
+    uint32_t bad = badTags;
+    uint32_t replayed = replays;
+    uint32_t unauthenticated = missing;
+    uint32_t keyless = noKey;
+    uint32_t minCycles = cyclesMin;
+    uint32_t maxCycles = cyclesMax;
+    uint64_t sumCycles = cyclesSum;
+    portEXIT_CRITICAL(&lock);
+
+    if (count == 0 && unauthenticated == 0 && keyless == 0) return;
+
+    uint32_t mhz = getCpuFrequencyMhz();
+    Serial.print("Auth: ");
+    Serial.print(ok);
+    Serial.print(" ok, ");
+    Serial.print(bad);
+    Serial.print(" bad tag, ");
+    Serial.print(replayed);
+    Serial.print(" replayed or duplicate, ");
+    Serial.print(unauthenticated);
+    Serial.print(" unauthenticated, ");
+    Serial.print(keyless);
+    Serial.print(" from stations without a key");
+    if (count == 0) {
+        Serial.println();
+        return;
+    }
+    Serial.print(", verify avg ");
+    Serial.print((uint32_t)(sumCycles / count));
+    Serial.print(" min ");
+    Serial.print(minCycles);
+    Serial.print(" max ");
+    Serial.print(maxCycles);
+    Serial.print(" cycles (avg ");
+    Serial.print((float)(sumCycles / count) / mhz, 2);
+    Serial.println(" us)");
+}
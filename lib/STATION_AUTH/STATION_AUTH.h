@@ -0,0 +1,67 @@
+#ifndef STATION_AUTH_H
+#define STATION_AUTH_H
+
+#include <Arduino.h>
+#include "STATION_PROTOCOL.h"
+
+#define STATION_KEY_SIZE 16
+#define AUTH_MAX_STATIONS 64             // LAYOUT_MAX_STATIONS; the station side does not pull in LAYOUT
+#define AUTH_REPLAY_WINDOW 32            // Older seqs within this window are accepted once (radio reorder)
+#define AUTH_REPORT_INTERVAL 30000       // Print the verification report this often (ms)
+#define AUTH_EPOCH_LAST 0xFFFE           // Epochs do not wrap, a station past this needs a new key (0xFFFF is erased EEPROM)
+#define AUTH_MAX_MESSAGE 32              // Largest message tagged, the epoch is appended to it
+
+enum AuthResult { AUTH_OK, AUTH_BAD_TAG, AUTH_REPLAY, AUTH_MISSING, AUTH_NO_KEY };
+
+// SipHash-2-4 of data under a 128-bit key
+uint64_t stationSipHash(const uint8_t *key, const uint8_t *data, size_t len);
+
+// Tag of a station packet: SipHash over the packet and the epoch, truncated to 32 bits
+uint32_t stationAuthTag(const uint8_t *key, const StationPacket &packet, uint16_t epoch);
+
+// Tag of a clock sync reply, under the key and epoch of the request it answers
+uint32_t stationAuthTag(const uint8_t *key, const StationSyncReply &reply, uint16_t epoch);
+
+// Names a key without giving it away, stored next to epochs so a new key starts them over
+uint32_t stationKeyId(const uint8_t *key);
+
+// An all-zero key is an unused row of the key table, anyone could sign with it
+bool stationKeyProvisioned(const uint8_t *key);
+
+struct AuthState {
+    bool seen;                           // Authenticated packets arrived, unauthenticated ones are refused now
+    uint16_t epoch;                      // Station boot counter of the newest packet
+    uint32_t seq;                        // Newest seq of that epoch
+    uint32_t window;                     // Bit n set = seq - n already accepted
+};
+
+// Controller side check of authenticated station packets. Runs in the ESP-NOW
+// receive callback, so it only hashes and compares; the cost is measured in
+// CPU cycles for the report.
+class StationAuthVerifier {
+public:
+    StationAuthVerifier();
+    AuthResult verify(int station, const uint8_t *key, const StationPacket &packet, const StationAuthTrailer &trailer);
+    bool requiresAuth(int station);      // After the first authenticated packet a station cannot downgrade
+    void restoreEpoch(int station, uint16_t epoch); // setup(): newest epoch accepted before the reset
+    bool acceptedEpoch(int station, uint16_t &epoch); // Newest epoch accepted, for loop() to persist; false = none
+    void reject(AuthResult result);      // Count a packet refused before verify() (AUTH_MISSING, AUTH_NO_KEY)
+    void update();                       // Print the periodic report, call from loop()
+    void printReport();
+
+private:
+    AuthState states[AUTH_MAX_STATIONS];
+    uint32_t accepted = 0;
+    uint32_t badTags = 0;
+    uint32_t replays = 0;
+    uint32_t missing = 0;
+    uint32_t noKey = 0;
+    uint32_t cyclesMin = 0;
+    uint32_t cyclesMax = 0;
+    uint64_t cyclesSum = 0;
+    uint32_t verifications = 0;
+    unsigned long lastReportMillis = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // STATION_AUTH_H
@@ -0,0 +1,356 @@
+#include "STATION_NODE.h"
+#include <WiFi.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
+#include <EEPROM.h>
+#include "STATION_AUTH.h"
+
+static const uint8_t broadcastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// esp_now callbacks are plain functions, so route them to the (single) node
+static StationNode *activeNode = nullptr;
+
+StationNode::StationNode() {
+
+}
+
+bool StationNode::begin(const uint8_t *mac, unsigned long interval) {
+    memcpy(controllerMac, mac, 6);
+    heartbeatInterval = interval;
+
+    WiFi.mode(WIFI_STA);
+    WiFi.disconnect();
+
+    if (esp_now_init() != ESP_OK) {
+        Serial.println("Error initializing ESP-NOW");
+        return false;
+    }
+
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, controllerMac, 6);
+    peer.channel = 0;
+    peer.encrypt = false;
+    if (esp_now_add_peer(&peer) != ESP_OK) {
+        Serial.println("Error adding controller peer");
+        return false;
+    }
+
+    esp_read_mac(ownMac, ESP_MAC_WIFI_STA);
+
+    activeNode = this;
+    esp_now_register_recv_cb(onReceive);
+
+    lastSentMillis = millis();
+    return true;
+}
+
+void StationNode::loop() {
+    if (semaphore != nullptr) semaphore->loop();
+
+    flushRelays();
+    applySyncSample();
+
+    if (relayEnabled && millis() - lastBeaconMillis >= STATION_BEACON_INTERVAL) {
+        lastBeaconMillis = millis();
+        sendBeacon();
+    }
+
+    // An authenticated station that is still waiting for its answer asks again
+    // at the fast rate, so a controller reset costs about a second of triggers
+    portENTER_CRITICAL(&syncLock);
+    bool waiting = pendingSyncSeq != 0;
+    portEXIT_CRITICAL(&syncLock);
+    unsigned long syncInterval = sync.syncInterval();
+    if (authEnabled && epochAnswered && waiting) syncInterval = TIME_SYNC_FAST_INTERVAL;
+    if (millis() - lastSyncMillis >= syncInterval) {
+        lastSyncMillis = millis();
+        // Armed before sending, the reply can arrive before esp_now_send() returns
+        portENTER_CRITICAL(&syncLock);
+        bool answered = pendingSyncSeq == 0;
+        pendingSyncSeq = seq + 1;
+        portEXIT_CRITICAL(&syncLock);
+        unansweredSyncs = answered ? 0 : unansweredSyncs + 1;
+
+        // A controller that reset refuses the epoch it already saw, so after
+        // it went quiet start a new one; once per silence, to spare the flash
+        if (authEnabled && epochAnswered && unansweredSyncs >= STATION_EPOCH_SILENCE) {
+            nextEpoch();
+            epochAnswered = false;
+        }
+        sendPacket(STATION_MSG_SYNC_REQUEST, micros());
+    }
+
+    // Any packet proves we are alive, so heartbeats only fill the silence
+    if (millis() - lastSentMillis >= heartbeatInterval) {
+        sendPacket(STATION_MSG_HEARTBEAT, micros());
+    }
+}
+
+bool StationNode::sendTrigger() {
+    return sendTrigger(micros());
+}
+
+bool StationNode::sendTrigger(uint32_t edgeMicros) {
+    return sendPacket(STATION_MSG_TRIGGER, edgeMicros);
+}
+
+TimeSyncClient &StationNode::timeSync() {
+    return sync;
+}
+
+void StationNode::attachSemaphore(SemaphoreNode *node) {
+    semaphore = node;
+    semaphore->setController(controllerMac);
+}
+
+void StationNode::enableRelay(bool enabled) {
+    relayEnabled = enabled;
+    if (enabled) ensurePeer(broadcastMac);
+}
+
+void StationNode::enableAuth(const uint8_t *key, int epochAddress) {
+    memcpy(authKey, key, STATION_KEY_SIZE);
+    this->epochAddress = epochAddress;
+
+    // One step per boot, so the controller can tell new packets from replays.
+    // A first boot (erased EEPROM) or a new key starts over at 0.
+    EEPROM.begin(epochAddress + 6);
+    epoch = EEPROM.read(epochAddress) | (EEPROM.read(epochAddress + 1) << 8);
+    uint32_t storedKeyId = 0;
+    for (int i = 0; i < 4; i++) storedKeyId |= (uint32_t)EEPROM.read(epochAddress + 2 + i) << (8 * i);
+    uint32_t keyId = stationKeyId(key);
+    if (storedKeyId != keyId) {
+        epoch = 0xFFFF;
+        for (int i = 0; i < 4; i++) EEPROM.write(epochAddress + 2 + i, (keyId >> (8 * i)) & 0xFF);
+    }
+    nextEpoch();
+
+    authEnabled = true;
+}
+
+void StationNode::nextEpoch() {
+    // The controller refuses a wrapped epoch as a replay
+    if (epoch == AUTH_EPOCH_LAST) {
+        Serial.println("Station: auth epochs used up, give this station a new key");
+        return;
+    }
+    epoch++;
+    EEPROM.write(epochAddress, epoch & 0xFF);
+    EEPROM.write(epochAddress + 1, epoch >> 8);
+    EEPROM.commit();
+}
+
+uint8_t StationNode::routeHops() {
+    uint8_t mac[6];
+    if (!router.nextHop(mac)) return 1;
+    return router.hops();
+}
+
+void StationNode::onReceive(const uint8_t *mac, const uint8_t *data, int len) {
+    uint32_t receivedMicros = micros();  // t4, taken before anything else
+
+    if (activeNode != nullptr) {
+        activeNode->handleReceive(mac, data, len, receivedMicros);
+    }
+}
+
+void StationNode::handleReceive(const uint8_t *mac, const uint8_t *data, int len, uint32_t receivedMicros) {
+    if (len < 1) return;
+
+    // Beacons and relayed messages come from other stations too
+    if (data[0] == STATION_MSG_ROUTE_BEACON && len >= (int)sizeof(StationRouteBeacon)) {
+        StationRouteBeacon beacon;
+        memcpy(&beacon, data, sizeof(beacon));
+        if (memcmp(beacon.controller, controllerMac, 6) == 0) router.recordBeacon(mac, beacon);
+        return;
+    }
+    if (data[0] == STATION_MSG_RELAY) {
+        handleRelay(mac, data, len, receivedMicros);
+        return;
+    }
+
+    if (memcmp(mac, controllerMac, 6) != 0) return;
+
+    if (data[0] == STATION_MSG_SYNC_REPLY && len >= (int)sizeof(StationSyncReply)) {
+        handleSyncReply(data, len, receivedMicros);
+    } else if (data[0] == STATION_MSG_ASPECTS && semaphore != nullptr) {
+        semaphore->handleReceive(mac, data, len, receivedMicros);
+    }
+}
+
+void StationNode::handleSyncReply(const uint8_t *data, int len, uint32_t receivedMicros) {
+    StationSyncReply reply;
+    memcpy(&reply, data, sizeof(reply));
+
+    // Signed requests get signed replies; anything else could steer our clock
+    if (authEnabled) {
+        if (!(reply.flags & STATION_FLAG_AUTH) || len < (int)(sizeof(reply) + sizeof(StationAuthTrailer))) return;
+        StationAuthTrailer trailer;
+        memcpy(&trailer, data + sizeof(reply), sizeof(trailer));
+        if (trailer.epoch != epoch || stationAuthTag(authKey, reply, epoch) != trailer.tag) return;
+    }
+
+    // A late reply to an older request would pair with the wrong t1
+    portENTER_CRITICAL(&syncLock);
+    if (reply.seq == pendingSyncSeq) {
+        pendingSyncSeq = 0;
+        syncSample = {reply.t1, reply.t2, reply.t3, receivedMicros};
+        syncSampleReady = true;
+    }
+    portEXIT_CRITICAL(&syncLock);
+}
+
+// TimeSyncClient is not locked, so the WiFi task leaves the reply for loop()
+void StationNode::applySyncSample() {
+    portENTER_CRITICAL(&syncLock);
+    bool ready = syncSampleReady;
+    SyncSample sample = syncSample;
+    syncSampleReady = false;
+    portEXIT_CRITICAL(&syncLock);
+
+    if (!ready) return;
+    sync.addSample(sample.t1, sample.t2, sample.t3, sample.t4);
+    epochAnswered = true;
+}
+
+void StationNode::handleRelay(const uint8_t *mac, const uint8_t *data, int len, uint32_t receivedMicros) {
+    if (len <= (int)sizeof(StationRelayHeader)) return;
+
+    StationRelayHeader header;
+    memcpy(&header, data, sizeof(header));
+    const uint8_t *payload = data + sizeof(header);
+    int payloadLen = len - sizeof(header);
+
+    // Addressed to us: only the controller sends downstream
+    if (memcmp(header.target, ownMac, 6) == 0) {
+        if (memcmp(header.origin, controllerMac, 6) != 0 || payload[0] == STATION_MSG_RELAY) return;
+        handleReceive(controllerMac, payload, payloadLen, receivedMicros);
+        return;
+    }
+
+    if (!relayEnabled || header.hops >= STATION_RELAY_MAX_HOPS) return;
+    header.hops++;
+
+    uint8_t next[6];
+    if (memcmp(header.target, controllerMac, 6) == 0) {
+        if (router.isDuplicate(header.origin, header.seq)) return;
+        router.learnReverse(header.origin, mac);
+        if (!router.nextHop(next)) memcpy(next, controllerMac, 6);
+    } else if (!router.reverseHop(header.target, next)) {
+        return;
+    }
+
+    queueRelay(next, header, payload, payloadLen);
+}
+
+// The receive callback runs in the WiFi task, forwarding happens in loop()
+void StationNode::queueRelay(const uint8_t *to, const StationRelayHeader &header, const uint8_t *payload, int payloadLen) {
+    if ((int)sizeof(header) + payloadLen > STATION_RELAY_MAX_LEN) return;
+
+    portENTER_CRITICAL(&relayLock);
+    if (relayCount == STATION_RELAY_QUEUE) {
+        portEXIT_CRITICAL(&relayLock);
+        return;
+    }
+    RelayFrame &frame = relayQueue[(relayHead + relayCount) % STATION_RELAY_QUEUE];
+    memcpy(frame.to, to, 6);
+    memcpy(frame.data, &header, sizeof(header));
+    memcpy(frame.data + sizeof(header), payload, payloadLen);
+    frame.len = sizeof(header) + payloadLen;
+    relayCount++;
+    portEXIT_CRITICAL(&relayLock);
+}
+
+void StationNode::flushRelays() {
+    while (true) {
+        RelayFrame frame;
+        portENTER_CRITICAL(&relayLock);
+        if (relayCount == 0) {
+            portEXIT_CRITICAL(&relayLock);
+            return;
+        }
+        frame = relayQueue[relayHead];
+        relayHead = (relayHead + 1) % STATION_RELAY_QUEUE;
+        relayCount--;
+        portEXIT_CRITICAL(&relayLock);
+
+        if (ensurePeer(frame.to)) {
+            esp_now_send(frame.to, frame.data, frame.len);
+        }
+    }
+}
+
+void StationNode::sendBeacon() {
+    StationRouteBeacon beacon;
+    beacon.type = STATION_MSG_ROUTE_BEACON;
+    beacon.cost = router.cost();
+    if (beacon.cost == STATION_ROUTE_NONE) return;  // Nothing to offer
+    beacon.hops = router.hops();
+    beacon.seq = ++beaconSeq;
+    memcpy(beacon.controller, controllerMac, 6);
+    esp_now_send(broadcastMac, (const uint8_t *)&beacon, sizeof(beacon));
+}
+
+bool StationNode::ensurePeer(const uint8_t *mac) {
+    if (esp_now_is_peer_exist(mac)) return true;
+
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, mac, 6);
+    peer.channel = 0;
+    peer.encrypt = false;
+    return esp_now_add_peer(&peer) == ESP_OK;
+}
+
+bool StationNode::sendPacket(uint8_t type, uint32_t stamp) {
+    StationPacket packet;
+    packet.type = type;
+    packet.flags = 0;
+    packet.seq = ++seq;
+    packet.sentMicros = stamp;
+    packet.syncError = sync.errorMicros();
+
+    // Sync requests need the raw local clock (t1), everything else goes out in controller time
+    if (type != STATION_MSG_SYNC_REQUEST && sync.isSynced()) {
+        packet.sentMicros = sync.toController(stamp);
+        packet.flags |= STATION_FLAG_SYNCED;
+    }
+
+    if (!authEnabled) {
+        lastSentMillis = millis();
+        return sendToController((const uint8_t *)&packet, sizeof(packet), packet.seq);
+    }
+
+    // The tag covers the flags, so it is computed last
+    packet.flags |= STATION_FLAG_AUTH;
+    StationAuthTrailer trailer;
+    trailer.epoch = epoch;
+    trailer.tag = stationAuthTag(authKey, packet, epoch);
+
+    uint8_t frame[sizeof(packet) + sizeof(trailer)];
+    memcpy(frame, &packet, sizeof(packet));
+    memcpy(frame + sizeof(packet), &trailer, sizeof(trailer));
+    lastSentMillis = millis();
+    return sendToController(frame, sizeof(frame), packet.seq);
+}
+
+bool StationNode::sendToController(const uint8_t *data, int len, uint32_t messageSeq) {
+    // Direct until a beacon shows a relay is the better way
+    uint8_t next[6];
+    if (!router.nextHop(next) || memcmp(next, controllerMac, 6) == 0) {
+        return esp_now_send(controllerMac, data, len) == ESP_OK;
+    }
+
+    uint8_t frame[STATION_RELAY_MAX_LEN];
+    StationRelayHeader header;
+    header.type = STATION_MSG_RELAY;
+    header.hops = 0;
+    memcpy(header.origin, ownMac, 6);
+    memcpy(header.target, controllerMac, 6);
+    header.seq = messageSeq;
+    if ((int)sizeof(header) + len > STATION_RELAY_MAX_LEN) return false;
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), data, len);
+
+    if (!ensurePeer(next)) return false;
+    return esp_now_send(next, frame, sizeof(header) + len) == ESP_OK;
+}
@@ -0,0 +1,85 @@
+#ifndef STATION_NODE_H
+#define STATION_NODE_H
+
+#include <Arduino.h>
+#include "STATION_PROTOCOL.h"
+#include "TIME_SYNC.h"
+#include "SEMAPHORE_NODE.h"
+#include "STATION_ROUTER.h"
+#include "STATION_AUTH.h"
+
+#define STATION_RELAY_QUEUE 8            // Messages waiting to be forwarded from loop()
+#define STATION_RELAY_MAX_LEN 64         // Largest relayed message, header included
+#define STATION_EPOCH_EEPROM_ADDR 0      // Boot counter of authenticated packets (2 bytes) and the id of its key (4)
+#define STATION_EPOCH_SILENCE 5          // Sync requests unanswered in a row before opening a new epoch
+
+// Station sender side of the ESP-NOW link. The sender sketch calls begin() once,
+// loop() every iteration and sendTrigger() when its sensor becomes stably LOW.
+// With enableRelay() the station also forwards other stations' messages and
+// advertises its route, so stations out of the controller's range still report.
+class StationNode {
+public:
+    StationNode();
+    bool begin(const uint8_t *controllerMac, unsigned long heartbeatInterval = STATION_HEARTBEAT_INTERVAL);
+    void loop();                         // Sends heartbeats and clock sync requests when due
+    bool sendTrigger();                  // Report the sensor edge (now) to the controller
+    bool sendTrigger(uint32_t edgeMicros); // Report an edge captured earlier, e.g. before debouncing
+    TimeSyncClient &timeSync();
+    void attachSemaphore(SemaphoreNode *node); // Station board that also drives a semaphore, call after begin()
+    void enableRelay(bool enabled);
+    // Sign every packet with the key the controller has for this station (stationKeys)
+    void enableAuth(const uint8_t *key, int epochAddress = STATION_EPOCH_EEPROM_ADDR);
+    uint8_t routeHops();                 // Radio hops to the controller, 1 = direct
+    void handleReceive(const uint8_t *mac, const uint8_t *data, int len, uint32_t receivedMicros);
+
+private:
+    static void onReceive(const uint8_t *mac, const uint8_t *data, int len);
+    void handleSyncReply(const uint8_t *data, int len, uint32_t receivedMicros);
+    void handleRelay(const uint8_t *mac, const uint8_t *data, int len, uint32_t receivedMicros);
+    bool sendPacket(uint8_t type, uint32_t stamp);
+    bool sendToController(const uint8_t *data, int len, uint32_t messageSeq);
+    void queueRelay(const uint8_t *to, const StationRelayHeader &header, const uint8_t *payload, int payloadLen);
+    void flushRelays();
+    void applySyncSample();
+    void nextEpoch();
+    void sendBeacon();
+    bool ensurePeer(const uint8_t *mac);
+    uint8_t controllerMac[6];
+    unsigned long heartbeatInterval = STATION_HEARTBEAT_INTERVAL;
+    unsigned long lastSentMillis = 0;
+    unsigned long lastSyncMillis = 0;
+    uint32_t seq = 0;
+    TimeSyncClient sync;                 // loop() only, replies reach it through syncSample
+
+    struct SyncSample {
+        uint32_t t1, t2, t3, t4;
+    };
+    uint32_t pendingSyncSeq = 0;         // Only the reply to the latest request is used
+    SyncSample syncSample;               // Reply handed from the WiFi task to loop()
+    bool syncSampleReady = false;
+    portMUX_TYPE syncLock = portMUX_INITIALIZER_UNLOCKED;
+    SemaphoreNode *semaphore = nullptr;
+
+    struct RelayFrame {
+        uint8_t to[6];
+        uint8_t len;
+        uint8_t data[STATION_RELAY_MAX_LEN];
+    };
+    bool authEnabled = false;
+    uint8_t authKey[STATION_KEY_SIZE];
+    uint16_t epoch = 0;
+    int epochAddress = STATION_EPOCH_EEPROM_ADDR;
+    bool epochAnswered = false;          // A sync reply came back in this epoch
+    uint8_t unansweredSyncs = 0;         // loop() only
+    StationRouter router;
+    bool relayEnabled = false;
+    uint8_t ownMac[6];
+    uint32_t beaconSeq = 0;
+    unsigned long lastBeaconMillis = 0;
+    RelayFrame relayQueue[STATION_RELAY_QUEUE];
+    uint8_t relayHead = 0;               // Next frame to send
+    uint8_t relayCount = 0;
+    portMUX_TYPE relayLock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // STATION_NODE_H
@@ -0,0 +1,161 @@
+#ifndef STATION_PROTOCOL_H
+#define STATION_PROTOCOL_H
+
+#include <stdint.h>
+
+// ESP-NOW messages exchanged between the station senders and the controller.
+// Old senders send a single byte (1) when the station becomes stably LOW, so
+// STATION_MSG_TRIGGER keeps that value and a 1-byte packet is still a trigger.
+
+#define STATION_MSG_TRIGGER      1  // Station sensor fired
+#define STATION_MSG_HEARTBEAT    2  // Periodic "I am alive" message
+#define STATION_MSG_SYNC_REQUEST 3  // Station asks for the controller time (sentMicros = t1)
+#define STATION_MSG_SYNC_REPLY   4  // Controller answers with StationSyncReply
+#define STATION_MSG_ASPECTS      5  // Controller broadcast of every semaphore aspect (SemaphoreAspects)
+#define STATION_MSG_ASPECT_ACK   6  // Semaphore node applied an aspect update (SemaphoreAck)
+#define STATION_MSG_ROUTE_BEACON 7  // Controller and relays advertise their path cost (StationRouteBeacon)
+#define STATION_MSG_RELAY        8  // Any other message carried over relays (StationRelayHeader + message)
+#define STATION_MSG_TRAIN_CMD    9  // Controller tells a train node how to drive (TrainCommand)
+#define STATION_MSG_TRAIN_ACK   10  // Train node applied a command (TrainAck)
+#define STATION_MSG_SECTION     11  // Between the controllers of neighbouring sections (SectionMessage)
+
+#define STATION_FLAG_SYNCED 0x01  // sentMicros is already in controller time
+#define STATION_FLAG_AUTH   0x02  // A StationAuthTrailer follows the packet
+
+#define STATION_SYNC_ERROR_UNKNOWN 0xFFFF
+
+#define TRAIN_CMD_STOP     0
+#define TRAIN_CMD_FORWARD  1
+#define TRAIN_CMD_BACKWARD 2
+#define TRAIN_CMD_RETRY 40               // ms between repeats of a command not acknowledged yet
+#define TRAIN_CMD_KEEPALIVE 250          // ms between repeats of the acknowledged one
+#define TRAIN_NODE_TIMEOUT 1000          // ms without any command before a train node stops by itself
+
+#define STATION_HEARTBEAT_INTERVAL 1000  // Milliseconds between heartbeats when idle
+
+#define STATION_BEACON_INTERVAL 1000     // Milliseconds between route beacons
+#define STATION_RELAY_MAX_HOPS 4         // Relays drop messages that already made this many hops
+#define STATION_ROUTE_COST_UNIT 16       // Cost of one loss-free hop; a hop costs UNIT / delivery ratio
+#define STATION_ROUTE_NONE 0xFFFF        // Cost of "no route to the controller"
+
+struct __attribute__((packed)) StationPacket {
+    uint8_t type;         // STATION_MSG_*
+    uint8_t flags;        // STATION_FLAG_*
+    uint32_t seq;         // Per-station counter shared by all message types (used for loss)
+    uint32_t sentMicros;  // Sender clock when the packet was built (edge time for triggers)
+    uint16_t syncError;   // Estimated clock sync error in microseconds, STATION_SYNC_ERROR_UNKNOWN if not synced
+};
+
+// Appended to a StationPacket sent with STATION_FLAG_AUTH, and to the controller's
+// StationSyncReply to an authenticated request. The tag is SipHash-2-4
+// of the packet and epoch under the station's key, truncated to 32 bits. The
+// epoch is a boot counter kept in the station's EEPROM, also stepped when the
+// controller stops answering, so (epoch, seq) never repeats and replays can be
+// refused; the controller keeps the newest epoch of each station across resets.
+struct __attribute__((packed)) StationAuthTrailer {
+    uint16_t epoch;
+    uint32_t tag;
+};
+
+// Two-way time exchange (NTP style):
+//   t1 station sends request, t2 controller receives it,
+//   t3 controller sends reply, t4 station receives reply.
+struct __attribute__((packed)) StationSyncReply {
+    uint8_t type;         // STATION_MSG_SYNC_REPLY
+    uint8_t flags;
+    uint32_t seq;         // seq of the request being answered
+    uint32_t t1;          // Station clock, copied from the request
+    uint32_t t2;          // Controller clock when the request arrived
+    uint32_t t3;          // Controller clock when the reply was sent
+};
+
+// Networked semaphores: one broadcast carries every aspect, so all semaphores
+// switch together. The seq only changes when an aspect changes; the same
+// packet is repeated so a lost broadcast is repaired.
+struct __attribute__((packed)) SemaphoreAspects {
+    uint8_t type;         // STATION_MSG_ASPECTS
+    uint8_t count;        // Number of semaphores described
+    uint32_t seq;
+    uint64_t green;       // Bit (id - 1) set = GREEN, clear = RED
+};
+
+// Sent once per applied seq. The controller measures broadcast-to-applied
+// latency from the round trip, so the node needs no synchronized clock.
+struct __attribute__((packed)) SemaphoreAck {
+    uint8_t type;             // STATION_MSG_ASPECT_ACK
+    uint8_t id;               // Semaphore id on the node
+    uint32_t seq;             // SemaphoreAspects seq that was applied
+    uint32_t receiveToApply;  // us from reception to the output change
+    uint32_t receiveToSend;   // us from reception to sending this ack
+};
+
+// Broadcast by the controller (cost 0) and by every relay that has a route.
+// Stations pick the neighbour with the lowest cost + cost of the link to it.
+struct __attribute__((packed)) StationRouteBeacon {
+    uint8_t type;         // STATION_MSG_ROUTE_BEACON
+    uint8_t hops;         // Hops from the sender to the controller
+    uint32_t seq;         // Per-sender counter, gaps measure the link delivery ratio
+    uint16_t cost;        // Sender's path cost to the controller
+    uint8_t controller[6];  // Which one: on a loop cut into sections several share the air
+};
+
+// Prefix of a relayed message. Upstream the target is the controller and the
+// next hop comes from the beacons; downstream (sync replies) each relay sends
+// it back the way the origin's messages came in.
+struct __attribute__((packed)) StationRelayHeader {
+    uint8_t type;         // STATION_MSG_RELAY
+    uint8_t hops;         // Relays passed so far
+    uint8_t origin[6];
+    uint8_t target[6];
+    uint32_t seq;         // seq of the carried message, (origin, seq) identifies it
+};
+
+// Train nodes: a board on each train drives its motor. The controller sends
+// the current command until it is acknowledged and then keeps repeating it,
+// so the train stops by itself when the controller goes silent. The seq only
+// changes with the command.
+struct __attribute__((packed)) TrainCommand {
+    uint8_t type;         // STATION_MSG_TRAIN_CMD
+    uint8_t train;        // Index in the controller's train table
+    uint8_t command;      // TRAIN_CMD_*
+    uint8_t speed;        // % motor drive in the commanded direction
+    uint32_t seq;
+};
+
+// Sent for every command received, repeats included. The controller takes
+// the round trip of the first send of a seq to its first ack as the latency.
+struct __attribute__((packed)) TrainAck {
+    uint8_t type;         // STATION_MSG_TRAIN_ACK
+    uint8_t train;
+    uint32_t seq;         // TrainCommand seq being applied
+};
+
+// Controllers of neighbouring sections of one line (lib/SECTION_LINK). Every
+// message also serves as a heartbeat and carries the sender's view of the
+// block on the boundary between the two sections.
+#define SECTION_MSG_HEARTBEAT 0  // train: a train that left the block, for the holder to clear
+#define SECTION_MSG_OFFER     1  // May this train cross into your section?
+#define SECTION_MSG_ACCEPT    2  // Yes, the berth is reserved; answers OFFER
+#define SECTION_MSG_REFUSE    3  // Not now; answers OFFER
+#define SECTION_MSG_COMMIT    4  // The train is yours; after ACCEPT
+#define SECTION_MSG_DONE      5  // The train is mine; answers COMMIT, or an OFFER of a train already taken over
+#define SECTION_MSG_OVERRUN   6  // seq: a train of yours ran past your last station into mine unannounced
+
+struct __attribute__((packed)) SectionMessage {
+    uint8_t type;         // STATION_MSG_SECTION
+    uint8_t kind;         // SECTION_MSG_*
+    uint8_t from;         // Sender's section
+    uint8_t boundary;     // Boundary b lies between section b and the next one up
+    uint32_t incarnation; // Sender's boot, a change means it lost its state
+    uint32_t seen;        // Receiver's incarnation as the sender last heard it, 0 if never
+    uint16_t epoch;       // Boundary token: bumped when it changes hands
+    uint16_t version;     // Bumped by the holder when the occupant changes
+    uint8_t holder;       // Section holding the token
+    uint8_t occupant;     // Train in the boundary block, SECTION_NO_TRAIN if none
+    uint8_t train;
+    uint8_t trip;         // The train's crossing count, the same for every try and across a restart
+    uint8_t seq;          // OFFER .. DONE: the try, per sender and boundary
+    uint16_t heardAgo;    // ms since the sender last heard the receiver, 0xFFFF for long ago
+};
+
+#endif // STATION_PROTOCOL_H
@@ -0,0 +1,169 @@
+#include "STATION_ROUTER.h"
+
+StationRouter::StationRouter() {
+    reset();
+}
+
+void StationRouter::reset() {
+    for (int i = 0; i < ROUTER_MAX_NEIGHBORS; i++) {
+        neighbors[i] = RouteNeighbor();
+    }
+    for (int i = 0; i < ROUTER_REVERSE_SIZE; i++) {
+        reverse[i] = RouteReverse();
+    }
+    memset(seen, 0, sizeof(seen));
+    parent = -1;
+}
+
+void StationRouter::recordBeacon(const uint8_t *mac, const StationRouteBeacon &beacon) {
+    portENTER_CRITICAL(&lock);
+
+    int slot = -1;
+    int oldest = 0;
+    for (int i = 0; i < ROUTER_MAX_NEIGHBORS; i++) {
+        if (neighbors[i].used && memcmp(neighbors[i].mac, mac, 6) == 0) {
+            slot = i;
+            break;
+        }
+        if (!neighbors[i].used) {
+            oldest = i;
+        } else if (neighbors[oldest].used && neighbors[i].lastHeardMillis < neighbors[oldest].lastHeardMillis) {
+            oldest = i;
+        }
+    }
+
+    if (slot < 0) {
+        slot = oldest;
+        if (slot == parent) parent = -1;
+        RouteNeighbor &fresh = neighbors[slot];
+        fresh = RouteNeighbor();
+        fresh.used = true;
+        memcpy(fresh.mac, mac, 6);
+        fresh.delivery = 128;         // Unproven link, half a clean one
+        fresh.lastSeq = beacon.seq - 1;
+    }
+
+    RouteNeighbor &neighbor = neighbors[slot];
+
+    // Every missed beacon pulls the ratio down, every received one up (1/8 steps)
+    uint32_t missed = beacon.seq - neighbor.lastSeq - 1;
+    if (beacon.seq <= neighbor.lastSeq) missed = 0;  // Duplicate, or the sender rebooted
+    if (missed > 16) missed = 16;
+    for (uint32_t i = 0; i < missed; i++) {
+        neighbor.delivery -= neighbor.delivery / 8;
+    }
+    if (beacon.seq != neighbor.lastSeq) {
+        neighbor.delivery += (256 - neighbor.delivery) / 8;
+    }
+
+    neighbor.lastSeq = beacon.seq;
+    neighbor.cost = beacon.cost;
+    neighbor.hops = beacon.hops;
+    neighbor.lastHeardMillis = millis();
+    portEXIT_CRITICAL(&lock);
+}
+
+uint16_t StationRouter::linkCost(const RouteNeighbor &neighbor) {
+    uint16_t delivery = neighbor.delivery ? neighbor.delivery : 1;
+    return (uint16_t)(STATION_ROUTE_COST_UNIT * 256 / delivery);
+}
+
+int StationRouter::best() {
+    unsigned long now = millis();
+    int bestIndex = -1;
+    uint32_t bestCost = STATION_ROUTE_NONE;
+    uint32_t parentCost = STATION_ROUTE_NONE;
+
+    for (int i = 0; i < ROUTER_MAX_NEIGHBORS; i++) {
+        RouteNeighbor &neighbor = neighbors[i];
+        if (!neighbor.used) continue;
+        if (now - neighbor.lastHeardMillis > ROUTER_NEIGHBOR_TIMEOUT) continue;
+        if (neighbor.cost == STATION_ROUTE_NONE || neighbor.hops >= STATION_RELAY_MAX_HOPS) continue;
+
+        uint32_t total = (uint32_t)neighbor.cost + linkCost(neighbor);
+        if (i == parent) parentCost = total;
+        if (total < bestCost) {
+            bestCost = total;
+            bestIndex = i;
+        }
+    }
+
+    // Stick with the current parent unless the new one is clearly better
+    if (parentCost != STATION_ROUTE_NONE && bestCost + ROUTER_SWITCH_MARGIN > parentCost) {
+        bestIndex = parent;
+    }
+    parent = bestIndex;
+    return bestIndex;
+}
+
+bool StationRouter::nextHop(uint8_t *mac) {
+    portENTER_CRITICAL(&lock);
+    int index = best();
+    if (index >= 0) memcpy(mac, neighbors[index].mac, 6);
+    portEXIT_CRITICAL(&lock);
+    return index >= 0;
+}
+
+uint16_t StationRouter::cost() {
+    portENTER_CRITICAL(&lock);
+    int index = best();
+    uint32_t total = STATION_ROUTE_NONE;
+    if (index >= 0) total = (uint32_t)neighbors[index].cost + linkCost(neighbors[index]);
+    portEXIT_CRITICAL(&lock);
+    return total < STATION_ROUTE_NONE ? (uint16_t)total : STATION_ROUTE_NONE - 1;
+}
+
+uint8_t StationRouter::hops() {
+    portENTER_CRITICAL(&lock);
+    int index = best();
+    uint8_t count = index >= 0 ? neighbors[index].hops + 1 : 1;
+    portEXIT_CRITICAL(&lock);
+    return count;
+}
+
+bool StationRouter::isDuplicate(const uint8_t *origin, uint32_t seq) {
+    portENTER_CRITICAL(&lock);
+    for (int i = 0; i < ROUTER_DEDUP_SIZE; i++) {
+        if (seen[i].seq == seq && memcmp(seen[i].origin, origin, 6) == 0) {
+            portEXIT_CRITICAL(&lock);
+            return true;
+        }
+    }
+    memcpy(seen[seenHead].origin, origin, 6);
+    seen[seenHead].seq = seq;
+    seenHead = (seenHead + 1) % ROUTER_DEDUP_SIZE;
+    portEXIT_CRITICAL(&lock);
+    return false;
+}
+
+void StationRouter::learnReverse(const uint8_t *origin, const uint8_t *via) {
+    portENTER_CRITICAL(&lock);
+    int slot = -1;
+    for (int i = 0; i < ROUTER_REVERSE_SIZE; i++) {
+        if (reverse[i].used && memcmp(reverse[i].origin, origin, 6) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        slot = reverseHead;
+        reverseHead = (reverseHead + 1) % ROUTER_REVERSE_SIZE;
+    }
+    reverse[slot].used = true;
+    memcpy(reverse[slot].origin, origin, 6);
+    memcpy(reverse[slot].via, via, 6);
+    portEXIT_CRITICAL(&lock);
+}
+
+bool StationRouter::reverseHop(const uint8_t *target, uint8_t *mac) {
+    portENTER_CRITICAL(&lock);
+    for (int i = 0; i < ROUTER_REVERSE_SIZE; i++) {
+        if (reverse[i].used && memcmp(reverse[i].origin, target, 6) == 0) {
+            memcpy(mac, reverse[i].via, 6);
+            portEXIT_CRITICAL(&lock);
+            return true;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+    return false;
+}
@@ -0,0 +1,61 @@
+#ifndef STATION_ROUTER_H
+#define STATION_ROUTER_H
+
+#include <Arduino.h>
+#include "STATION_PROTOCOL.h"
+
+#define ROUTER_MAX_NEIGHBORS 8       // Beacon senders tracked (controller + relays in range)
+#define ROUTER_NEIGHBOR_TIMEOUT 3500 // ms without a beacon before a neighbour is dropped
+#define ROUTER_SWITCH_MARGIN 8       // A new parent must be this much cheaper (cost units)
+#define ROUTER_DEDUP_SIZE 16         // Recently relayed (origin, seq) pairs
+#define ROUTER_REVERSE_SIZE 16       // Origins we know the way back to
+
+struct RouteNeighbor {
+    bool used;
+    uint8_t mac[6];
+    uint16_t cost;                   // Advertised path cost
+    uint8_t hops;                    // Advertised hop count
+    uint32_t lastSeq;
+    uint16_t delivery;               // Beacon delivery ratio, 256 = no loss
+    unsigned long lastHeardMillis;
+};
+
+struct RouteSeen {
+    uint8_t origin[6];
+    uint32_t seq;
+};
+
+struct RouteReverse {
+    bool used;
+    uint8_t origin[6];
+    uint8_t via[6];
+};
+
+// Route selection for the station relays. Link quality is the delivery ratio
+// of the beacons a neighbour sends every second (ETX style), so a lossy direct
+// link loses against two clean hops.
+class StationRouter {
+public:
+    StationRouter();
+    void reset();
+    void recordBeacon(const uint8_t *mac, const StationRouteBeacon &beacon);
+    bool nextHop(uint8_t *mac);      // false when no beacon was heard, send direct then
+    uint16_t cost();                 // Own path cost to the controller, STATION_ROUTE_NONE without a route
+    uint8_t hops();                  // Hops to the controller through nextHop()
+    bool isDuplicate(const uint8_t *origin, uint32_t seq); // Also remembers the pair
+    void learnReverse(const uint8_t *origin, const uint8_t *via);
+    bool reverseHop(const uint8_t *target, uint8_t *mac);
+
+private:
+    int best();                      // Index of the parent, -1 without a route
+    uint16_t linkCost(const RouteNeighbor &neighbor);
+    RouteNeighbor neighbors[ROUTER_MAX_NEIGHBORS];
+    int parent = -1;
+    RouteSeen seen[ROUTER_DEDUP_SIZE];
+    uint8_t seenHead = 0;
+    RouteReverse reverse[ROUTER_REVERSE_SIZE];
+    uint8_t reverseHead = 0;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // STATION_ROUTER_H
@@ -0,0 +1,207 @@
+#include "TASK_MONITOR.h"
+
+void TaskMonitor::begin() {
+    loopTask = xTaskGetCurrentTaskHandle();
+    loopCore = xPortGetCoreID();
+    if (TASK_MONITOR_PERIOD == 0) return;
+#if !configUSE_TRACE_FACILITY
+    Serial.println("Tasks: no task list in this core (configUSE_TRACE_FACILITY 0), not monitored");
+#elif !configGENERATE_RUN_TIME_STATS
+    Serial.println("Tasks: no run time statistics in this core, stack marks only");
+#endif
+}
+
+void TaskMonitor::update() {
+#if configUSE_TRACE_FACILITY
+    if (TASK_MONITOR_PERIOD == 0) return;
+    if (sampled && millis() - lastSampleMillis < TASK_MONITOR_PERIOD) return;
+    lastSampleMillis = millis();
+    uint32_t start = micros();
+    takeSample();
+    uint32_t sampleMicros = micros() - start;
+    if (sampleMicros > maxSampleMicros) maxSampleMicros = sampleMicros;
+#endif
+}
+
+static void printPermille(uint16_t permille) {
+    Serial.print(permille / 10.0, 1);
+    Serial.print("%");
+}
+
+#if configUSE_TRACE_FACILITY
+void TaskMonitor::takeSample() {
+    uint32_t totalRunTime = 0;
+    UBaseType_t found = uxTaskGetSystemState(status, TASK_MONITOR_MAX_TASKS, &totalRunTime);
+    if (found == 0) {
+        if (!tooMany) Serial.println("Tasks: more than " + String(TASK_MONITOR_MAX_TASKS) + " tasks, not sampled");
+        tooMany = true;
+        return;
+    }
+    tooMany = false;
+    uint32_t elapsed = totalRunTime - lastTotalRunTime;
+
+    TaskHandle_t idleTasks[portNUM_PROCESSORS];
+    uint16_t idleNow[portNUM_PROCESSORS];
+    for (uint8_t core = 0; core < portNUM_PROCESSORS; core++) {
+        idleTasks[core] = xTaskGetIdleTaskHandleForCPU(core);
+        idleNow[core] = TASK_MONITOR_UNKNOWN;
+    }
+
+    for (UBaseType_t i = 0; i < found; i++) {
+        const TaskStatus_t &source = status[i];
+        TaskSample &task = next[i];
+        const TaskSample *before = nullptr;
+        for (uint8_t j = 0; j < taskCount && before == nullptr; j++) {
+            if (tasks[j].number == source.xTaskNumber) before = &tasks[j];
+        }
+
+        strncpy(task.name, source.pcTaskName, TASK_MONITOR_NAME_SIZE - 1);
+        task.name[TASK_MONITOR_NAME_SIZE - 1] = 0;
+        task.number = source.xTaskNumber;
+        task.runTime = source.ulRunTimeCounter;
+        task.cpuPermille = TASK_MONITOR_UNKNOWN;
+#if configGENERATE_RUN_TIME_STATS
+        if (sampled && before != nullptr && elapsed > 0) {
+            uint64_t permille = (uint64_t)(task.runTime - before->runTime) * 1000 / elapsed;
+            task.cpuPermille = permille > 1000 ? 1000 : permille;
+        }
+#endif
+        task.stackFree = source.usStackHighWaterMark > 0xFFFF ? 0xFFFF : source.usStackHighWaterMark;
+        BaseType_t affinity = xTaskGetAffinity(source.xHandle);
+        task.core = affinity == tskNO_AFFINITY ? TASK_MONITOR_NO_CORE : affinity;
+        task.priority = source.uxCurrentPriority;
+        task.stackAlarm = before != nullptr && before->stackAlarm;
+        task.cpuAlarm = before != nullptr && before->cpuAlarm;
+
+        bool idleTask = false;
+        for (uint8_t core = 0; core < portNUM_PROCESSORS; core++) {
+            if (source.xHandle != idleTasks[core]) continue;
+            idleNow[core] = task.cpuPermille;
+            idleTask = true;
+        }
+
+        if (!task.stackAlarm && task.stackFree < TASK_MONITOR_STACK_ALARM) {
+            task.stackAlarm = true;
+            alarmsRaised++;
+            Serial.println("Tasks: " + String(task.name) + " stack low, " + String(task.stackFree) + " bytes never used");
+        }
+        if (idleTask || source.xHandle == loopTask || task.cpuPermille == TASK_MONITOR_UNKNOWN) continue;
+        bool busy = task.cpuPermille > TASK_MONITOR_CPU_ALARM;
+        if (busy == task.cpuAlarm) continue;
+        task.cpuAlarm = busy;
+        if (busy) alarmsRaised++;
+        Serial.print("Tasks: ");
+        Serial.print(task.name);
+        Serial.print(busy ? " takes " : " down to ");
+        printPermille(task.cpuPermille);
+        Serial.print(" of a core");
+        Serial.println(busy ? "" : " again");
+    }
+
+    for (uint8_t core = 0; core < portNUM_PROCESSORS; core++) {
+        if (core == loopCore || idleNow[core] == TASK_MONITOR_UNKNOWN) continue;
+        bool starved = idleNow[core] < TASK_MONITOR_IDLE_ALARM;
+        if (starved == idleAlarm[core]) continue;
+        idleAlarm[core] = starved;
+        if (starved) alarmsRaised++;
+        Serial.print("Tasks: core ");
+        Serial.print(core);
+        Serial.print(starved ? " idle only " : " idle ");
+        printPermille(idleNow[core]);
+        Serial.println(starved ? ", its task watchdog may bite" : " again");
+    }
+
+    portENTER_CRITICAL(&lock);
+    memcpy(tasks, next, sizeof(TaskSample) * found);
+    taskCount = found;
+    memcpy(idle, idleNow, sizeof(idle));
+    portEXIT_CRITICAL(&lock);
+    lastTotalRunTime = totalRunTime;
+    sampled = true;
+    samples++;
+}
+#else
+void TaskMonitor::takeSample() {}
+#endif
+
+uint8_t TaskMonitor::count() {
+    portENTER_CRITICAL(&lock);
+    uint8_t n = taskCount;
+    portEXIT_CRITICAL(&lock);
+    return n;
+}
+
+bool TaskMonitor::sample(uint8_t index, TaskSample &task) {
+    portENTER_CRITICAL(&lock);
+    bool valid = index < taskCount;
+    if (valid) task = tasks[index];
+    portEXIT_CRITICAL(&lock);
+    return valid;
+}
+
+uint16_t TaskMonitor::idlePermille(uint8_t core) {
+    if (core >= portNUM_PROCESSORS || samples == 0) return TASK_MONITOR_UNKNOWN;
+    portENTER_CRITICAL(&lock);
+    uint16_t permille = idle[core];
+    portEXIT_CRITICAL(&lock);
+    return permille;
+}
+
+uint8_t TaskMonitor::alarms() {
+    uint8_t raised = 0;
+    portENTER_CRITICAL(&lock);
+    for (uint8_t i = 0; i < taskCount; i++) {
+        if (tasks[i].stackAlarm) raised |= TASK_MONITOR_ALARM_STACK;
+        if (tasks[i].cpuAlarm) raised |= TASK_MONITOR_ALARM_CPU;
+    }
+    for (uint8_t core = 0; core < portNUM_PROCESSORS; core++) {
+        if (idleAlarm[core]) raised |= TASK_MONITOR_ALARM_IDLE;
+    }
+    portEXIT_CRITICAL(&lock);
+    return raised;
+}
+
+static void printColumn(const char *text, size_t width) {
+    Serial.print(text);
+    for (size_t column = strlen(text); column < width; column++) Serial.print(' ');
+}
+
+void TaskMonitor::printReport() {
+    if (TASK_MONITOR_PERIOD == 0 || !configUSE_TRACE_FACILITY) {
+        Serial.println("Tasks: not monitored");
+        return;
+    }
+    uint8_t n = count();
+    Serial.print("Tasks: ");
+    Serial.print(n);
+    Serial.print(" every ");
+    Serial.print(TASK_MONITOR_PERIOD);
+    Serial.print(" ms, sampling takes up to ");
+    Serial.print(maxSampleMicros);
+    Serial.print(" us, ");
+    Serial.print(alarmsRaised);
+    Serial.println(" alarms; cpu is the share of one core since the sample before");
+    Serial.println("  name         core prio    cpu  stack never used");
+    TaskSample task;
+    for (uint8_t i = 0; i < n && sample(i, task); i++) {
+        Serial.print("  ");
+        printColumn(task.name, TASK_MONITOR_NAME_SIZE + 1);
+        if (task.core == TASK_MONITOR_NO_CORE) {
+            Serial.print("   -");
+        } else {
+            Serial.print("   ");
+            Serial.print(task.core);
+        }
+        Serial.print(task.priority < 10 ? "    " : "   ");
+        Serial.print(task.priority);
+        if (task.cpuPermille == TASK_MONITOR_UNKNOWN) {
+            Serial.print("      -");
+        } else {
+            Serial.print(task.cpuPermille < 100 ? "   " : task.cpuPermille < 1000 ? "  " : " ");
+            printPermille(task.cpuPermille);
+        }
+        Serial.print("  ");
+        Serial.print(task.stackFree);
+        Serial.println(task.stackAlarm ? " bytes, LOW" : " bytes");
+    }
+}
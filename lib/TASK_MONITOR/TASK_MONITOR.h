@@ -0,0 +1,81 @@
+#ifndef TASK_MONITOR_H
+#define TASK_MONITOR_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#ifndef TASK_MONITOR_PERIOD
+#define TASK_MONITOR_PERIOD 1000         // ms between samples, 0 = off
+#endif
+#ifndef TASK_MONITOR_STACK_ALARM
+#define TASK_MONITOR_STACK_ALARM 512     // Bytes of stack never used, fewer raises the alarm
+#endif
+#ifndef TASK_MONITOR_IDLE_ALARM
+#define TASK_MONITOR_IDLE_ALARM 100      // Per mille left to the idle task of the other core than loop(); less starves its watchdog
+#endif
+#ifndef TASK_MONITOR_CPU_ALARM
+#define TASK_MONITOR_CPU_ALARM 500       // Per mille of its core for any task but loopTask and the idle tasks
+#endif
+#define TASK_MONITOR_MAX_TASKS 24        // More are not sampled
+#define TASK_MONITOR_NAME_SIZE 12        // Kept of each task name, with the terminator
+#define TASK_MONITOR_UNKNOWN 0xFFFF      // CPU share without run time statistics in the core
+#define TASK_MONITOR_NO_CORE 0xFF        // Not pinned
+
+#define TASK_MONITOR_ALARM_STACK 0x01    // alarms() bits
+#define TASK_MONITOR_ALARM_IDLE 0x02
+#define TASK_MONITOR_ALARM_CPU 0x04
+
+struct TaskSample {
+    char name[TASK_MONITOR_NAME_SIZE];
+    UBaseType_t number;                  // xTaskNumber, finds the task again in the next sample
+    uint32_t runTime;                    // Run time counter at the sample
+    uint16_t cpuPermille;                // Of one core's time since the last sample
+    uint16_t stackFree;                  // Bytes never used, clamped at 65535
+    uint8_t core;                        // TASK_MONITOR_NO_CORE when it runs on either
+    uint8_t priority;
+    bool stackAlarm;
+    bool cpuAlarm;
+};
+
+// Samples the FreeRTOS task list every TASK_MONITOR_PERIOD from loop():
+// each task's share of a core from the run time counters since the last
+// sample, its stack high-water mark and the core it is pinned to. The core
+// loop() runs on is busy by design (loopTask never blocks); the other one
+// has to leave its idle task enough time for the task watchdog. Crossing a
+// threshold prints one line, and another when it is back; a stack mark
+// never comes back, so that alarm stays.
+class TaskMonitor {
+public:
+    void begin();                        // setup(), from loopTask
+    void update();                       // loop()
+
+    uint8_t count();                     // Tasks of the last sample
+    bool sample(uint8_t index, TaskSample &task);   // Any task: a copy of one of them
+    uint16_t idlePermille(uint8_t core);  // Left to the idle task of the core, TASK_MONITOR_UNKNOWN before a sample
+    uint8_t alarms();                    // TASK_MONITOR_ALARM_* raised now
+    void printReport();                  // Any task
+
+    uint32_t samples = 0;
+    uint32_t alarmsRaised = 0;
+    uint32_t maxSampleMicros = 0;        // Longest update() that sampled, the scheduler is suspended for part of it
+
+private:
+    void takeSample();
+
+    TaskStatus_t status[TASK_MONITOR_MAX_TASKS];    // Filled by uxTaskGetSystemState(), loop() only
+    TaskSample tasks[TASK_MONITOR_MAX_TASKS] = {};
+    TaskSample next[TASK_MONITOR_MAX_TASKS] = {};   // Built here, then copied over tasks under the lock
+    uint8_t taskCount = 0;
+    uint16_t idle[portNUM_PROCESSORS] = {};
+    bool idleAlarm[portNUM_PROCESSORS] = {};
+    TaskHandle_t loopTask = nullptr;     // The task begin() ran in
+    uint8_t loopCore = 1;
+    uint32_t lastTotalRunTime = 0;
+    unsigned long lastSampleMillis = 0;
+    bool sampled = false;                // lastTotalRunTime and the run times in tasks are valid
+    bool tooMany = false;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif // TASK_MONITOR_H
@@ -0,0 +1,103 @@
+#include "TELEMETRY.h"
+
+void Telemetry::begin(uint16_t periodMillis) {
+    setPeriod(periodMillis);
+    lastSendMillis = millis();
+    passStartMicros = micros();
+    if (period() == 0) {
+        Serial.println("Telemetry: off");
+    } else {
+        Serial.println("Telemetry: " + String(sizeof(TelemetryFrame)) + " byte frames every " + String(period()) + " ms");
+    }
+}
+
+void Telemetry::setPeriod(uint16_t value) {
+    if (value != 0 && value < TELEMETRY_MIN_PERIOD) value = TELEMETRY_MIN_PERIOD;
+    periodMillis.store(value, std::memory_order_relaxed);
+}
+
+void Telemetry::pass() {
+    uint32_t now = micros();
+    uint32_t passMicros = now - passStartMicros;
+    passStartMicros = now;
+    if (passMicros > passMaxMicros) passMaxMicros = passMicros;
+    passTotalMicros += passMicros;
+    passCount++;
+}
+
+bool Telemetry::due() {
+    uint16_t every = period();
+    return every != 0 && millis() - lastSendMillis >= every;
+}
+
+void Telemetry::send() {
+    uint32_t start = micros();
+    lastSendMillis = millis();
+
+    frame.version = TELEMETRY_VERSION;
+    frame.seq = (uint16_t)frames;
+    frame.millis = lastSendMillis;
+    frame.passMaxMicros = passMaxMicros;
+    frame.passAvgMicros = passCount ? passTotalMicros / passCount : 0;
+    passMaxMicros = 0;
+    passTotalMicros = 0;
+    passCount = 0;
+
+    uint8_t packet[TELEMETRY_PACKET_BYTES];
+    memcpy(packet, &frame, sizeof(frame));
+    uint16_t crc = crc16(packet, sizeof(frame));
+    packet[sizeof(frame)] = crc & 0xFF;
+    packet[sizeof(frame) + 1] = crc >> 8;
+
+    uint8_t encoded[TELEMETRY_ENCODED_BYTES + 1];
+    size_t length = encode(packet, sizeof(packet), encoded);
+    encoded[length++] = 0;
+    Serial.write(encoded, length);  // One write, so no other print lands inside the frame
+    frames++;
+
+    uint32_t sendMicros = micros() - start;
+    if (sendMicros > maxSendMicros) maxSendMicros = sendMicros;
+}
+
+uint16_t Telemetry::crc16(const uint8_t *data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+size_t Telemetry::encode(const uint8_t *data, size_t length, uint8_t *out) {
+    size_t code = 0;           // Where the length byte of the current block goes
+    size_t written = 1;
+    uint8_t run = 1;
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] != 0) {
+            out[written++] = data[i];
+            run++;
+        }
+        if (data[i] == 0 || run == 0xFF) {
+            out[code] = run;
+            code = written++;
+            run = 1;
+        }
+    }
+    out[code] = run;
+    return written;
+}
+
+size_t Telemetry::decode(const uint8_t *data, size_t length, uint8_t *out) {
+    size_t written = 0;
+    size_t i = 0;
+    while (i < length) {
+        uint8_t run = data[i++];
+        if (run == 0 || i + run - 1 > length) return 0;
+        for (uint8_t k = 1; k < run; k++) {
+            if (data[i] == 0) return 0;
+            out[written++] = data[i++];
+        }
+        if (run != 0xFF && i < length) out[written++] = 0;
+    }
+    return written;
+}
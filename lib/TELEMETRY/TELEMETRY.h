@@ -0,0 +1,96 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+#include <atomic>
+
+#define TELEMETRY_VERSION 3
+#define TELEMETRY_NONE 0xFF              // Field not known, e.g. the valley state under block control
+#define TELEMETRY_MIN_PERIOD 20          // ms, 50 frames/s stay well within 115200 baud next to the text
+#define TELEMETRY_DEFAULT_PERIOD 0       // Off
+
+#define TELEMETRY_FLAG_LOOP 0x01         // Loop mode on
+#define TELEMETRY_FLAG_MAINTENANCE 0x02  // Console maintenance mode
+#define TELEMETRY_FLAG_BLOCKS 0x04       // Train nodes under block control
+
+#define TELEMETRY_LATENCY_EDGE 0x01      // latencyMicros starts at the sensor edge, else at the receive
+
+#define TELEMETRY_TASK_NAME_SIZE 12      // With the terminator, as TASK_MONITOR_NAME_SIZE
+
+// One status sample, sent as is (little endian) with a CRC-16 behind it.
+// Add fields at the end and bump TELEMETRY_VERSION.
+struct __attribute__((packed)) TelemetryFrame {
+    uint8_t version;
+    uint8_t flags;                       // TELEMETRY_FLAG_*
+    uint8_t state;                       // Valley state machine, names as in the crash trace
+    uint8_t trainState;                  // MOVING_FORWARD (0), MOVING_BACKWARD (1) or STOPPED (2)
+    uint8_t station;                     // Last station reached
+    uint8_t input;                       // Last button of the period, NO_INPUTS_RECEIVED if none
+    uint8_t profile;                     // Active operating profile, PROFILES_CUSTOM when tuned
+    uint8_t drivePercent;                // Motor drive applied now
+    uint16_t seq;                        // Counts frames, a gap is a lost one
+    uint16_t overdueForward;             // Stations the segment model flagged overdue
+    uint16_t overdueBackward;
+    uint16_t driftWarnings;
+    uint32_t millis;
+    uint32_t stationMillis;              // When the last station was reached
+    uint32_t loopPasses;
+    uint32_t loops;                      // Timetable runs completed
+    uint32_t passMaxMicros;              // Longest loop() pass of the period
+    uint32_t passAvgMicros;
+    uint64_t greenAspects;               // Bit (id - 1) set = semaphore GREEN
+    // Version 2: the last finished latency trace (lib/LATENCY_TRACE)
+    uint32_t latencyMicros;              // Sensor edge to motor outputs
+    uint16_t latencyTrace;               // Trace id, 0 = none yet; repeats until the next one
+    uint8_t latencyStation;
+    uint8_t latencyFlags;                // TELEMETRY_LATENCY_*
+    // Version 3: the task monitor (lib/TASK_MONITOR), one task per frame in turn
+    uint16_t idlePermille[2];            // Left to the idle task of each core, 0xFFFF unknown
+    uint8_t taskAlarms;                  // TASK_MONITOR_ALARM_* raised now
+    uint8_t taskCount;
+    uint8_t taskIndex;                   // Of the task below in the monitor's list
+    uint8_t taskCore;                    // TELEMETRY_NONE when not pinned
+    uint8_t taskPriority;
+    uint16_t taskCpuPermille;            // Of one core since the sample before, 0xFFFF unknown
+    uint16_t taskStackFree;              // Bytes never used
+    char taskName[TELEMETRY_TASK_NAME_SIZE];
+};
+
+#define TELEMETRY_PACKET_BYTES (sizeof(TelemetryFrame) + 2)     // Frame and CRC
+#define TELEMETRY_ENCODED_BYTES (TELEMETRY_PACKET_BYTES + 1)    // COBS adds one byte per 254
+
+// Binary status on Serial, for a host tool instead of text lines. Each frame
+// is COBS encoded, so it holds no zero byte, and ends with one: the reader
+// resynchronises at the next zero whatever came before, and the text the
+// firmware prints in between is told apart by the CRC. Encoding costs a
+// pass over 83 bytes, nothing is formatted.
+//
+// loop() keeps the fields of frame up to date; send() stamps version, seq,
+// millis and the pass times of the period.
+class Telemetry {
+public:
+    void begin(uint16_t periodMillis);
+    void setPeriod(uint16_t periodMillis);   // Any task; 0 stops, shorter than TELEMETRY_MIN_PERIOD is raised to it
+    uint16_t period() { return periodMillis.load(std::memory_order_relaxed); }
+    void pass();                         // End of each loop() pass, for the pass times
+    bool due();                          // Time for the next frame
+    void send();                         // Stamps, encodes and writes frame
+
+    static uint16_t crc16(const uint8_t *data, size_t length);                // CRC-16/CCITT-FALSE
+    static size_t encode(const uint8_t *data, size_t length, uint8_t *out);   // COBS, no delimiter
+    static size_t decode(const uint8_t *data, size_t length, uint8_t *out);   // 0 if not valid COBS
+
+    TelemetryFrame frame = {};
+    uint32_t frames = 0;                 // Sent this boot
+    uint32_t maxSendMicros = 0;
+
+private:
+    std::atomic<uint16_t> periodMillis{TELEMETRY_DEFAULT_PERIOD};
+    unsigned long lastSendMillis = 0;
+    uint32_t passStartMicros = 0;
+    uint32_t passMaxMicros = 0;
+    uint32_t passTotalMicros = 0;
+    uint32_t passCount = 0;
+};
+
+#endif // TELEMETRY_H
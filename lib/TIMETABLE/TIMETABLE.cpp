@@ -0,0 +1,159 @@
+#include "TIMETABLE.h"
+
+// A station number from 1 to LAST, or L for LAST
+static bool parseStation(const char *&p, uint8_t last, int &station) {
+    if (*p == 'L') {
+        p++;
+        station = last;
+        return true;
+    }
+    if (!isdigit((unsigned char)*p)) return false;
+    char *end;
+    long value = strtol(p, &end, 10);
+    p = end;
+    if (value < 1 || value > last) return false;
+    station = value;
+    return true;
+}
+
+const char *Timetable::compile(const char *spec) {
+    stepCount = 0;
+    stopSet = 0;
+    routeName[0] = 0;
+
+    const char *colon = strchr(spec, ':');
+    if (colon == nullptr) return "no \"name:\" in front of the stops";
+    size_t length = colon - spec;
+    if (length > TIMETABLE_NAME_SIZE - 1) length = TIMETABLE_NAME_SIZE - 1;
+    memcpy(routeName, spec, length);
+    routeName[length] = 0;
+
+    uint8_t last = layout.lastStation();
+    steps[stepCount++] = {ROUTE_DEPART, 0, 0};
+    int previous = 0;
+    const char *p = colon + 1;
+    while (true) {
+        while (*p == ' ') p++;
+        if (*p == 0) break;
+
+        if (!strncmp(p, "every ", 6)) {
+            char *end;
+            long seconds = strtol(p + 6, &end, 10);
+            if (end == p + 6 || seconds < 1 || seconds > 0xFFFF) return "\"every\" needs the seconds between departures";
+            steps[0].arg = seconds;
+            p = end;
+            continue;
+        }
+
+        int first, to;
+        if (!parseStation(p, last, first)) return "a station from 1 to LAST (or L) expected";
+        to = first;
+        if (*p == '-' && !parseStation(++p, last, to)) return "a station from 1 to LAST (or L) expected after -";
+        uint16_t dwell = 0;
+        if (*p == '/') {
+            char *end;
+            double seconds = strtod(p + 1, &end);
+            if (end == p + 1 || seconds < 0.001 || seconds > 65) return "a dwell from 0.001 to 65 s expected after /";
+            dwell = seconds * 1000 + 0.5;
+            p = end;
+        }
+        if (*p != ' ' && *p != 0) return "stops are separated by spaces";
+        if (first <= previous || to < first) return "stops must go up from START";
+
+        for (int station = first; station <= to; station++) {
+            steps[stepCount++] = {ROUTE_STOP, (uint8_t)station, dwell};
+            stopSet |= (StationSet)1 << station;
+        }
+        previous = to;
+    }
+    if (stepCount == 1) return "no stops";
+
+    // The train turns back at the last stop
+    uint8_t turn = stepCount - 1;
+    steps[turn].op = ROUTE_TURN;
+    steps[stepCount++] = {ROUTE_HOME, 0, 0};
+
+    // First stop past every station; at the turn and beyond it the turn itself
+    uint8_t step = 1;
+    for (int station = 0; station <= last; station++) {
+        while (step < turn && steps[step].station <= station) step++;
+        nextStep[station] = step;
+    }
+    return nullptr;
+}
+
+void Timetable::begin(const char *const *specs, uint8_t count, uint8_t route) {
+    routeIndex = route < count ? route : 0;
+    if (routeIndex != route) Serial.println("Timetable: no route " + String(route) + ", running route 0");
+
+    const char *error = compile(specs[routeIndex]);
+    if (error != nullptr) {
+        Serial.println("Timetable: route " + String(routeIndex) + " \"" + String(specs[routeIndex]) + "\": " + String(error) +
+                       ", stopping at all stations");
+        compile(TIMETABLE_FALLBACK);
+    }
+    printReport();
+}
+
+RouteStep Timetable::stopAt(uint8_t station) {
+    if (station == 0) return steps[stepCount - 1];
+    const RouteStep &turn = steps[stepCount - 2];
+    if (station > turn.station) return {ROUTE_TURN, station, turn.arg};
+
+    const RouteStep &planned = nextStop(station - 1);
+    if (planned.station == station) return planned;
+    // Stopped short of the planned stop, the train goes on from here
+    return {ROUTE_STOP, station, 0};
+}
+
+bool Timetable::departureDue(unsigned long now) {
+    if (steps[0].arg == 0 || !scheduled) return true;
+    return (long)(now - nextDepartureMillis) >= 0;
+}
+
+void Timetable::departed(unsigned long now) {
+    unsigned long headway = steps[0].arg * 1000UL;
+    if (headway > 0) {
+        if (!scheduled) {
+            scheduled = true;
+            nextDepartureMillis = now;
+        }
+        // Slots the loop before ran past are dropped, the schedule does not slip
+        while ((long)(now - nextDepartureMillis) >= (long)headway) {
+            nextDepartureMillis += headway;
+            missedSlots++;
+        }
+        nextDepartureMillis += headway;
+    }
+    if (departures == 0) firstDepartureMillis = now;
+    lastDepartureMillis = now;
+    departures++;
+    inLoop = true;
+}
+
+void Timetable::loopDone(unsigned long now) {
+    if (!inLoop) return;
+    inLoop = false;
+    loops++;
+    loopMillisSum += now - lastDepartureMillis;
+    if (loops % TIMETABLE_REPORT_LOOPS == 0) printReport();
+}
+
+void Timetable::printReport() {
+    String stops;
+    for (uint8_t i = 1; i < stepCount - 1; i++) {
+        stops += " " + String(steps[i].station);
+        if (steps[i].arg) stops += "/" + String(steps[i].arg / 1000.0f, 1);
+    }
+    Serial.print("Timetable: route " + String(routeIndex) + " " + String(routeName) + ", stops" + stops);
+    if (steps[0].arg) Serial.print(", departs every " + String(steps[0].arg) + " s");
+    Serial.println(steps[stepCount - 2].station < layout.lastStation() ? ", short turn" : "");
+
+    if (loops == 0) return;
+    Serial.print("Timetable: " + String(loops) + " loops, " + String(loopMillisSum / loops / 1000.0f, 1) + " s each");
+    if (departures > 1) {
+        float hours = (lastDepartureMillis - firstDepartureMillis) / 3600000.0f;
+        Serial.print(", " + String((departures - 1) / hours, 1) + " loops/h");
+    }
+    Serial.println(", " + String(missedSlots) + " departure slots missed");
+}
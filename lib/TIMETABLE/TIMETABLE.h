@@ -0,0 +1,78 @@
+#ifndef TIMETABLE_H
+#define TIMETABLE_H
+
+#include <Arduino.h>
+#include "LAYOUT.h"
+
+#define TIMETABLE_MAX_STEPS (LAYOUT_MAX_STATIONS + 1)  // Departure, a stop per station beyond START, the run home
+#define TIMETABLE_NAME_SIZE 16
+#define TIMETABLE_REPORT_LOOPS 10                      // Loops between reports
+#define TIMETABLE_FALLBACK "all: 1-L"                  // Runs when the chosen route does not compile
+
+enum RouteOp : uint8_t {
+    ROUTE_DEPART,            // Leave START; arg = seconds between scheduled departures, 0 = when the dwell is over
+    ROUTE_STOP,              // Run forward to station, stop, show GREEN, wait arg ms (0 = the dwell setting)
+    ROUTE_TURN,              // Run forward to station, stop, wait arg ms, then back to START without stops
+    ROUTE_HOME,              // Back at START, the loop is over
+};
+
+struct RouteStep {
+    uint8_t op;              // RouteOp
+    uint8_t station;
+    uint16_t arg;
+};
+
+// One route of the timetable, compiled from a line of text into steps the
+// train state machine executes:
+//
+//   name: STOPS [every SECONDS]
+//
+// STOPS are station numbers or ranges going up from START, L stands for
+// LAST. A stop may carry its own dwell as /SECONDS ("3/5", "1-4/2.5",
+// "L/3"). Stations left out are passed at speed, an express run; the train
+// turns back at the last stop, short of LAST for a short turn. "every 90"
+// departs from START on a 90 s schedule instead of as soon as the dwell is
+// over. Examples: "all: 1-L", "express: 3 6 L every 60", "short: 1-4/3".
+//
+// The state machine only asks for the step after the station it was last
+// at, a table lookup; it keeps no position in the route of its own, so a
+// resume after a reset needs nothing but the station.
+class Timetable {
+public:
+    const char *compile(const char *spec);                  // nullptr when done, else what is wrong; needs the layout
+    void begin(const char *const *specs, uint8_t count, uint8_t route);  // Compile the chosen route, all stations if it fails
+    const RouteStep &nextStop(uint8_t from) { return steps[nextStep[from]]; }  // First stop past a station going forward
+    bool stopsAt(uint8_t from, uint8_t station) { return station >= nextStop(from).station; }  // Reached or passed the next stop
+    RouteStep stopAt(uint8_t station);                      // The step of a stop there, planned or after its trigger was lost
+    uint16_t dwellMillis(const RouteStep &step, uint16_t fallback) { return step.arg ? step.arg : fallback; }
+    StationSet stops() { return stopSet; }                  // Stations the train stops at going forward
+    uint8_t route() { return routeIndex; }
+    uint32_t loopCount() { return loops; }                  // This boot
+    const char *name() { return routeName; }
+
+    bool departureDue(unsigned long now);                   // The next scheduled departure has come
+    void departed(unsigned long now);                       // Left START, the loop is timed from here
+    void loopDone(unsigned long now);                       // Stopped at START again
+    void printReport();
+
+private:
+    RouteStep steps[TIMETABLE_MAX_STEPS];
+    uint8_t stepCount = 0;
+    uint8_t nextStep[LAYOUT_MAX_STATIONS];   // Per station, the index of the first stop beyond it
+    StationSet stopSet = 0;
+    uint8_t routeIndex = 0;
+    char routeName[TIMETABLE_NAME_SIZE] = "";
+
+    // Departures and loops of this boot
+    bool scheduled = false;                  // A departure slot is set
+    unsigned long nextDepartureMillis = 0;
+    unsigned long firstDepartureMillis = 0;
+    unsigned long lastDepartureMillis = 0;
+    uint32_t departures = 0;
+    uint32_t missedSlots = 0;                // Departure slots gone by while the loop before still ran
+    bool inLoop = false;                     // Departed from START and not back yet
+    uint32_t loops = 0;
+    uint32_t loopMillisSum = 0;
+};
+
+#endif // TIMETABLE_H
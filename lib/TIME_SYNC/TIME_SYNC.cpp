@@ -0,0 +1,125 @@
+#include "TIME_SYNC.h"
+#include "STATION_PROTOCOL.h"
+#include <math.h>
+
+#define TIME_SYNC_MAX_DELAY 100000  // Round trips above 100 ms are dropped as stale
+
+TimeSyncClient::TimeSyncClient() {
+    reset();
+}
+
+void TimeSyncClient::reset() {
+    head = 0;
+    count = 0;
+    refLocal = 0;
+    refOffset = 0;
+    hasBase = false;
+    baseLocal = 0;
+    baseOffset = 0;
+    drift = 0.0f;
+    error = 0;
+}
+
+void TimeSyncClient::addSample(uint32_t t1, uint32_t t2, uint32_t t3, uint32_t t4) {
+    // All differences are taken on the same clock, so micros() wrap-around cancels out
+    uint32_t delay = (t4 - t1) - (t3 - t2);
+    if (delay > TIME_SYNC_MAX_DELAY) return;
+
+    TimeSyncSample &sample = samples[head];
+    sample.localMicros = t1 + (t4 - t1) / 2;
+    sample.offset = (int32_t)((t2 - t1) - delay / 2);  // == ((t2 - t1) + (t3 - t4)) / 2 without overflow
+    sample.delay = delay;
+
+    head = (head + 1) % TIME_SYNC_SAMPLES;
+    if (count < TIME_SYNC_SAMPLES) count++;
+
+    estimate();
+}
+
+void TimeSyncClient::estimate() {
+    // The exchange with the shortest round trip has the least queueing, so it anchors the model
+    int best = 0;
+    for (int i = 1; i < count; i++) {
+        if (samples[i].delay < samples[best].delay) best = i;
+    }
+    const TimeSyncSample &anchor = samples[best];
+
+    // Offset at the anchor: mean of the trusted samples, each moved to the anchor time with the current drift
+    double sumY = 0;
+    int trusted = 0;
+    for (int i = 0; i < count; i++) {
+        if (samples[i].delay > anchor.delay + TIME_SYNC_DELAY_MARGIN) continue;
+        int32_t x = (int32_t)(samples[i].localMicros - anchor.localMicros);
+        int32_t y = (int32_t)((uint32_t)samples[i].offset - (uint32_t)anchor.offset);
+        sumY += y - (double)drift * x;
+        trusted++;
+    }
+    refLocal = anchor.localMicros;
+    refOffset = (int32_t)((uint32_t)anchor.offset + (uint32_t)(int32_t)lround(sumY / trusted));
+
+    // Drift from a long baseline: a few samples only seconds apart are too noisy to give ppm
+    if (!hasBase) {
+        baseLocal = refLocal;
+        baseOffset = refOffset;
+        hasBase = true;
+    } else {
+        int32_t span = (int32_t)(refLocal - baseLocal);
+        if (span >= TIME_SYNC_MIN_DRIFT_SPAN) {
+            double slope = (double)(int32_t)((uint32_t)refOffset - (uint32_t)baseOffset) / span;
+            if (fabs(slope) * 1e6 <= TIME_SYNC_MAX_DRIFT_PPM) {
+                drift = (float)slope;
+            }
+        }
+        // Keep the baseline inside the int32 range of micros() differences by sliding it
+        // forward to a point on the current model
+        if (span > TIME_SYNC_MAX_BASELINE) {
+            int32_t move = span / 2;
+            baseLocal += move;
+            baseOffset = (int32_t)((uint32_t)baseOffset + (uint32_t)(int32_t)lround((double)drift * move));
+        }
+    }
+
+    // Error estimate: spread of the trusted samples around the model, or half the
+    // round trip (the asymmetry bound) while there is nothing to compare against
+    if (trusted < 2) {
+        error = anchor.delay / 2;
+        return;
+    }
+    double sumSquares = 0;
+    for (int i = 0; i < count; i++) {
+        if (samples[i].delay > anchor.delay + TIME_SYNC_DELAY_MARGIN) continue;
+        int32_t x = (int32_t)(samples[i].localMicros - refLocal);
+        int32_t y = (int32_t)((uint32_t)samples[i].offset - (uint32_t)refOffset);
+        double residual = y - (double)drift * x;
+        sumSquares += residual * residual;
+    }
+    error = (uint32_t)ceil(sqrt(sumSquares / trusted));
+    if (error < 1) error = 1;
+}
+
+bool TimeSyncClient::isSynced() {
+    return count >= 3;
+}
+
+uint32_t TimeSyncClient::toController(uint32_t localMicros) {
+    int32_t elapsed = (int32_t)(localMicros - refLocal);
+    int32_t correction = (int32_t)lround(drift * (double)elapsed);
+    return localMicros + (uint32_t)refOffset + (uint32_t)correction;
+}
+
+uint16_t TimeSyncClient::errorMicros() {
+    if (!isSynced()) return STATION_SYNC_ERROR_UNKNOWN;
+    return error >= STATION_SYNC_ERROR_UNKNOWN ? STATION_SYNC_ERROR_UNKNOWN - 1 : (uint16_t)error;
+}
+
+int32_t TimeSyncClient::offsetMicros() {
+    return refOffset;
+}
+
+float TimeSyncClient::driftPpm() {
+    return drift * 1e6f;
+}
+
+uint32_t TimeSyncClient::syncInterval() {
+    return count < TIME_SYNC_SAMPLES / 2 ? TIME_SYNC_FAST_INTERVAL : TIME_SYNC_INTERVAL;
+}
@@ -0,0 +1,49 @@
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include <stdint.h>
+
+#define TIME_SYNC_SAMPLES 8              // Exchanges kept for filtering and drift estimation
+#define TIME_SYNC_DELAY_MARGIN 150       // Samples within this many us of the best round trip are trusted
+#define TIME_SYNC_MIN_DRIFT_SPAN 10000000 // Need 10 s of baseline before estimating drift
+#define TIME_SYNC_MAX_BASELINE 600000000 // Slide the drift baseline after 10 minutes
+#define TIME_SYNC_MAX_DRIFT_PPM 200.0f   // Crystal drift beyond this is treated as a bad estimate
+
+#define TIME_SYNC_FAST_INTERVAL 200      // ms between exchanges until the first samples are in
+#define TIME_SYNC_INTERVAL 2000          // ms between exchanges once synced
+
+struct TimeSyncSample {
+    uint32_t localMicros;   // Station clock in the middle of the exchange
+    int32_t offset;         // Controller clock - station clock
+    uint32_t delay;         // Round trip without the controller turnaround
+};
+
+// Station side estimate of the controller clock from NTP style exchanges.
+// Pure arithmetic on micros() values so it runs unchanged on the host.
+class TimeSyncClient {
+public:
+    TimeSyncClient();
+    void reset();
+    void addSample(uint32_t t1, uint32_t t2, uint32_t t3, uint32_t t4);
+    bool isSynced();
+    uint32_t toController(uint32_t localMicros);  // Convert a station timestamp to controller time
+    uint16_t errorMicros();                       // Estimated error bound of toController()
+    int32_t offsetMicros();
+    float driftPpm();
+    uint32_t syncInterval();                      // ms until the next exchange should be sent
+
+private:
+    void estimate();
+    TimeSyncSample samples[TIME_SYNC_SAMPLES];
+    uint8_t head = 0;
+    uint8_t count = 0;
+    uint32_t refLocal = 0;   // Model: offset(t) = refOffset + drift * (t - refLocal)
+    int32_t refOffset = 0;
+    bool hasBase = false;    // Drift baseline: an older point of the model
+    uint32_t baseLocal = 0;
+    int32_t baseOffset = 0;
+    float drift = 0.0f;      // Controller us per station us, minus one
+    uint32_t error = 0;
+};
+
+#endif // TIME_SYNC_H
@@ -6,25 +6,168 @@ Train::Train() {
 
 void Train::initTrain() {
     Serial.println("Initializing train");
-    pinMode(FORWARD_PIN, OUTPUT);
-    pinMode(BACKWARD_PIN, OUTPUT);
-    stop(); // Ensure the train is stopped at startup
+    ledcSetup(TRAIN_FORWARD_CHANNEL, TRAIN_PWM_FREQ, TRAIN_PWM_BITS);
+    ledcSetup(TRAIN_BACKWARD_CHANNEL, TRAIN_PWM_FREQ, TRAIN_PWM_BITS);
+
+    // Ensure the train is stopped at startup, without a ramp. The duty is set
+    // before the pins are attached, zero duty would drive both inputs.
+    ledcWrite(TRAIN_FORWARD_CHANNEL, TRAIN_PWM_FULL);
+    ledcWrite(TRAIN_BACKWARD_CHANNEL, TRAIN_PWM_FULL);
+    ledcAttachPin(FORWARD_PIN, TRAIN_FORWARD_CHANNEL);
+    ledcAttachPin(BACKWARD_PIN, TRAIN_BACKWARD_CHANNEL);
+    crashTrace.record(TRACE_MOTOR, TRACE_MOTOR_STOP);
+    Serial.println("Train stopped");
+
+    // Only the timer writes the outputs after this, so a busy loop() cannot
+    // make the ramps uneven and the two pins are never written out of order
+    if (rampTimer == nullptr) {
+        esp_timer_create_args_t args = {};
+        args.callback = onRampTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "train_ramp";
+        esp_timer_create(&args, &rampTimer);
+        esp_timer_start_periodic(rampTimer, TRAIN_RAMP_PERIOD);
+    }
 }
 
 void Train::moveForward() {
-    digitalWrite(FORWARD_PIN, LOW);
-    digitalWrite(BACKWARD_PIN, HIGH);
+    crashTrace.record(TRACE_MOTOR, TRACE_MOTOR_FORWARD);
+    setTarget(1);
     Serial.println("Train moving forward");
 }
 
 void Train::moveBackward() {
-    digitalWrite(FORWARD_PIN, HIGH);
-    digitalWrite(BACKWARD_PIN, LOW);
+    crashTrace.record(TRACE_MOTOR, TRACE_MOTOR_BACKWARD);
+    setTarget(-1);
     Serial.println("Train moving backward");
 }
 
 void Train::stop() {
-    digitalWrite(FORWARD_PIN, HIGH);
-    digitalWrite(BACKWARD_PIN, HIGH);
+    crashTrace.record(TRACE_MOTOR, TRACE_MOTOR_STOP);
+    portENTER_CRITICAL(&lock);
+    stopPending = true;
+    portEXIT_CRITICAL(&lock);
+    setTarget(0);
     Serial.println("Train stopped");
 }
+
+bool Train::stopApplied(uint32_t &micros) {
+    portENTER_CRITICAL(&lock);
+    bool applied = !stopPending;
+    micros = stopAppliedMicros;
+    portEXIT_CRITICAL(&lock);
+    return applied;
+}
+
+void Train::setCreep(bool creeping) {
+    portENTER_CRITICAL(&lock);
+    creep = creeping;
+    portEXIT_CRITICAL(&lock);
+}
+
+void Train::setSpeeds(uint8_t forwardPercent, uint8_t backwardPercent) {
+    portENTER_CRITICAL(&lock);
+    forwardDrive = (uint32_t)TRAIN_PWM_FULL * constrain(forwardPercent, 0, 100) / 100;
+    backwardDrive = (uint32_t)TRAIN_PWM_FULL * constrain(backwardPercent, 0, 100) / 100;
+    portEXIT_CRITICAL(&lock);
+}
+
+void Train::setCreepSpeed(uint8_t percent) {
+    portENTER_CRITICAL(&lock);
+    creepDrive = (uint32_t)TRAIN_PWM_FULL * constrain(percent, 0, 100) / 100;
+    portEXIT_CRITICAL(&lock);
+}
+
+void Train::setRamps(uint16_t accelMillis, uint16_t decelMillis) {
+    portENTER_CRITICAL(&lock);
+    accelMicros = accelMillis * 1000UL;
+    decelMicros = decelMillis * 1000UL;
+    portEXIT_CRITICAL(&lock);
+}
+
+void Train::emergencyStop() {
+    portENTER_CRITICAL(&lock);
+    targetDirection = 0;
+    creep = false;
+    direction = 0;
+    drive = 0;
+    portEXIT_CRITICAL(&lock);
+
+    ledcWrite(TRAIN_FORWARD_CHANNEL, TRAIN_PWM_FULL);
+    ledcWrite(TRAIN_BACKWARD_CHANNEL, TRAIN_PWM_FULL);
+    crashTrace.record(TRACE_MOTOR, TRACE_MOTOR_STOP);
+}
+
+float Train::driveFraction() {
+    portENTER_CRITICAL(&lock);
+    uint32_t now = drive;
+    portEXIT_CRITICAL(&lock);
+    return (float)now / TRAIN_PWM_FULL;
+}
+
+void Train::setTarget(int8_t target) {
+    portENTER_CRITICAL(&lock);
+    targetDirection = target;
+    if (target != 0) creep = false;
+    portEXIT_CRITICAL(&lock);
+}
+
+void Train::onRampTimer(void *arg) {
+    Train *train = (Train *)arg;
+
+    // ledcWrite() takes a mutex, so the outputs are written outside the critical section
+    portENTER_CRITICAL(&train->lock);
+    bool changed = train->step();
+    int8_t direction = train->direction;
+    uint32_t drive = train->drive;
+    bool stopping = train->stopPending && train->targetDirection == 0;
+    portEXIT_CRITICAL(&train->lock);
+
+    if (changed) {
+        // Full duty keeps an active LOW input off
+        ledcWrite(TRAIN_FORWARD_CHANNEL, direction > 0 ? TRAIN_PWM_FULL - drive : TRAIN_PWM_FULL);
+        ledcWrite(TRAIN_BACKWARD_CHANNEL, direction < 0 ? TRAIN_PWM_FULL - drive : TRAIN_PWM_FULL);
+    }
+
+    // The first step after stop() starts the ramp down, or finds the motor off
+    if (stopping && (changed || drive == 0)) {
+        uint32_t now = micros();
+        portENTER_CRITICAL(&train->lock);
+        if (train->stopPending && train->targetDirection == 0) {
+            train->stopPending = false;
+            train->stopAppliedMicros = now;
+        }
+        portEXIT_CRITICAL(&train->lock);
+    }
+}
+
+// Called with the lock held. Moves the drive towards the target by the time
+// since the last step, so the ramp length does not depend on the step rate.
+bool Train::step() {
+    int64_t now = esp_timer_get_time();
+    uint32_t elapsed = (uint32_t)(now - lastStepMicros);
+    lastStepMicros = now;
+    if (elapsed > TRAIN_RAMP_PERIOD * 4) elapsed = TRAIN_RAMP_PERIOD;  // The timer task was held up
+
+    // Reversing first ramps down in the old direction
+    uint32_t goal = 0;
+    if (targetDirection != 0 && (direction == targetDirection || drive == 0)) {
+        direction = targetDirection;
+        goal = targetDirection > 0 ? forwardDrive : backwardDrive;
+        if (creep && creepDrive < goal) goal = creepDrive;
+    }
+
+    uint32_t before = drive;
+    if (drive < goal) {
+        uint32_t delta = accelMicros ? (uint32_t)((uint64_t)TRAIN_PWM_FULL * elapsed / accelMicros) : goal;
+        if (delta == 0) delta = 1;
+        drive = goal - drive > delta ? drive + delta : goal;
+    } else if (drive > goal) {
+        uint32_t delta = decelMicros ? (uint32_t)((uint64_t)TRAIN_PWM_FULL * elapsed / decelMicros) : drive;
+        if (delta == 0) delta = 1;
+        drive = drive - goal > delta ? drive - delta : goal;
+    }
+    if (drive == 0 && targetDirection == 0) direction = 0;
+    return drive != before;
+}
@@ -2,18 +2,58 @@
 #define TRAIN_H
 
 #include <Arduino.h>
+#include <esp_timer.h>
+#include "CRASH_TRACE.h"
 
 // Define the pins for controlling the train
 const uint8_t FORWARD_PIN = 21;
 const uint8_t BACKWARD_PIN = 22;
 
+// Both motor inputs are active LOW: the driven pin gets a PWM whose LOW time
+// is the drive, the other one stays HIGH
+#define TRAIN_FORWARD_CHANNEL 0
+#define TRAIN_BACKWARD_CHANNEL 1
+#define TRAIN_PWM_FREQ 20000          // Hz, above hearing
+#define TRAIN_PWM_BITS 10
+#define TRAIN_PWM_FULL (1 << TRAIN_PWM_BITS)
+#define TRAIN_RAMP_PERIOD 1000        // us between ramp steps, also the longest wait for a stop to start
+
 class Train {
 public:
     Train();               // Constructor
     void initTrain();      // Initialize the train
-    void moveForward();    // Move the train forward
-    void moveBackward();   // Move the train backward
-    void stop();           // Stop the train
+    void moveForward();    // Ramp up to the forward speed
+    void moveBackward();   // Ramp up to the backward speed (ramps down first when going forward)
+    void stop();           // Ramp down to standstill
+    bool stopApplied(uint32_t &micros);  // true once the ramp timer acted on the last stop(), with when
+    void setCreep(bool creeping);  // Ramp down to the creep speed ahead of a stop; moving again clears it
+    void setSpeeds(uint8_t forwardPercent, uint8_t backwardPercent);
+    void setCreepSpeed(uint8_t percent);
+    void setRamps(uint16_t accelMillis, uint16_t decelMillis);  // 0 switches at once
+    void emergencyStop();  // Motor off now, no ramp; from the esp_timer task, like the ramps
+    float driveFraction(); // Drive applied now, 0..1 of full in either direction
+
+private:
+    void setTarget(int8_t direction);
+    bool step();                      // true when the drive changed
+    static void onRampTimer(void *arg);
+
+    // Shared with the timer task
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    int8_t targetDirection = 0;       // 1 forward, -1 backward, 0 stop
+    bool creep = false;
+    int8_t direction = 0;             // Direction being driven now
+    uint32_t drive = 0;               // Current duty of the driven pin, 0..TRAIN_PWM_FULL
+    int64_t lastStepMicros = 0;
+    bool stopPending = false;         // stop() not acted on by the timer yet
+    uint32_t stopAppliedMicros = 0;   // When it was: outputs written, or already off
+
+    uint32_t forwardDrive = TRAIN_PWM_FULL;  // Full speed and no ramps until setSpeeds() / setRamps()
+    uint32_t backwardDrive = TRAIN_PWM_FULL;
+    uint32_t creepDrive = TRAIN_PWM_FULL;
+    uint32_t accelMicros = 0;
+    uint32_t decelMicros = 0;
+    esp_timer_handle_t rampTimer = nullptr;
 };
 
 #endif // TRAIN_H
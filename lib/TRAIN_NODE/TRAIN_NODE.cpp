@@ -0,0 +1,117 @@
+#include "TRAIN_NODE.h"
+#include <WiFi.h>
+#include <esp_now.h>
+
+// esp_now callbacks are plain functions, so route them to the (single) node
+static TrainNode *activeNode = nullptr;
+
+TrainNode::TrainNode(uint8_t trainId) {
+    id = trainId;
+    memset(controllerMacs, 0, sizeof(controllerMacs));
+}
+
+bool TrainNode::begin(const uint8_t macs[][6], uint8_t controllers) {
+    train.initTrain();
+    train.setRamps(TRAIN_NODE_ACCEL, TRAIN_NODE_DECEL);
+    controllerCount = min(controllers, (uint8_t)TRAIN_NODE_MAX_CONTROLLERS);
+    memcpy(controllerMacs, macs, controllerCount * 6);
+
+    WiFi.mode(WIFI_STA);
+    WiFi.disconnect();
+
+    if (esp_now_init() != ESP_OK) {
+        Serial.println("Error initializing ESP-NOW");
+        return false;
+    }
+
+    for (uint8_t c = 0; c < controllerCount; c++) {
+        esp_now_peer_info_t peer = {};
+        memcpy(peer.peer_addr, controllerMacs[c], 6);
+        peer.channel = 0;
+        peer.encrypt = false;
+        if (esp_now_add_peer(&peer) != ESP_OK) {
+            Serial.println("Error adding controller peer");
+            return false;
+        }
+    }
+
+    activeNode = this;
+    esp_now_register_recv_cb(onReceive);
+    return true;
+}
+
+void TrainNode::onReceive(const uint8_t *mac, const uint8_t *data, int len) {
+    uint32_t receivedMicros = micros();
+
+    if (activeNode != nullptr) {
+        activeNode->handleReceive(mac, data, len, receivedMicros);
+    }
+}
+
+void TrainNode::handleReceive(const uint8_t *mac, const uint8_t *data, int len, uint32_t receivedMicros) {
+    (void)receivedMicros;
+    if (len < (int)sizeof(TrainCommand) || data[0] != STATION_MSG_TRAIN_CMD) return;
+    int from = -1;
+    for (uint8_t c = 0; c < controllerCount; c++) {
+        if (memcmp(mac, controllerMacs[c], 6) == 0) from = c;
+    }
+    if (from < 0) return;
+
+    TrainCommand packet;
+    memcpy(&packet, data, sizeof(packet));
+    if (packet.train != id) return;
+
+    // A repeat only keeps the train going. The seq starts over when the
+    // controller reboots and every controller counts its own, so a different
+    // command or sender counts whatever its seq.
+    if (packet.seq != appliedSeq || packet.command != command || from != commander || timedOut) {
+        appliedSeq = packet.seq;
+        timedOut = false;
+        apply(packet.command, packet.speed);
+    }
+
+    portENTER_CRITICAL(&lock);
+    commander = from;
+    lastCommandMillis = millis();
+    ackSeq = packet.seq;
+    ackPending = true;
+    portEXIT_CRITICAL(&lock);
+}
+
+void TrainNode::apply(uint8_t wanted, uint8_t speed) {
+    command = wanted;
+    if (wanted == TRAIN_CMD_FORWARD) {
+        train.setSpeeds(speed, speed);
+        train.moveForward();
+    } else if (wanted == TRAIN_CMD_BACKWARD) {
+        train.setSpeeds(speed, speed);
+        train.moveBackward();
+    } else {
+        train.stop();
+    }
+}
+
+void TrainNode::loop() {
+    portENTER_CRITICAL(&lock);
+    unsigned long silentMillis = millis() - lastCommandMillis;
+    portEXIT_CRITICAL(&lock);
+    if (command != TRAIN_CMD_STOP && !timedOut && silentMillis > TRAIN_NODE_TIMEOUT) {
+        Serial.println("Train " + String(id) + ": controller silent, stopping");
+        train.stop();
+        command = TRAIN_CMD_STOP;
+        timedOut = true;
+    }
+
+    // Sent from here, not from the receive callback, like the semaphore acks
+    if (!ackPending) return;
+
+    TrainAck ack;
+    ack.type = STATION_MSG_TRAIN_ACK;
+    ack.train = id;
+    portENTER_CRITICAL(&lock);
+    ack.seq = ackSeq;
+    uint8_t to = commander;
+    ackPending = false;
+    portEXIT_CRITICAL(&lock);
+    esp_now_send(controllerMacs[to], (const uint8_t *)&ack, sizeof(ack));
+}
@@ -0,0 +1,48 @@
+#ifndef TRAIN_NODE_H
+#define TRAIN_NODE_H
+
+#include <Arduino.h>
+#include "STATION_PROTOCOL.h"
+#include "TRAIN.h"
+
+#define TRAIN_NODE_ACCEL 400       // ms from standstill to full drive, as the controller's default
+#define TRAIN_NODE_DECEL 150
+#define TRAIN_NODE_MAX_CONTROLLERS 8   // One per section of a loop (LAYOUT_MAX_SECTIONS)
+
+// Board on a train of a multi-train layout (lib/BLOCK_CONTROL). It drives the
+// train's own motor on the same pins and ramps as the controller does for a
+// single train, and applies each command in the ESP-NOW receive callback, so
+// a stop costs one radio hop. Silence from the controller for
+// TRAIN_NODE_TIMEOUT stops the train.
+//
+// On a loop run by several controllers (lib/SECTION_LINK) the train takes
+// commands from any of them: the section it is in drives it, and the handoff
+// makes sure only one does at a time. Acks go to the sender of the command.
+class TrainNode {
+public:
+    explicit TrainNode(uint8_t id);
+    bool begin(const uint8_t controllerMacs[][6], uint8_t controllers = 1);  // Starts the motor (stopped) and ESP-NOW
+    void loop();                               // Controller timeout and the pending ack
+    void handleReceive(const uint8_t *mac, const uint8_t *data, int len, uint32_t receivedMicros);
+
+private:
+    static void onReceive(const uint8_t *mac, const uint8_t *data, int len);
+    void apply(uint8_t command, uint8_t speed);
+
+    uint8_t id;
+    uint8_t controllerMacs[TRAIN_NODE_MAX_CONTROLLERS][6];
+    uint8_t controllerCount = 0;
+    uint8_t commander = 0;               // Controller of the last command, the acks go there
+    Train train;
+    uint8_t command = TRAIN_CMD_STOP;
+    uint32_t appliedSeq = 0;
+    volatile bool timedOut = false;      // Set after the stop, so a command racing it is applied again
+
+    // Shared with the receive callback
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    unsigned long lastCommandMillis = 0;
+    volatile bool ackPending = false;
+    uint32_t ackSeq = 0;
+};
+
+#endif // TRAIN_NODE_H
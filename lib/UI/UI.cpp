@@ -1,31 +1,34 @@
 #include "UI.h"
-
-extern volatile bool stationTriggered[NUM_STATIONS];
+#include "BOOT_PROFILE.h"
+#include "SPAN_PROFILE.h"
+#include "MOTOR_CURRENT.h"
 
 //const int stationPins[] = {36, 39, 34, 35, 33, 16, 17, 23};
-const int stationPins[] = {36, 34, 35, 33, 16, 17, 23, 39};
+// Wired station inputs; only START (the first) is still read. 34 is the
+// DFPlayer's RX and 35 the motor current ADC, both left out
+constexpr int stationPins[] = {36, 33, 16, 17, 23, 39};
+constexpr int stationPinCount = sizeof(stationPins) / sizeof(stationPins[0]);
+
+// pinMode() on a pin another driver owns takes it back from that driver
+constexpr bool stationPinsAvoid(int pin, int i = 0) {
+    return i == stationPinCount || (stationPins[i] != pin && stationPinsAvoid(pin, i + 1));
+}
+static_assert(stationPinsAvoid(DFPLAYER_RX_PIN) && stationPinsAvoid(DFPLAYER_TX_PIN), "station input on a DFPlayer pin");
+static_assert(stationPinsAvoid(CURRENT_ADC_PIN), "station input on the motor current ADC pin");
+static_assert(CURRENT_ADC_PIN != DFPLAYER_RX_PIN && CURRENT_ADC_PIN != DFPLAYER_TX_PIN, "motor current ADC on a DFPlayer pin");
+static_assert(CURRENT_ADC_PIN != IO_IN, "motor current ADC on the button MUX input");
+
+SPAN_ZONE(sampleStationsSpan, "sampleStations");
+SPAN_ZONE(inputReceivedSpan, "inputReceived");
+SPAN_ZONE(ledsSpan, "FastLED.show");
+SPAN_ZONE(dfPlayerSpan, "executeCMD");
 
 UI::UI() {
 
 }
 
 void UI::setupPinsAndSensors() {
-    FastLED.addLeds<WS2812B, DATA_PIN, GRB>(leds, NUM_LEDS);
-    FastLED.show();
-
-    //show leds for testing
-    for (int i = 0; i < NUM_LEDS; i++) {
-        leds[i] = CRGB::Red;
-        FastLED.show();
-        delay(100);
-        leds[i] = CRGB::Black;
-        FastLED.show();
-    }
-
-    leds[NUM_LEDS - 1] = CRGB(0, 0, 200);
-    FastLED.show();
-
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < stationPinCount; i++) {
         pinMode(stationPins[i], INPUT_PULLUP);
     }
 
@@ -35,15 +38,60 @@ void UI::setupPinsAndSensors() {
     pinMode(SEL3_IN, OUTPUT);
     pinMode(IO_IN, INPUT_PULLUP);
 
-    Serial2.begin(9600, SERIAL_8N1, 34, 12);
-    delay(100);
-    executeCMD(0x06, 0, 20);
-    delay(100);
-    Serial.println("Volume set to: " + String(20));
-    
+    // The DFPlayer and the LED test take their time in update()
+    Serial2.begin(9600, SERIAL_8N1, DFPLAYER_RX_PIN, DFPLAYER_TX_PIN);
+    dfPlayerState = DFPLAYER_STARTING;
+    dfPlayerMillis = millis();
+
+    FastLED.addLeds<WS2812B, DATA_PIN, GRB>(leds, NUM_LEDS);
+    ledTestStep = 0;
+    ledTestMillis = millis();
+    leds[0] = CRGB::Red;
+    showLeds();
+}
+
+void UI::update() {
+    // Power-on self-test: each LED red for LED_TEST_STEP, then the real state
+    if (ledTestStep < NUM_LEDS && millis() - ledTestMillis >= LED_TEST_STEP) {
+        leds[ledTestStep] = CRGB::Black;
+        ledTestStep++;
+        ledTestMillis = millis();
+        if (ledTestStep < NUM_LEDS) {
+            leds[ledTestStep] = CRGB::Red;
+            showLeds();
+        } else {
+            restoreLeds();
+            bootProfile.backgroundDone("LED self-test");
+        }
+    }
+
+    if (dfPlayerState == DFPLAYER_STARTING && millis() - dfPlayerMillis >= DFPLAYER_STARTUP) {
+        dfPlayerState = DFPLAYER_SETTLING;
+        dfPlayerMillis = millis();
+        setVolume(currentVolume);
+    } else if (dfPlayerState == DFPLAYER_SETTLING && millis() - dfPlayerMillis >= DFPLAYER_SETTLE) {
+        dfPlayerState = DFPLAYER_READY;
+        bootProfile.backgroundDone("DFPlayer");
+        if (playPending) {
+            playPending = false;
+            playSound();
+        }
+    }
+}
+
+void UI::restoreLeds() {
+    leds[0] = loopLedOn ? CRGB(0, 200, 0) : CRGB::Black;
+    leds[1] = currentVolume == 0 ? CRGB(0, 0, 0) : CRGB(0, 0, 200);
+    showLeds();
+}
+
+void UI::showLeds() {
+    SPAN(ledsSpan);
+    FastLED.show();
 }
 
 STATION_STATE UI::sampleStations() {
+    SPAN(sampleStationsSpan);
     const unsigned long debounceDelay = 30; // Debounce delay in milliseconds
 
     // 1) LOCAL: Station 0 (STATION_START) is still wired directly to this board
@@ -64,20 +112,18 @@ STATION_STATE UI::sampleStations() {
         stationDebounceTimes[0] = millis();
     }
 
-    // 2) REMOTE: Stations 1..7 come via ESP-NOW (stationTriggered[])
-    for (int i = 1; i < NUM_STATIONS; i++) {
-        if (stationTriggered[i]) {
-            stationTriggered[i] = false; // consume the event
-
-            Serial.println("Station " + String(i) + " is LOW (remote)");
-            return static_cast<STATION_STATE>(i); // STATION_1..STATION_LAST
-        }
+    // 2) REMOTE: Stations 1..LAST come via ESP-NOW (stationTriggers), lowest first
+    int station = stationTriggers.take(); // consume the event
+    if (station > STATION_START) {
+        Serial.println("Station " + String(station) + " is LOW (remote)");
+        return static_cast<STATION_STATE>(station);
     }
 
     return STATION_NONE; // No station active
 }
 
 BUTTON_SENSORS_INPUTS UI::inputReceived() {
+    SPAN(inputReceivedSpan);
     static int currentChannel = 0;
     static unsigned long lastMillis = 0;
     static unsigned long lastButtonPressTime = 0;
@@ -144,12 +190,14 @@ BUTTON_SENSORS_INPUTS UI::inputReceived() {
 }
 
 void UI::turnLoopLED(int state) {
-    if (state == 1) {
+    loopLedOn = state == 1;
+    if (ledTestStep < NUM_LEDS) return;  // Shown when the self-test ends
+    if (loopLedOn) {
         leds[0] = CRGB(0, 200, 0); // Custom green with reduced intensity
     } else {
         leds[0] = CRGB::Black;
     }
-    FastLED.show();
+    showLeds();
 }
 
 void UI::printButtonName(BUTTON_SENSORS_INPUTS button) {
@@ -183,11 +231,16 @@ void UI::selectMuxChannel(int channel) {
 }
 
 void UI::playSound() {
+    if (dfPlayerState != DFPLAYER_READY) {
+        playPending = true;
+        return;
+    }
     Serial.println("Playing sound!");
     executeCMD(0x0F, 0x01, 0x01);
 }
 
 void UI::executeCMD(byte CMD, byte Par1, byte Par2) {
+    SPAN(dfPlayerSpan);
     #define Start_Byte 0x7E
     #define Version_Byte 0xFF
     #define Command_Length 0x06
@@ -219,10 +272,25 @@ bool UI::isBusy() {
 }
 
 void UI::setVolume(int volume) {
+    if (dfPlayerState == DFPLAYER_STARTING) return;  // update() sends currentVolume once it can
     Serial.println("Volume set to: " + String(volume));
     executeCMD(0x06, 0, volume);
 }
 
+void UI::setVolumeLevel(int volume) {
+    currentVolume = constrain(volume, 0, 30);
+    setVolume(currentVolume);
+    updateSoundLed();
+}
+
+int UI::volume() {
+    return currentVolume;
+}
+
+bool UI::atStart() {
+    return digitalRead(stationPins[0]) == LOW;
+}
+
 void UI::changeVolume(int volume) {
     #define VOLUME_CHANGE_DEFICIT 5
     if (volume == VOLUME_UP) {
@@ -245,20 +313,21 @@ void UI::changeVolume(int volume) {
     setVolume(currentVolume);
     if (currentVolume == 0) {
         leds[1] = CRGB(0, 0, 0);
-        FastLED.show();
+        showLeds();
     }
     else {
         leds[1] = CRGB(0, 0, 200);
-        FastLED.show();
+        showLeds();
     }
 }
 
 void UI::updateSoundLed() {
+    if (ledTestStep < NUM_LEDS) return;  // Shown when the self-test ends
     if (currentVolume == 0) {
         leds[1] = CRGB(0, 0, 0);
     }
     else {
         leds[1] = CRGB(0, 0, 200);
     }
-    FastLED.show();
+    showLeds();
 }
\ No newline at end of file
@@ -3,10 +3,9 @@
 
 #include <Arduino.h>
 #include <FastLED.h>
+#include "LAYOUT.h"
 
-static const int NUM_STATIONS = 8;
-
-extern volatile bool stationTriggered[NUM_STATIONS];
+extern StationTriggers stationTriggers;
 
 // Pin definitions
 #define NUM_LEDS 2  // Increased to handle the 6 additional LEDs
@@ -18,6 +17,13 @@ extern volatile bool stationTriggered[NUM_STATIONS];
 #define SEL3_IN 27
 #define IO_IN 32
 
+#define DFPLAYER_RX_PIN 34
+#define DFPLAYER_TX_PIN 12
+
+#define LED_TEST_STEP 100       // ms each LED shows red in the power-on self-test
+#define DFPLAYER_STARTUP 100    // ms after opening Serial2 before the DFPlayer takes commands
+#define DFPLAYER_SETTLE 100     // ms after the first command before the next one
+
 #define VOLUME_UP 0
 #define VOLUME_DOWN 1
 #define CHANGE_STATE 2
@@ -32,16 +38,10 @@ enum BUTTON_SENSORS_INPUTS {
     NO_INPUTS_RECEIVED = -1,
 };
 
+// Stations 1..layout.lastStation() are the values above STATION_START
 enum STATION_STATE {
     STATION_NONE = -1,       // No station is active
     STATION_START = 0,       // Starting station
-    STATION_1 = 1,
-    STATION_2 = 2,
-    STATION_3 = 3,
-    STATION_4 = 4,
-    STATION_5 = 5,
-    STATION_6 = 6,
-    STATION_LAST = 7         // Last station
 };
 
 class UI {
@@ -49,11 +49,15 @@ public:
     UI();
     BUTTON_SENSORS_INPUTS inputReceived();
     void playSound();
-    void setupPinsAndSensors();
+    void setupPinsAndSensors();      // Pins now; LED self-test and DFPlayer start run in update()
+    void update();                   // Steps the start-up work, call from loop()
     void changeVolume(int volume);
+    void setVolumeLevel(int volume);     // Restore a saved volume (0-30)
+    int volume();
     void turnLoopLED(int state);
     void updateSoundLed();
     STATION_STATE sampleStations();  // Updated to return the station state
+    bool atStart();                  // Train is on the wired START sensor right now (no debounce)
 
 private:
     BUTTON_SENSORS_INPUTS buttonState;
@@ -62,8 +66,18 @@ private:
     bool isBusy();
     void setVolume(int volume);
     void executeCMD(byte CMD, byte Par1, byte Par2);
+    void restoreLeds();
+    void showLeds();                     // FastLED.show(), timed as a span
     CRGB leds[NUM_LEDS];
     int currentVolume = 20;
+    bool loopLedOn = false;
+
+    // Start-up work stepped by update() so it overlaps the radio and the first loop() passes
+    int ledTestStep = 0;             // LED shown red, NUM_LEDS once the test is over
+    unsigned long ledTestMillis = 0;
+    enum { DFPLAYER_STARTING, DFPLAYER_SETTLING, DFPLAYER_READY } dfPlayerState = DFPLAYER_STARTING;
+    unsigned long dfPlayerMillis = 0;
+    bool playPending = false;        // playSound() before the DFPlayer was ready
 
     // Debouncing for stations
     unsigned long stationDebounceTimes[8] = {0}; // For debouncing signals
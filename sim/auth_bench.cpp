@@ -0,0 +1,108 @@
+// Host benchmark of the station packet authentication (lib/STATION_AUTH).
+//
+// Build and run from the project root:
+//   g++ -std=c++17 -O2 -Isim/host $(for d in lib/*/; do printf -- "-I%s " "$d"; done)
+//       sim/auth_bench.cpp lib/STATION_AUTH/STATION_AUTH.cpp sim/host/SimHost.cpp sim/host/RadioSim.cpp -o auth_bench
+//   ./auth_bench
+//
+// Checks SipHash-2-4 against the reference test vector, then times the tag
+// and verify() per packet (forged tags, so every call hashes and compares;
+// the replay window behind it is a few compares). The firmware prints
+// the same verify cost in CPU cycles in its "Auth:" report, measured on the
+// chip inside the ESP-NOW receive callback. Last, a controller reset: with
+// the epoch restored, a packet captured before it must be a replay, and the
+// last epoch must not wrap back to 0. A station with no key is refused.
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "SimHost.h"
+#include "STATION_AUTH.h"
+
+static double nanosecondsPer(const std::chrono::steady_clock::time_point &start, int count) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+}
+
+int main() {
+    // Reference vector from the SipHash paper: key 00..0f, message 00..0e
+    uint8_t key[STATION_KEY_SIZE];
+    uint8_t message[15];
+    for (int i = 0; i < STATION_KEY_SIZE; i++) key[i] = i;
+    for (int i = 0; i < 15; i++) message[i] = i;
+    uint64_t hash = stationSipHash(key, message, sizeof(message));
+    bool vectorOk = hash == 0xa129ca6149be45e5ULL;
+    printf("SipHash-2-4 test vector: %s (%016llx)\n", vectorOk ? "ok" : "MISMATCH", (unsigned long long)hash);
+    if (!vectorOk) return 1;
+
+    SimNode *node = simAddNode("bench", key);
+    simSetCurrentNode(node);
+
+    const int count = 2000000;
+    std::vector<StationPacket> packets(1024);
+    std::vector<StationAuthTrailer> trailers(1024);
+    for (size_t i = 0; i < packets.size(); i++) {
+        packets[i].type = STATION_MSG_TRIGGER;
+        packets[i].flags = STATION_FLAG_SYNCED | STATION_FLAG_AUTH;
+        packets[i].seq = i + 1;
+        packets[i].sentMicros = 1000 * i;
+        packets[i].syncError = 40;
+        trailers[i].epoch = 1;
+        trailers[i].tag = stationAuthTag(key, packets[i], 1);
+    }
+
+    volatile uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        sink = sink + stationAuthTag(key, packets[i & 1023], 1);
+    }
+    double tagNs = nanosecondsPer(start, count);
+
+    StationAuthVerifier verifier;
+    int accepted = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        StationPacket packet = packets[i & 1023];
+        packet.seq = i + 1;
+        StationAuthTrailer trailer = trailers[i & 1023];
+        trailer.tag = 0;  // Forged tag: the full hash still runs, the result is rejected
+        if (verifier.verify(1, key, packet, trailer) == AUTH_OK) accepted++;
+    }
+    double verifyNs = nanosecondsPer(start, count);
+
+    printf("tag (14 byte packet + epoch): %.1f ns, verify: %.1f ns per packet on this host (%d forged accepted)\n",
+           tagNs, verifyNs, accepted);
+    // Captured in a new station's first epoch (0), replayed after the controller
+    // reset; only a station that opened epoch 1 gets through
+    StationAuthVerifier before;
+    StationAuthTrailer trailer = {0, stationAuthTag(key, packets[0], 0)};
+    bool firstOk = before.verify(1, key, packets[0], trailer) == AUTH_OK;
+    StationAuthVerifier after;
+    uint16_t epoch;
+    bool saved = before.acceptedEpoch(1, epoch);
+    if (saved) after.restoreEpoch(1, epoch);
+    bool replayRefused = after.verify(1, key, packets[0], trailer) == AUTH_REPLAY;
+    StationAuthTrailer next = {1, stationAuthTag(key, packets[0], 1)};
+    bool nextOk = after.verify(1, key, packets[0], next) == AUTH_OK;
+    printf("replay after a controller reset: %s\n", saved && firstOk && replayRefused && nextOk ? "refused" : "ACCEPTED");
+    if (!(saved && firstOk && replayRefused && nextOk)) return 1;
+
+    // The last epoch does not wrap to 0, that takes a new key
+    StationAuthVerifier last;
+    last.restoreEpoch(1, AUTH_EPOCH_LAST);
+    bool wrapRefused = last.verify(1, key, packets[0], trailer) == AUTH_REPLAY;
+    printf("epoch wrap: %s\n", wrapRefused ? "refused" : "ACCEPTED");
+    if (!wrapRefused) return 1;
+
+    // Anyone can sign with an empty row of the key table
+    static const uint8_t noKey[STATION_KEY_SIZE] = {0};
+    StationAuthTrailer unkeyed = {0, stationAuthTag(noKey, packets[0], 0)};
+    bool keylessRefused = StationAuthVerifier().verify(2, noKey, packets[0], unkeyed) == AUTH_NO_KEY;
+    printf("station without a key: %s\n", keylessRefused ? "refused" : "ACCEPTED");
+    if (!keylessRefused) return 1;
+
+    printf("16 bytes take 10 SipRounds of 64-bit add/rotate/xor, roughly 50 instructions each on the 32-bit\n"
+           "Xtensa core: expect 600-800 cycles (about 3 us at 240 MHz). The controller's Auth report has the real figure.\n");
+    return 0;
+}
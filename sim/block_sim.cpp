@@ -0,0 +1,700 @@
+// Host simulation of a layout with several trains (lib/BLOCK_CONTROL). The
+// controller firmware runs as in valley_sim, with TRAIN_NODES set at run time;
+// every train carries a TrainNode board (lib/TRAIN_NODE) whose motor pins move
+// it, the stations run StationNode and RadioSim carries everything in between.
+// The simulator keeps its own account of where the trains really are and
+// checks the firmware against it: two trains in one block or at one station,
+// trains touching, a train leaving a station whose semaphore shows RED.
+//
+// With --sections the line is the loop of sectionTable in src/main.cpp: one
+// controller firmware per section, each running its own stations, and the
+// trains running forward round the loop, handed from section to section over
+// SectionLink (lib/SECTION_LINK). The simulator checks besides that only the
+// controller of the section a train is in commands it, or the next one once
+// the train stands at the boundary.
+//
+// Build and run from the project root (valley_firmware.so as for valley_sim):
+//   g++ -std=c++17 -O2 -rdynamic -Isim/host $(for d in lib/*/; do printf -- "-I%s " "$d"; done)
+//       lib/STATION_NODE/*.cpp lib/SEMAPHORE_NODE/*.cpp lib/STATION_ROUTER/*.cpp lib/STATION_AUTH/*.cpp
+//       lib/TIME_SYNC/*.cpp lib/TRAIN_NODE/*.cpp lib/TRAIN/*.cpp lib/CRASH_TRACE/*.cpp sim/host/*.cpp
+//       sim/block_sim.cpp -o block_sim -ldl
+//   ./block_sim                  one run for each of 1 to 4 trains
+//   ./block_sim --trains 3 -v    one run with the Serial output of every node
+//   ./block_sim --sections       the same on the loop of two sections, 1 to 3 trains
+//
+// Options:
+//   --trains N          trains on the line, 1..4 (default: 1 to 4 in turn, 1 to 3 on the loop)
+//   --rounds N          convoy round trips START -> LAST -> START, with --sections
+//                       laps of every train round the loop (default 5)
+//   --seed N            random seed
+//   --loss P            radio loss per packet copy (default 0)
+//   --jitter US         mean radio queueing jitter (default 300)
+//   --sections          the loop of sectionTable, one controller per section
+//   --reset-every S[:WHY]  reset a controller at random, on average every S seconds;
+//                       WHY is poweron, panic, wdt, brownout or sw (default sw)
+//   --firmware PATH     firmware shared object (default: valley_firmware.so next to block_sim)
+//   -v                  print the Serial output of every node
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <esp_system.h>
+#include "SimHost.h"
+#include "RadioSim.h"
+#include "UI.h"
+#include "TRAIN.h"
+#include "SEMAPHORE_T.h"
+#include "STATION_NODE.h"
+#include "TRAIN_NODE.h"
+#include "BLOCK_CONTROL.h"
+
+#define NUM_STATIONS LAYOUT_DEFAULT_STATIONS  // The layout the firmware boots with
+#define NUM_SEMAPHORES (NUM_STATIONS - 2)
+#define START_SENSOR_PIN 36            // stationPins[0] in UI.cpp
+#define STATION_SPACING_MM 600.0
+#define SENSOR_HALF_WIDTH_MM 25.0      // Sensor is LOW while a train is this close
+#define BERTH_MM 100.0                 // A train this close to a station stands at it
+#define TRAIN_LENGTH_MM 150.0          // Closer than this, two trains touch
+#define TOUCH_HYSTERESIS_MM 10.0       // Apart again this much further away, for counting collisions
+#define STATION_DEBOUNCE_MICROS 10000
+#define CRUISE_SPEED_MM_S 200.0
+#define ACCEL_TAU_S 0.30
+#define BRAKE_TAU_S 0.08
+#define BUMPER_MM 300.0
+#define LOOP_COST_MICROS 50
+#define WORLD_TICK_MICROS 100
+#define STALL_TIMEOUT_MICROS 60000000ULL
+#define BOOT_MICROS 350000
+#define EDGE_TO_STOP_MICROS 1000000    // A stop this soon after a sensor edge was for that edge
+#define NUM_SECTIONS 2                 // Rows of sectionTable in src/main.cpp
+
+// Must match stationMacs, trainMacs and sectionTable in src/main.cpp
+static const uint8_t stationMacs[NUM_STATIONS][6] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0xCC, 0x7B, 0x5C, 0x28, 0x84, 0x4C},
+    {0xD8, 0xBC, 0x38, 0xF8, 0x90, 0x24},
+    {0x80, 0x64, 0x6F, 0xC4, 0x92, 0xD0},
+    {0xF0, 0x08, 0xD1, 0xD5, 0x3D, 0x80},
+    {0xA4, 0xCF, 0x12, 0x6A, 0x50, 0xD4},
+    {0xB4, 0xE6, 0x2D, 0xBA, 0xDB, 0x61},
+    {0x34, 0xB7, 0xDA, 0xF9, 0x4B, 0x4C},
+};
+static const uint8_t trainMacs[BLOCK_MAX_TRAINS][6] = {
+    {0x24, 0x6F, 0x28, 0x00, 0x03, 0x01},
+    {0x24, 0x6F, 0x28, 0x00, 0x03, 0x02},
+    {0x24, 0x6F, 0x28, 0x00, 0x03, 0x03},
+    {0x24, 0x6F, 0x28, 0x00, 0x03, 0x04},
+};
+static const uint8_t controllerMacs[NUM_SECTIONS][6] = {
+    {0x24, 0x6F, 0x28, 0x00, 0x00, 0x01},
+    {0x24, 0x6F, 0x28, 0x00, 0x00, 0x02},
+};
+static const int sectionFirst[NUM_SECTIONS] = {0, 4};
+
+struct Options {
+    int rounds = 5;
+    uint32_t seed = 1;
+    RadioConfig radio;
+    double resetEvery = 0;
+    int resetReason = ESP_RST_SW;
+    bool sections = false;
+};
+
+struct Results {
+    int trains = 0;
+    int rounds = 0;
+    int stopsServed = 0;                 // Rests at stations 1..LAST after running forward, any on the loop
+    double simSeconds = 0;
+    double roundSeconds = 0;             // From the first train movement to the end of the last round
+    int collisions = 0;                  // Trains touched
+    int conflicts = 0;                   // Two trains in one block or at one station, one of them moving
+    int redPassed = 0;                   // Left a station it stood at forward while its semaphore showed RED
+    double minDistance = 1e9;            // mm between two trains while one of them moves
+    int handoffs = 0;                    // A train took commands from another controller than before
+    int foreignCommands = 0;             // Commands from a controller not in charge of where the train is
+    std::vector<double> boundaryDwell;   // s from the stand to leaving, at the LAST of a section
+    std::vector<double> stationDwell;    // The same at the other stations
+    std::vector<double> stopMicros;      // Sensor edge -> the train's motor ramps down
+    int resets = 0;
+    bool stalled = false;
+    uint32_t missedTriggers = 0;         // Reported by the firmware
+    uint32_t ignoredTriggers = 0;
+    RadioStats radio;
+};
+
+// The controller firmware, from valley_firmware.so (sim/valley_firmware.cpp)
+struct Firmware {
+    void (*configure)(bool networkSemaphores, bool auth) = nullptr;
+    void (*configureTrains)(int trains) = nullptr;
+    void (*configureSections)(int count) = nullptr;
+    void (*setup)() = nullptr;
+    void (*loop)() = nullptr;
+    char *(*rtc)(size_t *size) = nullptr;
+    void (*blockStats)(uint32_t *missed, uint32_t *ignored) = nullptr;
+};
+
+static std::string firmwarePath;
+static int firmwareLoads = 0;
+
+// A fresh copy for every boot, see valley_sim.cpp
+static bool loadFirmware(Firmware &firmware) {
+    char copy[96];
+    snprintf(copy, sizeof(copy), "/tmp/block_firmware_%d_%d.so", (int)getpid(), firmwareLoads++);
+    FILE *in = fopen(firmwarePath.c_str(), "rb");
+    FILE *out = fopen(copy, "wb");
+    if (in == nullptr || out == nullptr) {
+        fprintf(stderr, "Cannot copy %s to %s\n", firmwarePath.c_str(), copy);
+        return false;
+    }
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) fwrite(buffer, 1, n, out);
+    fclose(in);
+    fclose(out);
+
+    void *handle = dlopen(copy, RTLD_NOW | RTLD_LOCAL);
+    unlink(copy);
+    if (handle == nullptr) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+    firmware.configure = (void (*)(bool, bool))dlsym(handle, "simFirmwareConfigure");
+    firmware.configureTrains = (void (*)(int))dlsym(handle, "simFirmwareConfigureTrains");
+    firmware.configureSections = (void (*)(int))dlsym(handle, "simFirmwareConfigureSections");
+    firmware.setup = (void (*)())dlsym(handle, "simFirmwareSetup");
+    firmware.loop = (void (*)())dlsym(handle, "simFirmwareLoop");
+    firmware.rtc = (char *(*)(size_t *))dlsym(handle, "simFirmwareRtc");
+    firmware.blockStats = (void (*)(uint32_t *, uint32_t *))dlsym(handle, "simFirmwareBlockStats");
+    if (!firmware.configure || !firmware.configureTrains || !firmware.configureSections || !firmware.setup || !firmware.loop || !firmware.rtc || !firmware.blockStats) {
+        fprintf(stderr, "%s is not a valley_firmware.so with train nodes\n", firmwarePath.c_str());
+        return false;
+    }
+    return true;
+}
+
+static int parseResetReason(const char *text) {
+    if (text == nullptr || !strcmp(text, "sw")) return ESP_RST_SW;
+    if (!strcmp(text, "poweron")) return ESP_RST_POWERON;
+    if (!strcmp(text, "panic")) return ESP_RST_PANIC;
+    if (!strcmp(text, "wdt")) return ESP_RST_TASK_WDT;
+    if (!strcmp(text, "brownout")) return ESP_RST_BROWNOUT;
+    fprintf(stderr, "Unknown reset reason %s, using sw\n", text);
+    return ESP_RST_SW;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[(size_t)(p * (values.size() - 1))];
+}
+
+static double stationPosition(int station) {
+    return station * STATION_SPACING_MM;
+}
+
+class Line {
+public:
+    Line(int trains, const Options &options) : trainCount(trains), options(options), rng(options.seed) {}
+
+    Results run() {
+        results.trains = trainCount;
+        radioSim.reset();
+        radioSim.configure(options.radio, rng());
+
+        controllerCount = options.sections ? NUM_SECTIONS : 1;
+        for (int c = 0; c < controllerCount; c++) {
+            Controller &controller = controllers[c];
+            controller.node = simAddNode(c == 0 ? "controller" : "controller2", controllerMacs[c]);
+            controller.node->eeprom[0] = 1;  // Loop mode on
+            controller.first = options.sections ? sectionFirst[c] : 0;
+            controller.count = (c + 1 < controllerCount ? sectionFirst[c + 1] : NUM_STATIONS) - controller.first;
+        }
+
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        for (int i = 1; i < NUM_STATIONS; i++) {
+            const Controller &owner = controllers[ownerOf(i)];
+            if (i == owner.first) continue;  // On the controller's START pin
+            char *name = new char[16];
+            snprintf(name, 16, "station%d", i);
+            stations[i].node = simAddNode(name, stationMacs[i], (uniform(rng) - 0.5) * 80, uniform(rng) * 4e9);
+            simRunAs(stations[i].node, [&]() { stations[i].sender.begin(owner.node->mac); });
+            StationNode *sender = &stations[i].sender;
+            stations[i].node->recv = [sender](const uint8_t *mac, const uint8_t *data, int len) {
+                sender->handleReceive(mac, data, len, micros());
+            };
+        }
+
+        // Parked at stations 0..N-1, as the controller assumes after power on;
+        // on the loop train t at station t / sections of section t % sections
+        for (int t = 0; t < trainCount; t++) {
+            char *name = new char[16];
+            snprintf(name, 16, "train%d", t);
+            SimTrain &train = trains[t];
+            int station = options.sections ? sectionFirst[t % NUM_SECTIONS] + t / NUM_SECTIONS : t;
+            train.node = simAddNode(name, trainMacs[t], (uniform(rng) - 0.5) * 80, uniform(rng) * 4e9);
+            train.board = new TrainNode(t);
+            train.position = stationPosition(station);
+            train.restedAt = station;
+            simRunAs(train.node, [&]() { train.board->begin(controllerMacs, controllerCount); });
+            TrainNode *board = train.board;
+            train.node->recv = [this, t, board](const uint8_t *mac, const uint8_t *data, int len) {
+                if (options.sections) checkCommand(t, mac, data, len);
+                board->handleReceive(mac, data, len, micros());
+            };
+        }
+
+        simSetInputReader([this](SimNode *node, uint8_t pin) { return readInput(node, pin); });
+        simSetPinWatcher([this](SimNode *node, uint8_t pin, uint8_t value) { onPin(node, pin, value); });
+        simSetWorld([this]() { tick(); }, WORLD_TICK_MICROS);
+
+        for (int c = 0; c < controllerCount; c++) {
+            Controller &controller = controllers[c];
+            if (!loadFirmware(controller.firmware)) exit(1);
+            configure(controller);
+            controller.node->offsetMicros = -(double)simNow() * (1.0 + controller.node->driftPpm * 1e-6);
+            simRunAs(controller.node, [&]() { controller.firmware.setup(); });
+        }
+
+        std::exponential_distribution<double> resetGap(options.resetEvery > 0 ? 1.0 / options.resetEvery : 1.0);
+        uint64_t nextReset = options.resetEvery > 0 ? simNow() + (uint64_t)(resetGap(rng) * 1e6) : UINT64_MAX;
+        uint64_t limit = simNow() + (uint64_t)options.rounds * 600000000ULL;
+        lastProgress = simNow();
+        while (results.rounds < options.rounds && simNow() < limit) {
+            if (simNow() >= nextReset) {
+                resetController(controllerCount > 1 ? controllers[rng() % controllerCount] : controllers[0], options.resetReason);
+                nextReset = simNow() + (uint64_t)(resetGap(rng) * 1e6);
+            }
+            for (int c = 0; c < controllerCount; c++) {
+                Controller &controller = controllers[c];
+                simRunAs(controller.node, [&]() { controller.firmware.loop(); });
+            }
+            simAdvance(LOOP_COST_MICROS);
+            if (simNow() - lastProgress > STALL_TIMEOUT_MICROS) {
+                results.stalled = true;
+                break;
+            }
+        }
+
+        results.simSeconds = simNow() / 1e6;
+        for (int c = 0; c < controllerCount; c++) collectBlockStats(controllers[c]);
+        results.radio = radioSim.stats;
+        return results;
+    }
+
+private:
+    struct Controller {
+        SimNode *node = nullptr;
+        Firmware firmware;
+        int first = 0;                   // Line station of its local START
+        int count = 0;                   // Stations of its section, or of the line
+    };
+
+    struct Station {
+        SimNode *node = nullptr;
+        StationNode sender;
+        bool low = false;
+        bool reported = false;
+        uint64_t lowSince = 0;
+    };
+
+    struct SimTrain {
+        SimNode *node = nullptr;
+        TrainNode *board = nullptr;
+        double position = 0;
+        double velocity = 0;
+        int lastDirection = 0;           // Of the last run, for what a rest counts as
+        double lastDrive = 0;            // |drive| at the last pin change
+        uint64_t lastDriveMicros = 0;
+        bool stopping = false;
+        uint64_t edgeMicros = 0;         // Last sensor edge of this train, 0 once a stop used it
+        double pendingStop = -1;         // Edge to ramp start of a ramp still running
+        int spot = -99;                  // Block or berth it was in at the last tick
+        int restedAt = -1;               // Station it came to a stand at, until it leaves the berth
+        uint64_t restMicros = 0;         // When it came to that stand
+        int stops = 0;                   // Rests after running forward, for the laps on the loop
+        int commander = -1;              // Controller of its last command
+    };
+
+    double drive(const SimTrain &train) const {
+        return simPinDuty(train.node, BACKWARD_PIN) - simPinDuty(train.node, FORWARD_PIN);
+    }
+
+    SimTrain *trainOf(SimNode *node) {
+        for (int t = 0; t < trainCount; t++) {
+            if (trains[t].node == node) return &trains[t];
+        }
+        return nullptr;
+    }
+
+    Controller *controllerOf(SimNode *node) {
+        for (int c = 0; c < controllerCount; c++) {
+            if (controllers[c].node == node) return &controllers[c];
+        }
+        return nullptr;
+    }
+
+    // Controller whose section has the station
+    int ownerOf(int station) const {
+        int owner = 0;
+        for (int c = 1; c < controllerCount; c++) {
+            if (station >= controllers[c].first) owner = c;
+        }
+        return owner;
+    }
+
+    bool sectionLast(int station) const {
+        const Controller &owner = controllers[ownerOf(station)];
+        return station == owner.first + owner.count - 1;
+    }
+
+    // On the loop the way round that is shorter
+    double distance(double a, double b) const {
+        double d = fabs(a - b);
+        return options.sections ? std::min(d, NUM_STATIONS * STATION_SPACING_MM - d) : d;
+    }
+
+    // Berth s as 2s, the block between s and s + 1 as 2s + 1, like BlockControl's sections
+    int spotOf(double position) const {
+        int nearest = (int)lround(position / STATION_SPACING_MM);
+        if (fabs(position - stationPosition(nearest)) < BERTH_MM) return 2 * (nearest % NUM_STATIONS);
+        return 2 * (int)floor(position / STATION_SPACING_MM) + 1;
+    }
+
+    int readInput(SimNode *node, uint8_t pin) {
+        Controller *controller = controllerOf(node);
+        if (controller != nullptr && pin == START_SENSOR_PIN) return stations[controller->first].low ? LOW : HIGH;
+        return HIGH;
+    }
+
+    void onPin(SimNode *node, uint8_t pin, uint8_t value) {
+        // Semaphore relays on the controller's MUX: the coil pulse sets the aspect
+        Controller *controller = controllerOf(node);
+        if (controller != nullptr) {
+            if (pin != MUX_OUTPUT_PIN || value != LOW) return;
+            int channel = (node->pins[SEL0] ? 1 : 0) | (node->pins[SEL1] ? 2 : 0) | (node->pins[SEL2] ? 4 : 0) |
+                          (node->pins[SEL3] ? 8 : 0);
+            int semaphores = controller->count - 2;
+            if (channel < semaphores) aspect[controller->first + channel + 1] = RED;
+            else if (channel < 2 * semaphores) aspect[controller->first + channel - semaphores + 1] = GREEN;
+            return;
+        }
+
+        SimTrain *train = trainOf(node);
+        if (train == nullptr || (pin != FORWARD_PIN && pin != BACKWARD_PIN)) return;
+
+        // First step of a ramp down to zero, as in valley_sim
+        double level = fabs(drive(*train));
+        bool down = level < train->lastDrive;
+        bool start = down && (!train->stopping || simNow() - train->lastDriveMicros > 2 * TRAIN_RAMP_PERIOD);
+        train->stopping = down;
+        train->lastDrive = level;
+        train->lastDriveMicros = simNow();
+        if (start && train->edgeMicros != 0 && simNow() - train->edgeMicros < EDGE_TO_STOP_MICROS) {
+            train->pendingStop = simNow() - train->edgeMicros;
+        }
+        if (down && level == 0 && train->pendingStop >= 0) {
+            results.stopMicros.push_back(train->pendingStop);
+            train->edgeMicros = 0;
+            train->pendingStop = -1;
+        }
+    }
+
+    // A command reaching train t: from the controller of the section it is
+    // in, or from the next one while it stands at or leaves that section's LAST
+    void checkCommand(int t, const uint8_t *mac, const uint8_t *data, int len) {
+        if (len < (int)sizeof(TrainCommand) || data[0] != STATION_MSG_TRAIN_CMD) return;
+        TrainCommand packet;
+        memcpy(&packet, data, sizeof(packet));
+        if (packet.train != t) return;
+        int from = -1;
+        for (int c = 0; c < controllerCount; c++) {
+            if (memcmp(mac, controllerMacs[c], 6) == 0) from = c;
+        }
+        if (from < 0) return;
+
+        SimTrain &train = trains[t];
+        int station = spotOf(train.position) / 2;
+        int owner = ownerOf(station);
+        bool next = from == (owner + 1) % controllerCount && sectionLast(station);
+        if (from != owner && !next) {
+            results.foreignCommands++;
+            if (simVerbose) printf("[%10.3f world     ] train %d commanded by controller %d at station %d\n", simNow() / 1e6, t, from, station);
+        }
+        if (train.commander >= 0 && from != train.commander) results.handoffs++;
+        train.commander = from;
+    }
+
+    void configure(Controller &controller) {
+        controller.firmware.configure(false, false);
+        controller.firmware.configureTrains(trainCount);
+        controller.firmware.configureSections(options.sections ? NUM_SECTIONS : 0);
+    }
+
+    void resetController(Controller &controller, int reason) {
+        size_t rtcSize = 0;
+        char *rtc = controller.firmware.rtc(&rtcSize);
+        std::vector<char> rtcMemory(rtc, rtc + rtcSize);
+        collectBlockStats(controller);
+
+        SimNode *node = controller.node;
+        simResetNode(node);
+        node->espNowReady = false;
+        node->recv = nullptr;
+        node->promiscuous = nullptr;
+        node->peers.clear();
+        results.resets++;
+        if (simVerbose) printf("[%10.3f %-10s] ==== RESET (%d) ====\n", simNow() / 1e6, node->name, reason);
+
+        simAdvance(BOOT_MICROS);
+        node->offsetMicros = -(double)simNow() * (1.0 + node->driftPpm * 1e-6);
+        node->resetReason = reason;
+        if (!loadFirmware(controller.firmware)) exit(1);
+        configure(controller);
+        rtc = controller.firmware.rtc(&rtcSize);
+        if (reason == ESP_RST_POWERON) {
+            for (size_t i = 0; i < rtcSize; i++) rtc[i] = (char)rng();
+        } else {
+            memcpy(rtc, rtcMemory.data(), std::min(rtcSize, rtcMemory.size()));
+        }
+        simRunAs(node, [&]() { controller.firmware.setup(); });
+    }
+
+    // The counters start over with every boot of the firmware
+    void collectBlockStats(Controller &controller) {
+        uint32_t missed = 0, ignored = 0;
+        simRunAs(controller.node, [&]() { controller.firmware.blockStats(&missed, &ignored); });
+        results.missedTriggers += missed;
+        results.ignoredTriggers += ignored;
+    }
+
+    void tick() {
+        const double dt = WORLD_TICK_MICROS / 1e6;
+        const double loop = NUM_STATIONS * STATION_SPACING_MM;
+
+        for (int t = 0; t < trainCount; t++) {
+            SimTrain &train = trains[t];
+            double previous = train.position;
+            double target = drive(train) * CRUISE_SPEED_MM_S;
+            int direction = target > 0 ? 1 : target < 0 ? -1 : 0;
+            double tau = fabs(target) > fabs(train.velocity) && direction * train.velocity >= 0 ? ACCEL_TAU_S : BRAKE_TAU_S;
+            bool wasMoving = train.velocity != 0;
+            train.velocity += (target - train.velocity) * (dt / tau);
+            if (direction == 0 && fabs(train.velocity) < 1.0) train.velocity = 0;
+            if (direction != 0) train.lastDirection = direction;
+            train.position += train.velocity * dt;
+            if (options.sections) train.position = fmod(train.position + loop, loop);
+            else train.position = std::max(stationPosition(0) - BUMPER_MM, std::min(stationPosition(NUM_STATIONS - 1) + BUMPER_MM, train.position));
+
+            // Trains do not pass through each other
+            for (int other = 0; other < trainCount; other++) {
+                if (other == t || distance(train.position, trains[other].position) >= TRAIN_LENGTH_MM) continue;
+                if (!touching[t][other]) {
+                    results.collisions++;
+                    if (simVerbose) {
+                        printf("[%10.3f world     ] trains %d and %d touch at %.0f and %.0f mm\n", simNow() / 1e6, t, other, train.position,
+                               trains[other].position);
+                    }
+                }
+                touching[t][other] = touching[other][t] = true;
+                train.position = previous;
+                train.velocity = 0;
+            }
+            if (train.velocity != 0) {
+                lastProgress = simNow();
+                if (startMicros == 0) startMicros = simNow();
+            }
+
+            // Leaving a station it stood at forward, past its semaphore
+            int spot = spotOf(train.position);
+            if (train.spot >= 0 && train.spot % 2 == 0 && spot == train.spot + 1 && train.restedAt == train.spot / 2) {
+                int station = train.spot / 2;
+                const Controller &owner = controllers[ownerOf(station)];
+                int local = station - owner.first;
+                if (local >= 1 && local <= owner.count - 2 && aspect[station] != GREEN) results.redPassed++;
+                if (options.sections && train.restMicros != 0) {
+                    double dwell = (simNow() - train.restMicros) / 1e6;
+                    (sectionLast(station) ? results.boundaryDwell : results.stationDwell).push_back(dwell);
+                }
+            }
+            if (spot != train.spot) {
+                train.restedAt = -1;
+                train.restMicros = 0;
+            }
+            train.spot = spot;
+
+            if (wasMoving && train.velocity == 0) rest(train);
+        }
+
+        for (int t = 0; t < trainCount; t++) {
+            for (int other = t + 1; other < trainCount; other++) {
+                double apart = distance(trains[t].position, trains[other].position);
+                bool moving = trains[t].velocity != 0 || trains[other].velocity != 0;
+                if (apart >= TRAIN_LENGTH_MM + TOUCH_HYSTERESIS_MM) touching[t][other] = touching[other][t] = false;
+                if (moving && apart < results.minDistance) results.minDistance = apart;
+                bool shared = moving && trains[t].spot == trains[other].spot;
+                if (shared && !sharing[t][other]) results.conflicts++;
+                sharing[t][other] = shared;
+            }
+        }
+
+        // Sensors: a controller's START sensor is read through digitalRead, the others report over ESP-NOW
+        for (int i = 0; i < NUM_STATIONS; i++) {
+            Station &station = stations[i];
+            SimTrain *nearest = nullptr;
+            for (int t = 0; t < trainCount; t++) {
+                if (distance(trains[t].position, stationPosition(i)) < SENSOR_HALF_WIDTH_MM) nearest = &trains[t];
+            }
+            bool low = nearest != nullptr;
+            if (low && !station.low) {
+                station.lowSince = simNow();
+                nearest->edgeMicros = simNow();
+                nearest->pendingStop = -1;
+            }
+            if (!low) station.reported = false;
+            station.low = low;
+            if (station.node == nullptr) continue;
+
+            simRunAs(station.node, [&]() {
+                if (low && !station.reported && simNow() - station.lowSince >= STATION_DEBOUNCE_MICROS) {
+                    station.reported = true;
+                    uint32_t edge = micros() - (uint32_t)(simNow() - station.lowSince);
+                    station.sender.sendTrigger(edge);
+                }
+                station.sender.loop();
+            });
+        }
+
+        for (int t = 0; t < trainCount; t++) {
+            simRunAs(trains[t].node, [&]() { trains[t].board->loop(); });
+        }
+    }
+
+    // Came to a standstill: a passenger stop going forward, a round at START
+    // going back; on the loop a lap once every train has stopped round it
+    void rest(SimTrain &train) {
+        int spot = spotOf(train.position);
+        if (spot % 2 != 0) return;
+        int station = spot / 2;
+        train.restedAt = station;
+        train.restMicros = simNow();
+        if (options.sections) {
+            if (train.lastDirection <= 0) return;
+            results.stopsServed++;
+            train.stops++;
+            int laps = INT32_MAX;
+            for (int t = 0; t < trainCount; t++) laps = std::min(laps, trains[t].stops / NUM_STATIONS);
+            if (laps > results.rounds) {
+                results.rounds = laps;
+                results.roundSeconds = (simNow() - startMicros) / 1e6;
+            }
+        } else if (train.lastDirection > 0 && station >= 1) {
+            results.stopsServed++;
+        } else if (train.lastDirection < 0 && station == 0) {
+            results.rounds++;
+            results.roundSeconds = (simNow() - startMicros) / 1e6;
+        }
+    }
+
+    int trainCount;
+    Options options;
+    std::mt19937 rng;
+    Controller controllers[NUM_SECTIONS];
+    int controllerCount = 1;
+    Station stations[NUM_STATIONS];
+    SimTrain trains[BLOCK_MAX_TRAINS];
+    bool touching[BLOCK_MAX_TRAINS][BLOCK_MAX_TRAINS] = {};
+    bool sharing[BLOCK_MAX_TRAINS][BLOCK_MAX_TRAINS] = {};
+    SemaphoreState aspect[NUM_STATIONS] = {};          // By line station, RED until a pulse says otherwise
+    Results results;
+    uint64_t lastProgress = 0;
+    uint64_t startMicros = 0;          // First train movement
+};
+
+static void printResults(const Results &results, const Options &options) {
+    double hours = results.roundSeconds / 3600;
+    char closest[16] = "-";
+    if (results.minDistance < 1e9) snprintf(closest, sizeof(closest), "%.0f", results.minDistance);
+    printf("trains %d | %s %d, %.1f s each, %d stops, %.0f stops per hour, each station served every %.1f s | "
+           "collisions %d, shared blocks %d, left at RED %d, closest %s mm | stop after sensor p50 %.2f p99 %.2f max %.2f ms | "
+           "triggers %u missed %u ignored%s\n",
+           results.trains, options.sections ? "laps" : "rounds", results.rounds, results.rounds ? results.roundSeconds / results.rounds : 0.0, results.stopsServed,
+           hours > 0 ? results.stopsServed / hours : 0.0,
+           results.stopsServed ? results.roundSeconds / ((double)results.stopsServed / (NUM_STATIONS - (options.sections ? 0 : 1))) : 0.0,
+           results.collisions, results.conflicts, results.redPassed, closest,
+           percentile(results.stopMicros, 0.5) / 1000, percentile(results.stopMicros, 0.99) / 1000,
+           percentile(results.stopMicros, 1.0) / 1000, results.missedTriggers, results.ignoredTriggers,
+           results.stalled ? " | STALLED" : "");
+    printf("         radio: sent %u lost %u delivered %u, controller resets %d, %.0f s simulated\n", results.radio.sent,
+           results.radio.lost, results.radio.delivered, results.resets, results.simSeconds);
+    if (options.sections) {
+        printf("         sections: %d handoffs, %d commands from a controller not in charge | dwell at a section's LAST p50 %.1f max %.1f s, "
+               "elsewhere p50 %.1f max %.1f s\n", results.handoffs, results.foreignCommands, percentile(results.boundaryDwell, 0.5),
+               percentile(results.boundaryDwell, 1.0), percentile(results.stationDwell, 0.5), percentile(results.stationDwell, 1.0));
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    options.radio.jitterMicros = 300;
+    int onlyTrains = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : "";
+        if (!strcmp(arg, "--trains")) { onlyTrains = atoi(value); i++; }
+        else if (!strcmp(arg, "--rounds")) { options.rounds = atoi(value); i++; }
+        else if (!strcmp(arg, "--seed")) { options.seed = (uint32_t)atoi(value); i++; }
+        else if (!strcmp(arg, "--loss")) { options.radio.lossChance = atof(value); i++; }
+        else if (!strcmp(arg, "--jitter")) { options.radio.jitterMicros = atof(value); i++; }
+        else if (!strcmp(arg, "--sections")) { options.sections = true; }
+        else if (!strcmp(arg, "--reset-every")) {
+            const char *colon = strchr(value, ':');
+            options.resetEvery = atof(value);
+            options.resetReason = parseResetReason(colon ? colon + 1 : nullptr);
+            i++;
+        }
+        else if (!strcmp(arg, "--firmware")) { firmwarePath = value; i++; }
+        else if (!strcmp(arg, "-v")) { simVerbose = true; }
+        else {
+            fprintf(stderr, "Unknown option %s (see the top of sim/block_sim.cpp)\n", arg);
+            return 1;
+        }
+    }
+    if (onlyTrains < 0 || onlyTrains > BLOCK_MAX_TRAINS) {
+        fprintf(stderr, "--trains takes 1 to %d\n", BLOCK_MAX_TRAINS);
+        return 1;
+    }
+
+    if (firmwarePath.empty()) {
+        char self[4096];
+        ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        self[length > 0 ? length : 0] = 0;
+        char *slash = strrchr(self, '/');
+        firmwarePath = slash ? std::string(self, slash + 1) + "valley_firmware.so" : "./valley_firmware.so";
+    }
+
+    // The firmware uses globals and function statics, so every run gets its own process.
+    // More trains than this lock each other up on the loop, see BlockControl::begin()
+    int most = options.sections ? (NUM_STATIONS - 1) / (1 + BLOCK_OVERLAP) : BLOCK_MAX_TRAINS;
+    for (int trains = 1; trains <= BLOCK_MAX_TRAINS; trains++) {
+        if (onlyTrains == 0 && trains > most) break;
+        if (onlyTrains != 0 && trains != onlyTrains) continue;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            Line line(trains, options);
+            printResults(line.run(), options);
+            fflush(stdout);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+    }
+    return 0;
+}
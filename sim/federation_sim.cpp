@@ -0,0 +1,525 @@
+// Host simulation of several controllers running one loop line together
+// (lib/SECTION_LINK), each on its own thread.
+//
+// Build and run from the project root:
+//   g++ -std=c++17 -O2 -pthread -Ilib/SECTION_LINK -Ilib/STATION_PROTOCOL sim/federation_sim.cpp lib/SECTION_LINK/SECTION_LINK.cpp -o federation_sim
+//   ./federation_sim [--controllers N] [--stations N] [--trains N] [--seconds S] [--loss P] [--delay MS]
+//                    [--jitter MS] [--stall C:S:D] [--restart C:S:D] [--seed N]
+//
+// The line is a ring of controllers x stations stations, every controller
+// owning a contiguous run of them. Each controller thread runs a SectionLink
+// and a small dispatcher: a train dwells at a station, runs on when the next
+// berth is free and is handed to the next controller at the last station of
+// the section. A world thread moves the trains at one station per 200 ms and
+// stops a train that has not been commanded for TRAIN_NODE_TIMEOUT. The radio
+// between the controllers delays, jitters and loses messages.
+//
+// Without options four scenarios run: clean, lossy, stall (controller 1
+// frozen for 2 s, what it was sent meanwhile is lost) and restart (controller
+// 2 comes back after 1.5 s with its link state gone and its trains kept, as
+// from RTC memory). --stall and --restart run the one given with the radio
+// of the other options.
+//
+// Each reports the handoffs per second and the latency from the first offer
+// of a train to its new controller taking it, and what must never happen:
+// trains closer than a train length, a train commanded by a controller other
+// than its last one or the next, both sides of a boundary deciding about its
+// block at once, and, after the line has settled at the end, a train with no
+// controller or with two.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "SECTION_LINK.h"
+
+#define LEG_MILLIS 200           // From one station to the next
+#define DWELL_MILLIS 300
+#define REFUSED_BACKOFF 50       // ms before a refused train is offered again
+#define TRAIN_LENGTH 0.3         // Stations
+#define SETTLE_MILLIS 3000       // After the run: no new departures, handoffs under way finish
+
+struct Options {
+    int controllers = 3;
+    int stations = 4;
+    int trains = 4;
+    int seconds = 10;
+    double loss = 0;
+    double delay = 2;
+    double jitter = 1;
+    int faultController = -1;
+    int faultStart = 0;
+    int faultMillis = 0;
+    bool restart = false;
+    unsigned seed = 1;
+};
+
+static std::chrono::steady_clock::time_point epoch0;
+
+static unsigned long nowMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch0).count();
+}
+
+struct Stats {
+    std::mutex lock;
+    std::vector<unsigned long> latencies;
+    uint32_t collisions = 0;
+    uint32_t conflicts = 0;
+    uint32_t overlaps = 0;
+    uint32_t ownership = 0;
+};
+
+// Trains, moved by the world thread and commanded by the controllers
+struct World {
+    struct Train {
+        double position;         // Stations from station 0
+        int target;
+        bool moving;
+        unsigned long commandMillis;
+        int commander;           // Last controller to command it, -1 none yet
+    };
+
+    std::mutex lock;
+    std::vector<Train> trains;
+    int length = 0;
+    int controllers = 0;
+    std::vector<std::vector<bool>> touching;
+    Stats *stats = nullptr;
+
+    void command(int controller, int train, int station, unsigned long now) {
+        std::lock_guard<std::mutex> guard(lock);
+        Train &t = trains[train];
+        if (t.commander >= 0 && controller != t.commander && controller != (t.commander + 1) % controllers) {
+            std::lock_guard<std::mutex> statsGuard(stats->lock);
+            stats->conflicts++;
+            printf("  %lu ms: controller %d commands train %d, last commanded by %d\n", now, controller, train, t.commander);
+        }
+        t.commander = controller;
+        t.commandMillis = now;
+        t.target = station;
+        t.moving = t.position != station;
+    }
+
+    bool standingAt(int train, int station) {
+        std::lock_guard<std::mutex> guard(lock);
+        return !trains[train].moving && trains[train].position == station;
+    }
+
+    void step(unsigned long now, double dt) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (Train &t : trains) {
+            if (!t.moving) continue;
+            if (now - t.commandMillis > TRAIN_NODE_TIMEOUT) {
+                t.moving = false;
+                continue;
+            }
+            double distance = fmod(t.target - t.position + length, length);
+            double run = dt / LEG_MILLIS;
+            if (run >= distance) {
+                t.position = t.target;
+                t.moving = false;
+            } else {
+                t.position = fmod(t.position + run, length);
+            }
+        }
+        for (size_t a = 0; a < trains.size(); a++) {
+            for (size_t b = a + 1; b < trains.size(); b++) {
+                double gap = fabs(trains[a].position - trains[b].position);
+                gap = std::min(gap, length - gap);
+                bool touch = gap < TRAIN_LENGTH;
+                if (touch && !touching[a][b]) {
+                    std::lock_guard<std::mutex> statsGuard(stats->lock);
+                    stats->collisions++;
+                    printf("  %lu ms: trains %zu and %zu touch at %.2f\n", now, a, b, trains[a].position);
+                }
+                touching[a][b] = touch;
+            }
+        }
+    }
+};
+
+struct Mailbox {
+    struct Letter {
+        unsigned long deliverMillis;
+        SectionMessage message;
+    };
+    std::mutex lock;
+    std::vector<Letter> letters;
+};
+
+// TRAIN_LEAVING: handed over and still standing in the last berth, which stays taken until it has left
+enum TrainState { TRAIN_STANDING, TRAIN_MOVING, TRAIN_OFFERING, TRAIN_LEAVING };
+
+struct OwnedTrain {
+    int train;
+    uint8_t trip;
+    TrainState state;
+    int station;                 // In the section, where it stands or heads to
+    bool crossed;                // Heading to station 0 from the boundary
+    bool offered;                // Offered on this visit of the last station, refused so far
+    unsigned long dwellMillis;
+    unsigned long keepaliveMillis;
+};
+
+struct Controller;
+
+struct Federation {
+    Options options;
+    World world;
+    Stats stats;
+    std::vector<Controller *> controllers;
+    std::vector<Mailbox> mailboxes;
+    std::vector<std::atomic<unsigned long>> offerMillis;  // First offer of the train's current crossing
+    std::atomic<bool> settling{false};
+    std::atomic<bool> stopping{false};
+    Federation(int controllers, int trains) : mailboxes(controllers), offerMillis(trains) {}
+};
+
+// Decisions one side of a boundary could take, as times it was seen holding the token with a valid lease
+struct DecisionLog {
+    std::vector<std::pair<unsigned long, unsigned long>> spans;
+    void note(unsigned long now) {
+        if (!spans.empty() && now - spans.back().second <= 1) spans.back().second = now;
+        else spans.push_back({now, now});
+    }
+};
+
+struct Controller {
+    Federation *federation;
+    int id;
+    SectionLink link;
+    uint32_t incarnation;
+    std::mt19937 rng;
+    std::vector<OwnedTrain> trains;
+    DecisionLog decisions[2];
+    uint32_t handedOver = 0, gone = 0, adopted = 0, restarts = 0;
+    uint32_t linkStats[8] = {};  // Of the links before restarts
+
+    int global(int station) { return id * federation->options.stations + station; }
+    int last() { return federation->options.stations - 1; }
+
+    static void send(void *context, uint8_t section, const SectionMessage &message) {
+        Controller *self = (Controller *)context;
+        Federation *f = self->federation;
+        std::uniform_real_distribution<double> uniform(0, 1);
+        if (uniform(self->rng) < f->options.loss) return;
+        std::exponential_distribution<double> jitter(1.0 / std::max(f->options.jitter, 0.001));
+        unsigned long deliver = nowMillis() + (unsigned long)(f->options.delay + jitter(self->rng));
+        Mailbox &box = f->mailboxes[section];
+        std::lock_guard<std::mutex> guard(box.lock);
+        box.letters.push_back({deliver, message});
+    }
+
+    void startLink() {
+        link.begin(id, federation->options.controllers, true, incarnation, send, this);
+    }
+
+    void saveLinkStats() {
+        uint32_t now[8] = {link.handoffs, link.taken, link.adoptions, link.refusals, link.takeovers, link.restarts, link.sent, link.repeats};
+        for (int i = 0; i < 8; i++) linkStats[i] += now[i];
+    }
+
+    void clearMailbox() {
+        Mailbox &box = federation->mailboxes[id];
+        std::lock_guard<std::mutex> guard(box.lock);
+        box.letters.clear();
+    }
+
+    bool berthFree(int station) {
+        for (OwnedTrain &t : trains) {
+            if (t.station == station) return false;
+        }
+        return station != 0 || link.incoming(SECTION_DOWN) == SECTION_NO_TRAIN;
+    }
+
+    void noteDecisions(unsigned long now) {
+        for (int side = SECTION_DOWN; side <= SECTION_UP; side++) {
+            if (link.mayDecide(side, now)) decisions[side].note(now);
+        }
+    }
+
+    void drive(OwnedTrain &t, int station, unsigned long now) {
+        t.state = station == t.station ? TRAIN_STANDING : TRAIN_MOVING;
+        t.station = station;
+        t.keepaliveMillis = now;
+        federation->world.command(id, t.train, global(station) % federation->world.length, now);
+    }
+
+    void step(unsigned long now) {
+        Federation *f = federation;
+        noteDecisions(now);
+
+        std::vector<SectionMessage> inbox;
+        {
+            Mailbox &box = f->mailboxes[id];
+            std::lock_guard<std::mutex> guard(box.lock);
+            for (size_t i = 0; i < box.letters.size();) {
+                if ((long)(box.letters[i].deliverMillis - now) <= 0) {
+                    inbox.push_back(box.letters[i].message);
+                    box.letters.erase(box.letters.begin() + i);
+                } else {
+                    i++;
+                }
+            }
+        }
+        for (SectionMessage &message : inbox) link.receive(message, now);
+        link.update(now);
+
+        SectionArrival arrival;
+        while (link.takeArrival(arrival)) {
+            {
+                std::lock_guard<std::mutex> guard(f->stats.lock);
+                f->stats.latencies.push_back(now - f->offerMillis[arrival.train]);
+            }
+            if (arrival.adopted) adopted++;
+            OwnedTrain t = {arrival.train, arrival.trip, TRAIN_MOVING, -1, true, false, 0, now};
+            trains.push_back(t);
+            drive(trains.back(), 0, now);
+        }
+        link.setAccepting(SECTION_DOWN, berthFree(0));
+
+        for (size_t i = 0; i < trains.size();) {
+            OwnedTrain &t = trains[i];
+            if (t.state == TRAIN_LEAVING) {
+                if (f->world.standingAt(t.train, global(t.station) % f->world.length)) i++;
+                else trains.erase(trains.begin() + i);
+                continue;
+            }
+            if (t.state == TRAIN_MOVING && f->world.standingAt(t.train, global(t.station) % f->world.length)) {
+                t.state = TRAIN_STANDING;
+                t.dwellMillis = now + DWELL_MILLIS;
+                if (t.crossed) link.arrived(SECTION_DOWN, t.train);
+                t.crossed = false;
+            }
+            if (t.state == TRAIN_STANDING && (long)(now - t.dwellMillis) >= 0 && !f->settling) {
+                if (t.station < last()) {
+                    if (berthFree(t.station + 1)) drive(t, t.station + 1, now);
+                } else {
+                    t.state = TRAIN_OFFERING;
+                    if (!t.offered) f->offerMillis[t.train] = now;
+                    t.offered = true;
+                }
+            }
+            if (t.state == TRAIN_OFFERING) {
+                SectionHandoff result = link.handOff(SECTION_UP, t.train, t.trip + 1, now);
+                if (result == SECTION_GO || result == SECTION_GONE) {
+                    if (result == SECTION_GO) handedOver++;
+                    else gone++;
+                    t.state = TRAIN_LEAVING;
+                    t.offered = false;
+                    i++;
+                    continue;
+                }
+                if (result == SECTION_REFUSED) {
+                    t.state = TRAIN_STANDING;
+                    t.dwellMillis = now + REFUSED_BACKOFF;
+                }
+            }
+            // An offered train is left alone, the next controller may take it over
+            if (t.state != TRAIN_OFFERING && now - t.keepaliveMillis >= TRAIN_CMD_KEEPALIVE) {
+                t.keepaliveMillis = now;
+                f->world.command(id, t.train, global(t.station) % f->world.length, now);
+            }
+            i++;
+        }
+        noteDecisions(now);
+    }
+
+    void run() {
+        Federation *f = federation;
+        const Options &o = f->options;
+        bool faultDone = false;
+        while (!f->stopping) {
+            unsigned long now = nowMillis();
+            if (!faultDone && id == o.faultController && now >= (unsigned long)o.faultStart) {
+                faultDone = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(o.faultMillis));
+                clearMailbox();
+                if (o.restart) {
+                    saveLinkStats();
+                    incarnation++;
+                    restarts++;
+                    startLink();
+                }
+                continue;
+            }
+            step(now);
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+        saveLinkStats();
+    }
+};
+
+static void worldRun(Federation *f) {
+    unsigned long last = nowMillis();
+    while (!f->stopping) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        unsigned long now = nowMillis();
+        f->world.step(now, now - last);
+        last = now;
+    }
+}
+
+static unsigned long percentile(std::vector<unsigned long> &values, double share) {
+    if (values.empty()) return 0;
+    size_t index = std::min(values.size() - 1, (size_t)(share * values.size()));
+    return values[index];
+}
+
+static bool runScenario(const char *name, const Options &options) {
+    Federation f(options.controllers, options.trains);
+    f.options = options;
+    int length = options.controllers * options.stations;
+    f.world.length = length;
+    f.world.controllers = options.controllers;
+    f.world.stats = &f.stats;
+    f.world.touching.assign(options.trains, std::vector<bool>(options.trains, false));
+    epoch0 = std::chrono::steady_clock::now();
+
+    std::vector<Controller> controllers(options.controllers);
+    for (int c = 0; c < options.controllers; c++) {
+        Controller &controller = controllers[c];
+        controller.federation = &f;
+        controller.id = c;
+        controller.incarnation = (options.seed << 8) + c * 16 + 1;
+        controller.rng.seed(options.seed * 100 + c);
+        controller.startLink();
+        f.controllers.push_back(&controller);
+    }
+    for (int t = 0; t < options.trains; t++) {
+        int station = t * length / options.trains;
+        f.world.trains.push_back({(double)station, station, false, 0, -1});
+        Controller &owner = controllers[station / options.stations];
+        owner.trains.push_back({t, 0, TRAIN_STANDING, station % options.stations, false, false, 0, 0});
+        f.offerMillis[t] = 0;
+    }
+
+    std::vector<std::thread> threads;
+    threads.emplace_back(worldRun, &f);
+    for (Controller &controller : controllers) threads.emplace_back(&Controller::run, &controller);
+    std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+    f.settling = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(SETTLE_MILLIS));
+    f.stopping = true;
+    for (std::thread &thread : threads) thread.join();
+
+    // Both sides of boundary b: section b going up and the next one going down
+    for (int b = 0; b < options.controllers; b++) {
+        DecisionLog &below = controllers[b].decisions[SECTION_UP];
+        DecisionLog &above = controllers[(b + 1) % options.controllers].decisions[SECTION_DOWN];
+        for (auto &x : below.spans) {
+            for (auto &y : above.spans) {
+                if (x.first <= y.second && y.first <= x.second) {
+                    f.stats.overlaps++;
+                    printf("  boundary %d: both sides decide, %lu..%lu and %lu..%lu ms\n", b, x.first, x.second, y.first, y.second);
+                }
+            }
+        }
+    }
+    for (int t = 0; t < options.trains; t++) {
+        int owners = 0;
+        for (Controller &controller : controllers) {
+            for (OwnedTrain &owned : controller.trains) owners += owned.train == t && owned.state != TRAIN_LEAVING;
+        }
+        if (owners != 1) {
+            f.stats.ownership++;
+            printf("  train %d has %d controllers at the end\n", t, owners);
+        }
+    }
+
+    uint32_t handoffs = 0, gone = 0, adopted = 0, sum[8] = {};
+    for (Controller &controller : controllers) {
+        handoffs += controller.handedOver;
+        gone += controller.gone;
+        adopted += controller.adopted;
+        for (int i = 0; i < 8; i++) sum[i] += controller.linkStats[i];
+    }
+    std::vector<unsigned long> &latencies = f.stats.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-8s %d controllers x %d stations, %d trains, %d s, loss %.0f %%: %u handoffs (%.1f/s), %u adopted, %u given up\n",
+           name, options.controllers, options.stations, options.trains, options.seconds, options.loss * 100, handoffs,
+           (double)handoffs / (options.seconds + SETTLE_MILLIS / 1000.0), adopted, gone);
+    printf("         offer to new controller p50 %lu ms, p99 %lu ms, max %lu ms over %zu crossings\n",
+           percentile(latencies, 0.50), percentile(latencies, 0.99), latencies.empty() ? 0 : latencies.back(), latencies.size());
+    printf("         %u offers refused, %u tokens taken over, %u restarts seen, %u messages (%u repeats)\n",
+           sum[3], sum[4], sum[5], sum[6], sum[7]);
+    uint32_t violations = f.stats.collisions + f.stats.conflicts + f.stats.overlaps + f.stats.ownership;
+    printf("         collisions %u, conflicting commands %u, token overlaps %u, ownership errors %u\n",
+           f.stats.collisions, f.stats.conflicts, f.stats.overlaps, f.stats.ownership);
+    return violations == 0;
+}
+
+static bool parseFault(const char *text, Options &options, bool restart) {
+    double start, duration;
+    if (sscanf(text, "%d:%lf:%lf", &options.faultController, &start, &duration) != 3) return false;
+    options.faultStart = start * 1000;
+    options.faultMillis = duration * 1000;
+    options.restart = restart;
+    return options.faultController >= 0;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    bool custom = false;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool ok = value != nullptr;
+        if (!strcmp(arg, "--controllers") && ok) options.controllers = atoi(value);
+        else if (!strcmp(arg, "--stations") && ok) options.stations = atoi(value);
+        else if (!strcmp(arg, "--trains") && ok) options.trains = atoi(value);
+        else if (!strcmp(arg, "--seconds") && ok) options.seconds = atoi(value);
+        else if (!strcmp(arg, "--loss") && ok) options.loss = atof(value), custom = true;
+        else if (!strcmp(arg, "--delay") && ok) options.delay = atof(value), custom = true;
+        else if (!strcmp(arg, "--jitter") && ok) options.jitter = atof(value), custom = true;
+        else if (!strcmp(arg, "--stall") && ok) ok = parseFault(value, options, false), custom = true;
+        else if (!strcmp(arg, "--restart") && ok) ok = parseFault(value, options, true), custom = true;
+        else if (!strcmp(arg, "--seed") && ok) options.seed = atoi(value);
+        else ok = false;
+        if (!ok) {
+            fprintf(stderr, "usage: %s [--controllers N] [--stations N] [--trains N] [--seconds S] [--loss P] [--delay MS]\n"
+                            "       [--jitter MS] [--stall C:S:D] [--restart C:S:D] [--seed N]\n", argv[0]);
+            return 2;
+        }
+        i++;
+    }
+    if (options.controllers < 2 || options.controllers > 16 || options.stations < 2 ||
+        options.trains < 1 || options.trains > options.controllers * options.stations / 2) {
+        fprintf(stderr, "2 to 16 controllers, 2 or more stations each, at most one train per two stations\n");
+        return 2;
+    }
+    if (options.faultController >= options.controllers) {
+        fprintf(stderr, "no controller %d\n", options.faultController);
+        return 2;
+    }
+
+    bool clean = true;
+    if (custom) {
+        clean = runScenario(options.faultController < 0 ? "custom" : options.restart ? "restart" : "stall", options);
+        return clean ? 0 : 1;
+    }
+
+    clean &= runScenario("clean", options);
+    Options lossy = options;
+    lossy.loss = 0.2;
+    lossy.jitter = 5;
+    clean &= runScenario("lossy", lossy);
+    Options stall = options;
+    stall.faultController = 1;
+    stall.faultStart = options.seconds * 1000 / 2;
+    stall.faultMillis = 2000;
+    clean &= runScenario("stall", stall);
+    Options restart = stall;
+    restart.faultController = 2 % options.controllers;
+    restart.faultMillis = 1500;
+    restart.restart = true;
+    clean &= runScenario("restart", restart);
+    return clean ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+// Minimal Arduino core for compiling the firmware on the host. Time, pins and
+// the radio are backed by SimHost / RadioSim.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef int esp_err_t;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define DEC 10
+#define HEX 16
+#define SERIAL_8N1 0x800001c
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#define IRAM_ATTR
+// Grouped in one section so valley_sim can carry RTC memory across a simulated reset
+#define RTC_NOINIT_ATTR __attribute__((section("rtc_noinit")))
+
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+using std::min;
+using std::max;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+uint32_t getCpuFrequencyMhz();
+
+// LEDC PWM (Arduino-ESP32 2.x API)
+double ledcSetup(uint8_t channel, double freq, uint8_t resolutionBits);
+void ledcAttachPin(uint8_t pin, uint8_t channel);
+void ledcDetachPin(uint8_t pin);
+void ledcWrite(uint8_t channel, uint32_t duty);
+
+// Cycle counter at the simulated 240 MHz, from the node clock; restart()
+// returns, the simulation resets the node (ESP_RST_SW) after the loop pass
+class EspClass {
+public:
+    uint32_t getCycleCount();
+    void restart();
+};
+extern EspClass ESP;
+
+enum { ESP_MAC_WIFI_STA = 0 };
+esp_err_t esp_read_mac(uint8_t *mac, int type);
+
+// Critical sections: the simulation runs callbacks on the same thread as loop()
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux) ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux) ((void)(mux))
+
+class String : public std::string {
+public:
+    String() {}
+    String(const char *text) : std::string(text) {}
+    String(const std::string &text) : std::string(text) {}
+    String(char c) : std::string(1, c) {}
+    String(int value) : std::string(std::to_string(value)) {}
+    String(unsigned int value) : std::string(std::to_string(value)) {}
+    String(long value) : std::string(std::to_string(value)) {}
+    String(unsigned long value) : std::string(std::to_string(value)) {}
+    String(float value, unsigned int decimals = 2) : std::string(format(value, decimals)) {}
+    String(double value, unsigned int decimals = 2) : std::string(format(value, decimals)) {}
+    String operator+(const String &other) const { return String(std::string(*this) + std::string(other)); }
+    String operator+(const char *other) const { return String(std::string(*this) + other); }
+    friend String operator+(const char *left, const String &right) { return String(std::string(left) + std::string(right)); }
+
+private:
+    static std::string format(double value, unsigned int decimals) {
+        char buffer[48];
+        snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, value);
+        return buffer;
+    }
+};
+
+class HostSerial {
+public:
+    HostSerial(bool echo = true) : echo(echo) {}
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rx = -1, int8_t tx = -1) {
+        (void)baud; (void)config; (void)rx; (void)tx;
+    }
+    int available();                     // What simSerialInput() typed into the node's Serial
+    int read();
+    void flush() {}
+    // Bytes written as data are captured (simCaptureSerial) but not echoed, they are not text
+    size_t write(uint8_t c) { emit(std::string(1, (char)c), true); return 1; }
+    size_t write(const uint8_t *data, size_t len) { emit(std::string((const char *)data, len), true); return len; }
+
+    void print(const char *text) { emit(text); }
+    void print(const String &text) { emit(text); }
+    void print(char c) { emit(std::string(1, c)); }
+    void print(int value, int base = DEC) { printNumber((long long)value, base); }
+    void print(unsigned int value, int base = DEC) { printNumber((unsigned long long)value, base); }
+    void print(long value, int base = DEC) { printNumber((long long)value, base); }
+    void print(unsigned long value, int base = DEC) { printNumber((unsigned long long)value, base); }
+    void print(long long value, int base = DEC) { printNumber(value, base); }
+    void print(unsigned long long value, int base = DEC) { printNumber(value, base); }
+    void print(double value, int decimals = 2) { emit(String(value, decimals)); }
+
+    void println() { emit("\n"); }
+    template <typename T> void println(T value) { print(value); println(); }
+    template <typename T> void println(T value, int format) { print(value, format); println(); }
+
+private:
+    void printNumber(long long value, int base) {
+        if (value < 0) { emit("-"); value = -value; }
+        printNumber((unsigned long long)value, base);
+    }
+    void printNumber(unsigned long long value, int base) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), base == HEX ? "%llX" : "%llu", value);
+        emit(buffer);
+    }
+    void emit(const std::string &text, bool data = false);
+    bool echo;
+    bool atLineStart = true;
+};
+
+typedef HostSerial HardwareSerial;
+extern HostSerial Serial;
+extern HostSerial Serial2;
+
+#endif // SIM_ARDUINO_H
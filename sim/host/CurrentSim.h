@@ -0,0 +1,34 @@
+#ifndef SIM_CURRENT_SIM_H
+#define SIM_CURRENT_SIM_H
+
+#include <stdint.h>
+#include <math.h>
+#include <random>
+
+// Synthetic motor current for the ADC stand-in (simSetAdcReader), in the
+// units of the controller's shunt amplifier (lib/MOTOR_CURRENT). A permanent
+// magnet motor draws its friction load at any steady speed, plus what the
+// drive voltage left over by the back-EMF pushes through the winding.
+
+#define SIM_MOTOR_RUN_MA 250.0            // Friction load at a steady speed
+#define SIM_MOTOR_STALL_MA 1000.0         // On top of it with the rotor held at full drive
+#define SIM_MOTOR_NOISE_MA 40.0           // Brush and PWM noise, standard deviation
+#define SIM_MOTOR_SHORT_MA 3000.0         // Short across the track, up to the supply's limit
+#define SIM_ADC_MICROAMPS_PER_COUNT 760.0 // CURRENT_MICROAMPS_PER_COUNT
+
+// drive 0..1; speed as a share of the speed full drive reaches, negative when
+// the train rolls against the drive. Coasting faster than the drive pushes
+// feeds back through the bridge diodes, which the shunt does not see.
+inline double simMotorMilliamps(double drive, double speed) {
+    if (drive <= 0) return 0;
+    double current = SIM_MOTOR_RUN_MA + SIM_MOTOR_STALL_MA * (drive - speed);
+    return current > 0 ? current : 0;
+}
+
+inline uint16_t simCurrentCounts(double milliamps, std::mt19937 &rng) {
+    std::normal_distribution<double> noise(0.0, SIM_MOTOR_NOISE_MA);
+    double counts = (milliamps + noise(rng)) * 1000.0 / SIM_ADC_MICROAMPS_PER_COUNT;
+    return counts <= 0 ? 0 : counts >= 4095 ? 4095 : (uint16_t)counts;
+}
+
+#endif // SIM_CURRENT_SIM_H
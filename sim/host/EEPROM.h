@@ -0,0 +1,17 @@
+#ifndef SIM_EEPROM_H
+#define SIM_EEPROM_H
+
+#include <stdint.h>
+
+// EEPROM emulation, one image per simulated node (SimNode::eeprom)
+class EEPROMClass {
+public:
+    bool begin(int size) { (void)size; return true; }
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+    bool commit() { return true; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif // SIM_EEPROM_H
@@ -0,0 +1,28 @@
+#ifndef SIM_FASTLED_H
+#define SIM_FASTLED_H
+
+#include <stdint.h>
+
+// LEDs are not simulated, only the types the firmware uses
+struct CRGB {
+    uint8_t r, g, b;
+    enum HTMLColorCode { Black = 0x000000, Red = 0xFF0000, Green = 0x008000, Blue = 0x0000FF };
+    CRGB() : r(0), g(0), b(0) {}
+    CRGB(uint8_t r, uint8_t g, uint8_t b) : r(r), g(g), b(b) {}
+    CRGB(HTMLColorCode code) : r((code >> 16) & 0xFF), g((code >> 8) & 0xFF), b(code & 0xFF) {}
+};
+
+enum EOrder { RGB, GRB };
+
+template <uint8_t DATA_PIN, EOrder RGB_ORDER> class WS2812B {};
+
+class CFastLED {
+public:
+    template <template <uint8_t, EOrder> class CHIPSET, uint8_t DATA_PIN, EOrder RGB_ORDER>
+    void addLeds(CRGB *leds, int count) { (void)leds; (void)count; }
+    void show() {}
+};
+
+extern CFastLED FastLED;
+
+#endif // SIM_FASTLED_H
@@ -0,0 +1,25 @@
+#ifndef SIM_PREFERENCES_H
+#define SIM_PREFERENCES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// NVS (Preferences) emulation, one key/value store per simulated node (SimNode::nvs)
+class Preferences {
+public:
+    bool begin(const char *name, bool readOnly = false);
+    void end();
+    size_t getBytesLength(const char *key);
+    size_t getBytes(const char *key, void *buffer, size_t maxLength);
+    size_t putBytes(const char *key, const void *value, size_t length);
+    bool isKey(const char *key);
+    bool remove(const char *key);
+
+private:
+    std::string space;
+    bool readOnly = true;
+    bool open = false;
+};
+
+#endif // SIM_PREFERENCES_H
@@ -0,0 +1,200 @@
+#include "RadioSim.h"
+#include <esp_now.h>
+#include <esp_wifi.h>
+#include <string.h>
+
+RadioSim radioSim;
+
+static const uint8_t broadcastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+void RadioSim::configure(const RadioConfig &config, uint32_t seed) {
+    settings = config;
+    rng.seed(seed);
+}
+
+void RadioSim::reset() {
+    while (!queue.empty()) queue.pop();
+    stats = RadioStats();
+    tap = nullptr;
+    linkLoss = nullptr;
+}
+
+void RadioSim::send(SimNode *from, const uint8_t *to, const uint8_t *data, int len) {
+    stats.sent++;
+    if (tap) tap(from, to, data, len);
+    bool broadcast = memcmp(to, broadcastMac, 6) == 0;
+    for (SimNode *node : simNodes()) {
+        if (node == from || !node->espNowReady) continue;
+        if (!broadcast && memcmp(node->mac, to, 6) != 0) continue;
+        if (linkLoss) {
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            if (uniform(rng) < linkLoss(from, node)) {
+                stats.lost++;
+                continue;
+            }
+        }
+        schedule(from->mac, from->rssi, node, data, len, true, simNow());
+    }
+}
+
+void RadioSim::inject(uint64_t atMicros, const uint8_t *fromMac, const uint8_t *toMac, const uint8_t *data, int len, bool exact) {
+    stats.injected++;
+    bool broadcast = memcmp(toMac, broadcastMac, 6) == 0;
+    for (SimNode *node : simNodes()) {
+        if (!broadcast && memcmp(node->mac, toMac, 6) != 0) continue;
+        schedule(fromMac, -70, node, data, len, !exact, atMicros);
+    }
+}
+
+void RadioSim::schedule(const uint8_t *fromMac, int8_t rssi, SimNode *to, const uint8_t *data, int len, bool impaired, uint64_t at) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    int copies = 1;
+
+    if (impaired) {
+        if (uniform(rng) < settings.lossChance) {
+            stats.lost++;
+            return;
+        }
+        if (uniform(rng) < settings.duplicateChance) {
+            stats.duplicated++;
+            copies = 2;
+        }
+    }
+
+    for (int copy = 0; copy < copies; copy++) {
+        RadioPacket packet;
+        packet.deliverAt = at;
+        if (impaired) {
+            std::exponential_distribution<double> jitter(1.0 / (settings.jitterMicros > 0 ? settings.jitterMicros : 1e-9));
+            double delay = settings.baseDelayMicros + (settings.jitterMicros > 0 ? jitter(rng) : 0.0);
+            if (uniform(rng) < settings.reorderChance) {
+                delay += settings.reorderDelayMicros * (0.5 + uniform(rng));
+                stats.reordered++;
+            }
+            packet.deliverAt += (uint64_t)delay;
+        }
+        packet.order = order++;
+        memcpy(packet.from, fromMac, 6);
+        packet.to = to;
+        packet.data.assign(data, data + len);
+        packet.rssi = (int8_t)(rssi + (uniform(rng) * 2.0 - 1.0) * settings.rssiNoise);
+        queue.push(packet);
+    }
+}
+
+uint64_t RadioSim::nextEventMicros() {
+    return queue.empty() ? UINT64_MAX : queue.top().deliverAt;
+}
+
+void RadioSim::deliverDue(uint64_t now) {
+    while (!queue.empty() && queue.top().deliverAt <= now) {
+        RadioPacket packet = queue.top();
+        queue.pop();
+        deliver(packet);
+    }
+}
+
+void RadioSim::deliver(const RadioPacket &packet) {
+    SimNode *node = packet.to;
+    if (!node->espNowReady || !node->recv) return;
+    stats.delivered++;
+
+    simRunAs(node, [&]() {
+        // The promiscuous callback sees the action frame first, like on the chip
+        if (node->promiscuous) {
+            uint8_t frame[sizeof(wifi_promiscuous_pkt_t) + 28] = {0};
+            wifi_promiscuous_pkt_t *pkt = (wifi_promiscuous_pkt_t *)frame;
+            uint8_t *header = frame + sizeof(wifi_promiscuous_pkt_t);
+            pkt->rx_ctrl.rssi = packet.rssi;
+            pkt->rx_ctrl.sig_len = 28 + packet.data.size();
+            memcpy(header + 10, packet.from, 6);   // addr2
+            header[24] = 127;                      // Vendor specific action, Espressif OUI
+            header[25] = 0x18;
+            header[26] = 0xFE;
+            header[27] = 0x34;
+            node->promiscuous(frame, WIFI_PKT_MGMT);
+        }
+        node->recv(packet.from, packet.data.data(), (int)packet.data.size());
+    });
+}
+
+// ---- ESP-NOW API for the current node ----
+
+esp_err_t esp_now_init() {
+    simCurrentNode()->espNowReady = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_deinit() {
+    simCurrentNode()->espNowReady = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+    simCurrentNode()->recv = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb) {
+    (void)cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer) {
+    if (peer == nullptr) return ESP_ERR_ESPNOW_ARG;
+    if (esp_now_is_peer_exist(peer->peer_addr)) return ESP_ERR_ESPNOW_EXIST;
+    std::array<uint8_t, 6> mac;
+    memcpy(mac.data(), peer->peer_addr, 6);
+    simCurrentNode()->peers.push_back(mac);
+    return ESP_OK;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr) {
+    std::vector<std::array<uint8_t, 6>> &peers = simCurrentNode()->peers;
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (memcmp(peers[i].data(), peer_addr, 6) == 0) {
+            peers.erase(peers.begin() + i);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *peer_addr) {
+    for (const std::array<uint8_t, 6> &peer : simCurrentNode()->peers) {
+        if (memcmp(peer.data(), peer_addr, 6) == 0) return true;
+    }
+    return false;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len) {
+    SimNode *node = simCurrentNode();
+    if (!node->espNowReady) return ESP_ERR_ESPNOW_NOT_INIT;
+    if (len == 0 || len > ESP_NOW_MAX_DATA_LEN) return ESP_ERR_ESPNOW_ARG;
+
+    // NULL sends to every peer, like the real API
+    if (peer_addr == nullptr) {
+        for (const std::array<uint8_t, 6> &peer : node->peers) {
+            radioSim.send(node, peer.data(), data, (int)len);
+        }
+        return ESP_OK;
+    }
+    if (!esp_now_is_peer_exist(peer_addr)) return ESP_ERR_ESPNOW_NOT_FOUND;
+    radioSim.send(node, peer_addr, data, (int)len);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous_filter(const wifi_promiscuous_filter_t *filter) {
+    (void)filter;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb) {
+    simCurrentNode()->promiscuous = (SimPromiscuousCallback)cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous(bool enable) {
+    (void)enable;
+    return ESP_OK;
+}
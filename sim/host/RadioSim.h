@@ -0,0 +1,75 @@
+#ifndef RADIO_SIM_H
+#define RADIO_SIM_H
+
+#include <stdint.h>
+#include <vector>
+#include <queue>
+#include <random>
+#include <functional>
+#include "SimHost.h"
+
+// Stand-in for the ESP-NOW radio. esp_now_send() from any simulated node ends
+// up here, every copy gets its own fate (loss, duplication, delay jitter, being
+// held back so later packets overtake it) and is delivered to the receiver's
+// callback at its arrival time. Packets can also be injected from senders that
+// do not exist as nodes (scripted or spoofed traffic).
+
+struct RadioConfig {
+    double lossChance = 0.0;          // Per copy
+    double duplicateChance = 0.0;     // A second copy is delivered
+    double baseDelayMicros = 900.0;   // Air time + both stacks
+    double jitterMicros = 100.0;      // Mean of the exponential queueing jitter
+    double reorderChance = 0.0;       // Copy is held back reorderDelayMicros so later packets overtake it
+    double reorderDelayMicros = 20000.0;
+    double rssiNoise = 3.0;           // dB, uniform +/-
+};
+
+struct RadioStats {
+    uint32_t sent = 0;
+    uint32_t lost = 0;
+    uint32_t duplicated = 0;
+    uint32_t reordered = 0;
+    uint32_t delivered = 0;
+    uint32_t injected = 0;
+};
+
+struct RadioPacket {
+    uint64_t deliverAt;
+    uint64_t order;                   // Tie breaker, keeps equal times FIFO
+    uint8_t from[6];
+    SimNode *to;
+    std::vector<uint8_t> data;
+    int8_t rssi;
+    bool operator>(const RadioPacket &other) const {
+        return deliverAt != other.deliverAt ? deliverAt > other.deliverAt : order > other.order;
+    }
+};
+
+class RadioSim {
+public:
+    void configure(const RadioConfig &config, uint32_t seed);
+    const RadioConfig &config() const { return settings; }
+    void send(SimNode *from, const uint8_t *to, const uint8_t *data, int len);
+    // Deliver data from any MAC at a fixed time (no impairments applied when exact is true)
+    void inject(uint64_t atMicros, const uint8_t *fromMac, const uint8_t *toMac, const uint8_t *data, int len, bool exact = true);
+    uint64_t nextEventMicros();
+    void deliverDue(uint64_t now);
+    void reset();
+    RadioStats stats;
+    // Sees every esp_now_send() before impairments, for measurements in the scenario
+    std::function<void(SimNode *from, const uint8_t *to, const uint8_t *data, int len)> tap;
+    // Extra loss chance of one link on top of lossChance (distance, obstacles)
+    std::function<double(SimNode *from, SimNode *to)> linkLoss;
+
+private:
+    void schedule(const uint8_t *fromMac, int8_t rssi, SimNode *to, const uint8_t *data, int len, bool impaired, uint64_t at);
+    void deliver(const RadioPacket &packet);
+    RadioConfig settings;
+    std::mt19937 rng;
+    uint64_t order = 0;
+    std::priority_queue<RadioPacket, std::vector<RadioPacket>, std::greater<RadioPacket>> queue;
+};
+
+extern RadioSim radioSim;
+
+#endif // RADIO_SIM_H
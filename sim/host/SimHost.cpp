@@ -0,0 +1,712 @@
+#include "SimHost.h"
+#include "RadioSim.h"
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <esp_system.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
+#include <driver/adc.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <FastLED.h>
+#include <freertos/task.h>
+#include <string.h>
+#include <math.h>
+#include <ucontext.h>
+#include <algorithm>
+
+bool simVerbose = false;
+
+static std::vector<SimNode *> nodes;
+static SimNode *currentNode = nullptr;
+static uint64_t nowMicros = 0;
+static std::function<void()> worldTick;
+static uint64_t worldPeriod = 1000;
+static uint64_t nextWorldTick = 0;
+static bool inWorld = false;
+static std::function<int(SimNode *, uint8_t)> inputReader;
+static std::function<void(SimNode *, uint8_t, uint8_t)> pinWatcher;
+static std::function<uint16_t(SimNode *, uint8_t)> adcReader;
+
+struct esp_timer {
+    SimNode *node;
+    esp_timer_cb_t callback;
+    void *arg;
+    uint64_t period;
+    uint64_t next;             // True time of the next call
+    bool running;
+};
+static std::vector<esp_timer *> timers;
+
+#define SIM_TASK_STACK (256 * 1024)     // Host code and the sanitizers need far more than the board
+#define SIM_STACK_PAINT 0xA5            // Stack bytes never used keep it, as FreeRTOS fills its stacks
+#define SIM_LOOP_STACK 8192             // Board stack sizes, reported for the tasks without a host stack
+#define SIM_IDLE_STACK 1536
+#define SIM_LOOP_CORE 1                 // CONFIG_ARDUINO_RUNNING_CORE
+
+struct SimTask {
+    SimNode *node;
+    TaskFunction_t function;
+    void *arg;
+    ucontext_t context;
+    char *stack;               // nullptr for loopTask and the idle tasks
+    uint64_t next;             // True time it runs again
+    bool done;                 // The function returned
+    const char *name;
+    uint32_t stackDepth;
+    UBaseType_t priority;
+    BaseType_t core;
+    UBaseType_t number;
+};
+static std::vector<SimTask *> tasks;
+static UBaseType_t taskNumbers = 0;
+
+// The tasks every board runs without creating them
+struct SimBoardTasks {
+    SimTask loop;
+    SimTask idle[portNUM_PROCESSORS];
+    uint64_t loopDelayMicros;  // Spent in delay() by loop(), since the last reset
+};
+static std::map<SimNode *, SimBoardTasks> boardTasks;
+static SimTask *runningTask = nullptr;
+static ucontext_t schedulerContext;
+static void runDueTasks();
+
+SimNode *simAddNode(const char *name, const uint8_t *mac, double driftPpm, double offsetMicros) {
+    SimNode *node = new SimNode();
+    node->name = name;
+    memcpy(node->mac, mac, 6);
+    node->driftPpm = driftPpm;
+    node->offsetMicros = offsetMicros;
+    node->rssi = -60;
+    memset(node->pins, HIGH, sizeof(node->pins));
+    memset(node->pinModes, INPUT, sizeof(node->pinModes));
+    memset(node->pinChannel, -1, sizeof(node->pinChannel));
+    memset(node->ledcDuty, 0, sizeof(node->ledcDuty));
+    memset(node->ledcBits, 0, sizeof(node->ledcBits));
+    node->espNowReady = false;
+    node->promiscuous = nullptr;
+    memset(node->eeprom, 0, sizeof(node->eeprom));
+    node->nvsWrites = 0;
+    node->resetReason = ESP_RST_POWERON;
+    node->adcRunning = false;
+    node->adcRate = 0;
+    node->serialCapture = nullptr;
+    nodes.push_back(node);
+    if (currentNode == nullptr) currentNode = node;
+    return node;
+}
+
+SimNode *simFindNode(const uint8_t *mac) {
+    for (SimNode *node : nodes) {
+        if (memcmp(node->mac, mac, 6) == 0) return node;
+    }
+    return nullptr;
+}
+
+std::vector<SimNode *> &simNodes() {
+    return nodes;
+}
+
+SimNode *simCurrentNode() {
+    return currentNode;
+}
+
+void simSetCurrentNode(SimNode *node) {
+    currentNode = node;
+}
+
+void simRunAs(SimNode *node, const std::function<void()> &fn) {
+    SimNode *previous = currentNode;
+    currentNode = node;
+    fn();
+    currentNode = previous;
+}
+
+uint64_t simNow() {
+    return nowMicros;
+}
+
+uint64_t simLocalMicros(SimNode *node) {
+    if (node == nullptr) return nowMicros;
+    double local = nowMicros * (1.0 + node->driftPpm * 1e-6) + node->offsetMicros;
+    return local < 0 ? 0 : (uint64_t)local;
+}
+
+void simSetWorld(const std::function<void()> &tick, uint64_t periodMicros) {
+    worldTick = tick;
+    worldPeriod = periodMicros;
+    nextWorldTick = nowMicros + periodMicros;
+}
+
+void simSetInputReader(const std::function<int(SimNode *, uint8_t)> &reader) {
+    inputReader = reader;
+}
+
+void simSetPinWatcher(const std::function<void(SimNode *, uint8_t, uint8_t)> &watcher) {
+    pinWatcher = watcher;
+}
+
+void simSetAdcReader(const std::function<uint16_t(SimNode *, uint8_t)> &reader) {
+    adcReader = reader;
+}
+
+void simAdvance(uint64_t micros) {
+    uint64_t target = nowMicros + micros;
+
+    // Radio callbacks and the world can call delay() themselves; that only moves the clock
+    if (inWorld) {
+        nowMicros = target;
+        return;
+    }
+
+    inWorld = true;
+    while (true) {
+        uint64_t next = target;
+        if (worldTick && nextWorldTick < next) next = nextWorldTick;
+        uint64_t radioNext = radioSim.nextEventMicros();
+        if (radioNext < next) next = radioNext;
+        for (esp_timer *timer : timers) {
+            if (timer->running && timer->next < next) next = timer->next;
+        }
+        for (SimTask *task : tasks) {
+            if (!task->done && task->next < next) next = task->next;
+        }
+        if (next > nowMicros) nowMicros = next;
+
+        radioSim.deliverDue(nowMicros);
+        for (size_t i = 0; i < timers.size(); i++) {
+            esp_timer *timer = timers[i];
+            if (!timer->running || nowMicros < timer->next) continue;
+            timer->next += timer->period;
+            simRunAs(timer->node, [timer]() { timer->callback(timer->arg); });
+        }
+        runDueTasks();
+        if (worldTick && nowMicros >= nextWorldTick) {
+            nextWorldTick += worldPeriod;
+            worldTick();
+        }
+        if (nowMicros >= target) break;
+    }
+    inWorld = false;
+}
+
+// ---- Arduino core stand-ins ----
+
+HostSerial Serial;
+HostSerial Serial2(false);
+
+unsigned long millis() {
+    return (unsigned long)(uint32_t)(simLocalMicros(currentNode) / 1000);
+}
+
+unsigned long micros() {
+    return (unsigned long)(uint32_t)simLocalMicros(currentNode);
+}
+
+void delay(unsigned long ms) {
+    if (!inWorld && runningTask == nullptr && currentNode != nullptr) boardTasks[currentNode].loopDelayMicros += (uint64_t)ms * 1000;
+    simAdvance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    simAdvance(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if (currentNode == nullptr || pin >= SIM_MAX_PINS) return;
+    currentNode->pinModes[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    if (currentNode == nullptr || pin >= SIM_MAX_PINS) return;
+    uint8_t level = value ? HIGH : LOW;
+    if (currentNode->pins[pin] == level) return;
+    currentNode->pins[pin] = level;
+    if (pinWatcher) pinWatcher(currentNode, pin, level);
+}
+
+int digitalRead(uint8_t pin) {
+    if (currentNode == nullptr || pin >= SIM_MAX_PINS) return LOW;
+    if (currentNode->pinModes[pin] == OUTPUT) return currentNode->pins[pin];
+    if (inputReader) return inputReader(currentNode, pin);
+    return HIGH;
+}
+
+double simPinDuty(SimNode *node, uint8_t pin) {
+    if (node == nullptr || pin >= SIM_MAX_PINS) return 0;
+    int channel = node->pinChannel[pin];
+    if (channel < 0) return node->pins[pin] == HIGH ? 1.0 : 0.0;
+    return (double)node->ledcDuty[channel] / (1u << node->ledcBits[channel]);
+}
+
+void simResetNode(SimNode *node) {
+    memset(node->pins, HIGH, sizeof(node->pins));
+    memset(node->pinModes, INPUT, sizeof(node->pinModes));
+    memset(node->pinChannel, -1, sizeof(node->pinChannel));
+    memset(node->ledcDuty, 0, sizeof(node->ledcDuty));
+    node->adcRunning = false;
+    // The firmware that created the timers is gone with the reset
+    for (size_t i = 0; i < timers.size();) {
+        if (timers[i]->node == node) {
+            delete timers[i];
+            timers.erase(timers.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    // Its tasks too; they are parked in vTaskDelay() and never switched to again
+    for (size_t i = 0; i < tasks.size();) {
+        if (tasks[i]->node == node) {
+            delete[] tasks[i]->stack;
+            delete tasks[i];
+            tasks.erase(tasks.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    node->serialInput.clear();
+    boardTasks[node].loopDelayMicros = 0;
+}
+
+void simCaptureSerial(SimNode *node, FILE *file) {
+    node->serialCapture = file;
+}
+
+void simSerialInput(SimNode *node, const std::string &text) {
+    node->serialInput += text;
+}
+
+// ---- FreeRTOS tasks ----
+
+static SimTask *startingTask = nullptr;
+
+static void taskEntry() {
+    SimTask *task = startingTask;
+    task->function(task->arg);
+    task->done = true;
+    swapcontext(&task->context, &schedulerContext);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+    SimTask *task = new SimTask();
+    task->node = currentNode;
+    task->function = function;
+    task->arg = arg;
+    task->stack = new char[SIM_TASK_STACK];
+    memset(task->stack, SIM_STACK_PAINT, SIM_TASK_STACK);
+    task->next = nowMicros;
+    task->done = false;
+    task->name = name;
+    task->stackDepth = stackDepth;
+    task->priority = priority;
+    task->core = core;
+    task->number = ++taskNumbers;
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = task->stack;
+    task->context.uc_stack.ss_size = SIM_TASK_STACK;
+    task->context.uc_link = nullptr;
+    makecontext(&task->context, taskEntry, 0);
+    tasks.push_back(task);
+    if (handle) *handle = task;
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    SimTask *task = runningTask;
+    if (task == nullptr) {
+        delay(ticks);
+        return;
+    }
+    task->next = nowMicros + (uint64_t)(ticks > 0 ? ticks : 1) * 1000;
+    swapcontext(&task->context, &schedulerContext);
+}
+
+static SimBoardTasks &board(SimNode *node) {
+    SimBoardTasks &board = boardTasks[node];
+    if (board.loop.number == 0) {
+        board.loop = {node, nullptr, nullptr, {}, nullptr, 0, false, "loopTask", SIM_LOOP_STACK, 1, SIM_LOOP_CORE, ++taskNumbers};
+        board.idle[0] = {node, nullptr, nullptr, {}, nullptr, 0, false, "IDLE0", SIM_IDLE_STACK, tskIDLE_PRIORITY, 0, ++taskNumbers};
+        board.idle[1] = {node, nullptr, nullptr, {}, nullptr, 0, false, "IDLE1", SIM_IDLE_STACK, tskIDLE_PRIORITY, 1, ++taskNumbers};
+    }
+    return board;
+}
+
+static uint32_t stackNeverUsed(const SimTask *task) {
+    if (task->stack == nullptr) return task->stackDepth;
+    uint32_t bytes = 0;
+    while (bytes < SIM_TASK_STACK && (uint8_t)task->stack[bytes] == SIM_STACK_PAINT) bytes++;
+    return bytes;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks() {
+    UBaseType_t count = 1 + portNUM_PROCESSORS;
+    for (SimTask *task : tasks) {
+        if (task->node == currentNode && !task->done) count++;
+    }
+    return count;
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *status, UBaseType_t size, uint32_t *totalRunTime) {
+    SimBoardTasks &tasksOf = board(currentNode);
+    uint32_t now = micros();
+    uint32_t loopDelay = (uint32_t)std::min<uint64_t>(tasksOf.loopDelayMicros, now);
+    std::vector<std::pair<SimTask *, uint32_t>> list = {
+        {&tasksOf.loop, now - loopDelay}, {&tasksOf.idle[0], now}, {&tasksOf.idle[1], loopDelay}};
+    for (SimTask *task : tasks) {
+        if (task->node == currentNode && !task->done) list.push_back({task, 0});
+    }
+    if (list.size() > size) return 0;
+
+    for (size_t i = 0; i < list.size(); i++) {
+        SimTask *task = list[i].first;
+        status[i] = {task, task->name, task->number, task == runningTask ? eRunning : eBlocked, task->priority,
+                     task->priority, list[i].second, (uint8_t *)task->stack, stackNeverUsed(task), task->core};
+    }
+    if (runningTask == nullptr) status[0].eCurrentState = eRunning;
+    if (totalRunTime) *totalRunTime = now;
+    return list.size();
+}
+
+BaseType_t xTaskGetAffinity(TaskHandle_t task) {
+    return task->core;
+}
+
+TaskHandle_t xTaskGetIdleTaskHandleForCPU(UBaseType_t core) {
+    return &board(currentNode).idle[core < portNUM_PROCESSORS ? core : 0];
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return runningTask != nullptr ? runningTask : &board(currentNode).loop;
+}
+
+BaseType_t xPortGetCoreID() {
+    if (runningTask == nullptr) return SIM_LOOP_CORE;
+    return runningTask->core == tskNO_AFFINITY ? 0 : runningTask->core;
+}
+
+// Every task that is due runs until its next vTaskDelay()
+static void runDueTasks() {
+    for (size_t i = 0; i < tasks.size(); i++) {
+        SimTask *task = tasks[i];
+        if (task->done || nowMicros < task->next) continue;
+        simRunAs(task->node, [task]() {
+            runningTask = task;
+            startingTask = task;
+            swapcontext(&schedulerContext, &task->context);
+            runningTask = nullptr;
+        });
+    }
+}
+
+// ---- LEDC ----
+
+double ledcSetup(uint8_t channel, double freq, uint8_t resolutionBits) {
+    if (currentNode == nullptr || channel >= SIM_LEDC_CHANNELS) return 0;
+    currentNode->ledcBits[channel] = resolutionBits;
+    currentNode->ledcDuty[channel] = 0;
+    return freq;
+}
+
+void ledcAttachPin(uint8_t pin, uint8_t channel) {
+    if (currentNode == nullptr || pin >= SIM_MAX_PINS || channel >= SIM_LEDC_CHANNELS) return;
+    currentNode->pinChannel[pin] = channel;
+    currentNode->pinModes[pin] = OUTPUT;
+}
+
+void ledcDetachPin(uint8_t pin) {
+    if (currentNode == nullptr || pin >= SIM_MAX_PINS) return;
+    currentNode->pinChannel[pin] = -1;
+}
+
+void ledcWrite(uint8_t channel, uint32_t duty) {
+    if (currentNode == nullptr || channel >= SIM_LEDC_CHANNELS) return;
+    if (currentNode->ledcDuty[channel] == duty) return;
+    currentNode->ledcDuty[channel] = duty;
+    uint32_t full = 1u << currentNode->ledcBits[channel];
+    for (uint8_t pin = 0; pin < SIM_MAX_PINS; pin++) {
+        if (currentNode->pinChannel[pin] != channel) continue;
+        currentNode->pins[pin] = duty >= full ? HIGH : LOW;
+        if (pinWatcher) pinWatcher(currentNode, pin, currentNode->pins[pin]);
+    }
+}
+
+// ---- ADC DMA ----
+
+esp_err_t adc_digi_initialize(const adc_digi_init_config_t *init_config) {
+    if (currentNode == nullptr) return ESP_FAIL;
+    currentNode->adcBufferSamples = init_config->max_store_buf_size / SOC_ADC_DIGI_RESULT_BYTES;
+    currentNode->adcRunning = false;
+    return ESP_OK;
+}
+
+esp_err_t adc_digi_controller_configure(const adc_digi_configuration_t *config) {
+    if (currentNode == nullptr || config->pattern_num < 1 || config->sample_freq_hz == 0) return ESP_FAIL;
+    currentNode->adcChannel = config->adc_pattern[0].channel;
+    currentNode->adcRate = config->sample_freq_hz;
+    return ESP_OK;
+}
+
+esp_err_t adc_digi_start() {
+    if (currentNode == nullptr || currentNode->adcRate == 0) return ESP_FAIL;
+    currentNode->adcRunning = true;
+    currentNode->adcStartMicros = nowMicros;
+    currentNode->adcTaken = 0;
+    return ESP_OK;
+}
+
+esp_err_t adc_digi_stop() {
+    if (currentNode == nullptr) return ESP_FAIL;
+    currentNode->adcRunning = false;
+    return ESP_OK;
+}
+
+esp_err_t adc_digi_deinitialize() {
+    return adc_digi_stop();
+}
+
+esp_err_t adc_digi_read_bytes(uint8_t *buf, uint32_t length_max, uint32_t *out_length, uint32_t timeout_ms) {
+    (void)timeout_ms;
+    *out_length = 0;
+    SimNode *node = currentNode;
+    if (node == nullptr || !node->adcRunning) return ESP_ERR_INVALID_STATE;
+
+    uint64_t converted = (nowMicros - node->adcStartMicros) * node->adcRate / 1000000;
+    bool overflow = converted - node->adcTaken > node->adcBufferSamples;
+    if (overflow) node->adcTaken = converted - node->adcBufferSamples;
+
+    uint64_t count = std::min<uint64_t>(converted - node->adcTaken, length_max / SOC_ADC_DIGI_RESULT_BYTES);
+    if (count == 0) return ESP_ERR_TIMEOUT;
+    for (uint64_t i = 0; i < count; i++) {
+        adc_digi_output_data_t sample;
+        sample.type1.data = adcReader ? std::min<uint16_t>(adcReader(node, node->adcChannel), 4095) : 0;
+        sample.type1.channel = node->adcChannel;
+        memcpy(buf + i * SOC_ADC_DIGI_RESULT_BYTES, &sample, SOC_ADC_DIGI_RESULT_BYTES);
+    }
+    node->adcTaken += count;
+    *out_length = count * SOC_ADC_DIGI_RESULT_BYTES;
+    return overflow ? ESP_ERR_INVALID_STATE : ESP_OK;
+}
+
+// ---- esp_timer ----
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle) {
+    esp_timer *timer = new esp_timer();
+    timer->node = currentNode;
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    timer->period = 0;
+    timer->next = 0;
+    timer->running = false;
+    timers.push_back(timer);
+    *handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    timer->period = period;
+    timer->next = nowMicros + period;
+    timer->running = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    if (!timer->running) return ESP_FAIL;
+    timer->running = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    timers.erase(std::remove(timers.begin(), timers.end(), timer), timers.end());
+    delete timer;
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time() {
+    return (int64_t)simLocalMicros(currentNode);
+}
+
+uint32_t getCpuFrequencyMhz() {
+    return 240;
+}
+
+EspClass ESP;
+
+uint32_t EspClass::getCycleCount() {
+    return (uint32_t)(micros() * 240ULL);
+}
+
+void EspClass::restart() {
+    if (currentNode != nullptr) currentNode->restartRequested = true;
+}
+
+esp_reset_reason_t esp_reset_reason() {
+    if (currentNode == nullptr) return ESP_RST_UNKNOWN;
+    return (esp_reset_reason_t)currentNode->resetReason;
+}
+
+uint32_t esp_random() {
+    static uint64_t draws = 0;
+    uint64_t x = nowMicros + (++draws << 40);
+    if (currentNode != nullptr) {
+        for (int i = 0; i < 6; i++) x = x * 31 + currentNode->mac[i];
+    }
+    // splitmix64
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return (uint32_t)(x ^ (x >> 31));
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, int type) {
+    (void)type;
+    if (currentNode == nullptr) return ESP_FAIL;
+    memcpy(mac, currentNode->mac, 6);
+    return ESP_OK;
+}
+
+int HostSerial::available() {
+    if (this != &Serial || currentNode == nullptr) return 0;
+    return (int)currentNode->serialInput.size();
+}
+
+int HostSerial::read() {
+    if (this != &Serial || currentNode == nullptr || currentNode->serialInput.empty()) return -1;
+    uint8_t c = currentNode->serialInput[0];
+    currentNode->serialInput.erase(0, 1);
+    return c;
+}
+
+void HostSerial::emit(const std::string &text, bool data) {
+    if (this == &Serial && currentNode != nullptr && currentNode->serialCapture != nullptr) {
+        fwrite(text.data(), 1, text.size(), currentNode->serialCapture);
+    }
+    if (data || !echo || !simVerbose) return;
+    for (char c : text) {
+        if (atLineStart) {
+            printf("[%10.3f %-10s] ", nowMicros / 1e6, currentNode ? currentNode->name : "?");
+            atLineStart = false;
+        }
+        putchar(c);
+        if (c == '\n') atLineStart = true;
+    }
+}
+
+// ---- EEPROM ----
+
+EEPROMClass EEPROM;
+
+uint8_t EEPROMClass::read(int address) {
+    if (currentNode == nullptr || address < 0 || address >= SIM_EEPROM_SIZE) return 0;
+    return currentNode->eeprom[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+    if (currentNode == nullptr || address < 0 || address >= SIM_EEPROM_SIZE) return;
+    currentNode->eeprom[address] = value;
+}
+
+// ---- Preferences (NVS) ----
+
+bool Preferences::begin(const char *name, bool readOnlyMode) {
+    space = name;
+    readOnly = readOnlyMode;
+    open = currentNode != nullptr;
+    return open;
+}
+
+void Preferences::end() {
+    open = false;
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+    if (!open) return 0;
+    auto entry = currentNode->nvs.find(space + "/" + key);
+    return entry == currentNode->nvs.end() ? 0 : entry->second.size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buffer, size_t maxLength) {
+    if (!open) return 0;
+    auto entry = currentNode->nvs.find(space + "/" + key);
+    if (entry == currentNode->nvs.end() || entry->second.size() > maxLength) return 0;
+    memcpy(buffer, entry->second.data(), entry->second.size());
+    return entry->second.size();
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t length) {
+    if (!open || readOnly) return 0;
+    const uint8_t *bytes = (const uint8_t *)value;
+    currentNode->nvs[space + "/" + key].assign(bytes, bytes + length);
+    currentNode->nvsWrites++;
+    return length;
+}
+
+bool Preferences::isKey(const char *key) {
+    return open && currentNode->nvs.count(space + "/" + key) > 0;
+}
+
+bool Preferences::remove(const char *key) {
+    if (!open || readOnly) return false;
+    return currentNode->nvs.erase(space + "/" + key) > 0;
+}
+
+// ---- Flash partitions ----
+
+static const esp_partition_t simPartitionTable[] = {
+    {ESP_PARTITION_TYPE_DATA, 0x40, 0x290000, 0x160000, "journal"},
+};
+
+static std::vector<uint8_t> *partitionData(const esp_partition_t *partition) {
+    if (currentNode == nullptr || partition == nullptr) return nullptr;
+    std::vector<uint8_t> &data = currentNode->partitions[partition->label];
+    if (data.empty()) data.assign(partition->size, 0xFF);
+    return &data;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label) {
+    for (const esp_partition_t &partition : simPartitionTable) {
+        if (partition.type != type) continue;
+        if (subtype != ESP_PARTITION_SUBTYPE_ANY && partition.subtype != (int)subtype) continue;
+        if (label != nullptr && strcmp(label, partition.label)) continue;
+        return &partition;
+    }
+    return nullptr;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size) {
+    std::vector<uint8_t> *data = partitionData(partition);
+    if (data == nullptr || offset + size > data->size()) return ESP_FAIL;
+    memcpy(dst, data->data() + offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src, size_t size) {
+    std::vector<uint8_t> *data = partitionData(partition);
+    if (data == nullptr || offset + size > data->size()) return ESP_FAIL;
+    const uint8_t *bytes = (const uint8_t *)src;
+    for (size_t i = 0; i < size; i++) {
+        (*data)[offset + i] &= bytes[i];
+    }
+    size_t pages = (offset + size + 255) / 256 - offset / 256;
+    simAdvance(SIM_FLASH_WRITE_OVERHEAD_MICROS + pages * SIM_FLASH_PAGE_MICROS);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+    std::vector<uint8_t> *data = partitionData(partition);
+    if (data == nullptr || offset % 4096 || size % 4096 || offset + size > data->size()) return ESP_FAIL;
+    memset(data->data() + offset, 0xFF, size);
+    simAdvance((size / 4096) * SIM_FLASH_ERASE_MICROS);
+    return ESP_OK;
+}
+
+// ---- WiFi / FastLED ----
+
+WiFiClass WiFi;
+CFastLED FastLED;
+
+bool WiFiClass::mode(int mode) {
+    if (mode == WIFI_STA) simAdvance(SIM_WIFI_START_MICROS);
+    return true;
+}
@@ -0,0 +1,93 @@
+#ifndef SIM_HOST_H
+#define SIM_HOST_H
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include <array>
+#include <map>
+#include <string>
+
+// Host stand-in for the parts of the ESP32 the firmware touches: one simulated
+// true clock, per-node local clocks (offset + drift), per-node pins and the
+// ESP-NOW state. The firmware code runs unchanged against these.
+
+#define SIM_MAX_PINS 40
+#define SIM_EEPROM_SIZE 512
+#define SIM_LEDC_CHANNELS 16
+
+typedef std::function<void(const uint8_t *mac, const uint8_t *data, int len)> SimRecvHandler;
+typedef void (*SimPromiscuousCallback)(void *buf, int type);
+
+struct SimNode {
+    const char *name;
+    uint8_t mac[6];
+    double driftPpm;             // Local clock rate error
+    double offsetMicros;         // Local clock value at true time 0
+    int8_t rssi;                 // Mean RSSI others see from this node
+    uint8_t pins[SIM_MAX_PINS];  // Output levels written by the firmware
+    uint8_t pinModes[SIM_MAX_PINS];
+    int8_t pinChannel[SIM_MAX_PINS];   // LEDC channel driving the pin, -1 for a plain GPIO
+    uint32_t ledcDuty[SIM_LEDC_CHANNELS];
+    uint8_t ledcBits[SIM_LEDC_CHANNELS];
+    bool espNowReady;
+    SimRecvHandler recv;
+    SimPromiscuousCallback promiscuous;
+    std::vector<std::array<uint8_t, 6>> peers;
+    uint8_t eeprom[SIM_EEPROM_SIZE];
+    std::map<std::string, std::vector<uint8_t>> nvs; // "namespace/key" -> value
+    uint32_t nvsWrites;                              // putBytes() calls that reached "flash"
+    int resetReason;                                 // esp_reset_reason() of the current run
+    std::map<std::string, std::vector<uint8_t>> partitions; // Flash partitions by label, created on first use
+    bool adcRunning;                                 // ADC DMA started
+    uint8_t adcChannel;
+    uint32_t adcRate;                                // Samples per second
+    uint32_t adcBufferSamples;                       // Driver ring buffer size
+    uint64_t adcStartMicros;                         // True time of adc_digi_start()
+    uint64_t adcTaken;                               // Samples handed out or dropped since then
+    std::string serialInput;                         // Typed into its Serial, not read yet
+    FILE *serialCapture;                             // Gets all its Serial output, text and data, or nullptr
+    bool restartRequested;                           // ESP.restart() called, for the simulation to reset it
+};
+
+SimNode *simAddNode(const char *name, const uint8_t *mac, double driftPpm = 0, double offsetMicros = 0);
+SimNode *simFindNode(const uint8_t *mac);
+std::vector<SimNode *> &simNodes();
+SimNode *simCurrentNode();
+void simSetCurrentNode(SimNode *node);
+
+// Runs fn as node (its clock, pins and ESP-NOW state), then restores the previous node
+void simRunAs(SimNode *node, const std::function<void()> &fn);
+
+uint64_t simNow();                        // True time in microseconds
+uint64_t simLocalMicros(SimNode *node);   // Node clock in microseconds (not wrapped)
+void simAdvance(uint64_t micros);         // Move time forward, delivering radio events and world ticks
+
+// The world (train physics, station senders) is stepped every periodMicros of true time
+void simSetWorld(const std::function<void()> &tick, uint64_t periodMicros);
+
+// Level returned by digitalRead() for inputs, per node; default is HIGH (pull-ups)
+void simSetInputReader(const std::function<int(SimNode *node, uint8_t pin)> &reader);
+
+// Called on every digitalWrite() that changes a pin, with the writing node, and
+// on every ledcWrite() that changes the duty of a pin (value HIGH only at full duty)
+void simSetPinWatcher(const std::function<void(SimNode *node, uint8_t pin, uint8_t value)> &watcher);
+
+// Raw 12-bit reading of each ADC DMA sample of a node, taken when the firmware reads it
+void simSetAdcReader(const std::function<uint16_t(SimNode *node, uint8_t channel)> &reader);
+
+// Share of the time an output pin is HIGH: its LEDC duty, or 0 / 1 for a GPIO
+double simPinDuty(SimNode *node, uint8_t pin);
+
+// Text typed into the node's Serial, for Serial.available() / read()
+void simSerialInput(SimNode *node, const std::string &text);
+
+// Writes everything the node sends on Serial to file from now on (nullptr stops)
+void simCaptureSerial(SimNode *node, FILE *file);
+
+// Floats the node's pins, detaches LEDC, stops the ADC DMA and deletes its esp_timers and tasks, as a chip reset does
+void simResetNode(SimNode *node);
+
+extern bool simVerbose;                   // Echo Serial output of every node to stdout
+
+#endif // SIM_HOST_H
@@ -0,0 +1,18 @@
+#ifndef SIM_WIFI_H
+#define SIM_WIFI_H
+
+#define WIFI_OFF 0
+#define WIFI_STA 1
+
+// WiFi.mode(WIFI_STA) blocks while the driver starts and calibrates the radio
+#define SIM_WIFI_START_MICROS 80000
+
+class WiFiClass {
+public:
+    bool mode(int mode);
+    bool disconnect() { return true; }
+};
+
+extern WiFiClass WiFi;
+
+#endif // SIM_WIFI_H
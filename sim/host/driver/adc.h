@@ -0,0 +1,64 @@
+#ifndef SIM_DRIVER_ADC_H
+#define SIM_DRIVER_ADC_H
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// ADC DMA (continuous mode) stand-in, the IDF 4.4 adc_digi_* API. Samples
+// accumulate at the configured rate in simulated time and come from the
+// reader set with simSetAdcReader(). Reads never block: the timeout is ignored.
+
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_TIMEOUT 0x107
+#define SOC_ADC_DIGI_RESULT_BYTES 2
+#define SOC_ADC_DIGI_MAX_BITWIDTH 12
+
+typedef enum { ADC1_CHANNEL_0, ADC1_CHANNEL_1, ADC1_CHANNEL_2, ADC1_CHANNEL_3, ADC1_CHANNEL_4, ADC1_CHANNEL_5, ADC1_CHANNEL_6, ADC1_CHANNEL_7 } adc1_channel_t;
+typedef enum { ADC_ATTEN_DB_0, ADC_ATTEN_DB_2_5, ADC_ATTEN_DB_6, ADC_ATTEN_DB_11 } adc_atten_t;
+typedef enum { ADC_CONV_SINGLE_UNIT_1 = 1, ADC_CONV_SINGLE_UNIT_2 = 2 } adc_digi_convert_mode_t;
+typedef enum { ADC_DIGI_OUTPUT_FORMAT_TYPE1, ADC_DIGI_OUTPUT_FORMAT_TYPE2 } adc_digi_output_format_t;
+
+typedef struct {
+    uint32_t max_store_buf_size;          // Driver ring buffer, bytes
+    uint32_t conv_num_each_intr;          // Bytes per DMA interrupt
+    uint32_t adc1_chan_mask;
+    uint32_t adc2_chan_mask;
+} adc_digi_init_config_t;
+
+typedef struct {
+    uint8_t atten;
+    uint8_t channel;
+    uint8_t unit;
+    uint8_t bit_width;
+} adc_digi_pattern_config_t;
+
+typedef struct {
+    bool conv_limit_en;
+    uint32_t conv_limit_num;
+    uint32_t pattern_num;
+    adc_digi_pattern_config_t *adc_pattern;  // Only the first pattern is sampled
+    uint32_t sample_freq_hz;
+    adc_digi_convert_mode_t conv_mode;
+    adc_digi_output_format_t format;
+} adc_digi_configuration_t;
+
+typedef struct {
+    union {
+        struct {
+            uint16_t data : 12;
+            uint16_t channel : 4;
+        } type1;
+        uint16_t val;
+    };
+} adc_digi_output_data_t;
+
+esp_err_t adc_digi_initialize(const adc_digi_init_config_t *init_config);
+esp_err_t adc_digi_controller_configure(const adc_digi_configuration_t *config);
+esp_err_t adc_digi_start();
+esp_err_t adc_digi_stop();
+esp_err_t adc_digi_deinitialize();
+// ESP_ERR_TIMEOUT when nothing is buffered; ESP_ERR_INVALID_STATE with data when
+// the ring buffer overflowed since the last read and the oldest samples were dropped
+esp_err_t adc_digi_read_bytes(uint8_t *buf, uint32_t length_max, uint32_t *out_length, uint32_t timeout_ms);
+
+#endif // SIM_DRIVER_ADC_H
@@ -0,0 +1,39 @@
+#ifndef SIM_ESP_PARTITION_H
+#define SIM_ESP_PARTITION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Data partitions of partitions.csv, backed by per node storage (SimNode::partitions).
+// Writes only clear bits like NOR flash, and every call costs the time the
+// chip would stall (page program about 0.7 ms per 256 bytes, sector erase 45 ms).
+
+typedef int esp_err_t;
+
+typedef enum {
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum {
+    ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct {
+    esp_partition_type_t type;
+    int subtype;
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size);
+
+#define SIM_FLASH_PAGE_MICROS 700
+#define SIM_FLASH_WRITE_OVERHEAD_MICROS 100
+#define SIM_FLASH_ERASE_MICROS 45000
+
+#endif // SIM_ESP_PARTITION_H
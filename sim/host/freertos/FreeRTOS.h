@@ -0,0 +1,29 @@
+#ifndef SIM_FREERTOS_H
+#define SIM_FREERTOS_H
+
+#include <stdint.h>
+
+// FreeRTOS types for the task stand-in (freertos/task.h). One tick is 1 ms, as
+// configTICK_RATE_HZ 1000 on the board.
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdPASS 1
+#define pdFAIL 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portTICK_PERIOD_MS 1
+#define tskIDLE_PRIORITY 0
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+// As the Arduino-ESP32 core is configured
+#define portNUM_PROCESSORS 2
+#define configMAX_TASK_NAME_LEN 16
+#define configUSE_TRACE_FACILITY 1
+#define configGENERATE_RUN_TIME_STATS 1
+#define configSTACK_DEPTH_TYPE uint32_t
+
+BaseType_t xPortGetCoreID();
+
+#endif // SIM_FREERTOS_H
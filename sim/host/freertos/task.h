@@ -0,0 +1,48 @@
+#ifndef SIM_FREERTOS_TASK_H
+#define SIM_FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+
+// Task stand-in. A task runs on its own host stack as the node that created
+// it, but never at the same time as anything else: simAdvance() switches to
+// it when it is due and it switches back when it calls vTaskDelay(), so the
+// simulation stays single-threaded. Priority and core do not change when a
+// task runs: it runs at its due time like an esp_timer callback.
+//
+// uxTaskGetSystemState() lists the node's tasks with loopTask (core 1) and
+// the two idle tasks besides. Task code takes no simulated time, so the run
+// time counters give loopTask all of core 1's time but its delay() calls,
+// which go to IDLE1, and IDLE0 all of core 0's. Stack marks are measured on
+// the host stacks of the created tasks (painted at creation, far bigger than
+// the board's); loopTask and the idle tasks run on none of their own and
+// report the board's stack sizes unused.
+
+typedef struct SimTask *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+typedef enum { eRunning, eReady, eBlocked, eSuspended, eDeleted, eInvalid } eTaskState;
+
+typedef struct {
+    TaskHandle_t xHandle;
+    const char *pcTaskName;
+    UBaseType_t xTaskNumber;
+    eTaskState eCurrentState;
+    UBaseType_t uxCurrentPriority;
+    UBaseType_t uxBasePriority;
+    uint32_t ulRunTimeCounter;           // us, as portGET_RUN_TIME_COUNTER_VALUE() on the board
+    uint8_t *pxStackBase;
+    configSTACK_DEPTH_TYPE usStackHighWaterMark;  // Bytes never used
+    BaseType_t xCoreID;
+} TaskStatus_t;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+void vTaskDelay(TickType_t ticks);        // Outside a task it is delay()
+
+UBaseType_t uxTaskGetNumberOfTasks();
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *status, UBaseType_t size, uint32_t *totalRunTime);
+BaseType_t xTaskGetAffinity(TaskHandle_t task);
+TaskHandle_t xTaskGetIdleTaskHandleForCPU(UBaseType_t core);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+
+#endif // SIM_FREERTOS_TASK_H
@@ -0,0 +1,291 @@
+// Reads a dump of the operations journal partition (lib/OPS_JOURNAL) and
+// prints travel-time statistics per segment, dwell per station, cycle counts
+// and a list of anomalies.
+//
+// Build and run from the project root:
+//   g++ -std=c++17 -O2 -Isim/host -Ilib/OPS_JOURNAL sim/journal_analyzer.cpp -o journal_analyzer
+//   ./journal_analyzer journal.bin [--records]
+//
+// Dump the partition from the board with (offset and size from partitions.csv):
+//   esptool.py read_flash 0x290000 0x160000 journal.bin
+// or produce one on the host with valley_sim --journal journal.bin.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <esp_system.h>
+#include "OPS_JOURNAL.h"
+
+struct Event {
+    uint32_t boot;           // Counted from the oldest BOOT in the dump
+    JournalRecord record;
+};
+
+struct Segment {
+    int from;
+    int to;
+    int direction;
+    bool operator<(const Segment &other) const {
+        if (direction != other.direction) return direction < other.direction;
+        if (from != other.from) return from < other.from;
+        return to < other.to;
+    }
+};
+
+static const char *resetReasonName(int reason) {
+    static const char *names[] = {"UNKNOWN", "POWERON", "EXT", "SW", "PANIC", "INT_WDT", "TASK_WDT", "WDT", "DEEPSLEEP", "BROWNOUT", "SDIO"};
+    return reason >= 0 && reason < (int)(sizeof(names) / sizeof(names[0])) ? names[reason] : "?";
+}
+
+static const char *typeName(int type) {
+    switch (type) {
+        case JOURNAL_BOOT: return "BOOT";
+        case JOURNAL_CYCLE_START: return "CYCLE_START";
+        case JOURNAL_DEPART: return "DEPART";
+        case JOURNAL_ARRIVE: return "ARRIVE";
+        case JOURNAL_PASS: return "PASS";
+        case JOURNAL_HALT: return "HALT";
+        case JOURNAL_SEMAPHORE: return "SEMAPHORE";
+        case JOURNAL_BUTTON: return "BUTTON";
+        case JOURNAL_MISSED: return "MISSED";
+        case JOURNAL_MOTOR_FAULT: return "MOTOR_FAULT";
+        default: return "?";
+    }
+}
+
+// CurrentFault in lib/MOTOR_CURRENT
+static const char *motorFaultName(int fault) {
+    static const char *names[] = {"?", "overcurrent", "stall", "no load"};
+    return fault >= 0 && fault < (int)(sizeof(names) / sizeof(names[0])) ? names[fault] : "?";
+}
+
+static std::string timeText(const Event &event) {
+    char text[48];
+    uint32_t seconds = event.record.millis / 1000;
+    snprintf(text, sizeof(text), "boot %u %02u:%02u:%02u.%03u", event.boot, seconds / 3600, seconds / 60 % 60, seconds % 60,
+             event.record.millis % 1000);
+    return text;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[(size_t)(p * (values.size() - 1))];
+}
+
+static void printStats(const char *label, const std::vector<double> &values) {
+    double sum = 0, squares = 0;
+    for (double v : values) {
+        sum += v;
+        squares += v * v;
+    }
+    double mean = sum / values.size();
+    double deviation = sqrt(std::max(0.0, squares / values.size() - mean * mean));
+    printf("  %-16s n %5zu  mean %8.3f  sd %6.3f  min %8.3f  p50 %8.3f  p90 %8.3f  max %8.3f s\n", label, values.size(), mean,
+           deviation, percentile(values, 0.0), percentile(values, 0.5), percentile(values, 0.9), percentile(values, 1.0));
+}
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    bool listRecords = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--records")) listRecords = true;
+        else path = argv[i];
+    }
+    if (path == nullptr) {
+        fprintf(stderr, "usage: %s journal.bin [--records]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        perror(path);
+        return 1;
+    }
+    std::vector<uint8_t> image;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) image.insert(image.end(), chunk, chunk + n);
+    fclose(file);
+
+    // Sectors in write order
+    std::vector<std::pair<uint32_t, uint32_t>> sectors;  // seq, sector
+    uint32_t sectorCount = image.size() / JOURNAL_SECTOR_SIZE;
+    for (uint32_t i = 0; i < sectorCount; i++) {
+        JournalSectorHeader header;
+        memcpy(&header, &image[i * JOURNAL_SECTOR_SIZE], sizeof(header));
+        if (header.magic != JOURNAL_MAGIC || header.recordSize != JOURNAL_RECORD_SIZE) continue;
+        sectors.push_back({(uint32_t)header.seq, i});
+    }
+    std::sort(sectors.begin(), sectors.end());
+    if (sectors.empty()) {
+        printf("%s: no journal sectors\n", path);
+        return 0;
+    }
+
+    std::vector<Event> events;
+    uint32_t boot = 0;
+    uint32_t unknown = 0;
+    for (const auto &entry : sectors) {
+        const uint8_t *base = &image[entry.second * JOURNAL_SECTOR_SIZE];
+        for (int slot = JOURNAL_HEADER_SLOTS; slot < JOURNAL_SLOTS_PER_SECTOR; slot++) {
+            Event event;
+            memcpy(&event.record, base + slot * JOURNAL_RECORD_SIZE, sizeof(event.record));
+            if (event.record.type == 0xFF) break;
+            if (event.record.type < JOURNAL_BOOT || event.record.type > JOURNAL_MOTOR_FAULT) {
+                unknown++;  // Torn write from a power cut
+                continue;
+            }
+            if (event.record.type == JOURNAL_BOOT) boot++;
+            event.boot = boot;
+            events.push_back(event);
+        }
+    }
+
+    printf("%s: %zu of %u sectors used (seq %u..%u), %zu records, %u unreadable, %u boots\n", path, sectors.size(), sectorCount,
+           sectors.front().first, sectors.back().first, events.size(), unknown, boot);
+
+    std::map<Segment, std::vector<double>> travel;
+    std::map<int, std::vector<double>> dwell;
+    std::vector<double> cycleSeconds;
+    std::vector<std::string> anomalies;
+    std::map<int, int> resetReasons;
+    uint32_t cycleStarts = 0, cyclesCompleted = 0, halts = 0, buttons = 0, semaphores = 0, overdue = 0, motorFaults = 0;
+
+    // Running state while replaying the records
+    bool moving = false;
+    int lastStation = -1;                      // Last departure, pass or arrival
+    uint32_t lastMillis = 0;
+    int direction = JOURNAL_FORWARD;
+    bool arrived = false;                      // Standing at lastStation since lastMillis
+    bool turned = false;                       // Turned back since the cycle started
+    const Event *cycleStart = nullptr;
+
+    for (const Event &event : events) {
+        const JournalRecord &r = event.record;
+        if (listRecords) printf("%s  %-11s a %3u b %5u\n", timeText(event).c_str(), typeName(r.type), r.a, r.b);
+
+        switch (r.type) {
+            case JOURNAL_BOOT:
+                resetReasons[r.a]++;
+                if (moving) {
+                    anomalies.push_back(timeText(event) + ": reset (" + resetReasonName(r.a) + ") while moving from station " +
+                                        std::to_string(lastStation));
+                } else if (r.a != ESP_RST_POWERON && r.a != ESP_RST_SW && event.boot > 1) {
+                    anomalies.push_back(timeText(event) + ": reset (" + resetReasonName(r.a) + ")");
+                }
+                moving = false;
+                arrived = false;
+                cycleStart = nullptr;
+                break;
+            case JOURNAL_CYCLE_START:
+                cycleStarts++;
+                if (cycleStart && cycleStart->boot == event.boot) {
+                    cycleSeconds.push_back((r.millis - cycleStart->record.millis) / 1000.0);
+                }
+                cycleStart = &event;
+                turned = false;
+                break;
+            case JOURNAL_DEPART:
+                if (arrived && lastStation == r.a) dwell[r.a].push_back((r.millis - lastMillis) / 1000.0);
+                if (arrived && r.b == JOURNAL_BACKWARD) turned = true;  // Turned back, at LAST or short of it
+                moving = true;
+                arrived = false;
+                lastStation = r.a;
+                lastMillis = r.millis;
+                direction = r.b;
+                break;
+            case JOURNAL_PASS:
+            case JOURNAL_ARRIVE:
+                if (moving) {
+                    travel[{lastStation, r.a, r.b}].push_back((r.millis - lastMillis) / 1000.0);
+                    int expected = r.b == JOURNAL_FORWARD ? lastStation + 1 : lastStation - 1;
+                    if (r.a != expected && direction == r.b) {
+                        anomalies.push_back(timeText(event) + ": " + (r.type == JOURNAL_ARRIVE ? "arrived at" : "passed") + " station " +
+                                            std::to_string(r.a) + " after " + std::to_string(lastStation) + ", station " +
+                                            std::to_string(expected) + " not seen");
+                    }
+                }
+                lastStation = r.a;
+                lastMillis = r.millis;
+                if (r.type == JOURNAL_ARRIVE) {
+                    moving = false;
+                    arrived = true;
+                    if (r.a == 0 && turned) {
+                        cyclesCompleted++;
+                        turned = false;
+                    }
+                }
+                break;
+            case JOURNAL_HALT:
+                halts++;
+                anomalies.push_back(timeText(event) + ": halted by button after station " + std::to_string(lastStation));
+                moving = false;
+                arrived = false;
+                break;
+            case JOURNAL_SEMAPHORE:
+                semaphores++;
+                break;
+            case JOURNAL_BUTTON:
+                buttons++;
+                break;
+            case JOURNAL_MISSED:
+                overdue++;
+                anomalies.push_back(timeText(event) + ": station " + std::to_string(r.a) + " overdue going " +
+                                    (r.b == JOURNAL_FORWARD ? "forward" : "backward") + ", trigger missed?");
+                break;
+            case JOURNAL_MOTOR_FAULT:
+                motorFaults++;
+                anomalies.push_back(timeText(event) + ": motor cut, " + motorFaultName(r.a) + " at " + std::to_string(r.b) +
+                                    " mA after station " + std::to_string(lastStation));
+                moving = false;
+                arrived = false;
+                break;
+        }
+    }
+
+    printf("cycles: %u started, %u completed (START -> turn -> START), %u halts, %u button presses, %u semaphore commands, "
+           "%u overdue stations, %u motor faults\n", cycleStarts, cyclesCompleted, halts, buttons, semaphores, overdue, motorFaults);
+    printf("resets:");
+    for (const auto &entry : resetReasons) printf(" %s %d", resetReasonName(entry.first), entry.second);
+    printf("\n");
+    if (!cycleSeconds.empty()) {
+        printf("\ncycle time\n");
+        printStats("loop start", cycleSeconds);
+    }
+
+    printf("\ntravel time per segment\n");
+    for (const auto &entry : travel) {
+        char label[32];
+        snprintf(label, sizeof(label), "%s %d -> %d", entry.first.direction == JOURNAL_FORWARD ? "fwd" : "back", entry.first.from,
+                 entry.first.to);
+        printStats(label, entry.second);
+
+        // Runs far from the usual time point at a slipping wheel, a dirty track or a late sensor
+        if (entry.second.size() < 5) continue;
+        double median = percentile(entry.second, 0.5);
+        for (double seconds : entry.second) {
+            if (seconds > median * 1.25 || seconds < median * 0.75) {
+                char text[96];
+                snprintf(text, sizeof(text), "segment %s took %.3f s (median %.3f s)", label, seconds, median);
+                anomalies.push_back(text);
+            }
+        }
+    }
+
+    printf("\ndwell per station\n");
+    for (const auto &entry : dwell) {
+        char label[32];
+        snprintf(label, sizeof(label), "station %d", entry.first);
+        printStats(label, entry.second);
+    }
+
+    printf("\nanomalies: %zu\n", anomalies.size());
+    for (const std::string &text : anomalies) printf("  %s\n", text.c_str());
+    return 0;
+}
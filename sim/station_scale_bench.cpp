@@ -0,0 +1,208 @@
+// Host benchmark of the per-event cost against the number of stations
+// (lib/LAYOUT, lib/LINK_MONITOR), and a check that the per-station state
+// kept in NVS (lib/SEGMENT_MODEL) comes back at every size.
+//
+// Build and run from the project root:
+//   g++ -std=c++17 -O2 -Isim/host $(for d in lib/*/; do printf -- "-I%s " "$d"; done)
+//       sim/station_scale_bench.cpp lib/LAYOUT/LAYOUT.cpp lib/LINK_MONITOR/LINK_MONITOR.cpp
+//       lib/SEGMENT_MODEL/SEGMENT_MODEL.cpp lib/OPS_JOURNAL/OPS_JOURNAL.cpp
+//       sim/host/SimHost.cpp sim/host/RadioSim.cpp -o station_scale_bench
+//   ./station_scale_bench
+//
+// A station trigger passes the controller as: sender MAC to station index in
+// the receive callback, the link monitor's record, posting the trigger, and
+// loop() taking it (UI::sampleStations) next to the link monitor's update.
+// Each is timed for 8 to 64 stations with random senders, next to the table
+// scans they replaced (a linear MAC search and one flag per station polled
+// from station 1 on), which grow with the station count. The last column is
+// the cost at that size over the cost at 8 stations.
+//
+// The segment model then learns a few runs over the whole line, saves and is
+// loaded again by a fresh instance, which has to expect the same times.
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "SimHost.h"
+#include "LAYOUT.h"
+#include "LINK_MONITOR.h"
+#include "SEGMENT_MODEL.h"
+
+StationTriggers stationTriggers;
+
+static double nanosecondsPer(const std::chrono::steady_clock::time_point &start, long count) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+}
+
+// As main.cpp looked the station up before lib/LAYOUT
+static int scanForMac(const uint8_t macs[][6], int stations, const uint8_t *mac) {
+    for (int i = 0; i < stations; i++) {
+        bool match = true;
+        for (int j = 0; j < 6; j++) {
+            if (mac[j] != macs[i][j]) {
+                match = false;
+                break;
+            }
+        }
+        if (match) return i;
+    }
+    return -1;
+}
+
+// As UI::sampleStations polled stationTriggered[]
+static int pollFlags(volatile bool *flags, int stations) {
+    for (int i = 1; i < stations; i++) {
+        if (flags[i]) {
+            flags[i] = false;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Learns SEGMENT_MIN_SAMPLES runs out and back with segment times that differ
+// per station, saves, and compares what a new instance loads. true if equal
+static bool segmentRoundTrip(int stations) {
+    OpsJournal journal;
+    SegmentModel *learned = new SegmentModel();
+    learned->begin();
+    for (int run = 0; run < SEGMENT_MIN_SAMPLES; run++) {
+        learned->depart(0, JOURNAL_FORWARD);
+        for (int station = 1; station < stations; station++) {
+            delay(1000 + station * 10);
+            if (station < stations - 1) learned->pass(station, JOURNAL_FORWARD);
+        }
+        learned->arrive(stations - 1, JOURNAL_FORWARD);
+        learned->depart(stations - 1, JOURNAL_BACKWARD);
+        for (int station = stations - 2; station >= 0; station--) {
+            delay(2000 + station * 10);
+            if (station > 0) learned->pass(station, JOURNAL_BACKWARD);
+        }
+        learned->arrive(0, JOURNAL_BACKWARD);
+    }
+    learned->update(journal);
+
+    SegmentModel *loaded = new SegmentModel();
+    loaded->begin();
+    bool same = true;
+    for (int from = 0; from < stations; from++) {
+        for (JournalDirection direction : {JOURNAL_FORWARD, JOURNAL_BACKWARD}) {
+            if (loaded->expectedMillis(from, direction) != learned->expectedMillis(from, direction)) same = false;
+        }
+    }
+    same = same && learned->expectedMillis(stations - 2, JOURNAL_FORWARD) > 0;
+    delete learned;
+    delete loaded;
+    return same;
+}
+
+struct Row {
+    double lookup, lookupScan;
+    double trigger, triggerScan;
+    double event;
+};
+
+int main() {
+    const uint8_t benchMac[6] = {0x02, 0, 0, 0, 0, 0x01};
+    SimNode *node = simAddNode("bench", benchMac);
+    simSetCurrentNode(node);
+
+    const int sizes[] = {8, 16, 32, 64};
+    const long count = 2000000;
+    std::mt19937 rng(42);
+    Row rows[4];
+    volatile int sink = 0;
+
+    for (int s = 0; s < 4; s++) {
+        int stations = sizes[s];
+
+        // Boards of two vendor prefixes, START wired
+        static uint8_t macs[LAYOUT_MAX_STATIONS][6];
+        memset(macs, 0, sizeof(macs));
+        for (int i = 1; i < stations; i++) {
+            const uint8_t prefix[2][3] = {{0x24, 0x6F, 0x28}, {0xA4, 0xCF, 0x12}};
+            memcpy(macs[i], prefix[rng() & 1], 3);
+            for (int j = 3; j < 6; j++) macs[i][j] = rng();
+        }
+        layout.begin(stations, macs);
+
+        // Mostly known senders, every eighth one unknown (semaphore nodes, other boards)
+        std::vector<uint8_t> senders(4096 * 6);
+        std::vector<uint8_t> picks(4096);
+        for (int k = 0; k < 4096; k++) {
+            picks[k] = 1 + rng() % (stations - 1);
+            memcpy(&senders[k * 6], macs[picks[k]], 6);
+            if (k % 8 == 7) senders[k * 6 + 5] ^= 0x5A;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (long n = 0; n < count; n++) sink = sink + layout.find(&senders[(n & 4095) * 6]);
+        rows[s].lookup = nanosecondsPer(start, count);
+
+        start = std::chrono::steady_clock::now();
+        for (long n = 0; n < count; n++) sink = sink + scanForMac(macs, stations, &senders[(n & 4095) * 6]);
+        rows[s].lookupScan = nanosecondsPer(start, count);
+
+        // One trigger posted and taken per event; loop() polls more often than
+        // triggers come, so the idle take/poll counts too
+        start = std::chrono::steady_clock::now();
+        for (long n = 0; n < count; n++) {
+            stationTriggers.post(picks[n & 4095], n);
+            sink = sink + stationTriggers.take();
+            sink = sink + stationTriggers.take();
+        }
+        rows[s].trigger = nanosecondsPer(start, count);
+
+        static volatile bool flags[LAYOUT_MAX_STATIONS];
+        start = std::chrono::steady_clock::now();
+        for (long n = 0; n < count; n++) {
+            flags[picks[n & 4095]] = true;
+            sink = sink + pollFlags(flags, stations);
+            sink = sink + pollFlags(flags, stations);
+        }
+        rows[s].triggerScan = nanosecondsPer(start, count);
+
+        // The whole path: lookup, link record, post, then loop()'s take and link update
+        LinkMonitor *links = new LinkMonitor();
+        links->init();
+        for (int i = 1; i < stations; i++) links->setMonitored(i, true);
+        StationPacket packet = {};
+        packet.type = STATION_MSG_TRIGGER;
+        packet.syncError = STATION_SYNC_ERROR_UNKNOWN;
+        start = std::chrono::steady_clock::now();
+        for (long n = 0; n < count; n++) {
+            int station = layout.find(&senders[(n & 4095) * 6]);
+            if (station >= 0) {
+                packet.seq = n;
+                packet.sentMicros = n;
+                links->recordPacket(station, packet, -60, n + 900);
+                stationTriggers.post(station, n);
+            }
+            sink = sink + stationTriggers.take();
+            links->update();
+        }
+        rows[s].event = nanosecondsPer(start, count);
+        delete links;
+    }
+
+    printf("\nstations | MAC lookup   hash   scan | trigger  bitset  flags | whole event    ns  vs 8\n");
+    for (int s = 0; s < 4; s++) {
+        printf("%8d |          %6.1f %6.1f |         %6.1f %6.1f |          %7.1f %5.2f\n", sizes[s], rows[s].lookup,
+               rows[s].lookupScan, rows[s].trigger, rows[s].triggerScan, rows[s].event, rows[s].event / rows[0].event);
+    }
+
+    int failed = 0;
+    printf("\nsegment model saved and loaded:");
+    for (int s = 0; s < 4; s++) {
+        static uint8_t macs[LAYOUT_MAX_STATIONS][6];
+        layout.begin(sizes[s], macs);
+        bool same = segmentRoundTrip(sizes[s]);
+        if (!same) failed++;
+        printf(" %d stations %s", sizes[s], same ? "ok" : "FAILED");
+    }
+    printf("\n");
+    return failed > 0 || sink == 42 ? 1 : 0;
+}
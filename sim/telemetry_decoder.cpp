@@ -0,0 +1,329 @@
+// Decodes the binary telemetry frames (lib/TELEMETRY) in a capture of the
+// controller's Serial output and prints, tabulates or plots them.
+//
+// Build and run from the project root:
+//   g++ -std=c++17 -O2 -Isim/host $(for d in lib/*/; do printf -- "-I%s " "$d"; done)
+//       sim/telemetry_decoder.cpp lib/TELEMETRY/TELEMETRY.cpp sim/host/SimHost.cpp sim/host/RadioSim.cpp -o telemetry_decoder
+//   ./telemetry_decoder capture.bin [--frames] [--text] [--csv FILE] [--plot [N]]
+//
+//   --frames   one line per frame
+//   --text     the text the firmware printed between the frames as well
+//   --csv FILE every frame as a CSV row, for a spreadsheet or gnuplot
+//   --plot [N] the train along the line over time, every Nth frame (default 1)
+//
+// Turn the frames on with "telemetry 100" on the console (the period is kept
+// across boots) and capture the port raw, e.g.
+//   stty -F /dev/ttyUSB0 115200 raw && cat /dev/ttyUSB0 > capture.bin
+// or on the host:
+//   valley_sim --scenario clean --cycles 3 --console "0:telemetry 100" --serial capture.bin
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include "TELEMETRY.h"
+
+static const char *stateName(int state) {
+    static const char *names[] = {
+        "START", "GOING_TO_STATION_X", "TURN_GREEN_LIGHT_ON_AT_STATION_X", "WAITING_AT_STATION_X",
+        "GOING_TO_LAST_STATION", "WAIT_BEFORE_GOING_BACKWARD", "GOING_BACKWARD", "WAITING_BEFORE_NEXT_LOOP",
+    };
+    if (state == TELEMETRY_NONE) return "-";
+    return state >= 0 && state < (int)(sizeof(names) / sizeof(names[0])) ? names[state] : "?";
+}
+
+static const char *trainStateName(int trainState) {
+    static const char *names[] = {"forward", "backward", "stopped"};
+    if (trainState == TELEMETRY_NONE) return "-";
+    return trainState >= 0 && trainState < (int)(sizeof(names) / sizeof(names[0])) ? names[trainState] : "?";
+}
+
+// UI buttons, NO_INPUTS_RECEIVED (-1) arrives as 0xFF
+static const char *inputName(int input) {
+    static const char *names[] = {"sound", "volume+", "volume-", "play/pause", "loop", "backwards"};
+    if (input == 0xFF) return "";
+    return input >= 0 && input < (int)(sizeof(names) / sizeof(names[0])) ? names[input] : "?";
+}
+
+static std::string profileName(int profile) {
+    if (profile == 0xFF) return "custom";
+    return std::to_string(profile);
+}
+
+// Semaphores 1..count, G or R
+static std::string aspectText(uint64_t green, int count) {
+    std::string text;
+    for (int id = 1; id <= count; id++) text += (green >> (id - 1)) & 1 ? 'G' : 'R';
+    return text;
+}
+
+// One task of the monitor, from the frames that carried it
+struct TaskSeen {
+    int core;
+    int priority;
+    double cpuSum;             // Per mille
+    uint32_t cpuCount;
+    uint16_t cpuMax;
+    uint16_t stackFree;        // Least seen
+};
+
+struct Sample {
+    uint32_t boot;               // Counted from the first frame of the capture
+    TelemetryFrame frame;
+};
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    const char *csvPath = nullptr;
+    bool listFrames = false;
+    bool showText = false;
+    int plotEvery = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--frames")) listFrames = true;
+        else if (!strcmp(argv[i], "--text")) showText = true;
+        else if (!strcmp(argv[i], "--csv") && i + 1 < argc) csvPath = argv[++i];
+        else if (!strcmp(argv[i], "--plot")) plotEvery = i + 1 < argc && argv[i + 1][0] != '-' && atoi(argv[i + 1]) > 0 ? atoi(argv[++i]) : 1;
+        else path = argv[i];
+    }
+    if (path == nullptr) {
+        fprintf(stderr, "usage: %s capture.bin [--frames] [--text] [--csv FILE] [--plot [N]]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        perror(path);
+        return 1;
+    }
+    std::vector<uint8_t> capture;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) capture.insert(capture.end(), chunk, chunk + n);
+    fclose(file);
+
+    // Every zero ends a frame. A frame is the last TELEMETRY_ENCODED_BYTES
+    // before it; what comes first is text, and so is a chunk that fails the CRC.
+    std::vector<Sample> samples;
+    std::vector<std::pair<std::string, int>> stream;  // Text, or the index of a frame in samples (-1 for text)
+    uint32_t badFrames = 0;
+    uint32_t otherVersion = 0;
+    size_t textBytes = 0;
+    uint32_t boot = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= capture.size(); i++) {
+        if (i < capture.size() && capture[i] != 0) continue;
+        size_t length = i - start;
+        size_t textLength = length;
+        int frameIndex = -1;
+        if (i < capture.size() && length >= TELEMETRY_ENCODED_BYTES) {
+            uint8_t packet[TELEMETRY_ENCODED_BYTES];
+            size_t decoded = Telemetry::decode(&capture[i - TELEMETRY_ENCODED_BYTES], TELEMETRY_ENCODED_BYTES, packet);
+            uint16_t crc = packet[sizeof(TelemetryFrame)] | packet[sizeof(TelemetryFrame) + 1] << 8;
+            if (decoded == TELEMETRY_PACKET_BYTES && Telemetry::crc16(packet, sizeof(TelemetryFrame)) == crc) {
+                textLength = length - TELEMETRY_ENCODED_BYTES;
+                Sample sample;
+                memcpy(&sample.frame, packet, sizeof(sample.frame));
+                if (sample.frame.version != TELEMETRY_VERSION) {
+                    otherVersion++;
+                } else {
+                    // A reset starts millis again
+                    if (!samples.empty() && sample.frame.millis < samples.back().frame.millis) boot++;
+                    sample.boot = boot;
+                    frameIndex = samples.size();
+                    samples.push_back(sample);
+                }
+            } else {
+                badFrames++;
+            }
+        }
+        textBytes += textLength;
+        if (textLength > 0) stream.push_back({std::string((const char *)&capture[start], textLength), -1});
+        if (frameIndex >= 0) stream.push_back({"", frameIndex});
+        start = i + 1;
+    }
+
+    int semaphoreCount = 6;  // As the default layout, or as many as were seen GREEN
+    for (const Sample &sample : samples) {
+        for (int id = 64; id > semaphoreCount; id--) {
+            if ((sample.frame.greenAspects >> (id - 1)) & 1) semaphoreCount = id;
+        }
+    }
+
+    if (listFrames || showText) {
+        for (const auto &entry : stream) {
+            if (entry.second < 0) {
+                if (showText) fputs(entry.first.c_str(), stdout);
+                continue;
+            }
+            if (!listFrames) continue;
+            const TelemetryFrame &f = samples[entry.second].frame;
+            printf("# %10.3f s  seq %5u  %-32s %-8s station %2u  drive %3u%%  profile %-6s %s  pass max %6u avg %5u us  %s\n",
+                   f.millis / 1000.0, f.seq, stateName(f.state), trainStateName(f.trainState), f.station, f.drivePercent,
+                   profileName(f.profile).c_str(), aspectText(f.greenAspects, semaphoreCount).c_str(), f.passMaxMicros,
+                   f.passAvgMicros, inputName(f.input));
+        }
+    }
+
+    if (samples.empty()) {
+        printf("%s: no telemetry frames (%zu bytes of text, %u bad frames)\n", path, textBytes, badFrames);
+        return 0;
+    }
+
+    if (csvPath) {
+        FILE *csv = fopen(csvPath, "w");
+        if (csv == nullptr) {
+            perror(csvPath);
+            return 1;
+        }
+        fprintf(csv, "boot,seq,millis,state,trainState,station,input,profile,drivePercent,flags,greenAspects,"
+                     "stationMillis,loopPasses,loops,overdueForward,overdueBackward,driftWarnings,passMaxMicros,passAvgMicros,"
+                     "latencyTrace,latencyStation,latencyMicros,latencyFlags,idle0,idle1,taskAlarms,taskCount,taskIndex,"
+                     "taskName,taskCore,taskPriority,taskCpuPermille,taskStackFree\n");
+        for (const Sample &sample : samples) {
+            const TelemetryFrame &f = sample.frame;
+            fprintf(csv, "%u,%u,%u,%u,%u,%u,%d,%u,%u,%u,%llu,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%.*s,%u,%u,%u,%u\n",
+                    sample.boot, f.seq, f.millis, f.state, f.trainState, f.station, f.input == 0xFF ? -1 : f.input, f.profile,
+                    f.drivePercent, f.flags, (unsigned long long)f.greenAspects, f.stationMillis, f.loopPasses, f.loops,
+                    f.overdueForward, f.overdueBackward, f.driftWarnings, f.passMaxMicros, f.passAvgMicros, f.latencyTrace,
+                    f.latencyStation, f.latencyMicros, f.latencyFlags, f.idlePermille[0], f.idlePermille[1], f.taskAlarms,
+                    f.taskCount, f.taskIndex, TELEMETRY_TASK_NAME_SIZE, f.taskName, f.taskCore, f.taskPriority,
+                    f.taskCpuPermille, f.taskStackFree);
+        }
+        fclose(csv);
+    }
+
+    if (plotEvery > 0) {
+        int lastStation = 0;
+        for (const Sample &sample : samples) {
+            if (sample.frame.station != TELEMETRY_NONE) lastStation = std::max(lastStation, (int)sample.frame.station);
+        }
+        printf("%10s  ", "s");
+        for (int station = 0; station <= lastStation; station++) printf("%-4d", station);
+        printf("  drive\n");
+        for (size_t i = 0; i < samples.size(); i += plotEvery) {
+            const TelemetryFrame &f = samples[i].frame;
+            std::string line((lastStation + 1) * 4, ' ');
+            for (int station = 0; station <= lastStation; station++) line[station * 4] = '.';
+            if (f.station != TELEMETRY_NONE && f.station <= lastStation) {
+                // Between the last station and the next one while moving
+                int column = f.station * 4;
+                if (f.trainState == 0 && column + 2 < (int)line.size()) column += 2;
+                if (f.trainState == 1 && column >= 2) column -= 2;
+                line[column] = f.trainState == 0 ? '>' : f.trainState == 1 ? '<' : '#';
+            }
+            std::string bar(f.drivePercent / 5, '=');
+            printf("%10.3f  %s  %-20s %s\n", f.millis / 1000.0, line.c_str(), bar.c_str(), inputName(f.input));
+        }
+    }
+
+    // Summary
+    uint32_t lost = 0;
+    std::map<int, double> stateSeconds;
+    std::map<int, double> trainStateSeconds;
+    uint32_t stationsReached = 0;
+    uint32_t worstPass = 0;
+    double passSum = 0;
+    double loopPassesPerSecond = 0;
+    double seconds = 0;
+    for (size_t i = 1; i < samples.size(); i++) {
+        const TelemetryFrame &a = samples[i - 1].frame;
+        const TelemetryFrame &b = samples[i].frame;
+        if (samples[i].boot != samples[i - 1].boot) continue;
+        lost += (uint16_t)(b.seq - a.seq - 1);
+        double gap = (b.millis - a.millis) / 1000.0;
+        stateSeconds[a.state] += gap;
+        trainStateSeconds[a.trainState] += gap;
+        if (b.stationMillis != a.stationMillis) stationsReached++;
+        seconds += gap;
+        loopPassesPerSecond += b.loopPasses - a.loopPasses;
+    }
+    // Tasks by name, and the time the idle tasks got per core
+    std::map<std::string, TaskSeen> tasks;
+    double idleSum[2] = {0, 0};
+    uint32_t idleCount[2] = {0, 0};
+    uint32_t alarmFrames = 0;
+    for (const Sample &sample : samples) {
+        const TelemetryFrame &f = sample.frame;
+        for (int core = 0; core < 2; core++) {
+            if (f.idlePermille[core] == 0xFFFF) continue;
+            idleSum[core] += f.idlePermille[core];
+            idleCount[core]++;
+        }
+        if (f.taskAlarms) alarmFrames++;
+        if (f.taskCount == 0) continue;
+        std::string name(f.taskName, strnlen(f.taskName, TELEMETRY_TASK_NAME_SIZE));
+        auto found = tasks.find(name);
+        if (found == tasks.end()) found = tasks.insert({name, {f.taskCore, f.taskPriority, 0, 0, 0, f.taskStackFree}}).first;
+        TaskSeen &task = found->second;
+        task.core = f.taskCore;
+        task.priority = f.taskPriority;
+        task.stackFree = std::min(task.stackFree, f.taskStackFree);
+        if (f.taskCpuPermille != 0xFFFF) {
+            task.cpuSum += f.taskCpuPermille;
+            task.cpuCount++;
+            task.cpuMax = std::max(task.cpuMax, f.taskCpuPermille);
+        }
+    }
+
+    // Each trace shows up in every frame until the next one; the id tells them apart
+    std::map<int, std::vector<double>> latencyByStation;
+    uint32_t unsyncedTraces = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        const TelemetryFrame &f = samples[i].frame;
+        worstPass = std::max(worstPass, f.passMaxMicros);
+        passSum += f.passAvgMicros;
+        if (f.latencyTrace == 0) continue;
+        if (i > 0 && samples[i - 1].boot == samples[i].boot && samples[i - 1].frame.latencyTrace == f.latencyTrace) continue;
+        latencyByStation[f.latencyStation].push_back(f.latencyMicros / 1000.0);
+        if (!(f.latencyFlags & TELEMETRY_LATENCY_EDGE)) unsyncedTraces++;
+    }
+    const TelemetryFrame &first = samples.front().frame;
+    const TelemetryFrame &last = samples.back().frame;
+
+    printf("%s: %zu frames over %.1f s in %u boot(s), %u lost, %u bad, %u of another version, %zu bytes of text\n", path,
+           samples.size(), seconds, boot + 1, lost, badFrames, otherVersion, textBytes);
+    printf("  loops %u -> %u, stations reached %u, overdue %u/%u forward/back, drift warnings %u\n", first.loops, last.loops,
+           stationsReached, last.overdueForward, last.overdueBackward, last.driftWarnings);
+    printf("  loop() %.0f passes/s, pass avg %.1f us, longest %u us\n", seconds > 0 ? loopPassesPerSecond / seconds : 0,
+           passSum / samples.size(), worstPass);
+    if (!latencyByStation.empty()) {
+        printf("  sensor edge to motor outputs (%u traces from the receive time):\n", unsyncedTraces);
+        for (auto &entry : latencyByStation) {
+            std::vector<double> &values = entry.second;
+            std::sort(values.begin(), values.end());
+            auto at = [&values](double share) { return values[std::min(values.size() - 1, (size_t)(share * values.size()))]; };
+            printf("    station %-3d %5zu stops, p50 %6.2f p99 %6.2f max %6.2f ms\n", entry.first, values.size(), at(0.5),
+                   at(0.99), values.back());
+        }
+    }
+    if (!tasks.empty()) {
+        printf("  tasks (share of one core), idle core 0 %.1f%% core 1 %.1f%% on average, alarms up in %u frames:\n",
+               idleCount[0] ? idleSum[0] / idleCount[0] / 10 : 0.0, idleCount[1] ? idleSum[1] / idleCount[1] / 10 : 0.0,
+               alarmFrames);
+        for (const auto &entry : tasks) {
+            const TaskSeen &task = entry.second;
+            std::string core = task.core == TELEMETRY_NONE ? "-" : std::to_string(task.core);
+            if (task.cpuCount > 0) {
+                printf("    %-12s core %s prio %2d  cpu avg %5.1f%% max %5.1f%%  stack never used %5u bytes\n", entry.first.c_str(),
+                       core.c_str(), task.priority, task.cpuSum / task.cpuCount / 10, task.cpuMax / 10.0, task.stackFree);
+            } else {
+                printf("    %-12s core %s prio %2d  cpu unknown              stack never used %5u bytes\n", entry.first.c_str(),
+                       core.c_str(), task.priority, task.stackFree);
+            }
+        }
+    }
+    printf("  time by state:\n");
+    for (const auto &entry : stateSeconds) {
+        printf("    %-32s %8.1f s %5.1f%%\n", stateName(entry.first), entry.second, 100 * entry.second / std::max(seconds, 1e-9));
+    }
+    printf("  time by train state:\n");
+    for (const auto &entry : trainStateSeconds) {
+        printf("    %-32s %8.1f s %5.1f%%\n", trainStateName(entry.first), entry.second,
+               100 * entry.second / std::max(seconds, 1e-9));
+    }
+    return 0;
+}
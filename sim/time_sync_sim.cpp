@@ -0,0 +1,115 @@
+// Host simulation of the station clock sync (lib/TIME_SYNC) over a jittery radio.
+//
+// Build and run from the project root:
+//   g++ -std=c++17 -O2 -Ilib/TIME_SYNC -Ilib/STATION_PROTOCOL sim/time_sync_sim.cpp lib/TIME_SYNC/TIME_SYNC.cpp -o time_sync_sim
+//   ./time_sync_sim
+//
+// The controller clock is the reference. The station clock has a random offset and
+// a crystal drift, and every radio hop adds a base delay, random jitter and, now and
+// then, a retransmission. After each exchange the station converts "now" to controller
+// time and the error against the true controller time is recorded.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include "TIME_SYNC.h"
+
+struct RadioModel {
+    const char *name;
+    double baseMicros;      // Air time + stack latency, both directions
+    double jitterMicros;    // Mean of the exponential queueing jitter
+    double retryChance;     // Probability that one hop is retransmitted
+    double retryMicros;     // Extra delay of a retransmission
+    double lossChance;      // Probability that one hop is lost
+};
+
+struct StationClock {
+    double offsetMicros;
+    double driftPpm;
+    uint32_t read(double trueMicros) const {
+        double local = trueMicros * (1.0 + driftPpm * 1e-6) + offsetMicros;
+        return (uint32_t)(uint64_t)fmod(local, 4294967296.0);
+    }
+};
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(p * (values.size() - 1));
+    return values[index];
+}
+
+static void runScenario(const RadioModel &radio, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::exponential_distribution<double> jitter(1.0 / radio.jitterMicros);
+
+    auto hopDelay = [&](bool &lost) {
+        lost = uniform(rng) < radio.lossChance;
+        double delay = radio.baseMicros + jitter(rng);
+        if (uniform(rng) < radio.retryChance) delay += radio.retryMicros * (0.5 + uniform(rng));
+        return delay;
+    };
+
+    StationClock station;
+    station.offsetMicros = uniform(rng) * 4e9;   // Anywhere in the micros() range, wrap included
+    station.driftPpm = (uniform(rng) - 0.5) * 80; // +/-40 ppm crystals
+
+    TimeSyncClient sync;
+    std::vector<double> errors;
+    int reportedCovers = 0;
+    int exchanges = 0;
+    int lostExchanges = 0;
+
+    double now = 0;                    // True (controller) time in us
+    const double duration = 600e6;     // Ten minutes
+    while (now < duration) {
+        now += sync.syncInterval() * 1000.0;
+
+        bool lostRequest, lostReply;
+        double t1True = now;
+        double t2True = t1True + hopDelay(lostRequest);
+        double t3True = t2True + 50 + uniform(rng) * 2000;  // Controller answers from loop()
+        double t4True = t3True + hopDelay(lostReply);
+        exchanges++;
+        if (lostRequest || lostReply) {
+            lostExchanges++;
+            continue;
+        }
+
+        sync.addSample(station.read(t1True), (uint32_t)(uint64_t)t2True, (uint32_t)(uint64_t)t3True, station.read(t4True));
+        if (!sync.isSynced()) continue;
+
+        // A trigger some time before the next exchange
+        double edgeTrue = t4True + uniform(rng) * sync.syncInterval() * 1000.0;
+        uint32_t estimate = sync.toController(station.read(edgeTrue));
+        double error = fabs((double)(int32_t)(estimate - (uint32_t)(uint64_t)edgeTrue));
+        errors.push_back(error);
+        if (error <= 3.0 * sync.errorMicros()) reportedCovers++;
+    }
+
+    printf("%-10s base %5.0f us jitter %5.0f us retry %3.0f%% loss %3.0f%% | exchanges %4d lost %3d | "
+           "error p50 %6.1f p99 %7.1f max %7.1f us | reported +/-%u us (3x covers %5.1f%%) | drift correction %6.2f ppm (true %6.2f)\n",
+           radio.name, radio.baseMicros, radio.jitterMicros, radio.retryChance * 100, radio.lossChance * 100,
+           exchanges, lostExchanges,
+           percentile(errors, 0.5), percentile(errors, 0.99), percentile(errors, 1.0),
+           sync.errorMicros(), errors.empty() ? 0.0 : 100.0 * reportedCovers / errors.size(),
+           sync.driftPpm(), -station.driftPpm);
+}
+
+int main() {
+    const RadioModel radios[] = {
+        {"quiet",    900,  50, 0.00,    0, 0.00},
+        {"typical",  900, 300, 0.05, 2000, 0.02},
+        {"busy",     900, 800, 0.15, 3000, 0.05},
+        {"hostile", 1500, 2000, 0.30, 5000, 0.15},
+    };
+
+    for (const RadioModel &radio : radios) {
+        runScenario(radio, 12345);
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+// Entry points of the controller firmware when it is built as a shared object
+// for valley_sim (see the build command there). valley_sim loads a fresh copy
+// of the object for every simulated reset, which gives the firmware new
+// globals and function statics just like a reboot, and copies the rtc_noinit
+// section across unless the reset is a power cycle.
+
+#include <Arduino.h>
+#include "SEMAPHORE_T.h"
+#include "CRASH_TRACE.h"
+#include "OPS_JOURNAL.h"
+#include "SEGMENT_MODEL.h"
+#include "BLOCK_CONTROL.h"
+#include "SETTINGS.h"
+#include "TIMETABLE.h"
+#include "PROFILES.h"
+
+void setup();
+void loop();
+extern SemaphoreMode semaphoreMode;
+extern bool requireStationAuth;
+extern OpsJournal journal;
+extern SegmentModel segmentModel;
+extern uint8_t trainNodes;
+extern uint8_t sections;
+extern BlockControl blockControl;
+extern Settings settings;
+extern Timetable timetable;
+extern Profiles profiles;
+
+// Bounds of the section, provided by the linker
+extern "C" char __start_rtc_noinit[];
+extern "C" char __stop_rtc_noinit[];
+
+extern "C" {
+
+void simFirmwareConfigure(bool networkSemaphores, bool auth) {
+    if (networkSemaphores) semaphoreMode = SEMAPHORE_NETWORK;
+    requireStationAuth = auth;
+}
+
+// Before setup(), as the TRAIN_NODES build flag would
+void simFirmwareConfigureTrains(int trains) {
+    trainNodes = trains;
+}
+
+// Before setup(), as the SECTIONS build flag would; the controller's MAC picks its row
+void simFirmwareConfigureSections(int count) {
+    sections = count;
+}
+
+// Before setup(), as the route setting would be changed on the board
+void simFirmwareConfigureRoute(int route) {
+    settings.setRoute(route);
+}
+
+// After setup(): the route running, which is 0 when the one asked for does not exist
+int simFirmwareRoute(uint64_t *stops, const char **name) {
+    *stops = timetable.stops();
+    *name = timetable.name();
+    return timetable.route();
+}
+
+// Before setup(), as a switch remembered from the last boot
+void simFirmwareConfigureProfile(int profile) {
+    settings.setProfile(profile);
+}
+
+// The active profile, which is 0 when the one asked for does not exist
+int simFirmwareProfile(const char **name) {
+    *name = profiles.active().name;
+    return profiles.activeIndex();
+}
+
+// While running, as another task would; applied when the train stands
+bool simFirmwareRequestProfile(int profile) {
+    return profile >= 0 && profiles.request(profile);
+}
+
+void simFirmwareBlockStats(uint32_t *missedTriggers, uint32_t *ignoredTriggers) {
+    *missedTriggers = blockControl.missedTriggers();
+    *ignoredTriggers = blockControl.ignoredTriggers();
+}
+
+void simFirmwareSetup() {
+    setup();
+}
+
+void simFirmwareLoop() {
+    loop();
+}
+
+void simFirmwarePrintTrace() {
+    crashTrace.printTrace();
+}
+
+void simFirmwareFlushJournal() {
+    journal.flush();
+    journal.printReport();
+}
+
+void simFirmwareSegmentStats(uint32_t overdue[2], uint32_t *driftWarnings) {
+    overdue[0] = segmentModel.missesFlagged(JOURNAL_FORWARD);
+    overdue[1] = segmentModel.missesFlagged(JOURNAL_BACKWARD);
+    *driftWarnings = segmentModel.driftWarnings();
+}
+
+char *simFirmwareRtc(size_t *size) {
+    *size = __stop_rtc_noinit - __start_rtc_noinit;
+    return __start_rtc_noinit;
+}
+
+}
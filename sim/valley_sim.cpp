@@ -0,0 +1,1159 @@
+// Host simulation of the whole layout: the controller firmware (src/main.cpp and
+// the libraries) runs unchanged on top of sim/host, the station senders run
+// StationNode, the radio in between is RadioSim and a simple train model turns
+// the motor pins into movement past the station sensors.
+//
+// The firmware is built as a shared object that valley_sim loads once per boot
+// of the controller, so a simulated reset starts it from scratch. Build and run
+// from the project root:
+//   g++ -std=c++17 -O2 -fPIC -shared -Wl,-Bsymbolic -Isim/host $(for d in lib/*/; do printf -- "-I%s " "$d"; done)
+//       src/main.cpp lib/*/*.cpp sim/valley_firmware.cpp -o valley_firmware.so
+//   g++ -std=c++17 -O2 -rdynamic -Isim/host $(for d in lib/*/; do printf -- "-I%s " "$d"; done)
+//       lib/STATION_NODE/*.cpp lib/SEMAPHORE_NODE/*.cpp lib/STATION_ROUTER/*.cpp lib/STATION_AUTH/*.cpp
+//       lib/TIME_SYNC/*.cpp sim/host/*.cpp sim/valley_sim.cpp -o valley_sim -ldl
+//   ./valley_sim                       benchmark table over all scenarios
+//   ./valley_sim --scenario lossy -v   one scenario with the firmware log
+//
+// Options:
+//   --scenario NAME     clean, jitter, lossy, duplicates, reorder, noisy, hostile or all
+//   --cycles N          round trips START -> LAST -> START to run (default 10)
+//   --seed N            random seed
+//   --loss P --dup P --reorder P --jitter US --base US   override the radio of the scenario
+//   --inject MS:STATION scripted trigger from a station MAC at a given time (repeatable)
+//   --net-semaphores    controller in SEMAPHORE_NETWORK mode with one SemaphoreNode per semaphore
+//   --range N           radio range in station spacings, links fade out over the last 30% (default unlimited)
+//   --relay             every station also relays (StationNode::enableRelay)
+//   --auth              stations sign their packets and the controller requires it; spoofed
+//                       triggers then become forgeries and replays of captured triggers
+//   --journal FILE      write the controller's journal partition to FILE at the end (see journal_analyzer.cpp)
+//   --serial FILE       write all the controller's Serial output, text and telemetry frames, to FILE
+//                       (see telemetry_decoder.cpp; --console "0:telemetry 100" turns the frames on)
+//   --reset-at S[:WHY]  reset the controller S seconds into the run (repeatable). WHY is poweron
+//                       (default, RTC memory lost), panic, wdt, brownout or sw
+//   --reset-every S[:WHY] reset the controller at random, on average every S seconds
+//   --firmware PATH     firmware shared object (default: valley_firmware.so next to valley_sim)
+//   --trace             print the controller's crash trace ring at the end, as a reset would dump it
+//   --wear PCT          the train loses PCT % of its speed every 100 cycles (dirty track, worn wheels)
+//   --warmup N          leave the first N cycles out of the latency and stop statistics, while the
+//                       controller's segment model is still learning
+//   --route N|all       timetable route of the controller (routeSpecs in src/main.cpp), all = one run
+//                       per route; adds the stops per loop, loops and stops per hour to the report
+//   --profile N|all     operating profile the controller boots in (profileTable in src/main.cpp, 0 =
+//                       normal), all = one run per profile; adds loops and stops per hour by profile
+//   --profile-at S:N    ask the running controller for profile N S seconds into the run (repeatable);
+//                       it switches when the train next stands
+//   --console S:LINE    type LINE into the controller's Serial console S seconds into the run
+//                       (repeatable, quote it: --console "60:set dwell 500"); its replies show with -v
+//   --fault S:KIND[:D]  motor fault S seconds into the run, lasting D seconds (repeatable). KIND is
+//                       stall (train blocked, default 5 s), derail (no track contact, 5 s) or short
+//                       (across the track, 0.05 s). The operator sends the train back to START
+//                       a second after it cleared if the controller cut the motor
+//   -v                  print the Serial output of every node
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <random>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <esp_system.h>
+#include "SimHost.h"
+#include "RadioSim.h"
+#include "UI.h"
+#include "TRAIN.h"
+#include "STATION_NODE.h"
+#include "SEMAPHORE_NODE.h"
+#include "OPS_JOURNAL.h"
+#include "CurrentSim.h"
+
+#define NUM_STATIONS LAYOUT_DEFAULT_STATIONS  // The layout the firmware boots with
+#define NUM_SEMAPHORES (NUM_STATIONS - 2)
+#define START_SENSOR_PIN 36            // stationPins[0] in UI.cpp
+#define STATION_SPACING_MM 600.0
+#define SENSOR_HALF_WIDTH_MM 25.0      // Sensor is LOW while the train front is this close
+#define STATION_DEBOUNCE_MICROS 10000  // Sender reports once the sensor is stably LOW
+#define CRUISE_SPEED_MM_S 200.0
+#define ACCEL_TAU_S 0.30               // Motor spin-up time constant
+#define BRAKE_TAU_S 0.08               // Coasting time constant once power is cut
+#define BUMPER_MM 300.0                // Track continues this far past START and LAST
+#define LOOP_COST_MICROS 50            // Simulated duration of one loop() pass
+#define WORLD_TICK_MICROS 100
+#define STALL_TIMEOUT_MICROS 60000000ULL
+#define SEMAPHORE_RED_PIN 25           // Relay pins on the simulated semaphore nodes
+#define SEMAPHORE_GREEN_PIN 26
+#define BOOT_MICROS 350000             // Reset to setup(): ROM, bootloader and app image load
+#define OPERATOR_MICROS 1000000        // Fault cleared to BACKWARDS pressed
+
+// Must match stationMacs in src/main.cpp (index 0 is wired locally)
+static const uint8_t stationMacs[NUM_STATIONS][6] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0xCC, 0x7B, 0x5C, 0x28, 0x84, 0x4C},
+    {0xD8, 0xBC, 0x38, 0xF8, 0x90, 0x24},
+    {0x80, 0x64, 0x6F, 0xC4, 0x92, 0xD0},
+    {0xF0, 0x08, 0xD1, 0xD5, 0x3D, 0x80},
+    {0xA4, 0xCF, 0x12, 0x6A, 0x50, 0xD4},
+    {0xB4, 0xE6, 0x2D, 0xBA, 0xDB, 0x61},
+    {0x34, 0xB7, 0xDA, 0xF9, 0x4B, 0x4C},
+};
+// Must match stationKeys in src/main.cpp
+static const uint8_t stationKeys[NUM_STATIONS][STATION_KEY_SIZE] = {
+    {0},
+    {0x3a, 0x91, 0x5c, 0x07, 0xe2, 0x4f, 0xb8, 0x16, 0xd0, 0x6b, 0x29, 0xa4, 0x73, 0xc5, 0x1e, 0x88},
+    {0x52, 0x0d, 0xf7, 0x9e, 0x34, 0xa1, 0x6c, 0xbb, 0x08, 0xe9, 0x47, 0x12, 0xdc, 0x85, 0x3f, 0x60},
+    {0xc4, 0x2b, 0x78, 0xe1, 0x95, 0x0a, 0x5d, 0x36, 0xfa, 0x17, 0x8c, 0x43, 0xb0, 0x69, 0xd2, 0x2e},
+    {0x1f, 0xa6, 0x3c, 0x84, 0x5b, 0xd7, 0x02, 0x99, 0x6e, 0xf3, 0x21, 0xb5, 0x48, 0x0c, 0x97, 0xea},
+    {0x8d, 0x64, 0xc9, 0x30, 0x1a, 0x7f, 0xe5, 0x4c, 0xa3, 0x58, 0xbe, 0x06, 0x91, 0x2d, 0xf4, 0x7b},
+    {0xe7, 0x35, 0x0b, 0xd6, 0x82, 0x49, 0x9f, 0x13, 0x5a, 0xc8, 0x76, 0x2f, 0x04, 0xbd, 0x61, 0xa9},
+    {0x27, 0xdb, 0x96, 0x4e, 0xf0, 0x63, 0x18, 0xac, 0x3d, 0x85, 0xe2, 0x7a, 0xc1, 0x59, 0x0e, 0xb4},
+};
+static const uint8_t controllerMac[6] = {0x24, 0x6F, 0x28, 0x00, 0x00, 0x01};
+
+struct Scenario {
+    const char *name;
+    RadioConfig radio;
+    double spuriousPerMinute;   // Random triggers from station MACs (faulty sensor, spoofing)
+    double unknownPerMinute;    // Random packets from MACs not in the table
+};
+
+struct ScriptedTrigger {
+    uint64_t atMicros;
+    int station;
+};
+
+enum MotorFaultKind { FAULT_STALL, FAULT_DERAIL, FAULT_SHORT };
+
+struct MotorFaultInjection {
+    double atSeconds;
+    MotorFaultKind kind;
+    double seconds;
+};
+
+struct ProfileRun {
+    std::string name;
+    int cycles = 0;
+    int stops = 0;                       // Expected stops of those loops
+    double seconds = 0;
+};
+
+struct Results {
+    int cycles = 0;
+    int expectedStops = 0;
+    int missedStops = 0;
+    int falseStops = 0;
+    int stalls = 0;
+    std::vector<double> latencyMicros;   // Sensor edge -> motor stop command, ESP-NOW stations only
+    std::vector<double> stopErrorMm;     // Rest position - station position (sensor centre), along the direction of travel
+    std::vector<double> semaphoreMicros; // Aspect broadcast -> relay output on the semaphore node
+    std::map<int, std::vector<double>> latencyByHops;
+    double simSeconds = 0;
+    uint32_t flashWrites = 0;            // Controller NVS writes
+    int resets = 0;
+    std::vector<double> resumeMicros;    // Reset -> motor driven again
+    int bumperHits = 0;                  // Train driven into the end of the track
+    double peakAccel = 0;                // Largest speed change per second, mm/s^2
+    double peakDecel = 0;
+    bool segmentModel = false;           // The firmware reports its segment model
+    uint32_t overdueForward = 0;         // Flagged by the firmware as a missed trigger
+    uint32_t overdueBackward = 0;
+    uint32_t driftWarnings = 0;
+    int faultsInjected = 0;
+    int faultsDriven = 0;                // The motor was driven while they lasted
+    int faultsCut = 0;                   // Injected faults the controller cut the motor for
+    int bumperCuts = 0;                  // Stall against the end of the track
+    int falseCuts = 0;                   // Motor cut without a fault
+    std::vector<double> cutMicros;       // Fault start, or the motor driven into it -> motor cut
+    bool noRoute = false;                // The firmware has no route with the number asked for
+    std::string routeName;
+    int stopsPerLoop = 0;                // Forward stops of the route, START not counted
+    bool noProfile = false;              // The firmware has no profile with the number asked for
+    std::map<int, ProfileRun> profileRuns;  // By profile index, each loop counted for the profile it ended in
+    RadioStats radio;
+};
+
+struct LayoutOptions {
+    bool networkSemaphores = false;
+    double rangeStations = 0;           // 0 = every node hears every other
+    bool relay = false;
+    bool auth = false;
+    bool trace = false;
+    const char *journalFile = nullptr;
+    const char *serialFile = nullptr;
+    double wearPercent = 0;             // Speed lost per 100 cycles
+    int warmupCycles = 0;               // Not counted in the latency and stop statistics
+    std::vector<MotorFaultInjection> faults;
+    std::vector<std::pair<double, int>> resetsAt;   // Seconds into the run, esp_reset_reason_t
+    double resetEvery = 0;                          // Mean seconds between random resets
+    int resetEveryReason = ESP_RST_POWERON;
+    int route = -1;                                 // -1 = as the firmware boots, without the route report
+    int profile = -1;                               // Likewise, without the profile report
+    std::vector<std::pair<double, int>> profilesAt; // Seconds into the run, profile asked for
+    std::vector<std::pair<double, std::string>> consoleAt;  // Seconds into the run, line typed
+};
+
+// The controller firmware, from valley_firmware.so (sim/valley_firmware.cpp)
+struct Firmware {
+    void (*configure)(bool networkSemaphores, bool auth) = nullptr;
+    void (*setup)() = nullptr;
+    void (*loop)() = nullptr;
+    void (*printTrace)() = nullptr;
+    void (*flushJournal)() = nullptr;
+    char *(*rtc)(size_t *size) = nullptr;
+    void (*segmentStats)(uint32_t overdue[2], uint32_t *driftWarnings) = nullptr;  // Older builds lack it
+    void (*configureRoute)(int route) = nullptr;                                   // And these two
+    int (*route)(uint64_t *stops, const char **name) = nullptr;
+    void (*configureProfile)(int profile) = nullptr;                               // And these three
+    int (*profile)(const char **name) = nullptr;
+    bool (*requestProfile)(int profile) = nullptr;
+};
+
+static std::string firmwarePath;
+static int firmwareLoads = 0;
+
+// Every boot gets a fresh instance: dlopen() of a file already loaded would
+// return the old one with its globals, so each boot opens its own copy
+static bool loadFirmware(Firmware &firmware) {
+    char copy[96];
+    snprintf(copy, sizeof(copy), "/tmp/valley_firmware_%d_%d.so", (int)getpid(), firmwareLoads++);
+    FILE *in = fopen(firmwarePath.c_str(), "rb");
+    FILE *out = fopen(copy, "wb");
+    if (in == nullptr || out == nullptr) {
+        fprintf(stderr, "Cannot copy %s to %s\n", firmwarePath.c_str(), copy);
+        return false;
+    }
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) fwrite(buffer, 1, n, out);
+    fclose(in);
+    fclose(out);
+
+    void *handle = dlopen(copy, RTLD_NOW | RTLD_LOCAL);
+    unlink(copy);
+    if (handle == nullptr) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+    firmware.configure = (void (*)(bool, bool))dlsym(handle, "simFirmwareConfigure");
+    firmware.setup = (void (*)())dlsym(handle, "simFirmwareSetup");
+    firmware.loop = (void (*)())dlsym(handle, "simFirmwareLoop");
+    firmware.printTrace = (void (*)())dlsym(handle, "simFirmwarePrintTrace");
+    firmware.flushJournal = (void (*)())dlsym(handle, "simFirmwareFlushJournal");
+    firmware.rtc = (char *(*)(size_t *))dlsym(handle, "simFirmwareRtc");
+    firmware.segmentStats = (void (*)(uint32_t *, uint32_t *))dlsym(handle, "simFirmwareSegmentStats");
+    firmware.configureRoute = (void (*)(int))dlsym(handle, "simFirmwareConfigureRoute");
+    firmware.route = (int (*)(uint64_t *, const char **))dlsym(handle, "simFirmwareRoute");
+    firmware.configureProfile = (void (*)(int))dlsym(handle, "simFirmwareConfigureProfile");
+    firmware.profile = (int (*)(const char **))dlsym(handle, "simFirmwareProfile");
+    firmware.requestProfile = (bool (*)(int))dlsym(handle, "simFirmwareRequestProfile");
+    if (!firmware.configure || !firmware.setup || !firmware.loop || !firmware.printTrace || !firmware.flushJournal || !firmware.rtc) {
+        fprintf(stderr, "%s is not a valley_firmware.so\n", firmwarePath.c_str());
+        return false;
+    }
+    return true;
+}
+
+static int parseResetReason(const char *text) {
+    if (text == nullptr || !strcmp(text, "poweron")) return ESP_RST_POWERON;
+    if (!strcmp(text, "panic")) return ESP_RST_PANIC;
+    if (!strcmp(text, "wdt")) return ESP_RST_TASK_WDT;
+    if (!strcmp(text, "brownout")) return ESP_RST_BROWNOUT;
+    if (!strcmp(text, "sw")) return ESP_RST_SW;
+    fprintf(stderr, "Unknown reset reason %s, using poweron\n", text);
+    return ESP_RST_POWERON;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[(size_t)(p * (values.size() - 1))];
+}
+
+static double stationPosition(int station) {
+    return station * STATION_SPACING_MM;
+}
+
+class Layout {
+public:
+    Layout(const Scenario &scenario, uint32_t seed, const std::vector<ScriptedTrigger> &script, const LayoutOptions &options)
+        : scenario(scenario), rng(seed), script(script), options(options) {}
+
+    Results run(int cycles) {
+        radioSim.reset();
+        radioSim.configure(scenario.radio, rng());
+
+        controller = simAddNode("controller", controllerMac);
+        controller->eeprom[0] = 1;  // Loop mode on, the train starts by itself
+        FILE *serialCapture = options.serialFile ? fopen(options.serialFile, "wb") : nullptr;
+        if (options.serialFile && serialCapture == nullptr) fprintf(stderr, "Cannot write %s\n", options.serialFile);
+        simCaptureSerial(controller, serialCapture);
+        nodePositions[controller] = stationPosition(0);
+
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        for (int i = 1; i < NUM_STATIONS; i++) {
+            char *name = new char[16];
+            snprintf(name, 16, "station%d", i);
+            SimNode *node = simAddNode(name, stationMacs[i], (uniform(rng) - 0.5) * 80, uniform(rng) * 4e9);
+            node->rssi = (int8_t)(-55 - 4 * i);  // Farther stations are weaker
+            stations[i].node = node;
+            nodePositions[node] = stationPosition(i);
+            simRunAs(node, [&]() {
+                stations[i].sender.begin(controllerMac);
+                stations[i].sender.enableRelay(options.relay);
+                if (options.auth) stations[i].sender.enableAuth(stationKeys[i]);
+            });
+            StationNode *sender = &stations[i].sender;
+            node->recv = [sender](const uint8_t *mac, const uint8_t *data, int len) {
+                sender->handleReceive(mac, data, len, micros());
+            };
+        }
+
+        if (options.networkSemaphores) addSemaphoreNodes();
+        if (!loadFirmware(firmware)) exit(1);
+        configureFirmware();
+
+        radioSim.tap = [this](SimNode *from, const uint8_t *to, const uint8_t *data, int len) {
+            (void)to;
+            onRadioSend(from, data, len);
+        };
+        if (options.rangeStations > 0) {
+            radioSim.linkLoss = [this](SimNode *from, SimNode *to) { return distanceLoss(from, to); };
+        }
+
+        stations[0].low = true;  // The train starts parked on the START sensor
+
+        simSetInputReader([this](SimNode *node, uint8_t pin) { return readInput(node, pin); });
+        simSetPinWatcher([this](SimNode *node, uint8_t pin, uint8_t value) { onPin(node, pin, value); });
+        simSetAdcReader([this](SimNode *node, uint8_t channel) { return readCurrent(node, channel); });
+        simSetWorld([this]() { tick(); }, WORLD_TICK_MICROS);
+
+        for (const ScriptedTrigger &trigger : script) {
+            injectTrigger(trigger.atMicros, trigger.station);
+        }
+
+        // The stations took their radio start-up time first; the controller's
+        // millis() starts at zero in setup() like after any reset
+        controller->offsetMicros = -(double)simNow() * (1.0 + controller->driftPpm * 1e-6);
+        simRunAs(controller, [this]() { firmware.setup(); });
+        if (options.route >= 0) {
+            const char *name = "all";
+            int route = firmware.route ? firmware.route(&routeStops, &name) : 0;
+            if (route != options.route) {
+                results.noRoute = true;
+                return results;
+            }
+            results.routeName = name;
+            for (int i = 1; i < NUM_STATIONS; i++) results.stopsPerLoop += (routeStops >> i) & 1;
+        }
+        if (options.profile >= 0) {
+            const char *name = "normal";
+            int profile = firmware.profile ? firmware.profile(&name) : 0;
+            if (profile != options.profile) {
+                results.noProfile = true;
+                return results;
+            }
+        }
+        std::vector<std::pair<double, int>> profileRequests = options.profilesAt;
+        std::sort(profileRequests.begin(), profileRequests.end());
+        size_t nextProfileRequest = 0;
+        std::vector<std::pair<double, std::string>> consoleLines = options.consoleAt;
+        std::stable_sort(consoleLines.begin(), consoleLines.end(),
+                         [](const std::pair<double, std::string> &a, const std::pair<double, std::string> &b) { return a.first < b.first; });
+        size_t nextConsoleLine = 0;
+
+        std::vector<std::pair<double, int>> resets = options.resetsAt;
+        std::sort(resets.begin(), resets.end());
+        size_t nextReset = 0;
+        std::exponential_distribution<double> resetGap(options.resetEvery > 0 ? 1.0 / options.resetEvery : 1.0);
+        uint64_t nextRandomReset = options.resetEvery > 0 ? simNow() + (uint64_t)(resetGap(rng) * 1e6) : UINT64_MAX;
+
+        // Time allowed for the cycles; a slow profile takes over two minutes a loop
+        uint64_t cycleMicros = options.profile >= 0 || !options.profilesAt.empty() ? 240000000ULL : 120000000ULL;
+        uint64_t limit = simNow() + (uint64_t)cycles * cycleMicros;
+        lastProgress = simNow();
+        while (results.cycles < cycles && simNow() < limit) {
+            if (nextReset < resets.size() && simNow() >= (uint64_t)(resets[nextReset].first * 1e6)) {
+                resetController(resets[nextReset++].second);
+            } else if (simNow() >= nextRandomReset) {
+                resetController(options.resetEveryReason);
+                nextRandomReset = simNow() + (uint64_t)(resetGap(rng) * 1e6);
+            }
+            if (nextProfileRequest < profileRequests.size() && simNow() >= (uint64_t)(profileRequests[nextProfileRequest].first * 1e6)) {
+                int profile = profileRequests[nextProfileRequest++].second;
+                bool known = false;
+                simRunAs(controller, [&]() { known = firmware.requestProfile && firmware.requestProfile(profile); });
+                if (!known) fprintf(stderr, "The firmware has no profile %d, request ignored\n", profile);
+            }
+            if (nextConsoleLine < consoleLines.size() && simNow() >= (uint64_t)(consoleLines[nextConsoleLine].first * 1e6)) {
+                simSerialInput(controller, consoleLines[nextConsoleLine++].second + "\n");
+            }
+            if (awaitingResume && commandedDirection() != 0) {
+                results.resumeMicros.push_back((double)(simNow() - resetMicros));
+                awaitingResume = false;
+            }
+            simRunAs(controller, [this]() { firmware.loop(); });
+            simAdvance(LOOP_COST_MICROS);
+            if (controller->restartRequested) {
+                controller->restartRequested = false;
+                resetController(ESP_RST_SW);
+            }
+        }
+        results.simSeconds = simNow() / 1e6;
+        for (const MotorFaultInjection &fault : options.faults) {
+            if (fault.atSeconds * 1e6 < simNow()) results.faultsInjected++;
+        }
+        collectSegmentStats();
+        results.flashWrites = controller->nvsWrites;
+        if (options.journalFile) saveJournal(options.journalFile);
+        if (serialCapture) {
+            simCaptureSerial(controller, nullptr);
+            fclose(serialCapture);
+        }
+        if (options.trace) {
+            bool verbose = simVerbose;
+            simVerbose = true;
+            simRunAs(controller, [this]() { firmware.printTrace(); });
+            simVerbose = verbose;
+        }
+        results.radio = radioSim.stats;
+        return results;
+    }
+
+private:
+    struct Station {
+        SimNode *node = nullptr;
+        StationNode sender;
+        bool low = false;
+        bool reported = false;
+        uint64_t lowSince = 0;
+        uint32_t triggerSeq = 0;       // Last trigger and how many radio hops it took so far
+        int triggerHops = 0;
+        std::vector<uint8_t> captured; // Last direct trigger as sent over the air
+    };
+
+    struct SemaphoreBoard {
+        SimNode *node = nullptr;
+        SemaphoreNode *receiver = nullptr;
+    };
+
+    struct PendingStop {
+        bool active = false;
+        int station = 0;
+        int direction = 0;
+        uint64_t edgeMicros = 0;
+    };
+
+    // The motor pins are active LOW, so a pin drives for the share of time it is LOW.
+    // Positive forward, -1..1.
+    double commandedDrive() const {
+        return simPinDuty(controller, BACKWARD_PIN) - simPinDuty(controller, FORWARD_PIN);
+    }
+
+    // Injected motor fault in effect now, -1 for none
+    int activeFault() const {
+        double now = simNow() / 1e6;
+        for (size_t i = 0; i < options.faults.size(); i++) {
+            const MotorFaultInjection &fault = options.faults[i];
+            if (now >= fault.atSeconds && now < fault.atSeconds + fault.seconds) return (int)i;
+        }
+        return -1;
+    }
+
+    // The shunt amplifier on the controller's current sense input
+    uint16_t readCurrent(SimNode *node, uint8_t channel) {
+        (void)channel;
+        if (node != controller) return 0;
+        double drive = commandedDrive();
+        double milliamps = simMotorMilliamps(fabs(drive), velocity * (drive < 0 ? -1 : 1) / cruiseSpeed());
+        int fault = activeFault();
+        if (fault >= 0 && options.faults[fault].kind == FAULT_SHORT && drive != 0) milliamps = SIM_MOTOR_SHORT_MA;
+        if (fault >= 0 && options.faults[fault].kind == FAULT_DERAIL) milliamps = 0;
+        return simCurrentCounts(milliamps, noiseRng);
+    }
+
+    // A drop to zero in one step is the controller cutting the motor, ramps take many
+    void motorCut() {
+        lastProgress = simNow();
+        pressButtonAt = simNow() + OPERATOR_MICROS;
+        int fault = activeFault();
+        for (size_t i = 0; fault < 0 && i < options.faults.size(); i++) {
+            // Cut right after a short ended still counts for it
+            const MotorFaultInjection &injected = options.faults[i];
+            double now = simNow() / 1e6;
+            if (now >= injected.atSeconds && now < injected.atSeconds + injected.seconds + 0.01) fault = (int)i;
+        }
+        if (fault < 0 || faultCut.count(fault)) {
+            if (againstBumper) {
+                results.bumperCuts++;
+            } else {
+                results.falseCuts++;
+            }
+            return;
+        }
+        faultCut.insert(fault);
+        const MotorFaultInjection &injected = options.faults[fault];
+        results.faultsCut++;
+        results.cutMicros.push_back(simNow() - faultDriven[fault]);
+        pressButtonAt = (uint64_t)((injected.atSeconds + injected.seconds) * 1e6) + OPERATOR_MICROS;
+    }
+
+    int commandedDirection() const {
+        double drive = commandedDrive();
+        return drive > 0 ? 1 : drive < 0 ? -1 : 0;
+    }
+
+    // The chip resets: outputs float (the motor relays drop out), the radio
+    // stack is gone, flash and, unless the power was cut, RTC memory stay
+    void resetController(int reason) {
+        size_t rtcSize = 0;
+        char *rtc = firmware.rtc(&rtcSize);
+        std::vector<char> rtcMemory(rtc, rtc + rtcSize);
+
+        simResetNode(controller);
+        controller->espNowReady = false;
+        controller->recv = nullptr;
+        controller->promiscuous = nullptr;
+        controller->peers.clear();
+        collectSegmentStats();
+        lastDrive = 0;
+        stopping = false;
+        results.resets++;
+        resetMicros = simNow();
+        awaitingResume = true;
+        if (simVerbose) printf("[%10.3f controller] ==== RESET (%d) ====\n", simNow() / 1e6, reason);
+
+        simAdvance(BOOT_MICROS);
+
+        // millis() starts over at zero
+        controller->offsetMicros = -(double)simNow() * (1.0 + controller->driftPpm * 1e-6);
+        controller->resetReason = reason;
+        if (!loadFirmware(firmware)) exit(1);
+        configureFirmware();
+        rtc = firmware.rtc(&rtcSize);
+        if (reason == ESP_RST_POWERON) {
+            // Unpowered RTC memory comes up as noise
+            for (size_t i = 0; i < rtcSize; i++) rtc[i] = (char)rng();
+        } else {
+            memcpy(rtc, rtcMemory.data(), std::min(rtcSize, rtcMemory.size()));
+        }
+        simRunAs(controller, [this]() { firmware.setup(); });
+    }
+
+    // The counters start over with every boot of the firmware
+    void collectSegmentStats() {
+        if (!firmware.segmentStats) return;
+        uint32_t overdue[2] = {0, 0}, warnings = 0;
+        firmware.segmentStats(overdue, &warnings);
+        results.segmentModel = true;
+        results.overdueForward += overdue[0];
+        results.overdueBackward += overdue[1];
+        results.driftWarnings += warnings;
+    }
+
+    void addSemaphoreNodes() {
+        for (int i = 0; i < NUM_SEMAPHORES; i++) {
+            uint8_t mac[6] = {0x24, 0x6F, 0x28, 0x00, 0x02, (uint8_t)(i + 1)};
+            char *name = new char[16];
+            snprintf(name, 16, "semaphore%d", i + 1);
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            SemaphoreBoard &board = semaphoreBoards[i];
+            board.node = simAddNode(name, mac, (uniform(rng) - 0.5) * 80, uniform(rng) * 4e9);
+            nodePositions[board.node] = stationPosition(i + 1);
+            board.receiver = new SemaphoreNode(i + 1, SEMAPHORE_RED_PIN, SEMAPHORE_GREEN_PIN);
+            simRunAs(board.node, [&]() { board.receiver->begin(controllerMac); });
+            SemaphoreNode *receiver = board.receiver;
+            board.node->recv = [receiver](const uint8_t *mac, const uint8_t *data, int len) {
+                receiver->handleReceive(mac, data, len, micros());
+            };
+        }
+    }
+
+    void onRadioSend(SimNode *from, const uint8_t *data, int len) {
+        // First transmission of every aspect seq, repeats keep the original time
+        if (from == controller && len >= (int)sizeof(SemaphoreAspects) && data[0] == STATION_MSG_ASPECTS) {
+            SemaphoreAspects packet;
+            memcpy(&packet, data, sizeof(packet));
+            if (packet.seq != aspectSeq) {
+                aspectSeq = packet.seq;
+                aspectSentMicros = simNow();
+            }
+            return;
+        }
+
+        // Radio hops of each trigger: the station's own send, then one per relay
+        if (data[0] == STATION_MSG_TRIGGER && len >= (int)sizeof(StationPacket)) {
+            for (int i = 1; i < NUM_STATIONS; i++) {
+                if (stations[i].node != from) continue;
+                StationPacket packet;
+                memcpy(&packet, data, sizeof(packet));
+                stations[i].triggerSeq = packet.seq;
+                stations[i].triggerHops = 1;
+                stations[i].captured.assign(data, data + len);  // What an eavesdropper can replay
+            }
+        } else if (data[0] == STATION_MSG_RELAY && len >= (int)(sizeof(StationRelayHeader) + sizeof(StationPacket))) {
+            StationRelayHeader header;
+            StationPacket packet;
+            memcpy(&header, data, sizeof(header));
+            memcpy(&packet, data + sizeof(header), sizeof(packet));
+            if (packet.type != STATION_MSG_TRIGGER) return;
+            for (int i = 1; i < NUM_STATIONS; i++) {
+                if (memcmp(stationMacs[i], header.origin, 6) != 0) continue;
+                if (header.hops == 0) {
+                    stations[i].triggerSeq = packet.seq;
+                    stations[i].triggerHops = 1;
+                } else if (packet.seq == stations[i].triggerSeq) {
+                    stations[i].triggerHops++;
+                }
+            }
+        }
+    }
+
+    double distanceLoss(SimNode *from, SimNode *to) {
+        double range = options.rangeStations * STATION_SPACING_MM;
+        double distance = fabs(nodePositions[from] - nodePositions[to]);
+        if (distance <= 0.7 * range) return 0.0;
+        if (distance >= range) return 1.0;
+        return (distance - 0.7 * range) / (0.3 * range);
+    }
+
+    int readInput(SimNode *node, uint8_t pin) {
+        if (node != controller) return HIGH;
+        if (pin == START_SENSOR_PIN) {
+            return fabs(position - stationPosition(0)) < SENSOR_HALF_WIDTH_MM ? LOW : HIGH;
+        }
+        if (pin == IO_IN && simNow() < buttonReleaseMicros) {
+            int channel = (node->pins[SEL0_IN] ? 1 : 0) | (node->pins[SEL1_IN] ? 2 : 0) |
+                          (node->pins[SEL2_IN] ? 4 : 0) | (node->pins[SEL3_IN] ? 8 : 0);
+            return channel == pressedButton ? LOW : HIGH;
+        }
+        return HIGH;
+    }
+
+    void pressButton(int button) {
+        pressedButton = button;
+        buttonReleaseMicros = simNow() + 100000;
+    }
+
+    void onPin(SimNode *node, uint8_t pin, uint8_t value) {
+        if (node != controller && value == LOW && (pin == SEMAPHORE_RED_PIN || pin == SEMAPHORE_GREEN_PIN)) {
+            results.semaphoreMicros.push_back((double)(simNow() - aspectSentMicros));
+            return;
+        }
+        if (node != controller || (pin != FORWARD_PIN && pin != BACKWARD_PIN)) return;
+
+        // The firmware ramps the drive, one step per TRAIN_RAMP_PERIOD. A stop
+        // command is the first step of the ramp that ends at zero, and not one
+        // that slows down to creep speed first; reversing also ramps through zero
+        double drive = fabs(commandedDrive());
+        if (drive == 0 && lastDrive > 0.05) {
+            motorCut();
+            lastDrive = 0;
+            stopping = false;
+            return;
+        }
+        bool down = drive < lastDrive;
+        if (down && (!stopping || simNow() - lastDriveMicros > 2 * TRAIN_RAMP_PERIOD)) rampDownMicros = simNow();
+        stopping = down;
+        lastDrive = drive;
+        lastDriveMicros = simNow();
+        if (!down || drive > 0) return;
+        stopping = false;
+        lastProgress = simNow();
+
+        if (pending.active) {
+            if (pending.station != 0 && results.cycles >= options.warmupCycles) {
+                // A creep ramp still running at the sensor edge runs on into the stop
+                double latency = (double)(std::max(rampDownMicros, pending.edgeMicros) - pending.edgeMicros);
+                results.latencyMicros.push_back(latency);
+                results.latencyByHops[stations[pending.station].triggerHops].push_back(latency);
+            }
+            measuringStop = true;
+            measuredStation = pending.station;
+            measuredDirection = pending.direction;
+            pending.active = false;
+        } else if (!recovering) {
+            results.falseStops++;
+        }
+    }
+
+    // Wear slows the train down as the cycles go by
+    double cruiseSpeed() const {
+        double factor = 1.0 - options.wearPercent / 100.0 * results.cycles / 100.0;
+        return CRUISE_SPEED_MM_S * std::max(factor, 0.2);
+    }
+
+    // Back at START: the loop counts for the profile the controller runs now
+    void loopDone() {
+        results.cycles++;
+        if (options.profile >= 0 || !options.profilesAt.empty()) {
+            const char *name = "normal";
+            int profile = firmware.profile ? firmware.profile(&name) : 0;
+            ProfileRun &run = results.profileRuns[profile];
+            run.name = name;
+            run.cycles++;
+            run.stops += results.expectedStops - loopStartStops;
+            run.seconds += (simNow() - loopStartMicros) / 1e6;
+        }
+        loopStartMicros = simNow();
+        loopStartStops = results.expectedStops;
+    }
+
+    // Before setup(), on every boot
+    void configureFirmware() {
+        firmware.configure(options.networkSemaphores, options.auth);
+        if (options.route >= 0 && firmware.configureRoute) firmware.configureRoute(options.route);
+        if (options.profile >= 0 && firmware.configureProfile) firmware.configureProfile(options.profile);
+    }
+
+    void sensorCrossed(int station, int direction) {
+        // Stopping is expected at the route's stops going forward (at any station
+        // once one was missed) and only at START going back
+        bool stop = ((routeStops >> station) & 1) || (pending.active && pending.direction > 0);
+        bool expected = (direction > 0 && station >= 1 && stop) || (direction < 0 && station == 0);
+        if (!expected) return;
+
+        if (pending.active) {
+            results.missedStops++;
+        }
+        results.expectedStops++;
+        pending.active = true;
+        pending.station = station;
+        pending.direction = direction;
+        pending.edgeMicros = simNow();
+    }
+
+    void tick() {
+        const double dt = WORLD_TICK_MICROS / 1e6;
+
+        // Train: first order response to the average motor voltage, braking
+        // faster than it spins up
+        double drive = commandedDrive();
+        int direction = commandedDirection();
+        int fault = activeFault();
+        double target = fault >= 0 && options.faults[fault].kind == FAULT_DERAIL ? 0 : drive * cruiseSpeed();
+        double tau = fabs(target) > fabs(velocity) && direction * velocity >= 0 ? ACCEL_TAU_S : BRAKE_TAU_S;
+        double before = velocity;
+        velocity += (target - velocity) * (dt / tau);
+        double acceleration = (fabs(velocity) - fabs(before)) / dt;
+        if (acceleration > results.peakAccel) results.peakAccel = acceleration;
+        if (-acceleration > results.peakDecel) results.peakDecel = -acceleration;
+        if (direction == 0 && fabs(velocity) < 1.0) velocity = 0;
+        if (fault >= 0 && options.faults[fault].kind == FAULT_STALL) velocity = 0;
+        if (fault >= 0 && direction != 0 && !faultDriven.count(fault)) {
+            faultDriven[fault] = simNow();
+            results.faultsDriven++;
+        }
+        double previous = position;
+        position += velocity * dt;
+
+        double low = stationPosition(0) - BUMPER_MM;
+        double high = stationPosition(NUM_STATIONS - 1) + BUMPER_MM;
+        if (position < low || position > high) {
+            position = position < low ? low : high;
+            velocity = 0;
+            if (direction != 0 && !againstBumper) results.bumperHits++;
+            againstBumper = direction != 0;
+        } else {
+            againstBumper = false;
+        }
+
+        // Rest position after a stop
+        if (measuringStop && velocity == 0) {
+            double error = (position - stationPosition(measuredStation)) * measuredDirection;
+            if (results.cycles >= options.warmupCycles) results.stopErrorMm.push_back(error);
+            measuringStop = false;
+            if (measuredStation == 0) loopDone();
+        }
+
+        // Sensors: the local START sensor is read through digitalRead, the others report over ESP-NOW
+        for (int i = 0; i < NUM_STATIONS; i++) {
+            Station &station = stations[i];
+            bool low = fabs(position - stationPosition(i)) < SENSOR_HALF_WIDTH_MM;
+            if (low && !station.low) {
+                station.lowSince = simNow();
+                sensorCrossed(i, position > previous ? 1 : -1);
+            }
+            if (!low) station.reported = false;
+            station.low = low;
+            if (i == 0) continue;
+
+            simRunAs(station.node, [&]() {
+                if (low && !station.reported && simNow() - station.lowSince >= STATION_DEBOUNCE_MICROS) {
+                    station.reported = true;
+                    uint32_t edge = micros() - (uint32_t)(simNow() - station.lowSince);
+                    station.sender.sendTrigger(edge);
+                }
+                station.sender.loop();
+            });
+        }
+
+        for (SemaphoreBoard &board : semaphoreBoards) {
+            if (board.node == nullptr) continue;
+            simRunAs(board.node, [&]() { board.receiver->loop(); });
+        }
+
+        randomTraffic(dt);
+
+        if (pressButtonAt && simNow() >= pressButtonAt) {
+            pressButtonAt = 0;
+            recovering = true;
+            pressButton(BUTTON_BACKWARDS);
+        }
+
+        // Operator recovery when the train is stuck against a bumper or waiting for a lost trigger
+        if (simNow() - lastProgress > STALL_TIMEOUT_MICROS) {
+            results.stalls++;
+            if (pending.active) {
+                results.missedStops++;
+                pending.active = false;
+            }
+            recovering = true;
+            pressButton(BUTTON_BACKWARDS);
+            lastProgress = simNow();
+        }
+        if (recovering && fabs(position - stationPosition(0)) < SENSOR_HALF_WIDTH_MM && velocity == 0) {
+            recovering = false;
+        }
+    }
+
+    void randomTraffic(double dt) {
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        if (uniform(rng) < scenario.spuriousPerMinute * dt / 60.0) {
+            int station = 1 + (int)(uniform(rng) * (NUM_STATIONS - 1));
+            injectTrigger(simNow(), station);
+        }
+        if (uniform(rng) < scenario.unknownPerMinute * dt / 60.0) {
+            uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, (uint8_t)(uniform(rng) * 255)};
+            uint8_t data[1] = {STATION_MSG_TRIGGER};
+            radioSim.inject(simNow(), mac, controllerMac, data, 1, false);
+        }
+    }
+
+    // As if the partition were read out after the show (esptool read_flash)
+    void saveJournal(const char *path) {
+        bool verbose = simVerbose;
+        simVerbose = true;
+        simRunAs(controller, [this]() { firmware.flushJournal(); });
+        simVerbose = verbose;
+
+        const std::vector<uint8_t> &image = controller->partitions[JOURNAL_PARTITION_LABEL];
+        FILE *file = fopen(path, "wb");
+        if (file == nullptr || fwrite(image.data(), 1, image.size(), file) != image.size()) {
+            fprintf(stderr, "Cannot write %s\n", path);
+        }
+        if (file) fclose(file);
+    }
+
+    void injectTrigger(uint64_t atMicros, int station) {
+        // With authentication on, the best an attacker can do is replay a real trigger
+        if (options.auth && !stations[station].captured.empty()) {
+            const std::vector<uint8_t> &frame = stations[station].captured;
+            radioSim.inject(atMicros, stationMacs[station], controllerMac, frame.data(), (int)frame.size(), false);
+            return;
+        }
+
+        StationPacket packet = {};
+        packet.type = STATION_MSG_TRIGGER;
+        packet.seq = 0;
+        packet.sentMicros = (uint32_t)atMicros;
+        packet.syncError = STATION_SYNC_ERROR_UNKNOWN;
+        radioSim.inject(atMicros, stationMacs[station], controllerMac, (const uint8_t *)&packet, sizeof(packet), false);
+    }
+
+    Scenario scenario;
+    std::mt19937 rng;
+    std::vector<ScriptedTrigger> script;
+    LayoutOptions options;
+    std::map<SimNode *, double> nodePositions;
+    SemaphoreBoard semaphoreBoards[NUM_SEMAPHORES];
+    uint32_t aspectSeq = 0;
+    uint64_t aspectSentMicros = 0;
+    SimNode *controller = nullptr;
+    Firmware firmware;
+    uint64_t resetMicros = 0;
+    bool awaitingResume = false;
+    bool againstBumper = false;
+    Station stations[NUM_STATIONS];
+    uint64_t routeStops = ~0ULL;         // Stations the controller's route stops at going forward
+    uint64_t loopStartMicros = 0;        // Previous return to START, for the profile report
+    int loopStartStops = 0;
+    Results results;
+    PendingStop pending;
+    double position = 0;
+    double velocity = 0;
+    double lastDrive = 0;                // |commandedDrive()| at the last pin change
+    uint64_t lastDriveMicros = 0;
+    bool stopping = false;               // The last change stepped the drive down
+    uint64_t rampDownMicros = 0;         // First step of the current ramp down
+    bool measuringStop = false;
+    int measuredStation = 0;
+    int measuredDirection = 0;
+    uint64_t lastProgress = 0;
+    bool recovering = false;
+    int pressedButton = -1;
+    uint64_t buttonReleaseMicros = 0;
+    uint64_t pressButtonAt = 0;          // Operator goes on after a motor cut, 0 = not waiting
+    std::set<int> faultCut;              // Injected faults already cut
+    std::map<int, uint64_t> faultDriven; // Injected fault -> first time the motor was driven during it
+    std::mt19937 noiseRng{7};            // Current noise, apart from the traffic randomness
+};
+
+static Scenario makeScenario(const char *name, double loss, double dup, double jitter, double reorder, double spurious, double unknown) {
+    Scenario scenario;
+    scenario.name = name;
+    scenario.radio.lossChance = loss;
+    scenario.radio.duplicateChance = dup;
+    scenario.radio.jitterMicros = jitter;
+    scenario.radio.reorderChance = reorder;
+    scenario.spuriousPerMinute = spurious;
+    scenario.unknownPerMinute = unknown;
+    return scenario;
+}
+
+static double deviation(const std::vector<double> &values) {
+    if (values.size() < 2) return 0;
+    double sum = 0, squares = 0;
+    for (double v : values) {
+        sum += v;
+        squares += v * v;
+    }
+    double mean = sum / values.size();
+    return sqrt(std::max(0.0, squares / values.size() - mean * mean));
+}
+
+static void printResults(const Scenario &scenario, const Results &results) {
+    double missedRate = results.expectedStops ? 100.0 * results.missedStops / results.expectedStops : 0;
+    std::vector<double> absError;
+    for (double e : results.stopErrorMm) absError.push_back(fabs(e));
+    // At cruise speed 1 mm of stop error is 5 ms of train travel
+    double msPerMm = 1000.0 / CRUISE_SPEED_MM_S;
+
+    printf("%-11s loss %4.0f%% dup %3.0f%% jit %5.0fus reo %3.0f%% | cycles %3d stops %4d missed %5.2f%% false %3d stalls %2d | "
+           "latency p50 %6.2f p90 %6.2f p99 %7.2f max %7.2f ms | stop err p50 %5.1f p99 %6.1f max %6.1f sd %5.1f mm (p99 %5.0f ms)\n",
+           scenario.name, scenario.radio.lossChance * 100, scenario.radio.duplicateChance * 100, scenario.radio.jitterMicros,
+           scenario.radio.reorderChance * 100, results.cycles, results.expectedStops, missedRate, results.falseStops, results.stalls,
+           percentile(results.latencyMicros, 0.5) / 1000, percentile(results.latencyMicros, 0.9) / 1000,
+           percentile(results.latencyMicros, 0.99) / 1000, percentile(results.latencyMicros, 1.0) / 1000,
+           percentile(absError, 0.5), percentile(absError, 0.99), percentile(absError, 1.0), deviation(results.stopErrorMm),
+           percentile(absError, 0.99) * msPerMm);
+    if (results.latencyByHops.size() > 1 || (results.latencyByHops.size() == 1 && results.latencyByHops.begin()->first != 1)) {
+        for (const auto &entry : results.latencyByHops) {
+            printf("%-11s %d hop(s): %4zu stops, latency p50 %6.2f p99 %6.2f max %6.2f ms\n", "", entry.first,
+                   entry.second.size(), percentile(entry.second, 0.5) / 1000, percentile(entry.second, 0.99) / 1000,
+                   percentile(entry.second, 1.0) / 1000);
+        }
+    }
+    if (!results.semaphoreMicros.empty()) {
+        printf("%-11s semaphores: %zu relay switches, broadcast to applied p50 %6.2f p99 %6.2f max %6.2f ms\n", "",
+               results.semaphoreMicros.size(), percentile(results.semaphoreMicros, 0.5) / 1000,
+               percentile(results.semaphoreMicros, 0.99) / 1000, percentile(results.semaphoreMicros, 1.0) / 1000);
+    }
+    printf("%-11s cycle time %.1f s, peak accel %.0f decel %.0f mm/s^2, flash writes %u, radio: sent %u lost %u duplicated %u held back %u delivered %u injected %u, %.0f s simulated\n", "",
+           results.cycles ? results.simSeconds / results.cycles : 0.0, results.peakAccel, results.peakDecel, results.flashWrites, results.radio.sent, results.radio.lost, results.radio.duplicated, results.radio.reordered,
+           results.radio.delivered, results.radio.injected, results.simSeconds);
+    if (results.resets > 0 || results.bumperHits > 0) {
+        printf("%-11s resets %d, motor driven again after p50 %.2f max %.2f s (%zu resumed), bumper hits %d\n", "", results.resets,
+               percentile(results.resumeMicros, 0.5) / 1e6, percentile(results.resumeMicros, 1.0) / 1e6, results.resumeMicros.size(),
+               results.bumperHits);
+    }
+    if (results.faultsInjected > 0 || results.bumperCuts > 0 || results.falseCuts > 0) {
+        printf("%-11s motor current: %d faults injected, %d while driven, %d cut after p50 %.1f max %.1f ms, %d stalls at a bumper cut, "
+               "%d cuts without a fault\n", "", results.faultsInjected, results.faultsDriven, results.faultsCut, percentile(results.cutMicros, 0.5) / 1000,
+               percentile(results.cutMicros, 1.0) / 1000, results.bumperCuts, results.falseCuts);
+    }
+    if (!results.routeName.empty()) {
+        double hours = results.simSeconds / 3600;
+        printf("%-11s route %s: %d stops per loop, %.1f loops/h, %.0f stops/h\n", "", results.routeName.c_str(), results.stopsPerLoop,
+               results.cycles / hours, results.cycles * results.stopsPerLoop / hours);
+    }
+    for (const auto &entry : results.profileRuns) {
+        const ProfileRun &run = entry.second;
+        double hours = run.seconds / 3600;
+        printf("%-11s profile %d %s: %d loops, %.1f s each, %.1f loops/h, %.0f stops/h\n", "", entry.first, run.name.c_str(),
+               run.cycles, run.seconds / run.cycles, run.cycles / hours, run.stops / hours);
+    }
+    if (results.segmentModel) {
+        printf("%-11s segment model: %u stations flagged overdue going forward (%d stops missed), %u going back, %u drift warnings\n",
+               "", results.overdueForward, results.missedStops, results.overdueBackward, results.driftWarnings);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<Scenario> scenarios = {
+        makeScenario("clean",      0.00, 0.00,  100, 0.00, 0, 0),
+        makeScenario("jitter",     0.00, 0.00, 3000, 0.00, 0, 0),
+        makeScenario("lossy",      0.10, 0.00,  300, 0.00, 0, 0),
+        makeScenario("duplicates", 0.00, 0.20,  300, 0.00, 0, 0),
+        makeScenario("reorder",    0.00, 0.00,  300, 0.20, 0, 0),
+        makeScenario("noisy",      0.02, 0.00,  300, 0.00, 1, 30),
+        makeScenario("hostile",    0.15, 0.10, 2000, 0.10, 1, 30),
+    };
+
+    const char *selected = "all";
+    int cycles = 10;
+    uint32_t seed = 1;
+    std::vector<ScriptedTrigger> script;
+    RadioConfig overrides;
+    LayoutOptions options;
+    bool routeAll = false;
+    bool profileAll = false;
+    bool overrideLoss = false, overrideDup = false, overrideReorder = false, overrideJitter = false, overrideBase = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : "";
+        if (!strcmp(arg, "--scenario")) { selected = value; i++; }
+        else if (!strcmp(arg, "--cycles")) { cycles = atoi(value); i++; }
+        else if (!strcmp(arg, "--seed")) { seed = (uint32_t)atoi(value); i++; }
+        else if (!strcmp(arg, "--loss")) { overrides.lossChance = atof(value); overrideLoss = true; i++; }
+        else if (!strcmp(arg, "--dup")) { overrides.duplicateChance = atof(value); overrideDup = true; i++; }
+        else if (!strcmp(arg, "--reorder")) { overrides.reorderChance = atof(value); overrideReorder = true; i++; }
+        else if (!strcmp(arg, "--jitter")) { overrides.jitterMicros = atof(value); overrideJitter = true; i++; }
+        else if (!strcmp(arg, "--base")) { overrides.baseDelayMicros = atof(value); overrideBase = true; i++; }
+        else if (!strcmp(arg, "--inject")) {
+            ScriptedTrigger trigger;
+            trigger.atMicros = (uint64_t)(atof(value) * 1000);
+            const char *colon = strchr(value, ':');
+            trigger.station = colon ? atoi(colon + 1) : 1;
+            if (trigger.station < 1 || trigger.station >= NUM_STATIONS) trigger.station = 1;
+            script.push_back(trigger);
+            i++;
+        }
+        else if (!strcmp(arg, "--net-semaphores")) { options.networkSemaphores = true; }
+        else if (!strcmp(arg, "--range")) { options.rangeStations = atof(value); i++; }
+        else if (!strcmp(arg, "--relay")) { options.relay = true; }
+        else if (!strcmp(arg, "--auth")) { options.auth = true; }
+        else if (!strcmp(arg, "--trace")) { options.trace = true; }
+        else if (!strcmp(arg, "--journal")) { options.journalFile = value; i++; }
+        else if (!strcmp(arg, "--serial")) { options.serialFile = value; i++; }
+        else if (!strcmp(arg, "--wear")) { options.wearPercent = atof(value); i++; }
+        else if (!strcmp(arg, "--warmup")) { options.warmupCycles = atoi(value); i++; }
+        else if (!strcmp(arg, "--fault")) {
+            MotorFaultInjection fault = {atof(value), FAULT_STALL, 5.0};
+            const char *kind = strchr(value, ':');
+            if (kind && !strncmp(kind + 1, "derail", 6)) fault.kind = FAULT_DERAIL;
+            if (kind && !strncmp(kind + 1, "short", 5)) {
+                fault.kind = FAULT_SHORT;
+                fault.seconds = 0.05;
+            }
+            const char *duration = kind ? strchr(kind + 1, ':') : nullptr;
+            if (duration) fault.seconds = atof(duration + 1);
+            options.faults.push_back(fault);
+            i++;
+        }
+        else if (!strcmp(arg, "--reset-at")) {
+            const char *colon = strchr(value, ':');
+            options.resetsAt.push_back({atof(value), parseResetReason(colon ? colon + 1 : nullptr)});
+            i++;
+        }
+        else if (!strcmp(arg, "--reset-every")) {
+            const char *colon = strchr(value, ':');
+            options.resetEvery = atof(value);
+            options.resetEveryReason = parseResetReason(colon ? colon + 1 : nullptr);
+            i++;
+        }
+        else if (!strcmp(arg, "--route")) {
+            routeAll = !strcmp(value, "all");
+            options.route = routeAll ? 0 : atoi(value);
+            i++;
+        }
+        else if (!strcmp(arg, "--profile")) {
+            profileAll = !strcmp(value, "all");
+            options.profile = profileAll ? 0 : atoi(value);
+            i++;
+        }
+        else if (!strcmp(arg, "--profile-at")) {
+            const char *colon = strchr(value, ':');
+            options.profilesAt.push_back({atof(value), colon ? atoi(colon + 1) : 0});
+            i++;
+        }
+        else if (!strcmp(arg, "--console")) {
+            const char *colon = strchr(value, ':');
+            options.consoleAt.push_back({atof(value), colon ? colon + 1 : ""});
+            i++;
+        }
+        else if (!strcmp(arg, "--firmware")) { firmwarePath = value; i++; }
+        else if (!strcmp(arg, "-v")) { simVerbose = true; }
+        else {
+            fprintf(stderr, "Unknown option %s (see the top of sim/valley_sim.cpp)\n", arg);
+            return 1;
+        }
+    }
+
+    if (firmwarePath.empty()) {
+        char self[4096];
+        ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        self[length > 0 ? length : 0] = 0;
+        char *slash = strrchr(self, '/');
+        firmwarePath = slash ? std::string(self, slash + 1) + "valley_firmware.so" : "./valley_firmware.so";
+    }
+
+    // The firmware uses globals and function statics, so every scenario runs in its own process.
+    // A bumper hit fails the run: a lost trigger must never take the train past the end stations.
+    bool all = !strcmp(selected, "all");
+    bool failed = false;
+    for (const Scenario &base : scenarios) {
+        if (!all && strcmp(selected, base.name)) continue;
+        Scenario scenario = base;
+        if (overrideLoss) scenario.radio.lossChance = overrides.lossChance;
+        if (overrideDup) scenario.radio.duplicateChance = overrides.duplicateChance;
+        if (overrideReorder) scenario.radio.reorderChance = overrides.reorderChance;
+        if (overrideJitter) scenario.radio.jitterMicros = overrides.jitterMicros;
+        if (overrideBase) scenario.radio.baseDelayMicros = overrides.baseDelayMicros;
+
+        if (all || routeAll || profileAll) {
+            // With --route all or --profile all, from 0 on until the firmware has no more
+            for (int route = options.route;; route++) {
+                int status = 0;
+                for (int profile = options.profile;; profile++) {
+                    LayoutOptions runOptions = options;
+                    runOptions.route = route;
+                    runOptions.profile = profile;
+                    fflush(stdout);
+                    pid_t pid = fork();
+                    if (pid == 0) {
+                        Layout layout(scenario, seed, script, runOptions);
+                        Results results = layout.run(cycles);
+                        if (results.noRoute) _exit(2);
+                        if (results.noProfile) _exit(3);
+                        printResults(scenario, results);
+                        fflush(stdout);
+                        _exit(results.bumperHits > 0 ? 4 : 0);
+                    }
+                    waitpid(pid, &status, 0);
+                    int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                    if (code == 4) failed = true;
+                    if (!profileAll || (code != 0 && code != 4)) break;
+                }
+                // The profiles of a route end with exit 3, the routes with exit 2
+                int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                if (!routeAll || (code != 0 && code != 3 && code != 4)) break;
+            }
+        } else {
+            Layout layout(scenario, seed, script, options);
+            Results results = layout.run(cycles);
+            if (results.noRoute) {
+                fprintf(stderr, "The firmware has no route %d\n", options.route);
+                return 1;
+            }
+            if (results.noProfile) {
+                fprintf(stderr, "The firmware has no profile %d\n", options.profile);
+                return 1;
+            }
+            printResults(scenario, results);
+            if (results.bumperHits > 0) {
+                printf("FAIL: the train was driven into a bumper\n");
+                return 1;
+            }
+            return 0;
+        }
+    }
+    if (failed) {
+        printf("FAIL: a train was driven into a bumper\n");
+        return 1;
+    }
+    return 0;
+}
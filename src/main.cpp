@@ -1,14 +1,31 @@
 #include <Arduino.h>
 #include "UI.h"
+#include "LAYOUT.h"
 #include "TRAIN.h"
 #include "SEMAPHORE_T.h"
-#include <EEPROM.h>
+#include "LINK_MONITOR.h"
+#include "STATION_PROTOCOL.h"
+#include "STATION_ROUTER.h"
+#include "STATION_AUTH.h"
+#include "SETTINGS.h"
+#include "CRASH_TRACE.h"
+#include "OPS_JOURNAL.h"
+#include "CHECKPOINT.h"
+#include "BOOT_PROFILE.h"
+#include "SEGMENT_MODEL.h"
+#include "TIMETABLE.h"
+#include "PROFILES.h"
+#include "CONSOLE.h"
+#include "TELEMETRY.h"
+#include "SPAN_PROFILE.h"
+#include "LATENCY_TRACE.h"
+#include "TASK_MONITOR.h"
+#include "MOTOR_CURRENT.h"
+#include "BLOCK_CONTROL.h"
 
 #include <WiFi.h>
 #include <esp_now.h>
-
-#define EEPROM_SIZE 1  // We only need to store 1 byte for loopEnabled
-#define EEPROM_ADDR 0
+#include <esp_wifi.h>
 
 #define MOVING_FORWARD 0
 #define MOVING_BACKWARD 1
@@ -17,21 +34,115 @@
 #define LOOP_LED_ON 1
 #define LOOP_LED_OFF 0
 
+#define HOMING_TIMEOUT 60000   // ms to find START when the position is unknown after a reset
+
+// true: only authenticated station packets are accepted. false: old senders
+// still work, but a station that sent one authenticated packet cannot go back
+#ifndef REQUIRE_STATION_AUTH
+#define REQUIRE_STATION_AUTH false
+#endif
+
+// SEMAPHORE_NETWORK drives the semaphores through ESP-NOW semaphore nodes,
+// SEMAPHORE_SHIFT through shift registers for more than the MUX has channels for
+#ifndef SEMAPHORE_MODE
+#define SEMAPHORE_MODE SEMAPHORE_MUX
+#endif
+
+// Trains with an ESP-NOW train node (lib/BLOCK_CONTROL). 0: one train on the
+// motor outputs of this board
+#ifndef TRAIN_NODES
+#define TRAIN_NODES 0
+#endif
+
+// Controllers sharing a loop layout with train nodes, rows of sectionTable
+// (lib/SECTION_LINK). 0: this board runs the whole line
+#ifndef SECTIONS
+#define SECTIONS 0
+#endif
+
 UI ui;
 Train train;
 Semaphore semaphores;
+LinkMonitor linkMonitor;
+Settings settings;
+OpsJournal journal;
+Checkpoint checkpoint;
+SegmentModel segmentModel;
+Timetable timetable;
+Profiles profiles;
+Console console;
+Telemetry telemetry;
+LatencyTrace latencyTrace;
+TaskMonitor taskMonitor;
+MotorCurrent motorCurrent;
+BlockControl blockControl;
+SPAN_ZONE(soundAndLoopSpan, "handleSoundAndLoop");
+SPAN_ZONE(stateMachineSpan, "stateMachine");
+uint8_t trainNodes = TRAIN_NODES;
+uint8_t sections = SECTIONS;
+SemaphoreMode semaphoreMode = SEMAPHORE_MODE;
+StationAuthVerifier authVerifier;
+bool requireStationAuth = REQUIRE_STATION_AUTH;
 int input;
 STATION_STATE activeStation = STATION_NONE;
 
 bool loopEnabled = false;
-bool firstLoopEnabled = false; 
-
-// One flag per station – set true by ESP-NOW callback when that station fires
-volatile bool stationTriggered[NUM_STATIONS] = {false};
+uint32_t loopPasses = 0;
+
+// Console commands that act on the train. The console task posts one at a
+// time, loop() carries it out at its top
+enum ConsoleAction : uint8_t { CONSOLE_NONE, CONSOLE_HALT, CONSOLE_FORCE, CONSOLE_SAVE, CONSOLE_REPORT, CONSOLE_RESTART };
+struct ConsoleRequest {
+    uint8_t action;
+    int8_t state;
+    int8_t station;
+};
+ConsoleRequest consoleRequest = {CONSOLE_NONE, 0, 0};
+portMUX_TYPE consoleLock = portMUX_INITIALIZER_UNLOCKED;
+volatile bool maintenance = false;     // Set by the console task only: state and station commands allowed
+
+// Taken up by the state machine on its next pass, loop() only
+struct ForcedTransition {
+    bool pending;
+    int8_t state;                      // -1: halt where the train is
+    int8_t station;
+};
+ForcedTransition forcedTransition = {false, -1, 0};
+
+// Posted by the ESP-NOW callback when a station fires, with the sensor edge
+// time (receive time for unsynced stations)
+StationTriggers stationTriggers;
+
+// Clock sync requests waiting for a reply from loop(), one slot per station
+struct PendingSyncReply {
+    uint32_t seq;
+    uint32_t t1;
+    uint32_t t2;
+    bool authenticated;                  // Signed request: the reply is signed with its epoch
+    uint16_t epoch;
+};
+PendingSyncReply pendingSyncReplies[LAYOUT_MAX_STATIONS];
+volatile StationSet syncRepliesPending = 0;
+portMUX_TYPE syncReplyLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Stations out of range reach us through relays; replies go back through the
+// relay their last message came from
+StationRouter relayRouter;
+bool stationRelayed[LAYOUT_MAX_STATIONS] = {false};
+uint8_t stationRelayMac[LAYOUT_MAX_STATIONS][6];
+uint8_t ownMac[6];
+uint32_t routeBeaconSeq = 0;
+const uint8_t broadcastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// RSSI of the last ESP-NOW frame, captured by the promiscuous callback right
+// before the ESP-NOW receive callback runs for the same frame (both in the WiFi task)
+volatile int8_t lastRxRssi = 0;
+uint8_t lastRxMac[6] = {0};
 
 // MAC table: which sender ESP32 belongs to which station index
-// NOTE: station index 0 == STATION_START, 1 == STATION_1, ..., 7 == STATION_LAST
-const uint8_t stationMacs[NUM_STATIONS][6] = {
+// NOTE: station index 0 == STATION_START, 1 == STATION_1, ..., station count - 1 == LAST.
+// A longer line adds rows here and raises the station count in the settings.
+const uint8_t stationMacs[LAYOUT_MAX_STATIONS][6] = {
     {0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // index 0 -> STATION_START (your Sender #1)
     {0xCC, 0x7B, 0x5C, 0x28, 0x84, 0x4C}, // index 1 -> STATION_1
     {0xD8, 0xBC, 0x38, 0xF8, 0x90, 0x24}, // index 2 -> STATION_2
@@ -39,73 +150,272 @@ const uint8_t stationMacs[NUM_STATIONS][6] = {
     {0xF0, 0x08, 0xD1, 0xD5, 0x3D, 0x80}, // index 4 -> STATION_4
     {0xA4, 0xCF, 0x12, 0x6A, 0x50, 0xD4}, // index 5 -> STATION_5
     {0xB4, 0xE6, 0x2D, 0xBA, 0xDB, 0x61}, // index 6 -> STATION_6
-    {0x34, 0xB7, 0xDA, 0xF9, 0x4B, 0x4C}, // index 7 -> STATION_LAST
+    {0x34, 0xB7, 0xDA, 0xF9, 0x4B, 0x4C}, // index 7 -> LAST with eight stations
+};
+
+// Per-station SipHash keys, same index as stationMacs. Each sender gets its own
+// key through StationNode::enableAuth(). Replace these example keys before use.
+const uint8_t stationKeys[LAYOUT_MAX_STATIONS][STATION_KEY_SIZE] = {
+    {0},                                                                                              // STATION_START is wired
+    {0x3a, 0x91, 0x5c, 0x07, 0xe2, 0x4f, 0xb8, 0x16, 0xd0, 0x6b, 0x29, 0xa4, 0x73, 0xc5, 0x1e, 0x88}, // STATION_1
+    {0x52, 0x0d, 0xf7, 0x9e, 0x34, 0xa1, 0x6c, 0xbb, 0x08, 0xe9, 0x47, 0x12, 0xdc, 0x85, 0x3f, 0x60}, // STATION_2
+    {0xc4, 0x2b, 0x78, 0xe1, 0x95, 0x0a, 0x5d, 0x36, 0xfa, 0x17, 0x8c, 0x43, 0xb0, 0x69, 0xd2, 0x2e}, // STATION_3
+    {0x1f, 0xa6, 0x3c, 0x84, 0x5b, 0xd7, 0x02, 0x99, 0x6e, 0xf3, 0x21, 0xb5, 0x48, 0x0c, 0x97, 0xea}, // STATION_4
+    {0x8d, 0x64, 0xc9, 0x30, 0x1a, 0x7f, 0xe5, 0x4c, 0xa3, 0x58, 0xbe, 0x06, 0x91, 0x2d, 0xf4, 0x7b}, // STATION_5
+    {0xe7, 0x35, 0x0b, 0xd6, 0x82, 0x49, 0x9f, 0x13, 0x5a, 0xc8, 0x76, 0x2f, 0x04, 0xbd, 0x61, 0xa9}, // STATION_6
+    {0x27, 0xdb, 0x96, 0x4e, 0xf0, 0x63, 0x18, 0xac, 0x3d, 0x85, 0xe2, 0x7a, 0xc1, 0x59, 0x0e, 0xb4}, // LAST with eight stations
+};
+
+// Key of a station of this controller, by its place on the whole line
+const uint8_t *stationKey(int station) {
+    return stationKeys[layout.lineStation(station)];
+}
+
+// Semaphore node boards (SEMAPHORE_NETWORK), row id - 1, the ids of this
+// controller's stations. Their acks only count from these MACs; a station
+// board that drives its semaphore goes in with its own.
+const uint8_t semaphoreMacs[][6] = {
+    {0x24, 0x6F, 0x28, 0x00, 0x02, 0x01}, // Semaphore 1
+    {0x24, 0x6F, 0x28, 0x00, 0x02, 0x02}, // Semaphore 2
+    {0x24, 0x6F, 0x28, 0x00, 0x02, 0x03}, // Semaphore 3
+    {0x24, 0x6F, 0x28, 0x00, 0x02, 0x04}, // Semaphore 4
+    {0x24, 0x6F, 0x28, 0x00, 0x02, 0x05}, // Semaphore 5
+    {0x24, 0x6F, 0x28, 0x00, 0x02, 0x06}, // Semaphore 6
+};
+
+// Train node boards, in the order they park at stations 0.. for power on
+const uint8_t trainMacs[BLOCK_MAX_TRAINS][6] = {
+    {0x24, 0x6F, 0x28, 0x00, 0x03, 0x01},
+    {0x24, 0x6F, 0x28, 0x00, 0x03, 0x02},
+    {0x24, 0x6F, 0x28, 0x00, 0x03, 0x03},
+    {0x24, 0x6F, 0x28, 0x00, 0x03, 0x04},
+};
+
+// Controllers of a loop cut into sections, in line order, each with the
+// first line station of its section; the station count in the settings is
+// then the whole loop's and stationMacs lists all of it. Every controller gets
+// the same tables and finds its own row by its MAC.
+const LayoutSection sectionTable[LAYOUT_MAX_SECTIONS] = {
+    {{0x24, 0x6F, 0x28, 0x00, 0x00, 0x01}, 0},
+    {{0x24, 0x6F, 0x28, 0x00, 0x00, 0x02}, 4},
+};
+
+// Timetable routes (lib/TIMETABLE), the route setting picks one at boot.
+// Route 0 stops everywhere, as the train always did.
+const char *const routeSpecs[] = {
+    "all: 1-L",
+    "express: 3 6 L",
+    "short: 1-4",
+    "busy: 2 4/5 6 L every 60",
+};
+
+// Operating profiles (lib/PROFILES) besides 0, normal, which the settings
+// make. profiles.request() switches, the train takes it up when it stands.
+const OperatingProfile profileTable[] = {
+    // name               dwell  back  pulse fwd back accel decel creep sound ms
+    {"rush hour",           800,  500,  200, 100, 100,  250,  120,   30, PROFILES_DEFAULT_SOUND},
+    {"quiet",              5000, 3000,  200,  60,  60,  800,  400,   25, 0},
+    {"maintenance crawl",  5000, 3000,  300,  45,  45, 1000,  500,   20, 0},
+};
+
+// Same order as TRAIN_STATE_TYPE in vallleyTrainStateMachine(), for the crash trace
+const char *const trainStateNames[] = {
+    "START", "GOING_TO_STATION_X", "TURN_GREEN_LIGHT_ON_AT_STATION_X", "WAITING_AT_STATION_X",
+    "GOING_TO_LAST_STATION", "WAIT_BEFORE_GOING_BACKWARD", "GOING_BACKWARD", "WAITING_BEFORE_NEXT_LOOP",
+};
+
+// Indexed by BUTTON_SENSORS_INPUTS (lib/UI), for the crash trace
+const char *const buttonNames[] = {
+    "SOUND_ON_OFF", "VOLUME_UP", "VOLUME_DOWN", "PLAY_PAUSE", "LOOP", "BACKWARDS",
+};
+
+void consoleGet(int argc, char **argv);
+void consoleSet(int argc, char **argv);
+void consoleProfile(int argc, char **argv);
+void consoleSave(int argc, char **argv);
+void consoleStats(int argc, char **argv);
+void consoleMaintenance(int argc, char **argv);
+void consoleState(int argc, char **argv);
+void consoleStation(int argc, char **argv);
+void consoleTelemetry(int argc, char **argv);
+void consoleSpans(int argc, char **argv);
+void consoleLatency(int argc, char **argv);
+void consoleTasks(int argc, char **argv);
+void consoleRestart(int argc, char **argv);
+
+const ConsoleCommand consoleCommands[] = {
+    {"get", "[NAME]", "values of the active profile", consoleGet},
+    {"set", "NAME VALUE", "change one, as a custom profile taken up when the train stands", consoleSet},
+    {"profile", "[N]", "list the profiles, or switch to profile N", consoleProfile},
+    {"save", "", "keep the active values as the normal profile for the next boot", consoleSave},
+    {"stats", "", "counters of this boot", consoleStats},
+    {"maint", "on|off", "maintenance mode: halt the train, allow state and station", consoleMaintenance},
+    {"state", "NAME|N [STATION]", "force the state machine into a state (maintenance)", consoleState},
+    {"station", "N", "act as if station N had fired (maintenance)", consoleStation},
+    {"telemetry", "[MS]", "binary status frames every MS ms, 0 stops them", consoleTelemetry},
+    {"spans", "[ZONE|reset]", "time per profiling zone, the histogram of one, or start over", consoleSpans},
+    {"latency", "[STATION|reset]", "sensor edge to motor outputs per station and hop, or start over", consoleLatency},
+    {"tasks", "", "CPU share, stack left and core of each FreeRTOS task", consoleTasks},
+    {"restart", "", "write pending settings and the journal, then restart (maintenance)", consoleRestart},
 };
 
 void handleSoundAndLoop();
+void applyProfile();
+void serviceConsole();
 void vallleyTrainStateMachine();
-String getStatusText(int input, int activeStation, int state, int trainState, int station, bool initiatedToRed);
+void serviceTelemetry();
 
 void printMacAddress();
-int findStationIndexByMac(const uint8_t *mac);
 void onEspNowReceive(const uint8_t *mac, const uint8_t *data, int len);
+void handleStationMessage(int stationIndex, const uint8_t *data, int len, uint32_t receivedMicros, int8_t rssi, uint8_t hops, const uint8_t *relayMac);
+void onPromiscuousRx(void *buf, wifi_promiscuous_pkt_type_t type);
 void setupEspNowReceiver();
-
-void loopAnalysis();
+void serviceTimeSync();
+void restoreAuthEpochs();
+void saveAuthEpochs();
+void sendRouteBeacon();
 
 void setup() {
     Serial.begin(115200);
+    bootProfile.begin();
     Serial.println("Starting Valley Train");
-    //delay(1000);
 
+    // Motor off before anything else; the pins float until then
+    train.initTrain();
+    motorCurrent.begin(train);
+    bootProfile.phase("motor");
+
+    crashTrace.setStateNames(trainStateNames, sizeof(trainStateNames) / sizeof(trainStateNames[0]));
+    crashTrace.setButtonNames(buttonNames, sizeof(buttonNames) / sizeof(buttonNames[0]));
+    crashTrace.begin();
+    journal.begin();
+    journal.record(JOURNAL_BOOT, crashTrace.resetReason());
+    checkpoint.restore(crashTrace.resetReason(), journal);
+    bootProfile.phase("trace+journal");
+
+    // Starts the LED self-test and the DFPlayer, which finish in ui.update()
+    // while the radio comes up and loop() is already running
+    ui.setupPinsAndSensors();
+    ui.setVolumeLevel(settings.volume());
+    profiles.begin(profileTable, sizeof(profileTable) / sizeof(profileTable[0]), settings);
+    train.setSpeeds(profiles.active().forwardSpeed, profiles.active().backwardSpeed);
+    train.setRamps(profiles.active().accelMillis, profiles.active().decelMillis);
+    train.setCreepSpeed(profiles.active().creepSpeed);
+    esp_read_mac(ownMac, ESP_MAC_WIFI_STA);
+    if (sections > 0 && trainNodes == 0) Serial.println("Layout: sections need train nodes, running the whole line");
+    layout.begin(settings.stationCount(), stationMacs, sectionTable, trainNodes > 0 ? sections : 0, ownMac);
+    timetable.begin(routeSpecs, sizeof(routeSpecs) / sizeof(routeSpecs[0]), settings.route());
+    segmentModel.begin(timetable.route(), timetable.stops());
+    loopEnabled = settings.loopEnabled();
+    ui.turnLoopLED(loopEnabled ? LOOP_LED_ON : LOOP_LED_OFF);
+    bootProfile.phase("io+settings");
+
+    // Before the radio: old epochs are replays from the first packet on
+    restoreAuthEpochs();
     printMacAddress();
     setupEspNowReceiver();
+    bootProfile.phase("radio");
 
-    ui.setupPinsAndSensors();
-    train.initTrain();
-    semaphores.init();
+    semaphores.init(semaphoreMode);
+    semaphores.setPulseDuration(profiles.active().pulseMillis);
+    if (trainNodes > 0) blockControl.begin(trainNodes, trainMacs, semaphores, settings, profiles, crashTrace.resetReason());
+
+    // Station 0 is wired locally, the others report over ESP-NOW
+    linkMonitor.init();
+    for (int i = 1; i < layout.stationCount(); i++) {
+        linkMonitor.setMonitored(i, true);
+    }
 
-    EEPROM.begin(EEPROM_SIZE);
-    
-    // Read stored value from EEPROM
-    loopEnabled = EEPROM.read(EEPROM_ADDR);
-    
     Serial.print("Loop mode loaded: ");
     Serial.println(loopEnabled ? "ENABLED" : "DISABLED");
 
-    // Set the loop LED accordingly
-    if (loopEnabled) {
-        ui.turnLoopLED(LOOP_LED_ON);
-        firstLoopEnabled = true;
-    } else {
-        ui.turnLoopLED(LOOP_LED_OFF);
+    telemetry.frame.input = NO_INPUTS_RECEIVED;
+    if (trainNodes > 0) {
+        telemetry.frame.state = TELEMETRY_NONE;
+        telemetry.frame.trainState = TELEMETRY_NONE;
+        telemetry.frame.station = TELEMETRY_NONE;
     }
+    telemetry.begin(settings.telemetryMillis());
+
+    console.begin(consoleCommands, sizeof(consoleCommands) / sizeof(consoleCommands[0]));
+    taskMonitor.begin();
 
+    bootProfile.ready();
 }
 
 void loop() {
 
+    ui.update();
+
     input = ui.inputReceived();
 
     activeStation = ui.sampleStations();
 
+    if (input != NO_INPUTS_RECEIVED) {
+        crashTrace.record(TRACE_BUTTON, input);
+        journal.record(JOURNAL_BUTTON, input);
+    }
+    if (activeStation != STATION_NONE) {
+        crashTrace.record(TRACE_STATION, activeStation);
+        latencyTrace.taken(activeStation, micros());
+    }
+
+    serviceConsole();
+
     handleSoundAndLoop();
 
-    vallleyTrainStateMachine();
+    if (trainNodes > 0) {
+        // Between two passes nothing is half done; each command takes the
+        // values of the moment
+        applyProfile();
+        blockControl.update(activeStation, input, loopEnabled);
+    } else {
+        vallleyTrainStateMachine();
+    }
+
+    serviceTimeSync();
+
+    sendRouteBeacon();
+
+    semaphores.update();
+
+    authVerifier.update();
+
+    saveAuthEpochs();
+
+    settings.update();
 
+    segmentModel.update(journal);
+
+    linkMonitor.update();
+
+    bootProfile.update();
+
+    taskMonitor.update();
+
+    uint32_t stopMicros;
+    if (latencyTrace.awaitingOutput() && train.stopApplied(stopMicros)) latencyTrace.applied(stopMicros);
+
+    serviceTelemetry();
+
+    loopPasses++;
+    telemetry.pass();
 }
 
 void vallleyTrainStateMachine() {
+    SPAN(stateMachineSpan);
     static int state = 0;
     static unsigned long previousMillis = 0;
-    static unsigned long lastPrintTime = 0;
     static int trainState = STOPPED;
     static int station = 0;
     static bool initiatedToRed = false;
-
-    #define WAITING_AT_SEMAPHORE_TIME 2000
-    #define PRINT_TIME 2000
-    #define GOING_BACKWARD_DELAY 2000
+    static int tracedState = -1;
+    static int savedState = -1;
+    static int savedStation = -1;
+    static int savedTrainState = -1;
+    static bool resumed = false;
+    static bool homing = false;
+    static RouteStep stopStep = {ROUTE_STOP, 0, 0};  // What the timetable says about the station the train stands at
 
     enum TRAIN_STATE_TYPE {
         START,
@@ -118,110 +428,252 @@ void vallleyTrainStateMachine() {
         WAITING_BEFORE_NEXT_LOOP
     };
 
-    if (firstLoopEnabled) {
-        state = WAITING_BEFORE_NEXT_LOOP;
-        firstLoopEnabled = false;
-    }
+    // First pass after a reset: carry on from where the train is instead of
+    // starting over at START, which could drive it off the far end
+    if (!resumed) {
+        resumed = true;
+        previousMillis = millis();
+        const char *source = "nothing saved";
+
+        if (checkpoint.source() == RESUME_CHECKPOINT && checkpoint.state() <= WAITING_BEFORE_NEXT_LOOP) {
+            state = checkpoint.state();
+            station = checkpoint.station();
+            trainState = checkpoint.trainState();
+            source = "RTC checkpoint";
+        } else if (checkpoint.source() == RESUME_JOURNAL) {
+            // Departures and passes reach flash within a loop(), so the last
+            // record names the segment the train was on
+            const JournalRecord &position = checkpoint.position();
+            station = position.a;
+            if (position.b == JOURNAL_BACKWARD && !(position.type == JOURNAL_ARRIVE && position.a == STATION_START)) {
+                state = GOING_BACKWARD;
+                trainState = position.type == JOURNAL_HALT ? STOPPED : MOVING_BACKWARD;
+            } else if (position.type == JOURNAL_ARRIVE) {
+                state = station == 0 ? START : WAITING_AT_STATION_X;
+                trainState = STOPPED;
+            } else {
+                state = GOING_TO_STATION_X;
+                trainState = position.type == JOURNAL_HALT ? STOPPED : MOVING_FORWARD;
+            }
+            source = "journal";
+        } else {
+            state = START;
+            station = 0;
+            trainState = STOPPED;
+            homing = !ui.atStart();
+        }
 
-    if (millis() - lastPrintTime > PRINT_TIME) {
-        //Serial.println(getStatusText(input, state, trainState, station, initiatedToRed));
-        lastPrintTime = millis();
+        // Stations report their sensor edge once, so the LAST station may have
+        // been passed while the controller was down. Go back to START rather
+        // than on towards the bumper.
+        if (trainState == MOVING_FORWARD && station >= layout.lastStation() - 1) homing = true;
+
+        // Standing on the START sensor settles it, whatever was saved
+        if (ui.atStart() && trainState != MOVING_FORWARD) {
+            state = START;
+            station = 0;
+            trainState = STOPPED;
+        }
+        if ((state == START || state == WAITING_BEFORE_NEXT_LOOP) && trainState == STOPPED) {
+            state = loopEnabled ? WAITING_BEFORE_NEXT_LOOP : START;
+            initiatedToRed = false;
+            previousMillis = 0;  // No extra wait, as before resuming existed
+        }
+        if (homing) {
+            state = GOING_BACKWARD;
+            trainState = MOVING_BACKWARD;
+            Serial.println(station >= layout.lastStation() - 1 ? "Resume: LAST station may have been passed, homing to START"
+                                                       : "Resume: position unknown, homing to START");
+        } else {
+            Serial.println("Resume: " + String(trainStateNames[state]) + " at station " + String(station) + " (" + source + ")");
+        }
+
+        stopStep = timetable.stopAt(station);
+
+        if (trainState == MOVING_FORWARD) {
+            train.moveForward();
+            journal.record(JOURNAL_DEPART, station, JOURNAL_FORWARD);
+        } else if (trainState == MOVING_BACKWARD) {
+            train.moveBackward();
+            journal.record(JOURNAL_DEPART, station, JOURNAL_BACKWARD);
+        }
     }
 
     if (input == BUTTON_PLAY_PAUSE && trainState != STOPPED) {
         train.stop();
         trainState = STOPPED;
         state = GOING_TO_STATION_X;
+        journal.record(JOURNAL_HALT);
+        segmentModel.cancel();
     }
     else if (input == BUTTON_PLAY_PAUSE && trainState == STOPPED) {
+        // Only a start from a station is timed, not one from where a halt left the train
+        if (state == START || state == WAITING_AT_STATION_X || state == TURN_GREEN_LIGHT_ON_AT_STATION_X || state == WAITING_BEFORE_NEXT_LOOP) {
+            segmentModel.depart(station, JOURNAL_FORWARD);
+            if (station == STATION_START) timetable.departed(millis());
+        }
         initiatedToRed = false;
         state = GOING_TO_STATION_X;
         train.moveForward();
         trainState = MOVING_FORWARD;
+        journal.record(JOURNAL_DEPART, station, JOURNAL_FORWARD);
     }
     else if (input == BUTTON_BACKWARDS) {
+        if (trainState != STOPPED) journal.record(JOURNAL_HALT);
+        segmentModel.cancel();
         train.stop();
         trainState = STOPPED;
         previousMillis = millis();
         state = WAIT_BEFORE_GOING_BACKWARD;
     }
 
+    // The sampling task has already cut the motor. Halted like with PLAY_PAUSE,
+    // the operator clears the track and presses it to go on.
+    CurrentFault fault = motorCurrent.takeFault();
+    if (fault != CURRENT_OK) {
+        Serial.println("Motor " + String(currentFaultName(fault)) + " (" + String(motorCurrent.faultMilliamps()) +
+                       " mA) after station " + String(station) + ", train stopped. PLAY/PAUSE to go on");
+        motorCurrent.printReport();
+        train.stop();
+        journal.record(JOURNAL_MOTOR_FAULT, fault, motorCurrent.faultMilliamps());
+        segmentModel.cancel();
+        trainState = STOPPED;
+        state = GOING_TO_STATION_X;
+        homing = false;
+    }
+
+    // From the console in maintenance mode: the train halted where it is, or
+    // put into a state with the motor as that state has it
+    if (forcedTransition.pending) {
+        forcedTransition.pending = false;
+        if (trainState != STOPPED) journal.record(JOURNAL_HALT);
+        segmentModel.cancel();
+        train.stop();
+        trainState = STOPPED;
+        initiatedToRed = false;
+        homing = false;
+        previousMillis = millis();
+        if (forcedTransition.state >= 0) {
+            state = forcedTransition.state;
+            station = forcedTransition.station;
+            stopStep = timetable.stopAt(station);
+            if (state == GOING_TO_STATION_X) {
+                train.moveForward();
+                trainState = MOVING_FORWARD;
+                journal.record(JOURNAL_DEPART, station, JOURNAL_FORWARD);
+            } else if (state == GOING_BACKWARD) {
+                train.moveBackward();
+                trainState = MOVING_BACKWARD;
+                journal.record(JOURNAL_DEPART, station, JOURNAL_BACKWARD);
+            }
+            Serial.println("Console: forced " + String(trainStateNames[state]) + " at station " + String(station));
+        } else {
+            state = GOING_TO_STATION_X;  // As after PLAY/PAUSE, which goes on from here
+            Serial.println("Console: train halted after station " + String(station));
+        }
+    }
+
+    // A run keeps the speed, ramps and creep it started with, so the segment
+    // model's timing holds; a new profile waits until the train stands
+    if (trainState == STOPPED) applyProfile();
+
     switch (state) {
         case START:
             if (!initiatedToRed && semaphores.initToRed()) {
                 initiatedToRed = true;
+                journal.record(JOURNAL_SEMAPHORE, 0, RED);
             }
             else if (trainState == MOVING_FORWARD && initiatedToRed) {
                 initiatedToRed = false;
                 state = GOING_TO_STATION_X;
-                Serial.println("Going to station 1");
+                Serial.println("Going to station " + String(timetable.nextStop(STATION_START).station));
             }
             break;
         case GOING_TO_STATION_X://Train is going to one of the stations
-            
-            switch (activeStation)
-            {
-                case STATION_1:
-                    station = 1;
-                    break;
-                case STATION_2:
-                    station = 2;
-                    break;
-                case STATION_3:
-                    station = 3;
-                    break;
-                case STATION_4:  
-                    station = 4;
-                    break;
-                case STATION_5:
-                    station = 5;
-                    break;
-                case STATION_6:
-                    station = 6;
-                    break;
-                case STATION_LAST:
-                    station = 7;
-                    break;
-                default:
-                    break;
-            }
-            
-            if (activeStation == STATION_1 || activeStation == STATION_2 || activeStation == STATION_3 || activeStation == STATION_4 || activeStation == STATION_5 || activeStation == STATION_6 || activeStation == STATION_LAST) {
+            // Stations before the route's next stop are passed. Any other
+            // stops the train: the next stop, one past it or past the station
+            // the segment model awaits after overdue ones, or LAST. A running
+            // train cannot trigger a station it has passed, one further on or
+            // one it cannot have reached yet: those are spurious.
+            if (activeStation > STATION_START && trainState == MOVING_FORWARD &&
+                (activeStation <= station || !segmentModel.reachable(activeStation, JOURNAL_FORWARD) ||
+                 (activeStation != layout.lastStation() &&
+                  activeStation > max((int)timetable.nextStop(station).station, (int)segmentModel.awaitedStation()) + 1))) {
+                Serial.println("Station " + String(activeStation) + " triggered, the train is not there. Ignored");
+            } else if (activeStation > station && !timetable.stopsAt(station, activeStation)) {
+                station = activeStation;
+                journal.record(JOURNAL_PASS, station, JOURNAL_FORWARD);
+                segmentModel.pass(station, JOURNAL_FORWARD);
+                Serial.println("Passing station " + String(station));
+            } else if (activeStation > STATION_START) {
+                station = activeStation;
+                stopStep = timetable.stopAt(station);
                 train.stop();
+                latencyTrace.decided(station, micros());
                 trainState = STOPPED;
+                journal.record(JOURNAL_ARRIVE, station, JOURNAL_FORWARD);
+                segmentModel.arrive(station, JOURNAL_FORWARD);
                 state = TURN_GREEN_LIGHT_ON_AT_STATION_X;
                 Serial.println("Reached station " + String(station) + ". Waiting");
                 previousMillis = millis();
+            } else if (trainState == MOVING_FORWARD && segmentModel.endOverdue(JOURNAL_FORWARD)) {
+                // LAST's trigger was lost and only the bumper is beyond it: stop
+                // here and turn as if it had come
+                station = layout.lastStation();
+                stopStep = timetable.stopAt(station);
+                train.stop();
+                trainState = STOPPED;
+                journal.record(JOURNAL_ARRIVE, station, JOURNAL_FORWARD);
+                segmentModel.cancel();
+                state = TURN_GREEN_LIGHT_ON_AT_STATION_X;
+                Serial.println("Station " + String(station) + " overdue, stopped before the bumper. Waiting");
+                previousMillis = millis();
             }
             break;
         case TURN_GREEN_LIGHT_ON_AT_STATION_X:
-            if (station != 7) {
+            if (station != layout.lastStation()) {
                 if (semaphores.setSemaphore(station,GREEN)) {
+                    journal.record(JOURNAL_SEMAPHORE, station, GREEN);
                     previousMillis = millis();
                     state = WAITING_AT_STATION_X;
                     break;
                 }
             }
             else {
-                Serial.println("Station 7 reached, not turning green light on");
+                Serial.println("Station " + String(station) + " reached, not turning green light on");
                 previousMillis = millis();
                 state = WAITING_AT_STATION_X;
                 break;
             }
             break;
         case WAITING_AT_STATION_X:
-            if (millis() - previousMillis > WAITING_AT_SEMAPHORE_TIME) {
-                if (station != 7) {
+            if (millis() - previousMillis > timetable.dwellMillis(stopStep, profiles.active().dwellMillis)) {
+                if (stopStep.op == ROUTE_STOP) {
                     train.moveForward();
                     trainState = MOVING_FORWARD;
+                    journal.record(JOURNAL_DEPART, station, JOURNAL_FORWARD);
+                    segmentModel.depart(station, JOURNAL_FORWARD);
                     state = GOING_TO_STATION_X;
-                    Serial.println("Going to station " + String(station + 1));
+                    Serial.println("Going to station " + String(timetable.nextStop(station).station));
+                    break;
+                }
+                else if (stopStep.op == ROUTE_TURN && ui.atStart()) {
+                    // Still on the START sensor, the stop was for a spurious
+                    // trigger: backing off it would only reach the bumper
+                    Serial.println("Already at Start Station");
+                    journal.record(JOURNAL_ARRIVE, STATION_START, JOURNAL_BACKWARD);
+                    station = 0;
+                    state = loopEnabled ? WAITING_BEFORE_NEXT_LOOP : START;
+                    previousMillis = millis();
                     break;
                 }
-                else if (station == 7) {
-                    Serial.println("Youv'e reached the last station");
+                else if (stopStep.op == ROUTE_TURN) {
+                    Serial.println(station == layout.lastStation() ? "Youv'e reached the last station"
+                                                                   : "Short turn at station " + String(station) + ", going back to START");
                     train.moveBackward();
                     trainState = MOVING_BACKWARD;
+                    journal.record(JOURNAL_DEPART, station, JOURNAL_BACKWARD);
+                    segmentModel.depart(station, JOURNAL_BACKWARD);
                     state = GOING_BACKWARD;
                     break;
                 }
@@ -232,18 +684,42 @@ void vallleyTrainStateMachine() {
             }
             break;
         case WAIT_BEFORE_GOING_BACKWARD:
-            if (millis() - previousMillis > GOING_BACKWARD_DELAY) {
+            if (millis() - previousMillis > profiles.active().backwardDelayMillis && ui.atStart()) {
+                // Backing off the START sensor would only reach the bumper
+                Serial.println("Already at Start Station");
+                journal.record(JOURNAL_ARRIVE, STATION_START, JOURNAL_BACKWARD);
+                station = 0;
+                state = loopEnabled ? WAITING_BEFORE_NEXT_LOOP : START;
+                previousMillis = millis();
+            } else if (millis() - previousMillis > profiles.active().backwardDelayMillis) {
                 trainState = MOVING_BACKWARD;
                 train.moveBackward();
+                journal.record(JOURNAL_DEPART, station, JOURNAL_BACKWARD);
                 previousMillis = millis();
                 state = GOING_BACKWARD;
             }
             break;
         case GOING_BACKWARD://Train is going backwards
+            if (homing && trainState == MOVING_BACKWARD && millis() - previousMillis > HOMING_TIMEOUT) {
+                Serial.println("Homing failed, START not reached. Stopped");
+                train.stop();
+                trainState = STOPPED;
+                journal.record(JOURNAL_HALT);
+                segmentModel.cancel();
+                homing = false;
+                station = 0;
+                state = START;
+                break;
+            }
             if (activeStation == STATION_START && trainState == MOVING_BACKWARD) {
                 Serial.println("Reached Start Station");
+                homing = false;
                 train.stop();
+                latencyTrace.decided(STATION_START, micros());
                 trainState = STOPPED;
+                journal.record(JOURNAL_ARRIVE, STATION_START, JOURNAL_BACKWARD);
+                segmentModel.arrive(STATION_START, JOURNAL_BACKWARD);
+                timetable.loopDone(millis());
                 station = 0;
                 state = START;
                 if (loopEnabled) {
@@ -251,55 +727,90 @@ void vallleyTrainStateMachine() {
                     previousMillis = millis();
                     break;
                 }
+            } else if (activeStation != STATION_NONE && trainState == MOVING_BACKWARD) {
+                journal.record(JOURNAL_PASS, activeStation, JOURNAL_BACKWARD);
+                segmentModel.pass(activeStation, JOURNAL_BACKWARD);
             }
             break;
         case WAITING_BEFORE_NEXT_LOOP:
             if (!initiatedToRed && semaphores.initToRed()) {
                 initiatedToRed = true;
+                journal.record(JOURNAL_SEMAPHORE, 0, RED);
             }
-            if (millis() - previousMillis > WAITING_AT_SEMAPHORE_TIME && initiatedToRed) {
+            if (millis() - previousMillis > profiles.active().dwellMillis && initiatedToRed && timetable.departureDue(millis())) {
                 initiatedToRed = false;
                 train.moveForward();
                 trainState = MOVING_FORWARD;
+                journal.record(JOURNAL_CYCLE_START);
+                journal.record(JOURNAL_DEPART, STATION_START, JOURNAL_FORWARD);
+                segmentModel.depart(STATION_START, JOURNAL_FORWARD);
+                timetable.departed(millis());
                 state = GOING_TO_STATION_X;
-                Serial.println("New Loop, Going to station 1");
+                Serial.println("New Loop, Going to station " + String(timetable.nextStop(STATION_START).station));
             }
             break;
     }
 
+    // Slow down when the segment model expects the next stop's sensor soon, so
+    // the train reaches it at creep speed and stops close to it
+    if (trainState != STOPPED) train.setCreep(segmentModel.creeping());
+
+    if (state != tracedState) {
+        crashTrace.record(TRACE_STATE, state, station);
+        tracedState = state;
+    }
+    // Stations the segment model found overdue count as passed, so a reset
+    // near LAST homes instead of running on into the bumper
+    uint8_t passed = station;
+    int8_t awaited = segmentModel.awaitedStation();
+    if (trainState == MOVING_FORWARD && awaited > station + 1) passed = awaited - 1;
+    if (state != savedState || passed != savedStation || trainState != savedTrainState) {
+        checkpoint.save(state, passed, trainState);
+        savedState = state;
+        savedStation = passed;
+        savedTrainState = trainState;
+    }
+
+    if (station != telemetry.frame.station) telemetry.frame.stationMillis = millis();
+    telemetry.frame.state = state;
+    telemetry.frame.trainState = trainState;
+    telemetry.frame.station = station;
 }
 
 void handleSoundAndLoop() {
 static unsigned long lastSoundTime = 0;
 static unsigned long lastLedsUpdateTime = 0;
 static bool firstTimePlaying = true;
-#define PLAYING_TIME 324000
+    SPAN(soundAndLoopSpan);
 
     if (firstTimePlaying) {
         ui.playSound();
         firstTimePlaying = false;
     }
 
-    if (millis() - lastSoundTime > PLAYING_TIME) {
+    uint32_t playingTime = profiles.active().soundMillis;
+    if (playingTime > 0 && millis() - lastSoundTime > playingTime) {
         ui.playSound();
         lastSoundTime = millis();
     }
     
     if (input == BUTTON_VOLUME_UP) {
         ui.changeVolume(VOLUME_UP);
+        settings.setVolume(ui.volume());
     }
     if (input == BUTTON_VOLUME_DOWN) {
         ui.changeVolume(VOLUME_DOWN);
+        settings.setVolume(ui.volume());
     }
     if (input == BUTTON_SOUND_ON_OFF) {
         ui.changeVolume(CHANGE_STATE);
+        settings.setVolume(ui.volume());
     }
 
     if (input == BUTTON_LOOP) {
         loopEnabled = !loopEnabled; // Toggle the state of loopEnabled
 
-        EEPROM.write(EEPROM_ADDR, loopEnabled);
-        EEPROM.commit(); 
+        settings.setLoopEnabled(loopEnabled);  // Written once the presses settle
 
         if (loopEnabled) {
             ui.turnLoopLED(LOOP_LED_ON);
@@ -325,72 +836,327 @@ static bool firstTimePlaying = true;
     }
 }
 
-String getStatusText(int input, int activeStation, int state, int trainState, int station, bool initiatedToRed) {
-    String stateText;
-    String trainStateText;
-    String stationText;
-    String redInitText = initiatedToRed ? "Yes" : "No";
-    String inputText;
+// Takes up a profile asked for with profiles.request(), at a safe point of
+// the caller. Remembered in the settings for the next boot, unless it was
+// tuned from the console ("save" keeps those values).
+void applyProfile() {
+    if (!profiles.apply()) return;
+    const OperatingProfile &profile = profiles.active();
+    train.setSpeeds(profile.forwardSpeed, profile.backwardSpeed);
+    train.setRamps(profile.accelMillis, profile.decelMillis);
+    train.setCreepSpeed(profile.creepSpeed);
+    semaphores.setPulseDuration(profile.pulseMillis);
+    if (profiles.activeIndex() != PROFILES_CUSTOM) settings.setProfile(profiles.activeIndex());
+    profiles.printReport();
+}
+
+// ---- Console (lib/CONSOLE): the handlers run in the console task ----
+
+bool postConsoleRequest(uint8_t action, int8_t state, int8_t station) {
+    portENTER_CRITICAL(&consoleLock);
+    bool free = consoleRequest.action == CONSOLE_NONE;
+    if (free) consoleRequest = {action, state, station};
+    portEXIT_CRITICAL(&consoleLock);
+    if (!free) Serial.println("Console: busy with the last command, try again");
+    return free;
+}
+
+// stats, in loop(): the counters belong to it
+void printStats() {
+    Serial.print("Stats: ");
+    Serial.print(loopPasses);
+    Serial.print(" loop passes, ");
+    Serial.print(timetable.loopCount());
+    Serial.print(" loops, ");
+    Serial.print(profiles.switches);
+    Serial.print(" profile switches, ");
+    Serial.print(segmentModel.missesFlagged(JOURNAL_FORWARD));
+    Serial.print("/");
+    Serial.print(segmentModel.missesFlagged(JOURNAL_BACKWARD));
+    Serial.print(" overdue stations forward/back, ");
+    Serial.print(segmentModel.driftWarnings());
+    Serial.println(" drift warnings");
+    if (trainNodes > 0) {
+        Serial.print("Stats: blocks ");
+        Serial.print(blockControl.missedTriggers());
+        Serial.print(" missed, ");
+        Serial.print(blockControl.ignoredTriggers());
+        Serial.println(" ignored triggers");
+    }
+    Serial.print("Stats: console ");
+    Serial.print(console.lines);
+    Serial.print(" commands, ");
+    Serial.print(console.unknown);
+    Serial.print(" unknown, ");
+    Serial.print(console.overflows);
+    Serial.print(" too long, longest pass ");
+    Serial.print(console.maxPassMicros);
+    Serial.println(" us");
+    Serial.print("Stats: telemetry ");
+    Serial.print(telemetry.frames);
+    Serial.print(" frames, longest send ");
+    Serial.print(telemetry.maxSendMicros);
+    Serial.println(" us");
+    settings.printReport();
+    journal.printReport();
+    semaphores.printReport();
+    linkMonitor.printReport();
+}
 
-    switch (input) {
-        case BUTTON_SOUND_ON_OFF: inputText = "BUTTON_SOUND_ON_OFF"; break;
-        case BUTTON_VOLUME_UP: inputText = "BUTTON_VOLUME_UP"; break;
-        case BUTTON_VOLUME_DOWN: inputText = "BUTTON_VOLUME_DOWN"; break;
-        case BUTTON_PLAY_PAUSE: inputText = "BUTTON_PLAY_PAUSE"; break;
-        case BUTTON_LOOP: inputText = "BUTTON_LOOP"; break;
-        case BUTTON_BACKWARDS: inputText = "BUTTON_BACKWARDS"; break;
-        default: inputText = "NO_INPUTS_RECEIVED"; break;
+// The console's request, carried out in loop()
+void serviceConsole() {
+    portENTER_CRITICAL(&consoleLock);
+    ConsoleRequest request = consoleRequest;
+    consoleRequest.action = CONSOLE_NONE;
+    portEXIT_CRITICAL(&consoleLock);
+
+    if (request.action == CONSOLE_HALT || request.action == CONSOLE_FORCE) {
+        forcedTransition = {true, request.action == CONSOLE_FORCE ? request.state : (int8_t)-1, request.station};
+    } else if (request.action == CONSOLE_SAVE) {
+        const OperatingProfile &profile = profiles.active();
+        settings.setDwellMillis(profile.dwellMillis);
+        settings.setBackwardDelayMillis(profile.backwardDelayMillis);
+        settings.setPulseMillis(profile.pulseMillis);
+        settings.setSpeeds(profile.forwardSpeed, profile.backwardSpeed);
+        settings.setRamps(profile.accelMillis, profile.decelMillis);
+        settings.setCreepSpeed(profile.creepSpeed);
+        settings.setProfile(PROFILES_NORMAL);
+        Serial.println("Console: " + String(profile.name) + " values saved as the normal profile");
+    } else if (request.action == CONSOLE_REPORT) {
+        printStats();
+    } else if (request.action == CONSOLE_RESTART) {
+        // Settings wait for SETTINGS_COMMIT_DELAY and the journal for its next
+        // write; a restart would lose both
+        settings.flush();
+        journal.flush();
+        Serial.println("Console: restarting");
+        Serial.flush();
+        ESP.restart();
     }
+}
 
-    if (activeStation != STATION_NONE) {
-        // Handle the active station
-        switch (activeStation) {
-            case STATION_START: Serial.println("Active: STATION_START"); break;
-            case STATION_1: Serial.println("Active: STATION_1"); break;
-            case STATION_2: Serial.println("Active: STATION_2"); break;
-            case STATION_3: Serial.println("Active: STATION_3"); break;
-            case STATION_4: Serial.println("Active: STATION_4"); break;
-            case STATION_5: Serial.println("Active: STATION_5"); break;
-            case STATION_6: Serial.println("Active: STATION_6"); break;
-            case STATION_LAST: Serial.println("Active: STATION_LAST"); break;
-            default: break;
+void printProfileValue(const OperatingProfile &profile, uint8_t field) {
+    Serial.print("  ");
+    Serial.print(Profiles::fieldName(field));
+    Serial.print(" ");
+    Serial.print(Profiles::value(profile, field));
+    Serial.print(" ");
+    Serial.println(Profiles::fieldUnit(field));
+}
+
+void consoleGet(int argc, char **argv) {
+    const OperatingProfile &profile = profiles.active();
+    if (argc > 1) {
+        int field = Profiles::field(argv[1]);
+        if (field < 0) {
+            Serial.print("Console: no value ");
+            Serial.println(argv[1]);
+            return;
         }
+        printProfileValue(profile, field);
+        return;
     }
+    Serial.print("Profile ");
+    Serial.print(profile.name);
+    Serial.println(profiles.pending() ? ", a switch is waiting for the train to stand" : "");
+    for (uint8_t field = 0; field < PROFILES_FIELDS; field++) printProfileValue(profile, field);
+}
 
-    // Convert state to human-readable text
-    switch (state) {
-        case 0: stateText = "START"; break;
-        case 1: stateText = "GOING_TO_STATION_X"; break;
-        case 2: stateText = "TURN_GREEN_LIGHT_ON_AT_STATION_X"; break;
-        case 3: stateText = "WAITING_AT_STATION_X"; break;
-        case 4: stateText = "GOING_TO_LAST_STATION"; break;
-        case 5: stateText = "WAIT_BEFORE_GOING_BACKWARD"; break;
-        case 6: stateText = "GOING_BACKWARD"; break;
-        case 7: stateText = "WAITING_BEFORE_NEXT_LOOP"; break;
-        default: stateText = "UNKNOWN"; break;
-    }
-
-    // Convert trainState to human-readable text
-    switch (trainState) {
-        case MOVING_FORWARD: trainStateText = "MOVING_FORWARD"; break;
-        case MOVING_BACKWARD: trainStateText = "MOVING_BACKWARD"; break;
-        case STOPPED: trainStateText = "STOPPED"; break;
-        default: trainStateText = "UNKNOWN"; break;
-    }
-
-    // Convert station number to human-readable text
-    if (station == 0) {
-        stationText = "Start Station";
-    } else if (station >= 1 && station <= 6) {
-        stationText = "Station " + String(station);
-    } else if (station == 7) {
-        stationText = "Last Station";
+void consoleSet(int argc, char **argv) {
+    int field = argc == 3 ? Profiles::field(argv[1]) : -1;
+    long value;
+    if (field < 0 || !Console::number(argv[2], 0, 0x7FFFFFFF, value)) {
+        Serial.println("Console: set NAME VALUE, \"get\" shows the names");
+        return;
+    }
+    if (profiles.pending()) {
+        Serial.println("Console: the last change waits for the train to stand, try again then");
+        return;
+    }
+    if (!profiles.tune(field, value)) {
+        Serial.print("Console: ");
+        Serial.print(argv[1]);
+        Serial.println(!strcmp(Profiles::fieldUnit(field), "%") ? " goes up to 100" : " is out of range");
+        return;
+    }
+    Serial.print("Console: ");
+    Serial.print(argv[1]);
+    Serial.print(" ");
+    Serial.print(value);
+    Serial.println(" once the train stands");
+}
+
+void consoleProfile(int argc, char **argv) {
+    long index;
+    if (argc > 1) {
+        if (!Console::number(argv[1], 0, profiles.count() - 1, index) || !profiles.request(index)) {
+            Serial.print("Console: profiles 0 to ");
+            Serial.println(profiles.count() - 1);
+            return;
+        }
+        Serial.print("Console: ");
+        Serial.print(profiles.profile(index)->name);
+        Serial.println(" once the train stands");
+        return;
+    }
+    for (uint8_t i = 0; i < profiles.count(); i++) {
+        Serial.print(i == profiles.activeIndex() ? "* " : "  ");
+        Serial.print(i);
+        Serial.print(" ");
+        Serial.println(profiles.profile(i)->name);
+    }
+    if (profiles.activeIndex() == PROFILES_CUSTOM) Serial.println("* custom");
+}
+
+void consoleSave(int, char **) {
+    if (postConsoleRequest(CONSOLE_SAVE, 0, 0)) Serial.println("Console: saving");
+}
+
+void consoleStats(int, char **) {
+    postConsoleRequest(CONSOLE_REPORT, 0, 0);
+}
+
+void consoleMaintenance(int argc, char **argv) {
+    bool on = argc > 1 && !strcmp(argv[1], "on");
+    if (argc < 2 || (!on && strcmp(argv[1], "off"))) {
+        Serial.println(maintenance ? "Console: maintenance on" : "Console: maintenance off");
+        return;
+    }
+    if (on && trainNodes == 0 && !postConsoleRequest(CONSOLE_HALT, 0, 0)) return;
+    maintenance = on;
+    Serial.println(on ? "Console: maintenance on" : "Console: maintenance off, PLAY/PAUSE or a forced state goes on");
+}
+
+bool inMaintenance() {
+    if (!maintenance) Serial.println("Console: only in maintenance mode (maint on)");
+    return maintenance;
+}
+
+void consoleState(int argc, char **argv) {
+    if (!inMaintenance()) return;
+    if (trainNodes > 0) {
+        Serial.println("Console: the train nodes have no state machine to force");
+        return;
+    }
+    const int states = sizeof(trainStateNames) / sizeof(trainStateNames[0]);
+    long state = -1;
+    for (int i = 0; argc > 1 && i < states; i++) {
+        if (!strcmp(argv[1], trainStateNames[i])) state = i;
+    }
+    long station = 0;
+    if (argc < 2 || (state < 0 && !Console::number(argv[1], 0, states - 1, state)) ||
+        (argc > 2 && !Console::number(argv[2], 0, layout.lastStation(), station))) {
+        Serial.println("Console: state NAME|N [STATION], the names are those of the crash trace");
+        return;
+    }
+    postConsoleRequest(CONSOLE_FORCE, state, station);
+}
+
+void consoleStation(int argc, char **argv) {
+    if (!inMaintenance()) return;
+    long station;
+    if (argc < 2 || !Console::number(argv[1], 1, layout.lastStation(), station)) {
+        Serial.print("Console: station 1 to ");
+        Serial.println(layout.lastStation());
+        return;
+    }
+    // As the ESP-NOW callback posts a trigger, from another task
+    stationTriggers.post(station, micros());
+}
+
+void consoleTelemetry(int argc, char **argv) {
+    long period;
+    if (argc > 1 && !Console::number(argv[1], 0, 0xFFFF, period)) {
+        Serial.println("Console: telemetry MS, 0 stops the frames");
+        return;
+    }
+    if (argc > 1) telemetry.setPeriod(period);
+    Serial.print("Console: telemetry ");
+    if (telemetry.period() == 0) {
+        Serial.println("off");
+    } else {
+        Serial.print("every ");
+        Serial.print(telemetry.period());
+        Serial.println(" ms");
+    }
+}
+
+void consoleSpans(int argc, char **argv) {
+    if (argc < 2) {
+        SpanProfile::printReport();
+    } else if (!strcmp(argv[1], "reset")) {
+        SpanProfile::reset();
+        Serial.println("Spans: reset");
+    } else {
+        SpanProfile::printHistogram(argv[1]);
+    }
+}
+
+void consoleLatency(int argc, char **argv) {
+    long station;
+    if (argc < 2) {
+        latencyTrace.printReport();
+    } else if (!strcmp(argv[1], "reset")) {
+        latencyTrace.reset();
+        Serial.println("Latency: reset");
+    } else if (Console::number(argv[1], 0, layout.lastStation(), station)) {
+        latencyTrace.printHistogram(station);
     } else {
-        stationText = "No Station";
+        Serial.print("Console: latency STATION, 0 to ");
+        Serial.println(layout.lastStation());
     }
+}
+
+void consoleTasks(int, char **) {
+    taskMonitor.printReport();
+}
 
-    // Return a formatted status string
-    return "Input: " + inputText + ", State: " + stateText + ", Train State: " + trainStateText + ", Station: " + stationText + ", Initiated to Red: " + redInitText;
+void consoleRestart(int, char **) {
+    if (!inMaintenance()) return;
+    postConsoleRequest(CONSOLE_RESTART, 0, 0);
+}
+
+void serviceTelemetry() {
+    // A period set from the console is kept for the next boot
+    if (telemetry.period() != settings.telemetryMillis()) settings.setTelemetryMillis(telemetry.period());
+
+    if (input != NO_INPUTS_RECEIVED) telemetry.frame.input = input;
+    if (!telemetry.due()) return;
+
+    TelemetryFrame &frame = telemetry.frame;
+    frame.flags = (loopEnabled ? TELEMETRY_FLAG_LOOP : 0) | (maintenance ? TELEMETRY_FLAG_MAINTENANCE : 0) |
+                  (trainNodes > 0 ? TELEMETRY_FLAG_BLOCKS : 0);
+    frame.profile = profiles.activeIndex();
+    frame.drivePercent = (uint8_t)(train.driveFraction() * 100 + 0.5f);
+    frame.overdueForward = segmentModel.missesFlagged(JOURNAL_FORWARD);
+    frame.overdueBackward = segmentModel.missesFlagged(JOURNAL_BACKWARD);
+    frame.driftWarnings = segmentModel.driftWarnings();
+    frame.loopPasses = loopPasses;
+    frame.loops = timetable.loopCount();
+    frame.greenAspects = semaphores.greenAspects();
+    frame.latencyMicros = latencyTrace.lastMicros;
+    frame.latencyTrace = latencyTrace.lastId;
+    frame.latencyStation = latencyTrace.lastStation;
+    frame.latencyFlags = latencyTrace.lastEdgeKnown ? TELEMETRY_LATENCY_EDGE : 0;
+
+    // The whole task list takes as many frames as there are tasks
+    static uint8_t taskIndex = 0;
+    TaskSample task;
+    frame.idlePermille[0] = taskMonitor.idlePermille(0);
+    frame.idlePermille[1] = taskMonitor.idlePermille(1);
+    frame.taskAlarms = taskMonitor.alarms();
+    frame.taskCount = taskMonitor.count();
+    if (taskIndex >= frame.taskCount) taskIndex = 0;
+    if (taskMonitor.sample(taskIndex, task)) {
+        frame.taskIndex = taskIndex++;
+        frame.taskCore = task.core == TASK_MONITOR_NO_CORE ? TELEMETRY_NONE : task.core;
+        frame.taskPriority = task.priority;
+        frame.taskCpuPermille = task.cpuPermille;
+        frame.taskStackFree = task.stackFree;
+        memcpy(frame.taskName, task.name, TELEMETRY_TASK_NAME_SIZE);
+    }
+    telemetry.send();
+    frame.input = NO_INPUTS_RECEIVED;
 }
 
 void printMacAddress() {
@@ -406,39 +1172,165 @@ void printMacAddress() {
     Serial.println();
 }
 
-int findStationIndexByMac(const uint8_t *mac) {
-    for (int i = 0; i < NUM_STATIONS; i++) {
-        bool match = true;
-        for (int j = 0; j < 6; j++) {
-            if (mac[j] != stationMacs[i][j]) {
-                match = false;
-                break;
+void onEspNowReceive(const uint8_t *mac, const uint8_t *data, int len) {
+    if (len < 1) return;
+
+    uint32_t receivedMicros = micros();
+
+    // Semaphore nodes are not necessarily stations, they have their own MAC table
+    if (data[0] == STATION_MSG_ASPECT_ACK) {
+        if (len >= (int)sizeof(SemaphoreAck)) {
+            SemaphoreAck ack;
+            memcpy(&ack, data, sizeof(ack));
+            if (ack.id >= 1 && ack.id <= sizeof(semaphoreMacs) / sizeof(semaphoreMacs[0]) &&
+                memcmp(mac, semaphoreMacs[ack.id - 1], 6) == 0) {
+                semaphores.recordAck(ack, receivedMicros);
             }
         }
-        if (match) return i;
+        return;
     }
-    return -1; // unknown sender
-}
 
-void onEspNowReceive(const uint8_t *mac, const uint8_t *data, int len) {
-    if (len < 1) return;
+    // BlockControl only takes a train's ack from that train's node
+    if (data[0] == STATION_MSG_TRAIN_ACK) {
+        if (len >= (int)sizeof(TrainAck)) {
+            TrainAck ack;
+            memcpy(&ack, data, sizeof(ack));
+            blockControl.recordAck(mac, ack, receivedMicros);
+        }
+        return;
+    }
+
+    // The neighbouring controllers of a loop cut into sections
+    if (data[0] == STATION_MSG_SECTION) {
+        if (len >= (int)sizeof(SectionMessage)) {
+            SectionMessage message;
+            memcpy(&message, data, sizeof(message));
+            blockControl.recordLink(mac, message);
+        }
+        return;
+    }
+
+    // Relays advertise to the stations, nothing for us in there
+    if (data[0] == STATION_MSG_ROUTE_BEACON) return;
 
-    int stationIndex = findStationIndexByMac(mac);
+    if (data[0] == STATION_MSG_RELAY) {
+        if (len <= (int)sizeof(StationRelayHeader)) return;
+        StationRelayHeader header;
+        memcpy(&header, data, sizeof(header));
+
+        int stationIndex = layout.find(header.origin);
+        if (stationIndex < 0) {
+            Serial.println("ESP-NOW: relayed message from unknown MAC");
+            return;
+        }
+        // Authenticated packets are deduplicated by the replay window instead, so a
+        // forged copy cannot claim their (origin, seq) first
+        const uint8_t *payload = data + sizeof(header);
+        bool authenticated = len - (int)sizeof(header) > 1 && (payload[1] & STATION_FLAG_AUTH);
+        if (!authenticated && relayRouter.isDuplicate(header.origin, header.seq)) return;
+
+        // The RSSI is the last hop's, not the station's
+        handleStationMessage(stationIndex, payload, len - sizeof(header), receivedMicros, 0, header.hops + 1, mac);
+        return;
+    }
+
+    int stationIndex = layout.find(mac);
     if (stationIndex < 0) {
         Serial.println("ESP-NOW: message from unknown MAC");
         return;
     }
+    int8_t rssi = (memcmp(mac, lastRxMac, 6) == 0) ? lastRxRssi : 0;
+    handleStationMessage(stationIndex, data, len, receivedMicros, rssi, 1, nullptr);
+}
 
-    uint8_t value = data[0];  // sender sends 1 when station becomes stably LOW
+void handleStationMessage(int stationIndex, const uint8_t *data, int len, uint32_t receivedMicros, int8_t rssi, uint8_t hops, const uint8_t *relayMac) {
+    uint8_t type = data[0];  // old senders send a single 1 when station becomes stably LOW
 
-    if (value == 1) {
-        stationTriggered[stationIndex] = true;
+    StationPacket packet = {};
+    if (len >= (int)sizeof(StationPacket)) {
+        memcpy(&packet, data, sizeof(packet));
+    } else {
+        packet.type = type;
+        packet.sentMicros = receivedMicros;
+        packet.syncError = STATION_SYNC_ERROR_UNKNOWN;
+    }
+
+    StationAuthTrailer trailer = {};
+    if (packet.flags & STATION_FLAG_AUTH) {
+        if (len < (int)(sizeof(StationPacket) + sizeof(StationAuthTrailer))) return;
+        memcpy(&trailer, data + sizeof(StationPacket), sizeof(trailer));
+        AuthResult result = authVerifier.verify(stationIndex, stationKey(stationIndex), packet, trailer);
+        if (result != AUTH_OK) {
+            // Replays include radio duplicates, only forgeries are worth a line
+            if (result == AUTH_BAD_TAG && type == STATION_MSG_TRIGGER) {
+                Serial.print("Station ");
+                Serial.print(stationIndex);
+                Serial.println(" trigger with BAD TAG, ignored");
+            } else if (result == AUTH_NO_KEY && type == STATION_MSG_TRIGGER) {
+                Serial.print("Station ");
+                Serial.print(stationIndex);
+                Serial.println(" trigger signed without a provisioned key, ignored");
+            }
+            return;
+        }
+    } else if (requireStationAuth || authVerifier.requiresAuth(stationIndex)) {
+        authVerifier.reject(AUTH_MISSING);
+        if (type == STATION_MSG_TRIGGER) {
+            Serial.print("Station ");
+            Serial.print(stationIndex);
+            Serial.println(" trigger WITHOUT AUTH, ignored");
+        }
+        return;
+    }
+
+    // Replies go back the way this (now trusted) message came
+    portENTER_CRITICAL(&syncReplyLock);
+    stationRelayed[stationIndex] = relayMac != nullptr;
+    if (relayMac != nullptr) memcpy(stationRelayMac[stationIndex], relayMac, 6);
+    portEXIT_CRITICAL(&syncReplyLock);
+
+    linkMonitor.recordPacket(stationIndex, packet, rssi, receivedMicros, hops);
+    bootProfile.stationEvent();
+
+    if (type == STATION_MSG_SYNC_REQUEST) {
+        portENTER_CRITICAL(&syncReplyLock);
+        PendingSyncReply &reply = pendingSyncReplies[stationIndex];
+        reply.seq = packet.seq;
+        reply.t1 = packet.sentMicros;
+        reply.t2 = receivedMicros;
+        reply.authenticated = packet.flags & STATION_FLAG_AUTH;
+        reply.epoch = trailer.epoch;
+        syncRepliesPending |= (StationSet)1 << stationIndex;
+        portEXIT_CRITICAL(&syncReplyLock);
+        return;
+    }
+
+    if (type == STATION_MSG_TRIGGER) {
+        uint32_t edgeMicros = (packet.flags & STATION_FLAG_SYNCED) ? packet.sentMicros : receivedMicros;
+        if (stationTriggers.post(stationIndex, edgeMicros)) {
+            crashTrace.record(TRACE_STATION, stationIndex, hops);
+            latencyTrace.received(stationIndex, edgeMicros, receivedMicros, packet.flags & STATION_FLAG_SYNCED);
+        }
         Serial.print("Station ");
         Serial.print(stationIndex);
         Serial.println(" triggered (via ESP-NOW)");
     }
 }
 
+void onPromiscuousRx(void *buf, wifi_promiscuous_pkt_type_t type) {
+    if (type != WIFI_PKT_MGMT) return;
+
+    const wifi_promiscuous_pkt_t *pkt = (const wifi_promiscuous_pkt_t *)buf;
+    const uint8_t *frame = pkt->payload;
+
+    // ESP-NOW is a vendor specific action frame: category 127, Espressif OUI 18:FE:34
+    if (pkt->rx_ctrl.sig_len < 28) return;
+    if (frame[24] != 127 || frame[25] != 0x18 || frame[26] != 0xFE || frame[27] != 0x34) return;
+
+    memcpy(lastRxMac, frame + 10, 6); // addr2 = transmitter
+    lastRxRssi = pkt->rx_ctrl.rssi;
+}
+
 void setupEspNowReceiver() {
     WiFi.mode(WIFI_STA);
     WiFi.disconnect();
@@ -449,59 +1341,137 @@ void setupEspNowReceiver() {
     }
 
     esp_now_register_recv_cb(onEspNowReceive);
-}
 
-void loopAnalysis() {
-    static unsigned long loopStartTime = 0;
-    static unsigned long loopEndTime = 0;
-    static unsigned long minLoopTime = 0xFFFFFFFF;
-    static unsigned long maxLoopTime = 0;
-    static unsigned long loopCount = 0;
-    static unsigned long totalLoopTime = 0;
-    static unsigned long lastPrintTime = 0;
+    // Stations are peers so clock sync replies can be sent back
+    for (int i = 0; i < layout.stationCount(); i++) {
+        if (!layout.hasMac(i) || esp_now_is_peer_exist(layout.mac(i))) continue;
 
-    // Measure the start time of the loop
-    if (loopStartTime == 0) {
-        loopStartTime = micros();
-        return;
+        esp_now_peer_info_t peer = {};
+        memcpy(peer.peer_addr, layout.mac(i), 6);
+        peer.channel = 0;
+        peer.encrypt = false;
+        esp_now_add_peer(&peer);
     }
 
-    // Measure the end time of the loop
-    loopEndTime = micros();
-    unsigned long loopDuration = loopEndTime - loopStartTime;
+    // Route beacons are broadcast
+    if (!esp_now_is_peer_exist(broadcastMac)) {
+        esp_now_peer_info_t peer = {};
+        memcpy(peer.peer_addr, broadcastMac, 6);
+        peer.channel = 0;
+        peer.encrypt = false;
+        esp_now_add_peer(&peer);
+    }
 
-    // Update statistics
-    minLoopTime = min(minLoopTime, loopDuration);
-    maxLoopTime = max(maxLoopTime, loopDuration);
-    totalLoopTime += loopDuration;
-    loopCount++;
+    // The receive callback does not carry RSSI, so sniff management frames for it
+    wifi_promiscuous_filter_t filter = {};
+    filter.filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT;
+    esp_wifi_set_promiscuous_filter(&filter);
+    esp_wifi_set_promiscuous_rx_cb(onPromiscuousRx);
+    esp_wifi_set_promiscuous(true);
+}
 
-    // Print analysis every second (1000 milliseconds)
-    if (millis() - lastPrintTime >= 1000) {
-        Serial.println("---- Loop Analysis (Microseconds) ----");
-        Serial.print("Min Loop Time: ");
-        Serial.print(minLoopTime);
-        Serial.println(" us");
+void serviceTimeSync() {
+    // Only the stations that asked, lowest first
+    while (syncRepliesPending != 0) {
+        StationSyncReply reply;
+        reply.type = STATION_MSG_SYNC_REPLY;
+        reply.flags = 0;
+        portENTER_CRITICAL(&syncReplyLock);
+        int i = lowestStation(syncRepliesPending);
+        syncRepliesPending &= syncRepliesPending - 1;
+        PendingSyncReply &pending = pendingSyncReplies[i];
+        reply.seq = pending.seq;
+        reply.t1 = pending.t1;
+        reply.t2 = pending.t2;
+        bool authenticated = pending.authenticated;
+        uint16_t epoch = pending.epoch;
+        bool relayed = stationRelayed[i];
+        uint8_t relayMac[6];
+        memcpy(relayMac, stationRelayMac[i], 6);
+        portEXIT_CRITICAL(&syncReplyLock);
+        reply.t3 = micros();  // As late as possible, the time spent waiting here is excluded from the delay
+
+        // A station that signs its requests only trusts signed replies
+        uint8_t message[sizeof(StationSyncReply) + sizeof(StationAuthTrailer)];
+        int messageLen = sizeof(reply);
+        if (authenticated) {
+            reply.flags |= STATION_FLAG_AUTH;
+            StationAuthTrailer trailer;
+            trailer.epoch = epoch;
+            trailer.tag = stationAuthTag(stationKey(i), reply, epoch);
+            memcpy(message + sizeof(reply), &trailer, sizeof(trailer));
+            messageLen += sizeof(trailer);
+        }
+        memcpy(message, &reply, sizeof(reply));
 
-        Serial.print("Max Loop Time: ");
-        Serial.print(maxLoopTime);
-        Serial.println(" us");
+        if (!relayed) {
+            esp_now_send(layout.mac(i), message, messageLen);
+            continue;
+        }
 
-        Serial.print("Avg Loop Time: ");
-        Serial.print(totalLoopTime / loopCount);
-        Serial.println(" us");
+        // Back along the relay the request came through
+        uint8_t frame[sizeof(StationRelayHeader) + sizeof(message)];
+        StationRelayHeader header;
+        header.type = STATION_MSG_RELAY;
+        header.hops = 0;
+        memcpy(header.origin, ownMac, 6);
+        memcpy(header.target, layout.mac(i), 6);
+        header.seq = reply.seq;
+        memcpy(frame, &header, sizeof(header));
+        memcpy(frame + sizeof(header), message, messageLen);
+        esp_now_send(relayMac, frame, sizeof(header) + messageLen);
+    }
+}
 
-        Serial.print("Loop Count: ");
-        Serial.println(loopCount);
+static_assert(AUTH_MAX_STATIONS >= LAYOUT_MAX_STATIONS, "auth epochs for every station");
+
+// Newest epoch of every station as it is in flash
+uint16_t savedEpochs[LAYOUT_MAX_STATIONS];
+StationSet epochsSaved = 0;
+
+// An epoch stored under an older key means the station was given a new one
+void restoreAuthEpochs() {
+    for (int i = 0; i < layout.stationCount(); i++) {
+        // Signed with an empty row of stationKeys proves nothing, verify() refuses it
+        if (!stationKeyProvisioned(stationKey(i))) {
+            if (requireStationAuth && i > 0) {
+                Serial.print("Auth: no key for station ");
+                Serial.print(i);
+                Serial.println(", its packets are refused");
+            }
+            continue;
+        }
+        AuthEpochRecord record;
+        if (!settings.authEpoch(i, record) || record.keyId != stationKeyId(stationKey(i))) continue;
+        authVerifier.restoreEpoch(i, record.epoch);
+        savedEpochs[i] = record.epoch;
+        epochsSaved |= (StationSet)1 << i;
+    }
+}
 
-        // Reset statistics for the next analysis period
-        minLoopTime = 0xFFFFFFFF;
-        maxLoopTime = 0;
-        totalLoopTime = 0;
-        loopCount = 0;
-        lastPrintTime = millis(); // Update the last print time
+// A station's epoch changes when it boots, so this rarely writes
+void saveAuthEpochs() {
+    for (int i = 0; i < layout.stationCount(); i++) {
+        uint16_t epoch;
+        if (!authVerifier.acceptedEpoch(i, epoch)) continue;
+        if ((epochsSaved & ((StationSet)1 << i)) && savedEpochs[i] == epoch) continue;
+        AuthEpochRecord record = {epoch, stationKeyId(stationKey(i))};
+        settings.saveAuthEpoch(i, record);
+        savedEpochs[i] = epoch;
+        epochsSaved |= (StationSet)1 << i;
     }
+}
 
-    // Reset loop start time for the next measurement
-    loopStartTime = loopEndTime;
+void sendRouteBeacon() {
+    static unsigned long lastBeaconMillis = 0;
+    if (millis() - lastBeaconMillis < STATION_BEACON_INTERVAL) return;
+    lastBeaconMillis = millis();
+
+    StationRouteBeacon beacon;
+    beacon.type = STATION_MSG_ROUTE_BEACON;
+    beacon.hops = 0;
+    beacon.seq = ++routeBeaconSeq;
+    beacon.cost = 0;
+    memcpy(beacon.controller, ownMac, 6);
+    esp_now_send(broadcastMac, (const uint8_t *)&beacon, sizeof(beacon));
 }